@@ -0,0 +1,239 @@
+/*
+End-to-end benchmark harness for Mangle.
+
+This program compiles in the whole of `mangle.c`, and then runs the
+same steps as Mangle's own `main` (see "Running Mangle" in
+`source/main.md`) over the input files given on the command line, with
+the same options (other than `-stdout`), timing each phase separately:
+
+ * parse: reading and parsing the input files (lines, blocks, spans and scraps)
+ * code:  expanding and writing every `file:` output
+ * html:  rendering and writing one HTML document per input
+ * flush: waiting for outputs still being written behind the run
+
+Large code files are expanded on `-jobs` threads, and outputs are written
+behind the run within `-write-buffer`, just as in Mangle itself.
+
+Output files are written exactly where Mangle would write them. The results are printed as a single line of
+`key=value` pairs, so that they are easy to compare from a script.
+*/
+
+#define main MgMain
+#include "../mangle.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static double GetSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+static long GetPeakResidentKilobytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/*
+We can tell whether Mangle rewrote an output (rather than finding it
+unchanged on disk) by checking whether its modification time changed.
+*/
+typedef struct OutputStampT
+{
+    int             exists;
+    struct timespec modified;
+} OutputStamp;
+
+static OutputStamp GetOutputStamp(
+    char const* path )
+{
+    OutputStamp stamp;
+    struct stat info;
+    memset(&stamp, 0, sizeof(stamp));
+    if( stat(path, &info) == 0 )
+    {
+        stamp.exists = 1;
+#ifdef __APPLE__
+        stamp.modified = info.st_mtimespec;
+#else
+        stamp.modified = info.st_mtim;
+#endif
+    }
+    return stamp;
+}
+
+static int OutputWasWritten(
+    OutputStamp before,
+    OutputStamp after )
+{
+    if( !after.exists )
+        return 0;
+    if( !before.exists )
+        return 1;
+    return before.modified.tv_sec != after.modified.tv_sec
+        || before.modified.tv_nsec != after.modified.tv_nsec;
+}
+
+/*
+Outputs are found where Mangle writes them, beneath `-code-dir` and
+`-doc-dir` if they were given.
+*/
+static OutputStamp GetCodeFileStamp(
+    MgContext*          context,
+    MgScrapNameGroup*   group )
+{
+    MgOutputFile file;
+    MgInitializeOutputFile( &file, context->codeOutputRoot, group->id, "" );
+    OutputStamp stamp = GetOutputStamp(file.path);
+    MgFreeOutputFile( &file );
+    return stamp;
+}
+
+static OutputStamp GetDocFileStamp(
+    MgContext*      context,
+    MgInputFile*    inputFile )
+{
+    char const* slash = strrchr(inputFile->path, '/');
+    char const* name = slash ? slash + 1 : inputFile->path;
+    char const* dot = strrchr(name, '.');
+
+    MgOutputFile file;
+    MgInitializeOutputFile( &file, context->docOutputRoot, MgMakeString(name, dot ? dot : name + strlen(name)), ".html" );
+    OutputStamp stamp = GetOutputStamp(file.path);
+    MgFreeOutputFile( &file );
+    return stamp;
+}
+
+int main(
+    int     argc,
+    char**  argv )
+{
+    MgContext context;
+    memset(&context, 0, sizeof(context));
+
+    Options options;
+    InitializeOptions( &options );
+
+    char const* label = "run";
+    if( argc >= 3 && strcmp(argv[1], "-label") == 0 )
+    {
+        label = argv[2];
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if( !ParseOptions( &options, &argc, argv ) || !argc )
+    {
+        fprintf(stderr, "usage: bench-mangle [-label name] [mangle options] file1.md [...]\n");
+        return 1;
+    }
+    if( options.toStdout )
+    {
+        fprintf(stderr, "bench-mangle: -stdout isn't supported, since the results are written to standard output\n");
+        return 1;
+    }
+    ApplyOptions( &options, &context );
+
+    double start = GetSeconds();
+    MgStartRun( &options, &context );
+
+    if( !MgReadInputs( &options, &context, argc, argv ) )
+        return 1;
+    double parseSeconds = GetSeconds() - start;
+
+    long inputBytes = 0;
+    for( int ii = 0; ii < argc; ++ii )
+    {
+        struct stat info;
+        if( stat(argv[ii], &info) == 0 )
+            inputBytes += (long) info.st_size;
+    }
+
+    /*
+    Outputs may be written behind the run (see `write-queue.md`), so we
+    can only tell which of them were written once the run is over. The
+    code outputs are those `MgWriteCodeOutputs` writes: every `file:`
+    group, or with `-only`, just the one group.
+    */
+    MgScrapNameGroup* onlyGroup = NULL;
+    if( options.onlyScrapId )
+    {
+        onlyGroup = MgFindScrapGroupForOption( &context, options.onlyScrapId );
+        if( !onlyGroup )
+            return 1;
+    }
+
+    int outputCount = 0;
+    for( MgScrapNameGroup* group = context.firstScrapNameGroup; group; group = group->next )
+        outputCount++;
+    for( MgInputFile* file = context.firstInputFile; file; file = file->next )
+        outputCount++;
+    OutputStamp* before = (OutputStamp*) calloc(outputCount ? outputCount : 1, sizeof(OutputStamp));
+    MgScrapNameGroup** codeGroups = (MgScrapNameGroup**) calloc(outputCount ? outputCount : 1, sizeof(MgScrapNameGroup*));
+
+    int codeOutputs = 0;
+    for( MgScrapNameGroup* group = context.firstScrapNameGroup; group; group = group->next )
+    {
+        if( onlyGroup ? group != onlyGroup : group->kind != kScrapKind_OutputFile )
+            continue;
+
+        before[codeOutputs] = GetCodeFileStamp(&context, group);
+        codeGroups[codeOutputs++] = group;
+    }
+    int docOutputs = 0;
+    for( MgInputFile* file = context.tangleOnly ? NULL : context.firstInputFile; file; file = file->next )
+    {
+        before[codeOutputs + docOutputs] = GetDocFileStamp(&context, file);
+        ++docOutputs;
+    }
+
+    double codeStart = GetSeconds();
+    if( !MgWriteCodeOutputs( &options, &context ) )
+        return 1;
+    double codeSeconds = GetSeconds() - codeStart;
+
+    double htmlStart = GetSeconds();
+    MgWriteDocOutputs( &options, &context );
+    double htmlSeconds = GetSeconds() - htmlStart;
+
+    /* the time spent waiting for outputs still being written behind the run */
+    double flushStart = GetSeconds();
+    MgFinishWritingOutputs( &options, &context );
+    double flushSeconds = GetSeconds() - flushStart;
+
+    double totalSeconds = GetSeconds() - start;
+
+    MgFinishRun( &options, &context );
+
+    int written = 0;
+    for( int ii = 0; ii < codeOutputs; ++ii )
+        written += OutputWasWritten(before[ii], GetCodeFileStamp(&context, codeGroups[ii]));
+    int docIndex = codeOutputs;
+    for( MgInputFile* file = context.tangleOnly ? NULL : context.firstInputFile; file; file = file->next )
+        written += OutputWasWritten(before[docIndex++], GetDocFileStamp(&context, file));
+    free(codeGroups);
+    free(before);
+
+    double inputMegabytes = (double) inputBytes / (1024.0 * 1024.0);
+    printf("workload=%s files=%d input_mb=%.3f jobs=%d"
+        " parse_ms=%.2f code_ms=%.2f html_ms=%.2f flush_ms=%.2f total_ms=%.2f"
+        " mb_per_s=%.2f peak_rss_kb=%ld"
+        " outputs=%d written=%d\n",
+        label, argc, inputMegabytes, context.jobCount,
+        parseSeconds * 1000.0, codeSeconds * 1000.0, htmlSeconds * 1000.0, flushSeconds * 1000.0, totalSeconds * 1000.0,
+        totalSeconds > 0 ? inputMegabytes / totalSeconds : 0.0,
+        GetPeakResidentKilobytes(),
+        codeOutputs + docOutputs, written);
+    return 0;
+}
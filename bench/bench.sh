@@ -0,0 +1,170 @@
+#!/bin/bash
+#
+# End-to-end benchmarks for Mangle.
+#
+#   bench/bench.sh [-update] [workload ...]
+#
+# Each workload generates a synthetic corpus with `gen-corpus`, and then
+# runs `bench-mangle` over it twice: a "cold" run into an empty output
+# directory (every output is written), and a "warm" run over the same
+# directory (every output should be found unchanged on disk). Each pass
+# is run BENCH_RUNS (default 3) times, and the fastest run is kept, since
+# a single run is too noisy to compare against a baseline.
+#
+# Results are compared against `bench/baselines.txt`; a run that is more
+# than BENCH_TOLERANCE (default 0.10) slower, or uses that much more peak
+# memory, is reported as a possible regression. These reports are for a
+# person to follow up on, and don't fail the script: timings vary too much
+# from one run to the next for that. Pass `-update` to record the
+# current results as the new baselines, which any change to a workload
+# needs. Baselines are only meaningful on the machine that recorded them.
+#
+# Each baseline also records the size of its input. If the input has
+# since changed size by more than the tolerance (as the self-host corpus
+# does whenever Mangle's own sources grow), the baseline is reported as
+# stale rather than compared, since it no longer measures the same work.
+#
+#   bench/bench.sh -micro [microbench options]
+#
+# Builds and runs the primitive microbenchmarks in `microbench.c` instead.
+
+pushd `dirname $0` > /dev/null
+BENCHPATH=`pwd`
+popd > /dev/null
+ROOTPATH=`dirname "$BENCHPATH"`
+
+: ${CC:="cc"}
+: ${CFLAGS:="-O2 -w"}
+: ${LIBS:="-pthread"}
+: ${BENCH_WORK:="$BENCHPATH/_work"}
+: ${BENCH_TOLERANCE:="0.10"}
+: ${BENCH_RUNS:="3"}
+BASELINES="$BENCHPATH/baselines.txt"
+
+if [[ "$1" == "-micro" ]]; then
+	shift
+	mkdir -p "$BENCH_WORK/bin"
+	$CC $CFLAGS "$BENCHPATH/microbench.c" -o "$BENCH_WORK/bin/microbench" $LIBS || exit 1
+	cd "$BENCH_WORK" && exec "$BENCH_WORK/bin/microbench" "$@"
+fi
+
+UPDATE=0
+if [[ "$1" == "-update" ]]; then
+	UPDATE=1
+	shift
+fi
+
+ALL_WORKLOADS="small large large-serial many fanout fanout-serial fanout-stream prose entities self-host"
+WORKLOADS="$@"
+: ${WORKLOADS:=$ALL_WORKLOADS}
+
+# Generator arguments for each workload
+workload_args() {
+	case "$1" in
+	small)		echo "-files 8 -size 16384 -scraps 16" ;;
+	large|large-serial)		echo "-files 4 -size 2097152 -scraps 512" ;;
+	many)		echo "-files 256 -size 8192 -scraps 8" ;;
+	fanout|fanout-serial|fanout-stream)	echo "-files 8 -size 65536 -scraps 64 -fanout 4 -depth 5" ;;
+	prose)		echo "-files 16 -size 131072 -code 0.1 -tables 0.3 -lists 0.3" ;;
+	entities)	echo "-files 16 -size 131072 -entities 0.25" ;;
+	self-host)	echo "-self-host $ROOTPATH -copies 8" ;;
+	*)			return 1 ;;
+	esac
+}
+
+# Extra options to pass to Mangle for each workload. The large code files
+# of `large` and `fanout` are expanded in parallel, and written behind the
+# run; their `-serial` variants do neither, for comparison. The code files
+# of `fanout` are large next to its input, so `fanout-stream` checks that
+# `-stream-docs` doesn't use more memory than a normal run for those.
+workload_mangle_args() {
+	case "$1" in
+	self-host)	echo "-local-scoping" ;;
+	*-serial)	echo "-jobs 1 -write-buffer 0" ;;
+	*-stream)	echo "-stream-docs" ;;
+	*)			echo "" ;;
+	esac
+}
+
+mkdir -p "$BENCH_WORK/bin"
+$CC $CFLAGS "$BENCHPATH/gen-corpus.c" -o "$BENCH_WORK/bin/gen-corpus" || exit 1
+$CC $CFLAGS "$BENCHPATH/bench-mangle.c" -o "$BENCH_WORK/bin/bench-mangle" $LIBS || exit 1
+
+field() {
+	echo "$1" | tr ' ' '\n' | grep "^$2=" | cut -d= -f2
+}
+
+RESULTS="$BENCH_WORK/results.txt"
+: > "$RESULTS"
+
+for workload in $WORKLOADS; do
+	args=`workload_args $workload`
+	if [[ $? -ne 0 ]]; then
+		echo "unknown workload: $workload" >&2
+		exit 1
+	fi
+
+	dir="$BENCH_WORK/$workload"
+	rm -rf "$dir"
+	mkdir -p "$dir/in" "$dir/out"
+	if [[ "$workload" == "self-host" ]]; then
+		(cd "$ROOTPATH" && ls README.md source/*.md) | "$BENCH_WORK/bin/gen-corpus" -o "$dir/in" $args || exit 1
+	else
+		"$BENCH_WORK/bin/gen-corpus" -o "$dir/in" $args || exit 1
+	fi
+
+	for pass in cold warm; do
+		line=""
+		for run in `seq $BENCH_RUNS`; do
+			if [[ "$pass" == "cold" ]]; then
+				rm -rf "$dir/out" && mkdir -p "$dir/out"
+			fi
+			runLine=`cd "$dir/out" && "$BENCH_WORK/bin/bench-mangle" -label "$workload-$pass" \
+				$(workload_mangle_args $workload) ../in/*.md`
+			if [[ $? -ne 0 ]]; then
+				echo "$workload-$pass: failed" >&2
+				exit 1
+			fi
+			if [[ -z "$line" ]] || awk -v s=`field "$runLine" mb_per_s` -v b=`field "$line" mb_per_s` 'BEGIN { exit !(s > b) }'; then
+				line="$runLine"
+			fi
+		done
+		echo "$line"
+		echo "$line" >> "$RESULTS"
+
+		label="$workload-$pass"
+		speed=`field "$line" mb_per_s`
+		rss=`field "$line" peak_rss_kb`
+		size=`field "$line" input_mb`
+		baseline=`grep "^$label " "$BASELINES" 2>/dev/null`
+		if [[ $UPDATE -eq 0 && -z "$baseline" ]]; then
+			echo "NO BASELINE $label: record one with -update"
+		elif [[ $UPDATE -eq 0 ]]; then
+			baseSize=`echo $baseline | cut -d' ' -f2`
+			baseSpeed=`echo $baseline | cut -d' ' -f3`
+			baseRss=`echo $baseline | cut -d' ' -f4`
+			stale=`awk -v m=$size -v bm=$baseSize -v t=$BENCH_TOLERANCE 'BEGIN {
+				if( m < bm * (1 - t) || m > bm * (1 + t) ) printf(" input %.3f -> %.3f MB", bm, m) }'`
+			verdict=`awk -v s=$speed -v r=$rss -v bs=$baseSpeed -v br=$baseRss -v t=$BENCH_TOLERANCE 'BEGIN {
+				v = "";
+				if( s < bs * (1 - t) ) v = v sprintf(" throughput %.2f -> %.2f MB/s", bs, s);
+				if( r > br * (1 + t) ) v = v sprintf(" peak RSS %d -> %d KB", br, r);
+				print v }'`
+			if [[ -n "$stale" ]]; then
+				echo "STALE BASELINE $label:$stale; record a new one with -update"
+			elif [[ -n "$verdict" ]]; then
+				echo "REGRESSION $label:$verdict"
+			fi
+		fi
+	done
+done
+
+if [[ $UPDATE -eq 1 ]]; then
+	{
+		echo "# label input_mb mb_per_s peak_rss_kb"
+		while read line; do
+			echo "`field "$line" workload` `field "$line" input_mb` `field "$line" mb_per_s` `field "$line" peak_rss_kb`"
+		done < "$RESULTS"
+	} > "$BASELINES"
+	echo "baselines written to $BASELINES"
+fi
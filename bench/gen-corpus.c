@@ -0,0 +1,590 @@
+/*
+Synthetic literate corpus generator for the Mangle benchmarks.
+
+Writes a set of Markdown files into an output directory, with the shape
+of the corpus controlled by command-line options (see `Usage()`).
+Each file contains prose (paragraphs, headers, lists, tables) and code
+blocks. Code blocks define scraps that reference each other in levels,
+so that the reference fan-out and nesting depth of the expanded output
+can be tuned independently of the file size. Every file also defines
+one `file:` scrap that roots its own tree of references.
+
+With `-self-host`, the generator instead makes `-copies` copies of the
+Mangle sources (or any other literate program), renaming every scrap so
+that the copies don't merge with each other.
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define MakeDirectory(path) _mkdir(path)
+#else
+#define MakeDirectory(path) mkdir(path, 0777)
+#endif
+
+typedef struct GenOptionsT
+{
+    char const* outputDir;
+    int         fileCount;
+    int         fileSize;
+    int         scrapCount;
+    int         fanOut;
+    int         depth;
+    double      codeRatio;
+    double      tableDensity;
+    double      listDensity;
+    double      entityDensity;
+    unsigned    seed;
+    char const* selfHostDir;
+    int         copies;
+} GenOptions;
+
+static void Usage(
+    char const* name )
+{
+    fprintf(stderr,
+        "usage: %s -o <dir> [options]\n"
+        "  -files N         number of input files (default 8)\n"
+        "  -size N          approximate bytes per file (default 65536)\n"
+        "  -scraps N        scrap definitions per file (default 32)\n"
+        "  -fanout N        scrap references per scrap body (default 2)\n"
+        "  -depth N         levels of scrap nesting (default 4)\n"
+        "  -code F          fraction of bytes in code blocks (default 0.5)\n"
+        "  -tables F        fraction of prose blocks that are tables (default 0.05)\n"
+        "  -lists F         fraction of prose blocks that are lists (default 0.1)\n"
+        "  -entities F      probability of an `&`, `<` or `>` per word (default 0.02)\n"
+        "  -seed N          random seed (default 1)\n"
+        "  -self-host DIR   replicate the `*.md` files listed on stdin from DIR\n"
+        "  -copies N        number of copies for -self-host (default 4)\n",
+        name);
+}
+
+/* Random Numbers */
+
+static unsigned gRandomState = 1;
+
+static unsigned NextRandom()
+{
+    /* xorshift32 */
+    unsigned x = gRandomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gRandomState = x;
+    return x;
+}
+
+static int RandomInt(
+    int limit )
+{
+    if( limit <= 0 )
+        return 0;
+    return (int)(NextRandom() % (unsigned) limit);
+}
+
+static int RandomChance(
+    double probability )
+{
+    return (NextRandom() & 0xFFFFFF) < (unsigned)(probability * 0x1000000);
+}
+
+/* Words */
+
+static char const* const kWords[] =
+{
+    "the", "parse", "block", "element", "scrap", "line", "input", "output",
+    "file", "group", "reference", "name", "export", "code", "writer", "reader",
+    "string", "table", "list", "item", "header", "paragraph", "span", "link",
+    "attribute", "context", "buffer", "cursor", "range", "kind", "value",
+    "and", "of", "to", "a", "in", "for", "with", "each", "every", "when",
+};
+enum { kWordCount = sizeof(kWords) / sizeof(kWords[0]) };
+
+static char const* RandomWord()
+{
+    return kWords[RandomInt(kWordCount)];
+}
+
+/* Output */
+
+typedef struct GenFileT
+{
+    FILE*   stream;
+    long    size;
+} GenFile;
+
+static void Put(
+    GenFile*    file,
+    char const* text )
+{
+    size_t length = strlen(text);
+    fwrite(text, 1, length, file->stream);
+    file->size += (long) length;
+}
+
+static void PutWords(
+    GenFile*            file,
+    GenOptions const*   options,
+    int                 count )
+{
+    for( int ii = 0; ii < count; ++ii )
+    {
+        if( ii != 0 )
+            Put(file, " ");
+        if( RandomChance(options->entityDensity) )
+        {
+            static char const* const kEntities[] = { "&", "<", ">", "a < b", "x & y" };
+            Put(file, kEntities[RandomInt(5)]);
+            Put(file, " ");
+        }
+        Put(file, RandomWord());
+    }
+}
+
+/* Scraps */
+
+/*
+Scrap `ii` (counting across all files) lives at level `ii % depth`.
+Scraps only reference scraps at the next level down, so the depth
+of nesting is bounded and fan-out multiplies once per level.
+*/
+static void ScrapName(
+    char*   buffer,
+    int     index )
+{
+    sprintf(buffer, "%s %s %d", kWords[index % kWordCount], kWords[(index / kWordCount + 7) % kWordCount], index);
+}
+
+static int ScrapLevel(
+    GenOptions const*   options,
+    int                 index )
+{
+    return index % options->depth;
+}
+
+static int RandomScrapAtLevel(
+    GenOptions const*   options,
+    int                 level )
+{
+    int total = options->fileCount * options->scrapCount;
+    int perLevel = (total - level + options->depth - 1) / options->depth;
+    if( perLevel <= 0 )
+        return -1;
+    return level + options->depth * RandomInt(perLevel);
+}
+
+static void PutCodeLine(
+    GenFile*            file,
+    GenOptions const*   options,
+    int                 indent )
+{
+    static char const* const kStatements[] =
+    {
+        "x = %s(y, %d);",
+        "if( %s > %d ) return 0;",
+        "while( n < %d && %s ) ++n;",
+        "flags = %s & 0x%x;",
+        "result += %s[%d];",
+    };
+    char buffer[128];
+    int which = RandomInt(5);
+    if( RandomChance(options->entityDensity * 4) )
+        which = (which & 1) ? 2 : 3;
+    if( which == 2 )
+        sprintf(buffer, kStatements[which], RandomInt(100), RandomWord());
+    else
+        sprintf(buffer, kStatements[which], RandomWord(), RandomInt(100));
+
+    Put(file, "    ");
+    for( int ii = 0; ii < indent; ++ii )
+        Put(file, "    ");
+    Put(file, buffer);
+    Put(file, "\n");
+}
+
+static void PutScrapBody(
+    GenFile*            file,
+    GenOptions const*   options,
+    int                 level,
+    int                 lineBudget )
+{
+    int refCount = level + 1 < options->depth ? options->fanOut : 0;
+    int lineCount = lineBudget > refCount ? lineBudget : refCount + 1;
+    int refsLeft = refCount;
+    for( int ii = 0; ii < lineCount; ++ii )
+    {
+        int linesLeft = lineCount - ii;
+        if( refsLeft && RandomInt(linesLeft) < refsLeft )
+        {
+            char name[128];
+            int target = RandomScrapAtLevel(options, level + 1);
+            ScrapName(name, target);
+            Put(file, "    ");
+            if( RandomInt(2) )
+                Put(file, "    ");
+            Put(file, "<<");
+            Put(file, name);
+            Put(file, ">>\n");
+            --refsLeft;
+            continue;
+        }
+        PutCodeLine(file, options, RandomInt(3));
+    }
+}
+
+/* Prose */
+
+static void PutParagraph(
+    GenFile*            file,
+    GenOptions const*   options )
+{
+    int lines = 1 + RandomInt(5);
+    for( int ii = 0; ii < lines; ++ii )
+    {
+        PutWords(file, options, 4 + RandomInt(6));
+        switch( RandomInt(6) )
+        {
+        case 0: Put(file, " *"); Put(file, RandomWord()); Put(file, "*"); break;
+        case 1: Put(file, " `"); Put(file, RandomWord()); Put(file, "`"); break;
+        case 2: Put(file, " [a link](http://example.com/"); Put(file, RandomWord()); Put(file, ")"); break;
+        case 3: Put(file, " **"); Put(file, RandomWord()); Put(file, "**"); break;
+        default: break;
+        }
+        Put(file, ".\n");
+    }
+    Put(file, "\n");
+}
+
+static void PutList(
+    GenFile*            file,
+    GenOptions const*   options )
+{
+    int items = 2 + RandomInt(5);
+    int ordered = RandomInt(2);
+    for( int ii = 0; ii < items; ++ii )
+    {
+        char marker[16];
+        if( ordered )
+            sprintf(marker, "%d. ", ii + 1);
+        else
+            strcpy(marker, " * ");
+        Put(file, marker);
+        PutWords(file, options, 3 + RandomInt(8));
+        Put(file, "\n");
+    }
+    Put(file, "\n");
+}
+
+static void PutTable(
+    GenFile*            file,
+    GenOptions const*   options )
+{
+    int columns = 2 + RandomInt(4);
+    int rows = 2 + RandomInt(6);
+    for( int row = 0; row < rows + 2; ++row )
+    {
+        Put(file, "|");
+        for( int column = 0; column < columns; ++column )
+        {
+            Put(file, " ");
+            if( row == 1 )
+                Put(file, "------");
+            else
+                PutWords(file, options, 1 + RandomInt(2));
+            Put(file, " |");
+        }
+        Put(file, "\n");
+    }
+    Put(file, "\n");
+}
+
+static void PutProseBlock(
+    GenFile*            file,
+    GenOptions const*   options )
+{
+    if( RandomChance(options->tableDensity) )
+        PutTable(file, options);
+    else if( RandomChance(options->listDensity) )
+        PutList(file, options);
+    else if( RandomInt(8) == 0 )
+    {
+        Put(file, "### ");
+        PutWords(file, options, 2 + RandomInt(3));
+        Put(file, " ###\n\n");
+    }
+    else
+        PutParagraph(file, options);
+}
+
+/* Files */
+
+static int GenerateFile(
+    GenOptions const*   options,
+    int                 fileIndex )
+{
+    char path[1024];
+    sprintf(path, "%s/gen-%04d.md", options->outputDir, fileIndex);
+
+    GenFile file;
+    file.size = 0;
+    file.stream = fopen(path, "wb");
+    if( !file.stream )
+    {
+        fprintf(stderr, "gen-corpus: failed to open \"%s\" for writing\n", path);
+        return 0;
+    }
+
+    Put(&file, "Generated File\n==============\n\n");
+    PutParagraph(&file, options);
+
+    /* the root of this file's output */
+    {
+        char line[256];
+        sprintf(line, "    <<file:gen-%04d.c | generated output %d>>=\n", fileIndex, fileIndex);
+        Put(&file, line);
+        PutScrapBody(&file, options, -1, options->fanOut + 2);
+        Put(&file, "\n");
+    }
+
+    int firstScrap = fileIndex * options->scrapCount;
+    int scrapsLeft = options->scrapCount;
+    int nextScrap = firstScrap;
+    long codeBytes = 0;
+    long proseBytes = 0;
+    while( file.size < options->fileSize || scrapsLeft )
+    {
+        long total = codeBytes + proseBytes;
+        int wantCode = total == 0
+            ? options->codeRatio >= 0.5
+            : (double) codeBytes / (double) total < options->codeRatio;
+        if( file.size >= options->fileSize )
+            wantCode = 1;
+
+        long before = file.size;
+        if( wantCode && options->codeRatio > 0 )
+        {
+            char name[128];
+            int scrap = firstScrap;
+            int append = 0;
+            if( scrapsLeft )
+            {
+                scrap = nextScrap++;
+                --scrapsLeft;
+            }
+            else
+            {
+                scrap = firstScrap + RandomInt(options->scrapCount);
+                append = 1;
+            }
+            if( options->scrapCount == 0 )
+                break;
+
+            ScrapName(name, scrap);
+            Put(&file, "    <<");
+            Put(&file, name);
+            Put(&file, append ? ">>+=\n" : ">>=\n");
+            PutScrapBody(&file, options, ScrapLevel(options, scrap), 4 + RandomInt(12));
+            Put(&file, "\n");
+            codeBytes += file.size - before;
+        }
+        else
+        {
+            PutProseBlock(&file, options);
+            proseBytes += file.size - before;
+        }
+    }
+
+    fclose(file.stream);
+    return 1;
+}
+
+/* Self-Host */
+
+/*
+Copy `text` to `stream`, renaming every scrap `<<id>>` or `<<id | name>>`
+to `<<id-suffix>>`, so that copies of the same program stay separate.
+A `<<` followed by white-space is not a scrap reference, and is left alone.
+*/
+static void CopyWithRenamedScraps(
+    FILE*       stream,
+    char const* text,
+    char const* suffix )
+{
+    char const* cursor = text;
+    for(;;)
+    {
+        char const* open = strstr(cursor, "<<");
+        if( !open )
+            break;
+        char const* close = strstr(open + 2, ">>");
+        char const* newline = strchr(open + 2, '\n');
+        if( !close || (newline && newline < close) || isspace((unsigned char) open[2]) )
+        {
+            fwrite(cursor, 1, open + 2 - cursor, stream);
+            cursor = open + 2;
+            continue;
+        }
+
+        char const* idEnd = open + 2;
+        while( idEnd != close && *idEnd != '|' )
+            ++idEnd;
+        while( idEnd != open + 2 && isspace((unsigned char) idEnd[-1]) )
+            --idEnd;
+
+        fwrite(cursor, 1, idEnd - cursor, stream);
+        fputs(suffix, stream);
+        cursor = idEnd;
+    }
+    fputs(cursor, stream);
+}
+
+static char* ReadWholeFile(
+    char const* path )
+{
+    FILE* stream = fopen(path, "rb");
+    if( !stream )
+        return NULL;
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    char* data = (char*) malloc(size + 1);
+    size_t sizeRead = fread(data, 1, size, stream);
+    data[sizeRead] = 0;
+    fclose(stream);
+    return data;
+}
+
+static int GenerateSelfHost(
+    GenOptions const*   options )
+{
+    char name[512];
+    while( scanf("%511s", name) == 1 )
+    {
+        char path[1024];
+        sprintf(path, "%s/%s", options->selfHostDir, name);
+        char* text = ReadWholeFile(path);
+        if( !text )
+        {
+            fprintf(stderr, "gen-corpus: failed to read \"%s\"\n", path);
+            return 0;
+        }
+
+        /* flatten any directories, since output names come from the file name */
+        char* base = name;
+        for( char* cc = name; *cc; ++cc )
+            if( *cc == '/' || *cc == '\\' )
+                *cc = '-';
+        char* dot = strrchr(base, '.');
+        if( dot )
+            *dot = 0;
+
+        for( int copy = 0; copy < options->copies; ++copy )
+        {
+            char outPath[1024];
+            char suffix[32];
+            sprintf(outPath, "%s/%s-%d.md", options->outputDir, base, copy);
+            sprintf(suffix, "-%d", copy);
+            FILE* stream = fopen(outPath, "wb");
+            if( !stream )
+            {
+                fprintf(stderr, "gen-corpus: failed to open \"%s\" for writing\n", outPath);
+                return 0;
+            }
+            CopyWithRenamedScraps(stream, text, suffix);
+            fclose(stream);
+        }
+        free(text);
+    }
+    return 1;
+}
+
+/* Options */
+
+static int ParseGenOptions(
+    GenOptions* options,
+    int         argc,
+    char**      argv )
+{
+    options->outputDir      = NULL;
+    options->fileCount      = 8;
+    options->fileSize       = 65536;
+    options->scrapCount     = 32;
+    options->fanOut         = 2;
+    options->depth          = 4;
+    options->codeRatio      = 0.5;
+    options->tableDensity   = 0.05;
+    options->listDensity    = 0.1;
+    options->entityDensity  = 0.02;
+    options->seed           = 1;
+    options->selfHostDir    = NULL;
+    options->copies         = 4;
+
+    for( int ii = 1; ii < argc; ++ii )
+    {
+        char const* option = argv[ii];
+        if( ii + 1 >= argc )
+        {
+            fprintf(stderr, "expected argument for option %s\n", option);
+            return 0;
+        }
+        char const* value = argv[++ii];
+
+        if( strcmp(option, "-o") == 0 )                 options->outputDir = value;
+        else if( strcmp(option, "-files") == 0 )        options->fileCount = atoi(value);
+        else if( strcmp(option, "-size") == 0 )         options->fileSize = atoi(value);
+        else if( strcmp(option, "-scraps") == 0 )       options->scrapCount = atoi(value);
+        else if( strcmp(option, "-fanout") == 0 )       options->fanOut = atoi(value);
+        else if( strcmp(option, "-depth") == 0 )        options->depth = atoi(value);
+        else if( strcmp(option, "-code") == 0 )         options->codeRatio = atof(value);
+        else if( strcmp(option, "-tables") == 0 )       options->tableDensity = atof(value);
+        else if( strcmp(option, "-lists") == 0 )        options->listDensity = atof(value);
+        else if( strcmp(option, "-entities") == 0 )     options->entityDensity = atof(value);
+        else if( strcmp(option, "-seed") == 0 )         options->seed = (unsigned) atoi(value);
+        else if( strcmp(option, "-self-host") == 0 )    options->selfHostDir = value;
+        else if( strcmp(option, "-copies") == 0 )       options->copies = atoi(value);
+        else
+        {
+            fprintf(stderr, "unknown option: %s\n", option);
+            return 0;
+        }
+    }
+
+    if( !options->outputDir )
+        return 0;
+    if( options->depth < 1 )
+        options->depth = 1;
+    if( options->seed == 0 )
+        options->seed = 1;
+    return 1;
+}
+
+int main(
+    int     argc,
+    char**  argv )
+{
+    GenOptions options;
+    if( !ParseGenOptions(&options, argc, argv) )
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    gRandomState = options.seed;
+    MakeDirectory(options.outputDir);
+
+    if( options.selfHostDir )
+        return GenerateSelfHost(&options) ? 0 : 1;
+
+    for( int ii = 0; ii < options.fileCount; ++ii )
+    {
+        if( !GenerateFile(&options, ii) )
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,515 @@
+/*
+Microbenchmarks for Mangle's hot primitives.
+
+Like `bench-mangle.c`, this program compiles in the whole of `mangle.c`,
+so that it can call internal functions directly. Each benchmark runs one
+primitive over a fixed, deterministically generated input of a given
+size, with some warmup runs followed by timed repetitions. We report the
+fastest and median times, along with nanoseconds and cycles per byte of
+input. Cycles are read from the time-stamp counter where one is
+available, and so count reference cycles rather than core cycles.
+
+    microbench [-sizes 1024,16384,262144] [-reps 20] [-warmup 3] [filter]
+
+Only benchmarks whose name contains `filter` are run.
+*/
+
+#define main MgMain
+#include "../mangle.c"
+#undef main
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLE_COUNTER 1
+static uint64_t ReadCycleCounter() { return __rdtsc(); }
+#else
+#define HAS_CYCLE_COUNTER 0
+static uint64_t ReadCycleCounter() { return 0; }
+#endif
+
+static double GetSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/* Inputs */
+
+/*
+Everything a benchmark might need is generated once per size, and
+shared by all the benchmarks of that size.
+*/
+typedef struct BenchInputT
+{
+    int             size;
+    MgContext       context;
+
+    /* Markdown text with a mix of prose and code */
+    MgString        text;
+    MgInputFile*    inputFile;
+    MgLine*         lines;
+    int             lineCount;
+
+    /* a line array that `ParseBlockElement` is free to modify */
+    MgLine*         scratchLines;
+
+    /* identifiers for the string comparison benchmarks */
+    MgString*       ids;
+    int             idCount;
+
+    char*           outputBuffer;
+    char const*     diskPath;
+
+    /* the text as a one-segment rope, and the file on disk it is compared with */
+    MgString        diskSegment;
+    MgRope          diskRope;
+    MgOutputFile    diskFile;
+} BenchInput;
+
+static unsigned gRandomState = 12345;
+
+static unsigned NextRandom()
+{
+    unsigned x = gRandomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gRandomState = x;
+    return x;
+}
+
+static char const* const kWords[] =
+{
+    "the", "parse", "block", "element", "scrap", "line", "input", "output",
+    "file", "group", "reference", "name", "export", "code", "writer",
+    "string", "table", "list", "span", "link", "context", "buffer", "cursor",
+};
+enum { kWordCount = sizeof(kWords) / sizeof(kWords[0]) };
+
+static char const* const kProseLines[] =
+{
+    "The *%s* of a %s is `%s`, which [links](http://example.com/%s) here.",
+    "When a %s & a %s differ, the **%s** wins over the %s.",
+    "Reading a %s means that %s < %s and %s > 0 for every _%s_.",
+    "See [%s][] and the %s for the %s of each %s.",
+};
+
+static char const* const kCodeLines[] =
+{
+    "    <<%s %s definitions>>=",
+    "    if( %s < %s && %s > 0 ) return %s;",
+    "    <<%s %s>>",
+    "    x = %s(%s, %s) & %s;",
+    "    // %s: %s %s %s",
+};
+
+static char* GenerateText(
+    int size )
+{
+    char* text = (char*) malloc(size + 256);
+    int used = 0;
+    int inCode = 0;
+    while( used < size )
+    {
+        char const* pattern;
+        unsigned pick = NextRandom();
+        if( (pick & 7) == 0 )
+        {
+            /* switch between prose and code, with a blank line between */
+            inCode = !inCode;
+            text[used++] = '\n';
+            continue;
+        }
+        if( inCode )
+            pattern = kCodeLines[(pick >> 3) % 5];
+        else
+            pattern = kProseLines[(pick >> 3) % 4];
+
+        char line[256];
+        int length = sprintf(line, pattern,
+            kWords[NextRandom() % kWordCount],
+            kWords[NextRandom() % kWordCount],
+            kWords[NextRandom() % kWordCount],
+            kWords[NextRandom() % kWordCount],
+            kWords[NextRandom() % kWordCount]);
+        line[length++] = '\n';
+        if( used + length > size )
+            length = size - used;
+        memcpy(text + used, line, length);
+        used += length;
+    }
+    text[used] = 0;
+    return text;
+}
+
+/*
+The identifiers look like the ones that actually get compared in a
+Mangle run: scrap names (many sharing a prefix, and with similar
+lengths), attribute names, and meta-data keys.
+*/
+static void GenerateIds(
+    BenchInput* input,
+    int         count )
+{
+    static char const* const kFixedIds[] =
+    {
+        "$scrap", "$scrap-group", "$resume-at", "$referenceLink", "$key",
+        "href", "class", "title", "css",
+    };
+    input->ids = (MgString*) malloc(count * sizeof(MgString));
+    input->idCount = count;
+    for( int ii = 0; ii < count; ++ii )
+    {
+        char buffer[128];
+        if( ii < 9 )
+            strcpy(buffer, kFixedIds[ii]);
+        else if( ii & 1 )
+            sprintf(buffer, "%s-level %s definitions", kWords[NextRandom() % kWordCount], kWords[NextRandom() % kWordCount]);
+        else
+            sprintf(buffer, "%s %s %s", kWords[NextRandom() % kWordCount], kWords[NextRandom() % kWordCount], kWords[NextRandom() % kWordCount]);
+        input->ids[ii] = MgTerminatedString(strdup(buffer));
+    }
+}
+
+static void InitializeBenchInput(
+    BenchInput* input,
+    int         size )
+{
+    memset(input, 0, sizeof(*input));
+    input->size = size;
+    input->context.defaultScrapKind = kScrapKind_GlobalMacro;
+
+    char* text = GenerateText(size);
+    input->text = MgMakeString(text, text + strlen(text));
+    input->inputFile = MgAllocateInputFile(&input->context, "microbench.md", input->text.begin, input->text.end);
+    MgReadLines(&input->context, input->inputFile);
+    input->lines = input->inputFile->beginLines;
+    input->lineCount = (int)(input->inputFile->endLines - input->inputFile->beginLines);
+    input->scratchLines = (MgLine*) malloc(input->lineCount * sizeof(MgLine));
+
+    GenerateIds(input, 64);
+
+    input->outputBuffer = (char*) malloc(size + 1);
+
+    input->diskPath = "microbench.tmp";
+    FILE* file = fopen(input->diskPath, "wb");
+    if( file )
+    {
+        fwrite(input->text.begin, 1, size, file);
+        fclose(file);
+    }
+
+    input->diskSegment = input->text;
+    MgInitializeRope(&input->diskRope);
+    input->diskRope.segments = &input->diskSegment;
+    input->diskRope.segmentCount = 1;
+    input->diskRope.size = input->text.end - input->text.begin;
+    MgInitializeOutputFile(&input->diskFile, NULL, MgTerminatedString(input->diskPath), "");
+    MgOpenOutputFileDirectory(&input->context, &input->diskFile);
+}
+
+/* Benchmarks */
+
+typedef void (*BenchFunc)( BenchInput* input );
+
+/* keeps results alive, so the compiler can't discard the work */
+static volatile long gSink;
+
+static void Bench_ReadLineText( BenchInput* input )
+{
+    MgReader reader;
+    MgInitializeStringReader(&reader, input->text);
+    long count = 0;
+    while( !MgAtEnd(&reader) )
+    {
+        MgString line = ReadLineText(&reader);
+        count += line.end - line.begin;
+    }
+    gSink += count;
+}
+
+static void Bench_CountLines( BenchInput* input )
+{
+    gSink += MgCountLinesInString(input->text);
+}
+
+static void Bench_ReadLineSpans( BenchInput* input )
+{
+    for( int ii = 0; ii < input->lineCount; ++ii )
+    {
+        MgLine* line = &input->lines[ii];
+        SpanWriter writer;
+        InitializeSpanWriter(&writer);
+        ReadLineSpans(&input->context, input->inputFile, line, line->text.begin, line->text.end, kMgSpanFlags_Default, &writer);
+        gSink += writer.firstElement != NULL;
+    }
+}
+
+static void Bench_TryParseSpanElement( BenchInput* input )
+{
+    /* try every position, as `ReadLineSpans` does when nothing matches */
+    long matches = 0;
+    for( int ii = 0; ii < input->lineCount; ++ii )
+    {
+        MgLine* line = &input->lines[ii];
+        for( char const* cursor = line->text.begin; cursor != line->text.end; ++cursor )
+        {
+            MgReader reader;
+            MgInitializeStringReader(&reader, MgMakeString(cursor, line->text.end));
+            matches += TryParseSpanElement(&input->context, input->inputFile, line, &reader, kMgSpanFlags_Default) != NULL;
+        }
+    }
+    gSink += matches;
+}
+
+static void Setup_ParseBlockElement( BenchInput* input )
+{
+    /* block parsing trims lines in place, so every run gets a fresh copy */
+    memcpy(input->scratchLines, input->lines, input->lineCount * sizeof(MgLine));
+}
+
+static void Bench_ParseBlockElement( BenchInput* input )
+{
+    LineRange range;
+    range.begin = input->scratchLines;
+    range.end = input->scratchLines + input->lineCount;
+    long count = 0;
+    for(;;)
+    {
+        SkipEmptyLines(&range);
+        if( range.begin == range.end )
+            break;
+        count += ParseBlockElement(&input->context, input->inputFile, &range) != NULL;
+    }
+    gSink += count;
+}
+
+static void Bench_ParseLiterateScrapIntroduction( BenchInput* input )
+{
+    long count = 0;
+    for( int ii = 0; ii < input->lineCount; ++ii )
+    {
+        MgScrapKind kind;
+        char const* idBegin; char const* idEnd;
+        char const* nameBegin; char const* nameEnd;
+        MgString text = input->lines[ii].text;
+        TrimLeadingSpace(&text.begin, text.end);
+        count += ParseLiterateScrapIntroduction(&input->context, input->inputFile, text,
+            &kind, &idBegin, &idEnd, &nameBegin, &nameEnd);
+    }
+    gSink += count;
+}
+
+/*
+The string benchmarks compare every identifier against every other one,
+the way a linear search over a list of name groups would. The amount of
+work doesn't depend on the input size, so they are only run once.
+*/
+static MgBool LegacyStringsAreEqual( MgString left, MgString right )
+{
+    char const* l = left.begin;
+    char const* r = right.begin;
+    for(;;)
+    {
+        MgBool lEnd = l == left.end;
+        MgBool rEnd = r == right.end;
+        if( lEnd || rEnd )
+            return lEnd == rEnd;
+        if( *l++ != *r++ )
+            return MG_FALSE;
+    }
+}
+
+static MgBool LegacyStringsAreEqualNoCase( MgString left, MgString right )
+{
+    char const* l = left.begin;
+    char const* r = right.begin;
+    for(;;)
+    {
+        MgBool lEnd = l == left.end;
+        MgBool rEnd = r == right.end;
+        if( lEnd || rEnd )
+            return lEnd == rEnd;
+        if( tolower(*l++) != tolower(*r++) )
+            return MG_FALSE;
+    }
+}
+
+#define STRING_BENCH(Name, Compare)                                     \
+    static void Name( BenchInput* input )                               \
+    {                                                                   \
+        long count = 0;                                                 \
+        for( int ii = 0; ii < input->idCount; ++ii )                    \
+            for( int jj = 0; jj < input->idCount; ++jj )                \
+                count += Compare(input->ids[ii], input->ids[jj]);       \
+        gSink += count;                                                 \
+    }
+
+STRING_BENCH(Bench_StringsAreEqual, MgStringsAreEqual)
+STRING_BENCH(Bench_StringsAreEqualNoCase, MgStringsAreEqualNoCase)
+STRING_BENCH(Bench_LegacyStringsAreEqual, LegacyStringsAreEqual)
+STRING_BENCH(Bench_LegacyStringsAreEqualNoCase, LegacyStringsAreEqualNoCase)
+
+static void Bench_MemoryWriter( BenchInput* input )
+{
+    MgWriter writer;
+    MgInitializeMemoryWriter(&writer, input->outputBuffer);
+    MgWriteString(&writer, input->text);
+    gSink += input->outputBuffer[0];
+}
+
+static void Bench_CountingWriter( BenchInput* input )
+{
+    MgWriter writer;
+    int counter = 0;
+    MgInitializeCountingWriter(&writer, &counter);
+    MgWriteString(&writer, input->text);
+    gSink += counter;
+}
+
+static void Bench_RopeIsSameAsFileOnDisk( BenchInput* input )
+{
+    gSink += MgRopeIsSameAsFileOnDisk(&input->diskRope, &input->diskFile);
+}
+
+typedef struct BenchmarkT
+{
+    char const* name;
+    BenchFunc   setup;
+    BenchFunc   run;
+    int         sizeIndependent;
+} Benchmark;
+
+static Benchmark const kBenchmarks[] =
+{
+    { "ReadLineText",                   NULL, &Bench_ReadLineText, 0 },
+    { "MgCountLinesInString",           NULL, &Bench_CountLines, 0 },
+    { "ReadLineSpans",                  NULL, &Bench_ReadLineSpans, 0 },
+    { "TryParseSpanElement",            NULL, &Bench_TryParseSpanElement, 0 },
+    { "ParseBlockElement",              &Setup_ParseBlockElement, &Bench_ParseBlockElement, 0 },
+    { "ParseLiterateScrapIntroduction", NULL, &Bench_ParseLiterateScrapIntroduction, 0 },
+    { "MgStringsAreEqual",              NULL, &Bench_StringsAreEqual, 1 },
+    { "MgStringsAreEqualNoCase",        NULL, &Bench_StringsAreEqualNoCase, 1 },
+    { "legacy-MgStringsAreEqual",       NULL, &Bench_LegacyStringsAreEqual, 1 },
+    { "legacy-MgStringsAreEqualNoCase", NULL, &Bench_LegacyStringsAreEqualNoCase, 1 },
+    { "MemoryWriter",                   NULL, &Bench_MemoryWriter, 0 },
+    { "CountingWriter",                 NULL, &Bench_CountingWriter, 0 },
+    { "MgRopeIsSameAsFileOnDisk",       NULL, &Bench_RopeIsSameAsFileOnDisk, 0 },
+};
+enum { kBenchmarkCount = sizeof(kBenchmarks) / sizeof(kBenchmarks[0]) };
+
+/* Harness */
+
+static int CompareDoubles( void const* left, void const* right )
+{
+    double l = *(double const*) left;
+    double r = *(double const*) right;
+    return (l > r) - (l < r);
+}
+
+static void RunBenchmark(
+    Benchmark const*    benchmark,
+    BenchInput*         input,
+    int                 warmup,
+    int                 reps )
+{
+    double* seconds = (double*) malloc(reps * sizeof(double));
+    double* cycles = (double*) malloc(reps * sizeof(double));
+
+    for( int ii = 0; ii < warmup; ++ii )
+    {
+        if( benchmark->setup )
+            benchmark->setup(input);
+        benchmark->run(input);
+    }
+
+    for( int ii = 0; ii < reps; ++ii )
+    {
+        if( benchmark->setup )
+            benchmark->setup(input);
+        uint64_t startCycles = ReadCycleCounter();
+        double start = GetSeconds();
+        benchmark->run(input);
+        seconds[ii] = GetSeconds() - start;
+        cycles[ii] = (double)(ReadCycleCounter() - startCycles);
+    }
+
+    qsort(seconds, reps, sizeof(double), &CompareDoubles);
+    qsort(cycles, reps, sizeof(double), &CompareDoubles);
+
+    double bytes = benchmark->sizeIndependent ? (double)(input->idCount * input->idCount) : (double) input->size;
+    char const* unit = benchmark->sizeIndependent ? "compare" : "byte";
+    printf("%-32s %9d %12.1f %12.1f %10.3f ns/%s",
+        benchmark->name,
+        benchmark->sizeIndependent ? input->idCount * input->idCount : input->size,
+        seconds[0] * 1e6,
+        seconds[reps / 2] * 1e6,
+        seconds[0] * 1e9 / bytes,
+        unit);
+    if( HAS_CYCLE_COUNTER )
+        printf(" %10.3f cycles/%s", cycles[0] / bytes, unit);
+    printf("\n");
+
+    free(seconds);
+    free(cycles);
+}
+
+int main(
+    int     argc,
+    char**  argv )
+{
+    int sizes[16] = { 1024, 16384, 262144 };
+    int sizeCount = 3;
+    int reps = 20;
+    int warmup = 3;
+    char const* filter = "";
+
+    for( int ii = 1; ii < argc; ++ii )
+    {
+        if( strcmp(argv[ii], "-sizes") == 0 && ii + 1 < argc )
+        {
+            sizeCount = 0;
+            for( char* cursor = argv[++ii]; *cursor && sizeCount < 16; )
+            {
+                sizes[sizeCount++] = (int) strtol(cursor, &cursor, 10);
+                if( *cursor == ',' )
+                    ++cursor;
+            }
+        }
+        else if( strcmp(argv[ii], "-reps") == 0 && ii + 1 < argc )
+            reps = atoi(argv[++ii]);
+        else if( strcmp(argv[ii], "-warmup") == 0 && ii + 1 < argc )
+            warmup = atoi(argv[++ii]);
+        else if( argv[ii][0] != '-' )
+            filter = argv[ii];
+        else
+        {
+            fprintf(stderr, "usage: %s [-sizes n,n,...] [-reps n] [-warmup n] [filter]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( reps < 1 )
+        reps = 1;
+
+    printf("%-32s %9s %12s %12s %s\n", "benchmark", "size", "min (us)", "median (us)", "per unit (min)");
+    for( int ss = 0; ss < sizeCount; ++ss )
+    {
+        BenchInput input;
+        InitializeBenchInput(&input, sizes[ss]);
+        for( int bb = 0; bb < kBenchmarkCount; ++bb )
+        {
+            Benchmark const* benchmark = &kBenchmarks[bb];
+            if( !strstr(benchmark->name, filter) )
+                continue;
+            if( benchmark->sizeIndependent && ss != 0 )
+                continue;
+            RunBenchmark(benchmark, &input, warmup, reps);
+        }
+        MgFreeOutputFile(&input.diskFile);
+        remove(input.diskPath);
+    }
+    return 0;
+}
@@ -1,20 +1,17 @@
-
-#line 124 "source/main.md"
-    
-#line 50 "README.md"
+#line 76 "README.md"
     /****************************************************************************
     Copyright (c) 2014 Tim Foley
-    
+
     Permission is hereby granted, free of charge, to any person obtaining a copy
     of this software and associated documentation files (the "Software"), to deal
     in the Software without restriction, including without limitation the rights
     to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
     copies of the Software, and to permit persons to whom the Software is
     furnished to do so, subject to the following conditions:
-    
+
     The above copyright notice and this permission notice shall be included in
     all copies or substantial portions of the Software.
-    
+
     THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
     IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
     FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
@@ -23,188 +20,449 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
     THE SOFTWARE.
     ****************************************************************************/
-    
-#line 124 "source/main.md"
-               
-    
-#line 136 "source/main.md"
+#line 325 "source/main.md"
+    #if !defined(_WIN32) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+    #endif
     #include <assert.h>
     #include <ctype.h>
     #include <stdio.h>
+    #include <stdint.h>
     #include <stdlib.h>
     #include <string.h>
-    
-#line 125 "source/main.md"
-                
-    
-#line 148 "source/main.md"
-    
+#line 339 "source/main.md"
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define MG_HAS_SSE2 1
+    #include <emmintrin.h>
+    #else
+    #define MG_HAS_SSE2 0
+    #endif
+#line 349 "source/main.md"
+    #ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define PSAPI_VERSION 2
+    #include <windows.h>
+    #include <psapi.h>
+    #else
+    #include <sys/resource.h>
+    #include <time.h>
+    #endif
+#line 362 "source/main.md"
+    #if defined(__linux__)
+    #include <sys/syscall.h>
+    #include <unistd.h>
+    #endif
+#line 371 "source/main.md"
+    #ifndef MG_THREADS
+    #define MG_THREADS 1
+    #endif
+    #if !defined(_WIN32) && (MG_THREADS || !defined(__linux__))
+    #include <pthread.h>
+    #endif
+#line 382 "source/main.md"
+    #ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <limits.h>
+    #include <sys/uio.h>
+    #include <unistd.h>
+    #else
+    #include <direct.h>
+    #include <errno.h>
+    #endif
+#line 397 "source/main.md"
+    #include <sys/types.h>
+    #include <sys/stat.h>
 #line 11 "source/string.md"
     typedef struct MgStringT
     {
         char const* begin;
         char const* end;
     } MgString;
-    
 #line 43 "source/string.md"
     MgString MgMakeString( char const* begin, char const* end );
-    
-#line 148 "source/main.md"
-                           
-    
-#line 493 "source/document.md"
-    
-#line 482 "source/document.md"
+#line 219 "source/string.md"
+    typedef unsigned int MgHash;
+#line 257 "source/string.md"
+    typedef uint64_t MgContentHash;
+#line 13 "source/stats.md"
+    typedef enum MgPhaseT
+    {
+        kMgPhase_FileRead,          /* reading input files into memory */
+        kMgPhase_LineIndexing,      /* splitting input text into lines */
+        kMgPhase_BlockParse,        /* parsing block-level elements */
+        kMgPhase_SpanParse,         /* parsing span-level elements */
+        kMgPhase_ScrapRegistration, /* finding/creating scrap groups */
+        kMgPhase_CodeExpansion,     /* expanding scraps into code output */
+        kMgPhase_HtmlRender,        /* rendering documents to HTML */
+        kMgPhase_OutputCompare,     /* comparing output with the file on disk */
+        kMgPhase_DiskWrite,         /* writing changed output to disk */
+
+        kMgPhaseCount,
+    } MgPhase;
+#line 52 "source/stats.md"
+    typedef struct MgPhaseStatsT
+    {
+        double      wallSeconds;
+        double      cpuSeconds;
+        long long   bytes;
+        long long   elements;
+    } MgPhaseStats;
+#line 66 "source/stats.md"
+    enum
+    {
+        kMgMaxPhaseDepth = 64,
+    };
+
+    typedef struct MgStatsT
+    {
+        MgPhaseStats    phases[kMgPhaseCount];
+
+        MgPhase         phaseStack[kMgMaxPhaseDepth];
+        int             phaseDepth;
+        double          lastWallSeconds;
+        double          lastCpuSeconds;
+
+        double          startWallSeconds;
+        double          startCpuSeconds;        /* of the main thread */
+        double          startProcessCpuSeconds;
+
+        int             outputsWritten;
+        int             outputsUnchanged;
+        int             outputsSkipped;         /* not even expanded, per `-output-hashes` */
+    } MgStats;
+#line 15 "source/threads.md"
+    #if MG_THREADS
+    #ifdef _WIN32
+    typedef CRITICAL_SECTION    MgMutex;
+    typedef CONDITION_VARIABLE  MgCondition;
+    typedef HANDLE              MgThread;
+    #else
+    typedef pthread_mutex_t     MgMutex;
+    typedef pthread_cond_t      MgCondition;
+    typedef pthread_t           MgThread;
+    #endif
+    #endif
+
+    typedef struct MgSchedulerT MgScheduler;
+#line 33 "source/threads.md"
+    #if !MG_THREADS
+    #define MG_THREAD_LOCAL
+    #elif defined(_MSC_VER)
+    #define MG_THREAD_LOCAL __declspec(thread)
+    #else
+    #define MG_THREAD_LOCAL __thread
+    #endif
+#line 17 "source/trace.md"
+    typedef struct MgTraceT
+    {
+        FILE*   stream;
+        double  startSeconds;
+        int     eventCount;
+    #if MG_THREADS
+        MgMutex lock;           /* held while writing an event */
+    #endif
+    } MgTrace;
+#line 12 "source/counters.md"
+    #ifndef MG_PARSER_COUNTERS
+    #define MG_PARSER_COUNTERS 0
+    #endif
+#line 24 "source/counters.md"
+    #define MG_PARSER_ENTRY(func) &func
+#line 33 "source/counters.md"
+    #if MG_PARSER_COUNTERS
+    enum
+    {
+        kMgMaxParserCounters = 32,
+    };
+
+    typedef struct MgParserCounterT
+    {
+        char const* name;
+        long long   attempts;
+        long long   successes;
+        long long   bytes;
+        double      seconds;
+    } MgParserCounter;
+    #endif
+#line 14 "source/alloc.md"
+    typedef enum MgAllocKindT
+    {
+        kMgAllocKind_Element,           /* `MgElement` (also counted by element kind) */
+        kMgAllocKind_Attribute,         /* `MgAttribute` */
+        kMgAllocKind_Lines,             /* arrays of `MgLine` */
+        kMgAllocKind_LineTable,         /* compact line tables */
+        kMgAllocKind_Scrap,             /* `MgScrap` */
+        kMgAllocKind_ScrapNameGroup,    /* `MgScrapNameGroup` */
+        kMgAllocKind_ScrapFileGroup,    /* `MgScrapFileGroup` */
+        kMgAllocKind_ScrapOps,          /* arrays of `MgScrapOp` */
+        kMgAllocKind_ReferenceLink,     /* `MgReferenceLink` */
+        kMgAllocKind_InputFile,         /* `MgInputFile` */
+        kMgAllocKind_InputBuffer,       /* text of input files */
+        kMgAllocKind_OutputBuffer,      /* text of output files */
+        kMgAllocKind_ScrapText,         /* text of scraps retained by `-stream-docs` */
+        kMgAllocKind_CompactTree,       /* compact document trees */
+        kMgAllocKind_LineDirectivePath, /* input file paths, quoted for `#line` */
+        kMgAllocKind_SourceMap,         /* source map ranges, with `-source-map` */
+        kMgAllocKind_Rope,              /* rope segments and generated bytes, for code files */
+        kMgAllocKind_Parallel,          /* scheduler and pieces of code files, for parallel expansion */
+        kMgAllocKind_OutputHashes,      /* records of code file hashes, with `-output-hashes` */
+        kMgAllocKind_ExpansionReport,   /* scrap groups listed when a code file is too large */
+        kMgAllocKind_OutputPath,        /* paths of output files, and cached output directories */
+        kMgAllocKind_WriteQueue,        /* outputs waiting to be written behind the run */
+
+        kMgAllocKindCount,
+    } MgAllocKind;
+#line 118 "source/alloc.md"
+    typedef struct MgAllocCountT
+    {
+        long long   objects;
+        long long   bytes;
+    } MgAllocCount;
+#line 658 "source/document.md"
     typedef struct MgAttributeT         MgAttribute;
+    typedef struct MgCompactDocT        MgCompactDoc;
     typedef struct MgContextT           MgContext;
     typedef struct MgElementT           MgElement;
     typedef struct MgInputFileT         MgInputFile;
     typedef struct MgLineT              MgLine;
+    typedef struct MgOutputDirectoriesT MgOutputDirectories;
+    typedef struct MgOutputHashesT      MgOutputHashes;
+    typedef struct MgWriteQueueT        MgWriteQueue;
     typedef struct MgReferenceLinkT     MgReferenceLink;
     typedef struct MgScrapT             MgScrap;
+    typedef struct MgScrapOpT           MgScrapOp;
     typedef struct MgScrapFileGroupT    MgScrapFileGroup;
     typedef struct MgScrapNameGroupT    MgScrapNameGroup;
-    
-#line 493 "source/document.md"
-                                     
-    
 #line 13 "source/document.md"
     typedef int MgBool;
     #define MG_TRUE     (1)
     #define MG_FALSE    (0)
-    
 #line 24 "source/document.md"
     typedef struct MgSourceLocT
     {
         int line;
         int col;
     } MgSourceLoc;
-    
-#line 40 "source/document.md"
+#line 246 "source/document.md"
+    typedef enum MgExpandedSizeStateT
+    {
+        kMgExpandedSize_Unknown,        /* not computed yet */
+        kMgExpandedSize_Computing,      /* being computed (seeing this again means recursion) */
+        kMgExpandedSize_Known,
+        kMgExpandedSize_Recursive,      /* expansion would never terminate */
+    } MgExpandedSizeState;
+
+    typedef struct MgExpandedSizeT
+    {
+        MgExpandedSizeState state;
+        long long           bytes;
+        long long           ownBytes;       /* written by the group's own scraps */
+        long long           refCount;       /* references followed to expand the group */
+        MgContentHash       hash;           /* only computed with `-output-hashes` */
+        long long           uses;           /* scratch, for reporting on expansions */
+    } MgExpandedSize;
+#line 41 "source/document.md"
     struct MgScrapT
     {
         
-#line 48 "source/document.md"
+#line 49 "source/document.md"
     MgSourceLoc         sourceLoc;
     MgElement*          body;
-    
-#line 125 "source/document.md"
+#line 55 "source/document.md"
+    MgCompactDoc*       compactDoc;
+    uint32_t            compactBody;
+#line 62 "source/document.md"
+    MgScrapOp*          ops;
+    int                 opCount;
+#line 166 "source/document.md"
     MgScrap*            next;
-    
-#line 134 "source/document.md"
+#line 175 "source/document.md"
     MgScrapFileGroup*   fileGroup;
-    
-#line 42 "source/document.md"
-                         
+#line 180 "source/document.md"
+    MgScrap*            nextInFile;
+#line 44 "source/document.md"
+    };
+#line 69 "source/document.md"
+    typedef enum MgScrapOpKindT
+    {
+        kMgScrapOp_Text,
+        kMgScrapOp_NewLine,
+        kMgScrapOp_Ref,
+    } MgScrapOpKind;
+
+    typedef struct MgScrapOpRefT
+    {
+        MgScrapFileGroup*   fileGroup;
+        MgSourceLoc         resumeLoc;
+    } MgScrapOpRef;
+
+    struct MgScrapOpT
+    {
+        MgScrapOpKind       kind;
+        union
+        {
+            MgString        text;
+            MgScrapOpRef    ref;
+        };
     };
-    
-#line 56 "source/document.md"
+#line 97 "source/document.md"
     typedef enum MgScrapKind
     {
         
-#line 68 "source/document.md"
+#line 109 "source/document.md"
     kScrapKind_Unknown,
-    
-#line 79 "source/document.md"
+#line 120 "source/document.md"
     kScrapKind_LocalMacro,
-    
-#line 88 "source/document.md"
+#line 129 "source/document.md"
     kScrapKind_GlobalMacro,
-    
-#line 97 "source/document.md"
+#line 138 "source/document.md"
     kScrapKind_OutputFile,
-    
-#line 104 "source/document.md"
+#line 145 "source/document.md"
     kScrapKind_RawMacro,
-    
-#line 58 "source/document.md"
-                       
+#line 100 "source/document.md"
     } MgScrapKind;
-    
-#line 111 "source/document.md"
+#line 152 "source/document.md"
     struct MgScrapFileGroupT
     {
         
-#line 119 "source/document.md"
+#line 160 "source/document.md"
     MgInputFile*      inputFile;
-    
-#line 128 "source/document.md"
+#line 169 "source/document.md"
     MgScrap*          firstScrap;
     MgScrap*          lastScrap;
-    
-#line 166 "source/document.md"
+#line 217 "source/document.md"
     MgScrapFileGroup* next;
-    
-#line 175 "source/document.md"
+#line 226 "source/document.md"
     MgScrapNameGroup* nameGroup;
-    
-#line 113 "source/document.md"
-                                    
+#line 268 "source/document.md"
+    MgExpandedSize      expandedSize;
+#line 155 "source/document.md"
     };
-    
-#line 141 "source/document.md"
+#line 187 "source/document.md"
     struct MgScrapNameGroupT
     {
         
-#line 151 "source/document.md"
+#line 197 "source/document.md"
     MgString            id;
     MgElement*          name;
-    
-#line 157 "source/document.md"
+#line 203 "source/document.md"
+    MgHash              idHash;
+#line 208 "source/document.md"
     MgScrapKind         kind;
-    
-#line 169 "source/document.md"
+#line 220 "source/document.md"
     MgScrapFileGroup*   firstFileGroup;
     MgScrapFileGroup*   lastFileGroup;
-    
-#line 184 "source/document.md"
+#line 235 "source/document.md"
     MgScrapNameGroup*   next;
-    
-#line 143 "source/document.md"
-                                    
+#line 265 "source/document.md"
+    MgExpandedSize      expandedSize;
+#line 190 "source/document.md"
     };
-    
-#line 192 "source/document.md"
+#line 276 "source/document.md"
     struct MgLineT
     {
         MgString      text;
         char const* originalBegin;
     };
-    
-#line 218 "source/document.md"
+#line 302 "source/document.md"
+    typedef struct MgLineEntry32T
+    {
+        uint32_t    start;      /* offset of `originalBegin` in the file text */
+        uint32_t    trim;       /* `text.begin - originalBegin` */
+        uint32_t    length;     /* `text.end - text.begin` */
+    } MgLineEntry32;
+
+    typedef struct MgLineEntry64T
+    {
+        uint64_t    start;
+        uint64_t    trim;
+        uint64_t    length;
+    } MgLineEntry64;
+#line 319 "source/document.md"
+    typedef struct MgLineTableT
+    {
+        MgLineEntry32*  entries32;          /* used when the file is smaller than 4GB */
+        MgLineEntry64*  entries64;          /* used otherwise */
+        size_t          count;
+    } MgLineTable;
+#line 333 "source/document.md"
     struct MgInputFileT
     {
         char const*     path;               /* path of input file (terminated) */
         MgString        text;               /* full text of the input file */
         char*           allocatedFileData;  /* allocated file buffer, if any */
-        MgLine*         beginLines;         /* allocated per-line data */
+        MgLine*         beginLines;         /* allocated per-line data (only during parsing) */
         MgLine*         endLines;
+        MgLineTable     lineTable;          /* compact per-line data, after parsing */
         MgElement*      firstElement;       /* first element in doc structure*/
         MgInputFile*    next;               /* next input file in context */
         MgReferenceLink*firstReferenceLink; /* first reference link parsed */
+        MgCompactDoc*   compact;            /* compact tree, replacing `firstElement`, if any */
+        MgString        lineDirectivePath;  /* quoted path for `#line` directives, once needed */
+        
+#line 62 "source/counters.md"
+    #if MG_PARSER_COUNTERS
+    long long       parseAttempts;      /* block- and span-level parse attempts */
+    long long       failedParseAttempts;
+    #endif
+#line 347 "source/document.md"
+        
+#line 142 "source/alloc.md"
+    MgAllocCount    allocated;          /* allocated while parsing this file */
+#line 348 "source/document.md"
+        
+#line 21 "source/stream.md"
+    char*           scrapText;          /* retained text of scraps, with `-stream-docs` */
+    size_t          scrapTextSize;
+#line 29 "source/stream.md"
+    MgScrap*        firstScrap;         /* scraps defined in this file, in order */
+    MgScrap*        lastScrap;
+    MgScrap*        nextReparsedScrap;  /* next scrap to match up, while re-parsing */
+    MgBool          reparsing;          /* is this the second parse of the file? */
+#line 349 "source/document.md"
     };
-    
-#line 237 "source/document.md"
+#line 358 "source/document.md"
     struct MgContextT
     {
         MgInputFile*        firstInputFile;         /* singly-linked list of input files */
         MgInputFile*        lastInputFile;
-    
+
         MgScrapNameGroup*   firstScrapNameGroup;    /* singly-linked list of scrap name groups */
         MgScrapNameGroup*   lastScrapNameGroup;
-    
+
         MgInputFile*        metaDataFile;
-    
+
         MgScrapKind         defaultScrapKind;
+        MgBool              useCompactTrees;        /* convert documents to compact trees after parsing */
+        MgBool              tangleOnly;             /* only parse what is needed to write code */
+        MgBool              writeSourceMaps;        /* write source maps, instead of `#line` directives */
+        MgBool              writeToStdout;          /* write code to `stdout`, instead of to files */
+        int                 jobCount;               /* threads to expand large code files with */
+        MgScheduler*        scheduler;              /* `NULL` until a code file is expanded in parallel */
+        MgOutputHashes*     outputHashes;           /* `NULL` unless output hashes were requested */
+        char const*         codeOutputRoot;         /* directories to write outputs beneath, or `NULL` */
+        char const*         docOutputRoot;
+        MgOutputDirectories* outputDirectories;     /* handles of output directories (see `output-dir.md`) */
+        long long           writeBufferBytes;       /* budget for outputs written behind the run, or zero */
+        MgWriteQueue*       writeQueue;             /* `NULL` until an output is written behind the run */
+        MgBool              writeQueueFailed;       /* outputs are written on the spot */
+
+        long long           maxOutputBytes;         /* limits on code files (see `limits.md`), or zero */
+        long long           maxTotalBytes;
+        long long           maxOutputRefs;
+        long long           maxTotalRefs;
+        long long           totalOutputBytes;       /* in the code files written so far */
+        long long           totalRefs;
+
+        MgStats*            stats;                  /* `NULL` unless statistics were requested */
+        MgTrace*            trace;                  /* `NULL` unless tracing was requested */
     };
-    
-#line 259 "source/document.md"
+#line 403 "source/document.md"
     typedef enum MgElementKindT
     {
         
-#line 267 "source/document.md"
-    
-#line 275 "source/document.md"
+#line 421 "source/document.md"
     kMgElementKind_BlockQuote,          /* `<blockquote>` */
     kMgElementKind_HorizontalRule,      /* `<hr>` */
     kMgElementKind_UnorderedList,       /* `<ul>` */
@@ -215,145 +473,151 @@
     kMgElementKind_TableRow,            /* `<tr>` */
     kMgElementKind_TableHeader,         /* `<th>` */
     kMgElementKind_TableCell,           /* `<td>` */
-    
-#line 296 "source/document.md"
+#line 442 "source/document.md"
     kMgElementKind_Header1,             /* `<h1>` */
     kMgElementKind_Header2,             /* `<h2>` */
     kMgElementKind_Header3,             /* `<h3>` */
     kMgElementKind_Header4,             /* `<h4>` */
     kMgElementKind_Header5,             /* `<h5>` */
     kMgElementKind_Header6,             /* `<h6>` */
-    
-#line 309 "source/document.md"
+#line 455 "source/document.md"
     kMgElementKind_CodeBlock,           /* `<pre><code>` */
-    
-#line 316 "source/document.md"
+#line 462 "source/document.md"
     kMgElementKind_ScrapDef,
-    
-#line 332 "source/document.md"
+#line 478 "source/document.md"
     kMgElementKind_MetaData,
-    
-#line 340 "source/document.md"
+#line 486 "source/document.md"
     kMgElementKind_HtmlBlock,
-    
-#line 267 "source/document.md"
-                                 
-    
-#line 287 "source/document.md"
+#line 433 "source/document.md"
     kMgElementKind_Em,                  /* `<em>` */
     kMgElementKind_Strong,              /* `<strong>` */
     kMgElementKind_InlineCode,          /* `<code>` */
-    
-#line 325 "source/document.md"
+#line 471 "source/document.md"
     kMgElementKind_ScrapRef,
-    
-#line 354 "source/document.md"
+#line 500 "source/document.md"
     kMgElementKind_LessThanEntity,      /* `&lt;` */
     kMgElementKind_GreaterThanEntity,   /* `&gt;` */
     kMgElementKind_AmpersandEntity,     /* `&amp;` */
-    
-#line 364 "source/document.md"
-    kMgElementKind_NewLine,             /* `"\n"` */
-    
-#line 371 "source/document.md"
+#line 509 "source/document.md"
     kMgElementKind_Link,                /* `<a>` with href attribute */
-    
-#line 397 "source/document.md"
+#line 536 "source/document.md"
     kMgElementKind_ReferenceLink,
-    
-#line 268 "source/document.md"
-                                
-    
-#line 347 "source/document.md"
+#line 493 "source/document.md"
     kMgElementKind_Text,
-    
-#line 261 "source/document.md"
-                         
+#line 407 "source/document.md"
+        kMgElementKindCount,
     } MgElementKind;
-    
-#line 384 "source/document.md"
+#line 522 "source/document.md"
     struct MgReferenceLinkT
     {
         MgString          id;
+        MgHash            idHash;   /* case-insensitive hash of `id` */
         MgString          url;
         MgString          title;
         MgReferenceLink*  next;
     };
-    
-#line 405 "source/document.md"
+#line 589 "source/document.md"
+    typedef struct MgDeferredSpansT
+    {
+        MgInputFile*    inputFile;
+        unsigned        spanFlags;          /* `MgSpanFlags` to parse with */
+        MgBool          wholeLines;         /* lines (with breaks), or a single string? */
+    } MgDeferredSpans;
+#line 546 "source/document.md"
     struct MgAttributeT
     {
         
-#line 419 "source/document.md"
+#line 560 "source/document.md"
     MgString              id;
-    
-#line 424 "source/document.md"
+#line 565 "source/document.md"
     MgAttribute*          next;
-    
-#line 407 "source/document.md"
-                             
+#line 549 "source/document.md"
         union
         {
             
-#line 429 "source/document.md"
+#line 570 "source/document.md"
     MgString          val;
-    
-#line 434 "source/document.md"
+#line 575 "source/document.md"
     MgReferenceLink*  referenceLink;
     MgScrap*          scrap;
     MgScrapFileGroup* scrapFileGroup;
     MgSourceLoc       sourceLoc;
-    
-#line 410 "source/document.md"
-                                       
+#line 584 "source/document.md"
+    MgDeferredSpans   deferredSpans;
+#line 552 "source/document.md"
         };
     };
-    
-#line 444 "source/document.md"
+#line 603 "source/document.md"
+    typedef enum MgElementFlagsT
+    {
+        kMgElementFlag_EndsLine         = 0x1,
+        kMgElementFlag_DeferredSpans    = 0x2,
+    } MgElementFlags;
+#line 610 "source/document.md"
     struct MgElementT
     {
         
-#line 452 "source/document.md"
+#line 618 "source/document.md"
     MgElementKind   kind;
-    
-#line 458 "source/document.md"
+#line 628 "source/document.md"
+    MgElementFlags  flags;
+#line 634 "source/document.md"
     MgString        text;
-    
-#line 463 "source/document.md"
+#line 639 "source/document.md"
     MgAttribute*    firstAttr;
-    
-#line 468 "source/document.md"
+#line 644 "source/document.md"
     MgElement*      firstChild;
     MgElement*      next;
-    
-#line 446 "source/document.md"
-                           
+#line 613 "source/document.md"
+    };
+#line 24 "source/compact.md"
+    typedef struct MgCompactNodeT
+    {
+        uint8_t     kind;       /* an `MgElementKind` */
+        uint8_t     flags;
+        uint32_t    textOffset;
+        uint32_t    textLength;
+        uint32_t    end;        /* index just past the last descendant */
+        uint32_t    firstAttr;  /* index into attribute table, or `kMgCompactNoAttr` */
+    } MgCompactNode;
+
+    #define kMgCompactNoAttr ((uint32_t) 0xFFFFFFFFu)
+#line 43 "source/compact.md"
+    enum
+    {
+        kMgCompactNodeFlag_ExternalText = 0x1,
+        kMgCompactNodeFlag_EndsLine     = 0x2,
+    };
+#line 57 "source/compact.md"
+    struct MgCompactDocT
+    {
+        MgInputFile*    inputFile;
+        MgCompactNode*  nodes;
+        uint32_t        nodeCount;
+        MgAttribute*    attrs;
+        uint32_t        attrCount;
+        MgString*       externalText;
+        uint32_t        externalTextCount;
     };
-    
-#line 494 "source/document.md"
-                                  
-    
-#line 149 "source/main.md"
-                             
-    
-#line 126 "source/main.md"
-                    
-    
-#line 154 "source/main.md"
-    
+#line 76 "source/compact.md"
+    typedef struct MgNodeT
+    {
+        MgElement*      element;    /* element, for a pointer-based tree */
+        MgCompactDoc*   doc;        /* document, for a compact tree */
+        uint32_t        index;      /* index of node within `doc` */
+        uint32_t        limit;      /* end of the sibling list containing the node */
+    } MgNode;
 #line 13 "source/reader.md"
     typedef struct MgReaderT
     {
         MgString    string;
         char const* cursor;
     } MgReader;
-    
 #line 23 "source/reader.md"
     enum
     {
         kMgEndOfFile = -1,
     };
-    
 #line 31 "source/reader.md"
     void MgInitializeStringReader(
         MgReader*   reader,
@@ -362,24 +626,21 @@
         reader->string  = string;
         reader->cursor  = string.begin;    
     }
-    
 #line 42 "source/reader.md"
     MgBool MgAtEnd(
         MgReader*   reader )
     {
         return reader->cursor == reader->string.end;
     }
-    
 #line 52 "source/reader.md"
     int MgGetChar(
         MgReader*   reader )
     {
         if( MgAtEnd(reader) )
             return kMgEndOfFile;
-    
+
         return *(reader->cursor++);
     }
-    
 #line 65 "source/reader.md"
     void MgUnGetChar(
         MgReader*   reader,
@@ -387,36 +648,29 @@
     {
         if( value == kMgEndOfFile )
             return;
-    
+
         --(reader->cursor);
     }
-    
 #line 81 "source/reader.md"
     int MgPeekChar(
         MgReader*   reader )
     {
         if( MgAtEnd(reader) )
             return kMgEndOfFile;
-    
+
         return *(reader->cursor);
     }
-    
-#line 154 "source/main.md"
-                          
-    
 #line 23 "source/string.md"
     static MgBool MgIsEmptyString(
         MgString string)
     {
         return string.begin == string.end;
     }
-    
 #line 32 "source/string.md"
     MgString MgMakeEmptyString()
     {
         return MgMakeString(NULL, NULL);
     }
-    
 #line 46 "source/string.md"
     MgString MgMakeString(
         char const* begin,
@@ -427,3276 +681,7756 @@
         result.end      = end;
         return result;
     }
-    
 #line 60 "source/string.md"
     MgString MgTerminatedString(
         char const* begin)
     {
         return MgMakeString(begin, begin + strlen(begin));
     }
-    
-#line 74 "source/string.md"
+#line 72 "source/string.md"
+    static int MgGetStringLength(
+        MgString string )
+    {
+        return (int)(string.end - string.begin);
+    }
+#line 90 "source/string.md"
     MgBool MgStringsAreEqual(
         MgString left,
         MgString right )
     {
-        char const* leftCursor = left.begin;
-        char const* rightCursor = right.begin;
-    
-        for(;;)
-        {
-            
-#line 93 "source/string.md"
-    MgBool leftAtEnd = leftCursor == left.end;
-    MgBool rightAtEnd = rightCursor == right.end;
-    if( leftAtEnd || rightAtEnd )
-        return leftAtEnd == rightAtEnd;
-    
-#line 83 "source/string.md"
-                                        
-            
-#line 101 "source/string.md"
-    char leftChar = *leftCursor++;
-    char rightChar = *rightCursor++;
-    
-#line 84 "source/string.md"
-                                          
-            
-#line 105 "source/string.md"
-    if( leftChar != rightChar )
-        return MG_FALSE;
-    
-#line 85 "source/string.md"
-                                               
-        }
-    }
-    
-#line 113 "source/string.md"
+        int length = MgGetStringLength(left);
+        if( length != MgGetStringLength(right) )
+            return MG_FALSE;
+        if( left.begin == right.begin )
+            return MG_TRUE;
+        return memcmp(left.begin, right.begin, length) == 0;
+    }
+#line 111 "source/string.md"
+    static int MgFoldCharCase(
+        int c )
+    {
+        if( c >= 'A' && c <= 'Z' )
+            return c + ('a' - 'A');
+        return c;
+    }
+#line 125 "source/string.md"
+    static uint64_t MgFoldWordCase(
+        uint64_t word )
+    {
+        uint64_t const kOnes    = 0x0101010101010101ull;
+        uint64_t const kHigh    = 0x8080808080808080ull;
+        uint64_t low            = word & ~kHigh;
+        uint64_t aboveA         = low + kOnes * (0x80 - 'A');
+        uint64_t aboveZ         = low + kOnes * (0x80 - 'Z' - 1);
+        uint64_t upper          = aboveA & ~aboveZ & ~word & kHigh;
+        return word | (upper >> 2);
+    }
+#line 140 "source/string.md"
     MgBool MgStringsAreEqualNoCase(
         MgString left,
         MgString right )
     {
+        int length = MgGetStringLength(left);
+        if( length != MgGetStringLength(right) )
+            return MG_FALSE;
+
         char const* leftCursor = left.begin;
         char const* rightCursor = right.begin;
-    
-        for(;;)
+        char const* leftEnd = left.end;
+
+        
+#line 164 "source/string.md"
+    #if MG_HAS_SSE2
+    {
+        __m128i const upperMin = _mm_set1_epi8('A' - 1);
+        __m128i const upperMax = _mm_set1_epi8('Z' + 1);
+        __m128i const caseBit  = _mm_set1_epi8(0x20);
+        while( leftEnd - leftCursor >= 16 )
         {
-            
-#line 93 "source/string.md"
-    MgBool leftAtEnd = leftCursor == left.end;
-    MgBool rightAtEnd = rightCursor == right.end;
-    if( leftAtEnd || rightAtEnd )
-        return leftAtEnd == rightAtEnd;
-    
-#line 122 "source/string.md"
-                                        
-            
-#line 101 "source/string.md"
-    char leftChar = *leftCursor++;
-    char rightChar = *rightCursor++;
-    
-#line 123 "source/string.md"
-                                          
-            
-#line 129 "source/string.md"
-    if( tolower(leftChar) != tolower(rightChar) )
-        return MG_FALSE;
-    
-#line 124 "source/string.md"
-                                                                
+            __m128i l = _mm_loadu_si128((__m128i const*) leftCursor);
+            __m128i r = _mm_loadu_si128((__m128i const*) rightCursor);
+            __m128i lUpper = _mm_and_si128(_mm_cmpgt_epi8(l, upperMin), _mm_cmplt_epi8(l, upperMax));
+            __m128i rUpper = _mm_and_si128(_mm_cmpgt_epi8(r, upperMin), _mm_cmplt_epi8(r, upperMax));
+            l = _mm_or_si128(l, _mm_and_si128(lUpper, caseBit));
+            r = _mm_or_si128(r, _mm_and_si128(rUpper, caseBit));
+            if( _mm_movemask_epi8(_mm_cmpeq_epi8(l, r)) != 0xFFFF )
+                return MG_FALSE;
+            leftCursor += 16;
+            rightCursor += 16;
         }
     }
-    
-#line 155 "source/main.md"
-                          
-    
-#line 5 "source/parse.md"
-    enum
+    #endif
+#line 153 "source/string.md"
+        
+#line 189 "source/string.md"
+    while( leftEnd - leftCursor >= 8 )
     {
-        kMaxHeaderLevel = 6,
-    };
-    
-    /*
-    Flags for parsing span-level elements in Markdown source.
-    */
-    enum
+        uint64_t l, r;
+        memcpy(&l, leftCursor, 8);
+        memcpy(&r, rightCursor, 8);
+        if( l != r && MgFoldWordCase(l) != MgFoldWordCase(r) )
+            return MG_FALSE;
+        leftCursor += 8;
+        rightCursor += 8;
+    }
+#line 154 "source/string.md"
+        
+#line 203 "source/string.md"
+    while( leftCursor != leftEnd )
     {
-        /* No flags. */
-        kMgSpanFlags_None = 0x00,
-    
-        /* Enable escaping of HTML entiteis like `&amp;` into characters like `&`.*/
-        kMgSpanFlag_EscapeHtmlEntities = 0x01,
-    
-        /* Disable processing of standard Markdown syntax. */
-        kMgSpanFlag_DontProcessMarkdown = 0x02,
-    
-        /* Default behavior: escape HTML entities, process Markdown. */
-        kMgSpanFlags_Default =
-            kMgSpanFlag_EscapeHtmlEntities,
-    
-        /* Inside a code block: escape HTML, but don't process Markdown */
-        kMgSpanFlags_CodeBlock =
-            kMgSpanFlag_EscapeHtmlEntities
-            | kMgSpanFlag_DontProcessMarkdown,
-    
-        /* Inline code: handle the same as a code block */
-        kMgSpanFlags_InlineCode = kMgSpanFlags_CodeBlock,
-    
-        /* Inside an HTML block: don't process Markdown. */
-        kMgSpanFlags_HtmlBlock =
-            kMgSpanFlag_DontProcessMarkdown,
-    };
-    typedef unsigned MgSpanFlags;
-    
-    /*
-    When encountering either a reference to or a definition of a "reference-style"
-    link in the document, call this function to get or create the object to represent
-    the link. At a definition site, fill in the `MgReferenceLink*` that was returned,
-    to provide information that will be used at any sites that reference it.
-    */
-    MgReferenceLink* MgFindOrCreateReferenceLink(
-        MgInputFile*    inputFile,
-        MgString          id )
+        int leftChar = (unsigned char) *leftCursor++;
+        int rightChar = (unsigned char) *rightCursor++;
+        if( MgFoldCharCase(leftChar) != MgFoldCharCase(rightChar) )
+            return MG_FALSE;
+    }
+#line 156 "source/string.md"
+        return MG_TRUE;
+    }
+#line 222 "source/string.md"
+    #define MG_HASH_OFFSET_BASIS    ((MgHash) 2166136261u)
+    #define MG_HASH_PRIME           ((MgHash) 16777619u)
+
+    MgHash MgHashString(
+        MgString string )
     {
-        MgReferenceLink* link = inputFile->firstReferenceLink;
-        while( link )
+        MgHash hash = MG_HASH_OFFSET_BASIS;
+        for( char const* cursor = string.begin; cursor != string.end; ++cursor )
         {
-            if( MgStringsAreEqualNoCase(
-                id,
-                link->id  ) )
-            {
-                return link;
-            }
-            link = link->next;
+            hash ^= (unsigned char) *cursor;
+            hash *= MG_HASH_PRIME;
         }
-    
-        link = (MgReferenceLink*) malloc(sizeof(MgReferenceLink));
-        link->id    = id;
-        link->url   = MgMakeEmptyString();
-        link->title = MgMakeEmptyString();
-    
-        link->next = inputFile->firstReferenceLink;
-        inputFile->firstReferenceLink = link;
-    
-        return link;
+        return hash;
     }
-    
-    /*
-    Allocate and add a new attribute to an existing element, with the
-    specified NULL-terminated `id` and value.
-    */
-    MgAttribute* MgAddAttribute(
-        MgElement*  element,
-        char const* id,
-        MgString      val )
+#line 240 "source/string.md"
+    MgHash MgHashStringNoCase(
+        MgString string )
     {
-        MgAttribute* attr = (MgAttribute*) malloc(sizeof(MgAttribute));
-        attr->next  = NULL;
-        attr->id    = MgTerminatedString(id);
-        attr->val   = val;
-    
-        // this is a linear-time insert, but we expect the
-        // number of attributes per element to be very low,
-        // so it probably won't matter for performance.
-        MgAttribute** link = &element->firstAttr;
-        while( *link )
-            link = &((*link)->next);
-        *link = attr;
-        return attr;
+        MgHash hash = MG_HASH_OFFSET_BASIS;
+        for( char const* cursor = string.begin; cursor != string.end; ++cursor )
+        {
+            hash ^= (MgHash) MgFoldCharCase((unsigned char) *cursor);
+            hash *= MG_HASH_PRIME;
+        }
+        return hash;
     }
-    
-    /*
-    Allocate an add a new atttribute to an existing element, with the
-    specified NULL-terminated `id`, but with no value. The caller is
-    expected to fill in of the fields in the `union` inside the
-    attribute, based on the chosen ID.
-    */
-    MgAttribute* MgAddCustomAttribute(
-        MgElement*  element,
-        char const* id)
-    {
-        return MgAddAttribute(element, id, MgMakeString(NULL, NULL));
+#line 260 "source/string.md"
+    #define MG_CONTENT_HASH_OFFSET_BASIS    ((MgContentHash) 14695981039346656037ull)
+    #define MG_CONTENT_HASH_PRIME           ((MgContentHash) 1099511628211ull)
+
+    MgContentHash MgHashContentBytes(
+        MgContentHash   hash,
+        void const*     data,
+        size_t          size )
+    {
+        unsigned char const* cursor = (unsigned char const*) data;
+        unsigned char const* end = cursor + size;
+        for( ; cursor != end; ++cursor )
+        {
+            hash ^= *cursor;
+            hash *= MG_CONTENT_HASH_PRIME;
+        }
+        return hash;
     }
-    
-    MgElement* MgCreateElementImpl(
-        MgElementKind   kind,
-        MgString          text,
-        MgElement*      firstChild )
+
+    MgContentHash MgHashContentInteger(
+        MgContentHash   hash,
+        long long       value )
     {
-        MgElement* element = (MgElement*) malloc(sizeof(MgElement));
-        element->kind       = kind;
-        element->text       = text;
-        element->firstAttr  = NULL;
-        element->firstChild = firstChild;
-        element->next       = NULL;
-        return element;
+        return MgHashContentBytes(hash, &value, sizeof(value));
     }
-    
-    /*
-    Create a leaf document element, with the specified kind and text.
-    */
-    MgElement* MgCreateLeafElement(
-        MgElementKind   kind,
-        MgString          text )
+
+    MgContentHash MgHashContentString(
+        MgContentHash   hash,
+        MgString        string )
+    {
+        hash = MgHashContentInteger(hash, string.end - string.begin);
+        return MgHashContentBytes(hash, string.begin, string.end - string.begin);
+    }
+#line 45 "source/threads.md"
+    #if MG_THREADS
+    static void MgInitializeMutex(
+        MgMutex*    mutex )
+    {
+    #ifdef _WIN32
+        InitializeCriticalSection(mutex);
+    #else
+        pthread_mutex_init(mutex, NULL);
+    #endif
+    }
+
+    static void MgDestroyMutex(
+        MgMutex*    mutex )
     {
-        return MgCreateElementImpl(
-            kind,
-            text,
-            NULL );  // no children
+    #ifdef _WIN32
+        DeleteCriticalSection(mutex);
+    #else
+        pthread_mutex_destroy(mutex);
+    #endif
     }
-    
-    /*
-    Create a parent document element, with the specified first child in
-    the linked list of child elements.
-    */
-    MgElement* MgCreateParentElement(
-        MgElementKind   kind,
-        MgElement*      firstChild )
+
+    static void MgLockMutex(
+        MgMutex*    mutex )
     {
-        return MgCreateElementImpl(
-            kind,
-            MgMakeString(NULL, NULL), // no text
-            firstChild );
+    #ifdef _WIN32
+        EnterCriticalSection(mutex);
+    #else
+        pthread_mutex_lock(mutex);
+    #endif
     }
-    
-    MgScrapNameGroup* MgFindScrapNameGroup(
-        MgContext*    context,
-        MgString      id )
+
+    static void MgUnlockMutex(
+        MgMutex*    mutex )
     {
-        MgScrapNameGroup* group = context->firstScrapNameGroup;
-        while( group )
-        {
-            if( MgStringsAreEqual( group->id, id ) )
-                return group;
-    
-            group = group->next;
-        }
-    
-        return 0;
+    #ifdef _WIN32
+        LeaveCriticalSection(mutex);
+    #else
+        pthread_mutex_unlock(mutex);
+    #endif
     }
-    
-    MgScrapFileGroup* MgFindScrapFileGroup(
-        MgScrapNameGroup* nameGroup,
-        MgInputFile*      inputFile )
+
+    static void MgInitializeCondition(
+        MgCondition*    condition )
     {
-        MgScrapFileGroup* fileGroup = nameGroup->firstFileGroup;
-        while( fileGroup )
+    #ifdef _WIN32
+        InitializeConditionVariable(condition);
+    #else
+        pthread_cond_init(condition, NULL);
+    #endif
+    }
+
+    static void MgDestroyCondition(
+        MgCondition*    condition )
+    {
+    #ifdef _WIN32
+        (void) condition;
+    #else
+        pthread_cond_destroy(condition);
+    #endif
+    }
+
+    static void MgWaitCondition(
+        MgCondition*    condition,
+        MgMutex*        mutex )
+    {
+    #ifdef _WIN32
+        SleepConditionVariableCS(condition, mutex, INFINITE);
+    #else
+        pthread_cond_wait(condition, mutex);
+    #endif
+    }
+
+    static void MgBroadcastCondition(
+        MgCondition*    condition )
+    {
+    #ifdef _WIN32
+        WakeAllConditionVariable(condition);
+    #else
+        pthread_cond_broadcast(condition);
+    #endif
+    }
+    #endif
+#line 132 "source/threads.md"
+    #if MG_THREADS
+    typedef void* (*MgThreadFunc)( void* );
+
+    #ifdef _WIN32
+    typedef struct MgWin32ThreadStartT
+    {
+        MgThreadFunc    func;
+        void*           arg;
+    } MgWin32ThreadStart;
+
+    static DWORD WINAPI MgWin32ThreadMain(
+        LPVOID  param )
+    {
+        MgWin32ThreadStart start = *(MgWin32ThreadStart*) param;
+        free(param);
+        start.func(start.arg);
+        return 0;
+    }
+    #endif
+
+    static int MgStartThread(
+        MgThread*       thread,
+        MgThreadFunc    func,
+        void*           arg )
+    {
+    #ifdef _WIN32
+        MgWin32ThreadStart* start = (MgWin32ThreadStart*) malloc(sizeof(MgWin32ThreadStart));
+        if( !start )
+            return 0;
+        start->func = func;
+        start->arg  = arg;
+        *thread = CreateThread(NULL, 0, MgWin32ThreadMain, start, 0, NULL);
+        if( !*thread )
         {
-            if( fileGroup->inputFile == inputFile )
-                return fileGroup;
-    
-            fileGroup = fileGroup->next;
+            free(start);
+            return 0;
         }
-    
-        return 0;
+        return 1;
+    #else
+        return pthread_create(thread, NULL, func, arg) == 0;
+    #endif
     }
-    
-    /*
-    When encountering either a reference to or a definition of a scrap,
-    call this function to get or create the object that represents the scrap
-    group with that `id` for the given `file`.
-    
-    The `kind` can either be `kMgScrapKind_Unknown` if you don't care what
-    kind of scrap it is, or a specific scrap kind if you want to set the
-    scrap kind as part of retrieving it. (TODO: separate those steps)
-    */
-    MgScrapFileGroup* MgFindOrCreateScrapGroup(
-        MgContext*    context,
-        MgScrapKind   kind,
-        MgString      id,
-        MgInputFile*  file )
+
+    static void MgJoinThread(
+        MgThread    thread )
+    {
+    #ifdef _WIN32
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    #else
+        pthread_join(thread, NULL);
+    #endif
+    }
+    #endif
+#line 190 "source/threads.md"
+    static int MgGetProcessorCount()
     {
-        MgScrapNameGroup* nameGroup = MgFindScrapNameGroup( context, id );
-        if( !nameGroup )
+    #if !MG_THREADS
+        return 1;
+    #elif defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (int) info.dwNumberOfProcessors;
+    #else
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? (int) count : 1;
+    #endif
+    }
+#line 31 "source/stats.md"
+    static char const* const kMgPhaseNames[kMgPhaseCount] =
+    {
+        "file read",
+        "line indexing",
+        "block parse",
+        "span parse",
+        "scrap registration",
+        "code expansion",
+        "HTML render",
+        "output compare",
+        "disk write",
+    };
+#line 102 "source/stats.md"
+    double MgGetWallSeconds()
+    {
+    #ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return (double) counter.QuadPart / (double) frequency.QuadPart;
+    #else
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+    #endif
+    }
+
+    #ifdef _WIN32
+    static double MgGetFileTimeSeconds(
+        FILETIME    kernelTime,
+        FILETIME    userTime )
+    {
+        ULARGE_INTEGER kernel, user;
+        kernel.LowPart = kernelTime.dwLowDateTime;
+        kernel.HighPart = kernelTime.dwHighDateTime;
+        user.LowPart = userTime.dwLowDateTime;
+        user.HighPart = userTime.dwHighDateTime;
+        return (double)(kernel.QuadPart + user.QuadPart) * 1e-7;
+    }
+    #endif
+
+    double MgGetCpuSeconds()
+    {
+    #ifdef _WIN32
+        FILETIME creationTime, exitTime, kernelTime, userTime;
+        GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+        return MgGetFileTimeSeconds(kernelTime, userTime);
+    #else
+        struct timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+    #endif
+    }
+
+    double MgGetProcessCpuSeconds()
+    {
+    #ifdef _WIN32
+        FILETIME creationTime, exitTime, kernelTime, userTime;
+        GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+        return MgGetFileTimeSeconds(kernelTime, userTime);
+    #else
+        struct timespec now;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+    #endif
+    }
+#line 159 "source/stats.md"
+    long long MgGetPeakResidentBytes()
+    {
+    #ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if( !GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) )
+            return 0;
+        return (long long) counters.PeakWorkingSetSize;
+    #else
+        struct rusage usage;
+        if( getrusage(RUSAGE_SELF, &usage) != 0 )
+            return 0;
+    #ifdef __APPLE__
+        return (long long) usage.ru_maxrss;
+    #else
+        return (long long) usage.ru_maxrss * 1024;
+    #endif
+    #endif
+    }
+#line 184 "source/stats.md"
+    void MgInitializeStats(
+        MgStats*    stats )
+    {
+        memset(stats, 0, sizeof(*stats));
+        stats->startWallSeconds = MgGetWallSeconds();
+        stats->startCpuSeconds  = MgGetCpuSeconds();
+        stats->startProcessCpuSeconds = MgGetProcessCpuSeconds();
+        stats->lastWallSeconds  = stats->startWallSeconds;
+        stats->lastCpuSeconds   = stats->startCpuSeconds;
+    }
+#line 199 "source/stats.md"
+    static void MgChargePhaseTime(
+        MgStats*    stats )
+    {
+        double wallSeconds = MgGetWallSeconds();
+        double cpuSeconds = MgGetCpuSeconds();
+        if( stats->phaseDepth > 0 )
         {
-            nameGroup = (MgScrapNameGroup*) malloc(sizeof(MgScrapNameGroup));
-            nameGroup->kind = kind;
-            nameGroup->id   = id;
-            nameGroup->name = 0;
-            nameGroup->firstFileGroup = 0;
-            nameGroup->lastFileGroup = 0;
-            nameGroup->next = 0;
-    
-            if( context->lastScrapNameGroup )
-            {
-                context->lastScrapNameGroup->next = nameGroup;
-            }
-            else
-            {
-                context->firstScrapNameGroup = nameGroup;
-            }
-            context->lastScrapNameGroup = nameGroup;
+            MgPhaseStats* phase = &stats->phases[stats->phaseStack[stats->phaseDepth-1]];
+            phase->wallSeconds  += wallSeconds - stats->lastWallSeconds;
+            phase->cpuSeconds   += cpuSeconds - stats->lastCpuSeconds;
         }
-    
-        if( nameGroup->kind == kScrapKind_Unknown )
+        stats->lastWallSeconds  = wallSeconds;
+        stats->lastCpuSeconds   = cpuSeconds;
+    }
+#line 219 "source/stats.md"
+    MgBool MgBeginPhase(
+        MgContext*  context,
+        MgPhase     phase )
+    {
+        MgStats* stats = context->stats;
+        if( !stats )
+            return MG_FALSE;
+
+        MgChargePhaseTime(stats);
+        MgBool outermost = MG_TRUE;
+        for( int ii = 0; ii < stats->phaseDepth; ++ii )
         {
-            nameGroup->kind = kind;
+            if( stats->phaseStack[ii] == phase )
+                outermost = MG_FALSE;
         }
-        else if( kind != kScrapKind_Unknown
-            && kind != nameGroup->kind )
+
+        assert(stats->phaseDepth < kMgMaxPhaseDepth);
+        if( stats->phaseDepth < kMgMaxPhaseDepth )
+            stats->phaseStack[stats->phaseDepth] = phase;
+        stats->phaseDepth++;
+        return outermost;
+    }
+
+    void MgEndPhase(
+        MgContext*  context )
+    {
+        MgStats* stats = context->stats;
+        if( !stats )
+            return;
+
+        MgChargePhaseTime(stats);
+        stats->phaseDepth--;
+    }
+#line 256 "source/stats.md"
+    void MgCountPhaseWork(
+        MgContext*  context,
+        MgPhase     phase,
+        long long   bytes,
+        long long   elements )
+    {
+        MgStats* stats = context->stats;
+        if( !stats )
+            return;
+
+        stats->phases[phase].bytes      += bytes;
+        stats->phases[phase].elements   += elements;
+    }
+#line 274 "source/stats.md"
+    void MgCountPhaseElements(
+        MgContext*  context,
+        MgPhase     phase,
+        long long   bytes,
+        MgElement*  firstElement )
+    {
+        if( !context->stats )
+            return;
+
+        long long count = 0;
+        for( MgElement* element = firstElement; element; element = element->next )
+            ++count;
+        MgCountPhaseWork( context, phase, bytes, count );
+    }
+#line 35 "source/trace.md"
+    MgBool MgBeginTrace(
+        MgTrace*    trace,
+        char const* path )
+    {
+        memset(trace, 0, sizeof(*trace));
+        trace->stream = fopen(path, "wb");
+        if( !trace->stream )
         {
-            fprintf(stderr, "incompatible scrap kinds!\n");
+            fprintf(stderr, "mangle: failed to open \"%s\" for writing\n", path);
+            return MG_FALSE;
         }
-    
-        MgScrapFileGroup* fileGroup = MgFindScrapFileGroup( nameGroup, file );
-        if( !fileGroup )
+        trace->startSeconds = MgGetWallSeconds();
+    #if MG_THREADS
+        MgInitializeMutex( &trace->lock );
+    #endif
+        fprintf(trace->stream, "[\n");
+        return MG_TRUE;
+    }
+
+    void MgEndTrace(
+        MgTrace*    trace )
+    {
+        fprintf(trace->stream, "\n]\n");
+        fclose(trace->stream);
+        trace->stream = NULL;
+    #if MG_THREADS
+        MgDestroyMutex( &trace->lock );
+    #endif
+    }
+#line 73 "source/trace.md"
+    unsigned long long MgGetCurrentThreadID()
+    {
+    #if defined(_WIN32)
+        return (unsigned long long) GetCurrentThreadId();
+    #elif defined(__linux__)
+        return (unsigned long long) syscall(SYS_gettid);
+    #else
+        return (unsigned long long) (uintptr_t) pthread_self();
+    #endif
+    }
+#line 90 "source/trace.md"
+    void MgWriteTraceJsonString(
+        FILE*       stream,
+        MgString    text )
+    {
+        for( char const* cursor = text.begin; cursor != text.end; ++cursor )
         {
-            fileGroup = (MgScrapFileGroup*) malloc(sizeof(MgScrapFileGroup));
-            fileGroup->nameGroup    = nameGroup;
-            fileGroup->inputFile    = file;
-            fileGroup->firstScrap   = 0;
-            fileGroup->lastScrap    = 0;
-            fileGroup->next         = 0;
-            
-            if( nameGroup->lastFileGroup )
-            {
-                nameGroup->lastFileGroup->next = fileGroup;
-            }
-            else
+            unsigned char c = (unsigned char) *cursor;
+            switch( c )
             {
-                nameGroup->firstFileGroup = fileGroup;
+            case '"':   fputs("\\\"", stream); break;
+            case '\\':  fputs("\\\\", stream); break;
+            case '\n':  fputs("\\n", stream); break;
+            case '\r':  fputs("\\r", stream); break;
+            case '\t':  fputs("\\t", stream); break;
+            default:
+                if( c < 0x20 )
+                    fprintf(stream, "\\u%04x", c);
+                else
+                    fputc(c, stream);
+                break;
             }
-            nameGroup->lastFileGroup = fileGroup;
         }
-    
-        return fileGroup;
     }
-    
-    /*
-    Add a particular scrap definition to a group of scraps with the same
-    ID in the same file.
-    */
-    void MgAddScrapToFileGroup(
-        MgScrapFileGroup* fileGroup,
-        MgScrap*          scrap)
+#line 123 "source/trace.md"
+    double MgBeginTraceSpan(
+        MgContext*  context )
     {
-        if( fileGroup->lastScrap )
+        if( !context->trace )
+            return 0;
+        return MgGetWallSeconds();
+    }
+#line 135 "source/trace.md"
+    void MgEndTraceSpan(
+        MgContext*  context,
+        double      startSeconds,
+        char const* name,
+        char const* category,
+        MgString    detail )
+    {
+        MgTrace* trace = context->trace;
+        if( !trace )
+            return;
+
+        double endSeconds = MgGetWallSeconds();
+        FILE* stream = trace->stream;
+    #if MG_THREADS
+        MgLockMutex( &trace->lock );
+    #endif
+        fprintf(stream,
+            "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%llu",
+            trace->eventCount ? ",\n" : "",
+            name,
+            category,
+            (startSeconds - trace->startSeconds) * 1e6,
+            (endSeconds - startSeconds) * 1e6,
+            MgGetCurrentThreadID());
+        if( detail.begin != detail.end )
         {
-            fileGroup->lastScrap->next = scrap;
+            fprintf(stream, ",\"args\":{\"detail\":\"");
+            MgWriteTraceJsonString(stream, detail);
+            fprintf(stream, "\"}");
+        }
+        fprintf(stream, "}");
+        trace->eventCount++;
+    #if MG_THREADS
+        MgUnlockMutex( &trace->lock );
+    #endif
+    }
+#line 53 "source/counters.md"
+    #if MG_PARSER_COUNTERS
+    MgParserCounter gMgBlockParserCounters[kMgMaxParserCounters];
+    MgParserCounter gMgSpanParserCounters[kMgMaxParserCounters];
+    #endif
+#line 73 "source/counters.md"
+    #if MG_PARSER_COUNTERS
+    void MgCountParseAttempt(
+        MgParserCounter*    counters,
+        int                 index,
+        char const*         name,
+        MgInputFile*        inputFile,
+        MgBool              succeeded,
+        long long           bytes,
+        double              seconds )
+    {
+        assert(index < kMgMaxParserCounters);
+        MgParserCounter* counter = &counters[index];
+        counter->name = name;
+        counter->attempts++;
+        counter->seconds += seconds;
+        inputFile->parseAttempts++;
+        if( succeeded )
+        {
+            counter->successes++;
+            counter->bytes += bytes;
         }
         else
         {
-            fileGroup->firstScrap = scrap;
+            inputFile->failedParseAttempts++;
         }
-        fileGroup->lastScrap = scrap;
     }
-    
-    MgBool MgCheckMatch(
-        MgReader*   reader,
-        char            c,
-        int             count )
-    {
-        for( int ii = 0; ii < count; ++ii )
+    #endif
+#line 107 "source/counters.md"
+    #if MG_PARSER_COUNTERS
+    static void MgPrintParserCounterTable(
+        FILE*                   stream,
+        char const*             title,
+        MgParserCounter const*  counters )
+    {
+        fprintf(stream, "%-32s %12s %12s %8s %12s %10s\n",
+            title, "attempts", "successes", "hit %", "bytes", "ms");
+        for( int ii = 0; ii < kMgMaxParserCounters; ++ii )
         {
-            int d = MgGetChar( reader );
-            if( d != c )
-                return MG_FALSE;
+            MgParserCounter const* counter = &counters[ii];
+            if( !counter->name )
+                continue;
+            fprintf(stream, "%-32s %12lld %12lld %8.2f %12lld %10.2f\n",
+                counter->name,
+                counter->attempts,
+                counter->successes,
+                counter->attempts ? 100.0 * (double) counter->successes / (double) counter->attempts : 0.0,
+                counter->bytes,
+                counter->seconds * 1000.0);
         }
-        return MG_TRUE;
-    
+        fprintf(stream, "\n");
     }
-    
-    /*
-    Look ahead in the reader for an occurence of character `c`, `count` times
-    in a row. Return a pointer to right before the first character in the match,
-    and leave the cursor of the reader pointing right after the match.
-    
-    If no match is found, returns NULL.
-    */
-    char const* MgFindMatching(
-        MgReader*   reader,
-        char            c,
-        int             count )
+
+    void MgPrintParserCounters(
+        MgContext*  context,
+        FILE*       stream )
     {
-        for(;;)
+        MgPrintParserCounterTable(stream, "block-level parser", gMgBlockParserCounters);
+        MgPrintParserCounterTable(stream, "span-level parser", gMgSpanParserCounters);
+
+        fprintf(stream, "%-32s %12s %12s\n", "input file", "attempts", "failed");
+        for( MgInputFile* file = context->firstInputFile; file; file = file->next )
         {
-            char const* mark = reader->cursor;
-            int d = MgGetChar(reader);
-            if( d == -1 )
-                return 0;
-            if( d == c )
-            {
-                if( MgCheckMatch(reader, c, count-1) )
-                {
-                    return mark;
-                }
-            }
-    
-            if( d == '\\' )
-            {
-                // read the escaped char, if any
-                int e = MgGetChar(reader);
-            }
+            fprintf(stream, "%-32s %12lld %12lld\n",
+                file->path,
+                file->parseAttempts,
+                file->failedParseAttempts);
         }
     }
-    
-    /*
-    Similar to `MgFindMatching`, except that it returns the intial cursor of the
-    reader as the `begin` of the result string, and the result from
-    `MgFindMatching` as the `end`.
-    
-    Note: this means that when no match is found, the `end` of the result will
-    be NULL, but the `begin` won't be.
-    */
-    MgString MgFindMatchingString(
-        MgReader*   reader,
-        char            c,
-        int             count)
+    #endif
+#line 43 "source/alloc.md"
+    static char const* const kMgAllocKindNames[kMgAllocKindCount] =
+    {
+        "MgElement",
+        "MgAttribute",
+        "MgLine arrays",
+        "line tables",
+        "MgScrap",
+        "MgScrapNameGroup",
+        "MgScrapFileGroup",
+        "MgScrapOp arrays",
+        "MgReferenceLink",
+        "MgInputFile",
+        "input buffers",
+        "output buffers",
+        "retained scrap text",
+        "compact trees",
+        "#line paths",
+        "source maps",
+        "output ropes",
+        "parallel expansion",
+        "output hashes",
+        "expansion reports",
+        "output paths",
+        "write queue",
+    };
+#line 73 "source/alloc.md"
+    char const* MgGetElementKindName(
+        MgElementKind   kind )
     {
-        MgString text;
-        text.begin = reader->cursor;
-        text.end = MgFindMatching(reader, c, count);
-        return text;
+        switch( kind )
+        {
+        case kMgElementKind_BlockQuote:         return "BlockQuote";
+        case kMgElementKind_HorizontalRule:     return "HorizontalRule";
+        case kMgElementKind_UnorderedList:      return "UnorderedList";
+        case kMgElementKind_OrderedList:        return "OrderedList";
+        case kMgElementKind_ListItem:           return "ListItem";
+        case kMgElementKind_Paragraph:          return "Paragraph";
+        case kMgElementKind_Table:              return "Table";
+        case kMgElementKind_TableRow:           return "TableRow";
+        case kMgElementKind_TableHeader:        return "TableHeader";
+        case kMgElementKind_TableCell:          return "TableCell";
+        case kMgElementKind_Em:                 return "Em";
+        case kMgElementKind_Strong:             return "Strong";
+        case kMgElementKind_InlineCode:         return "InlineCode";
+        case kMgElementKind_Header1:            return "Header1";
+        case kMgElementKind_Header2:            return "Header2";
+        case kMgElementKind_Header3:            return "Header3";
+        case kMgElementKind_Header4:            return "Header4";
+        case kMgElementKind_Header5:            return "Header5";
+        case kMgElementKind_Header6:            return "Header6";
+        case kMgElementKind_CodeBlock:          return "CodeBlock";
+        case kMgElementKind_ScrapDef:           return "ScrapDef";
+        case kMgElementKind_ScrapRef:           return "ScrapRef";
+        case kMgElementKind_MetaData:           return "MetaData";
+        case kMgElementKind_HtmlBlock:          return "HtmlBlock";
+        case kMgElementKind_Text:               return "Text";
+        case kMgElementKind_LessThanEntity:     return "LessThanEntity";
+        case kMgElementKind_GreaterThanEntity:  return "GreaterThanEntity";
+        case kMgElementKind_AmpersandEntity:    return "AmpersandEntity";
+        case kMgElementKind_Link:               return "Link";
+        case kMgElementKind_ReferenceLink:      return "ReferenceLink";
+        default:                                return "unknown";
+        }
     }
-    
-    int MgGetLineNumber(
-        MgInputFile*    inputFile,
-        MgLine*         line)
+#line 128 "source/alloc.md"
+    typedef struct MgAllocStatsT
     {
-        return 1 + (line - inputFile->beginLines);
+        MgAllocCount    kinds[kMgAllocKindCount];
+        MgAllocCount    elementKinds[kMgElementKindCount];
+
+        long long       liveBytes;
+        long long       peakLiveBytes;
+    } MgAllocStats;
+#line 148 "source/alloc.md"
+    MgAllocStats* gMgAllocStats = NULL;
+#line 154 "source/alloc.md"
+    #if MG_THREADS
+    static MgMutex gMgAllocStatsLock;
+    static MgBool gMgAllocStatsLockEnabled = MG_FALSE;
+
+    void MgEnableAllocStatsLock()
+    {
+        if( gMgAllocStatsLockEnabled )
+            return;
+        MgInitializeMutex( &gMgAllocStatsLock );
+        gMgAllocStatsLockEnabled = MG_TRUE;
     }
-    
-    int MgGetColumnNumber(
-        MgLine*     line,
-        const char* cursor)
+    #endif
+
+    static void MgLockAllocStats()
     {
-        return 1 + (cursor - line->originalBegin);
+    #if MG_THREADS
+        if( gMgAllocStatsLockEnabled )
+            MgLockMutex( &gMgAllocStatsLock );
+    #endif
     }
-    
-    /*
-    Return line number and column information (1-based) for a location in the
-    given input file, represented by the given pointer into the given line.
-    */
-    MgSourceLoc MgGetSourceLoc(
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        const char*     cursor)
+
+    static void MgUnlockAllocStats()
     {
-        MgSourceLoc sourceLoc;
-        sourceLoc.line  = MgGetLineNumber( inputFile, line );
-        sourceLoc.col   = MgGetColumnNumber( line, cursor );
-        return sourceLoc;
+    #if MG_THREADS
+        if( gMgAllocStatsLockEnabled )
+            MgUnlockMutex( &gMgAllocStatsLock );
+    #endif
     }
-    
-#line 156 "source/main.md"
-                           
-    
-#line 5 "source/parse-span.md"
-    /*
-    ### Span-Level Elements ###
-    */
-    typedef struct SpanWriterT
-    {
-        MgElement* firstElement;
-        MgElement* lastElement;
-    
-        char const* spanStart;
-        char const* spanEnd;
-    } SpanWriter;
-    
-    void InitializeSpanWriter(
-        SpanWriter* writer )
+#line 191 "source/alloc.md"
+    static MG_THREAD_LOCAL MgInputFile* gMgAllocationFile = NULL;
+
+    void MgSetAllocationFile(
+        MgInputFile*    inputFile )
     {
-        writer->firstElement = 0;
-        writer->lastElement = 0;
-        writer->spanStart = 0;
-        writer->spanEnd = 0;
+        gMgAllocationFile = inputFile;
     }
-    
-    void BeginSpan(
-        SpanWriter* writer,
-        char const* spanStart )
+#line 203 "source/alloc.md"
+    static void MgChargeAllocationToFileImpl(
+        MgInputFile*    inputFile,
+        long long       bytes )
     {
-        writer->spanStart = spanStart;
-        writer->spanEnd = spanStart;
+        inputFile->allocated.objects++;
+        inputFile->allocated.bytes += bytes;
     }
-    
-    void ExtendSpan(
-        SpanWriter* writer,
-        char const* spanEnd )
+
+    void MgChargeAllocationToFile(
+        MgInputFile*    inputFile,
+        long long       bytes )
     {
-        writer->spanEnd = spanEnd;
+        if( !gMgAllocStats || !inputFile )
+            return;
+        MgLockAllocStats();
+        MgChargeAllocationToFileImpl( inputFile, bytes );
+        MgUnlockAllocStats();
     }
-    
-    void AddSpanElementImpl(
-        SpanWriter* writer,
-        MgElement*  element )
-    {
-        // add the element to the list
-        if( writer->lastElement )
+
+    static void MgCountAllocation(
+        MgAllocKind kind,
+        long long   bytes )
+    {
+        MgAllocStats* stats = gMgAllocStats;
+        stats->kinds[kind].objects++;
+        stats->kinds[kind].bytes += bytes;
+        stats->liveBytes += bytes;
+        if( stats->liveBytes > stats->peakLiveBytes )
+            stats->peakLiveBytes = stats->liveBytes;
+        if( gMgAllocationFile )
+            MgChargeAllocationToFileImpl( gMgAllocationFile, bytes );
+    }
+#line 239 "source/alloc.md"
+    void* MgAllocate(
+        MgAllocKind kind,
+        size_t      size )
+    {
+        void* data = malloc(size);
+        if( data && gMgAllocStats )
         {
-            writer->lastElement->next = element;
+            MgLockAllocStats();
+            MgCountAllocation( kind, (long long) size );
+            MgUnlockAllocStats();
         }
-        else
+        return data;
+    }
+#line 256 "source/alloc.md"
+    MgElement* MgAllocateElement(
+        MgElementKind   kind )
+    {
+        MgElement* element = (MgElement*) MgAllocate( kMgAllocKind_Element, sizeof(MgElement) );
+        if( element && gMgAllocStats && kind >= 0 && kind < kMgElementKindCount )
         {
-            writer->firstElement = element;
+            MgLockAllocStats();
+            gMgAllocStats->elementKinds[kind].objects++;
+            gMgAllocStats->elementKinds[kind].bytes += sizeof(MgElement);
+            MgUnlockAllocStats();
         }
-        writer->lastElement = element;
-    
-        writer->spanStart = 0;
-        writer->spanEnd = 0;    
+        return element;
     }
-    
-    void FlushSpan(
-        SpanWriter* writer )
+#line 273 "source/alloc.md"
+    void MgFree(
+        MgAllocKind kind,
+        void*       data,
+        size_t      size )
     {
-        MgElement* element = NULL;
-        if( writer->spanStart == writer->spanEnd )
+        if( !data )
             return;
-    
-        element = MgCreateLeafElement(
-            kMgElementKind_Text,
-            MgMakeString(writer->spanStart, writer->spanEnd) );
-    
-        AddSpanElementImpl( writer, element );
+        free(data);
+        if( gMgAllocStats )
+        {
+            MgLockAllocStats();
+            gMgAllocStats->liveBytes -= (long long) size;
+            MgUnlockAllocStats();
+        }
     }
-    
-    void AddSpanElement(
-        SpanWriter* writer,
-        MgElement*  element )
+#line 295 "source/alloc.md"
+    void MgPrintAllocStats(
+        MgContext*  context,
+        FILE*       stream )
     {
-        FlushSpan( writer );
-        AddSpanElementImpl( writer, element );
+        MgAllocStats* stats = gMgAllocStats;
+        if( !stats )
+            return;
+
+        fprintf(stream, "%-32s %12s %14s\n", "allocations", "objects", "bytes");
+        for( int ii = 0; ii < kMgAllocKindCount; ++ii )
+        {
+            fprintf(stream, "%-32s %12lld %14lld\n",
+                kMgAllocKindNames[ii], stats->kinds[ii].objects, stats->kinds[ii].bytes);
+        }
+        for( int ii = 0; ii < kMgElementKindCount; ++ii )
+        {
+            if( !stats->elementKinds[ii].objects )
+                continue;
+            fprintf(stream, "  %-30s %12lld %14lld\n",
+                MgGetElementKindName((MgElementKind) ii),
+                stats->elementKinds[ii].objects, stats->elementKinds[ii].bytes);
+        }
+        for( MgInputFile* file = context->firstInputFile; file; file = file->next )
+        {
+            fprintf(stream, "%-32s %12lld %14lld\n",
+                file->path, file->allocated.objects, file->allocated.bytes);
+        }
+        fprintf(stream, "peak allocated: %lld bytes\n", stats->peakLiveBytes);
     }
-    
-    
-    #include <memory.h>
-    
-    void AddLiteralSpan(
-        SpanWriter* writer,
-        char const* text )
+#line 329 "source/alloc.md"
+    void MgWriteAllocStatsJson(
+        MgContext*  context,
+        FILE*       stream )
     {
-        FlushSpan( writer );
-        BeginSpan( writer, text );
-        ExtendSpan( writer, text + strlen(text) );
-        FlushSpan( writer );
+        MgAllocStats* stats = gMgAllocStats;
+        if( !stats )
+            return;
+
+        fprintf(stream, "  \"allocations\": [\n");
+        for( int ii = 0; ii < kMgAllocKindCount; ++ii )
+        {
+            fprintf(stream, "    { \"name\": \"%s\", \"objects\": %lld, \"bytes\": %lld }%s\n",
+                kMgAllocKindNames[ii], stats->kinds[ii].objects, stats->kinds[ii].bytes,
+                ii + 1 < kMgAllocKindCount ? "," : "");
+        }
+        fprintf(stream, "  ],\n");
+
+        fprintf(stream, "  \"element_allocations\": {");
+        for( int ii = 0; ii < kMgElementKindCount; ++ii )
+        {
+            fprintf(stream, "%s\n    \"%s\": { \"objects\": %lld, \"bytes\": %lld }",
+                ii ? "," : "",
+                MgGetElementKindName((MgElementKind) ii),
+                stats->elementKinds[ii].objects, stats->elementKinds[ii].bytes);
+        }
+        fprintf(stream, "\n  },\n");
+
+        fprintf(stream, "  \"file_allocations\": [");
+        for( MgInputFile* file = context->firstInputFile; file; file = file->next )
+        {
+            fprintf(stream, "%s\n    { \"path\": \"", file == context->firstInputFile ? "" : ",");
+            MgWriteTraceJsonString(stream, MgTerminatedString(file->path));
+            fprintf(stream, "\", \"objects\": %lld, \"bytes\": %lld }",
+                file->allocated.objects, file->allocated.bytes);
+        }
+        fprintf(stream, "\n  ],\n");
+        fprintf(stream, "  \"peak_allocated_bytes\": %lld,\n", stats->peakLiveBytes);
     }
-    
-    void ReadLineSpans(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        char const*     textBegin,
-        char const*     textEnd,
-        MgSpanFlags       flags,
-        SpanWriter*     writer );
-    
-    /*
-    Read span-level elements from the range of text given by
-    `textBegin` and `textEnd`, using the given flags. The range
-    of characters given should belong to `line` in `inputFile`,
-    which should be loaded in `context`.
-    */
-    MgElement* MgReadSpanElements(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgString        text,
-        MgSpanFlags     flags )
+#line 219 "source/threads.md"
+    #if MG_THREADS
+    typedef void (*MgTaskFunc)( MgScheduler* scheduler, int workerIndex, void* data );
+
+    typedef struct MgTaskT
     {
-        SpanWriter writer;
-        InitializeSpanWriter( &writer );
-        ReadLineSpans(context, inputFile, line, text.begin, text.end, flags, &writer);
-        return writer.firstElement;
-    }
-    
-    //
-    //
-    //
-    
-    MgElement* ParseHtmlEntity(
-        MgContext*        context,
-        MgInputFile*      inputFile,
-        MgReader*   reader,
-        MgSpanFlags       flags,
-        char            c,
-        MgElementKind   kind )
+        MgTaskFunc  func;
+        void*       data;
+    } MgTask;
+
+    typedef struct MgTaskQueueT
+    {
+        MgMutex     lock;
+        MgTask*     tasks;
+        int         head;               /* index of the oldest task */
+        int         count;
+        int         capacity;
+    } MgTaskQueue;
+
+    typedef struct MgWorkerT
     {
-        if( !(flags & kMgSpanFlag_EscapeHtmlEntities) )
-            return 0;
-    
-        int d = MgGetChar( reader );
-        if( d != c )
-            return 0;
-    
-        return MgCreateParentElement(
-            kind, 0 );
-    }
-    
-    MgElement* ParseHtmlEntity_LessThan(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
+        MgScheduler*    scheduler;
+        int             index;
+        MgThread        thread;
+        MgBool          started;
+    } MgWorker;
+
+    struct MgSchedulerT
+    {
+        int             workerCount;
+        MgTaskQueue*    queues;             /* one per worker */
+        MgWorker*       workers;
+        MgMutex         lock;               /* protects the fields below */
+        MgCondition     wake;               /* signalled when tasks are queued or all are finished */
+        int             queuedTasks;
+        int             unfinishedTasks;    /* queued or running */
+        MgBool          stopping;
+    };
+
+    static void MgPushTask(
+        MgTaskQueue*    queue,
+        MgTask          task )
     {
-        return ParseHtmlEntity(context, inputFile, reader, flags, '<', kMgElementKind_LessThanEntity);
+        MgLockMutex( &queue->lock );
+        if( queue->count == queue->capacity )
+        {
+            int capacity = queue->capacity ? 2 * queue->capacity : 64;
+            MgTask* tasks = (MgTask*) MgAllocate(kMgAllocKind_Parallel, capacity * sizeof(MgTask));
+            for( int ii = 0; ii < queue->count; ++ii )
+                tasks[ii] = queue->tasks[(queue->head + ii) % queue->capacity];
+            MgFree(kMgAllocKind_Parallel, queue->tasks, queue->capacity * sizeof(MgTask));
+            queue->tasks    = tasks;
+            queue->head     = 0;
+            queue->capacity = capacity;
+        }
+        queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+        queue->count++;
+        MgUnlockMutex( &queue->lock );
     }
-    
-    MgElement* ParseHtmlEntity_GreaterThan(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
-    {
-        return ParseHtmlEntity(context, inputFile, reader, flags, '>', kMgElementKind_GreaterThanEntity);
+
+    static MgBool MgTakeTask(
+        MgTaskQueue*    queue,
+        MgBool          newest,
+        MgTask*         outTask )
+    {
+        MgBool found = MG_FALSE;
+        MgLockMutex( &queue->lock );
+        if( queue->count )
+        {
+            if( newest )
+            {
+                *outTask = queue->tasks[(queue->head + queue->count - 1) % queue->capacity];
+            }
+            else
+            {
+                *outTask = queue->tasks[queue->head];
+                queue->head = (queue->head + 1) % queue->capacity;
+            }
+            queue->count--;
+            found = MG_TRUE;
+        }
+        MgUnlockMutex( &queue->lock );
+        return found;
+    }
+#line 306 "source/threads.md"
+    void MgSpawnTask(
+        MgScheduler*    scheduler,
+        int             workerIndex,
+        MgTaskFunc      func,
+        void*           data )
+    {
+        MgTask task;
+        task.func = func;
+        task.data = data;
+
+        MgLockMutex( &scheduler->lock );
+        scheduler->unfinishedTasks++;
+        MgUnlockMutex( &scheduler->lock );
+
+        MgPushTask( &scheduler->queues[workerIndex], task );
+
+        MgLockMutex( &scheduler->lock );
+        scheduler->queuedTasks++;
+        MgBroadcastCondition( &scheduler->wake );
+        MgUnlockMutex( &scheduler->lock );
+    }
+#line 332 "source/threads.md"
+    static MgBool MgFindTask(
+        MgScheduler*    scheduler,
+        int             workerIndex,
+        MgTask*         outTask )
+    {
+        int workerCount = scheduler->workerCount;
+        for( int ii = 0; ii < workerCount; ++ii )
+        {
+            int victim = (workerIndex + ii) % workerCount;
+            if( MgTakeTask(&scheduler->queues[victim], victim == workerIndex, outTask) )
+            {
+                MgLockMutex( &scheduler->lock );
+                scheduler->queuedTasks--;
+                MgUnlockMutex( &scheduler->lock );
+                return MG_TRUE;
+            }
+        }
+        return MG_FALSE;
     }
-    
-    MgElement* ParseHtmlEntity_Ampersand(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
+
+    static void MgRunTask(
+        MgScheduler*    scheduler,
+        int             workerIndex,
+        MgTask          task )
     {
-        return ParseHtmlEntity(context, inputFile, reader, flags, '&', kMgElementKind_AmpersandEntity);
+        task.func( scheduler, workerIndex, task.data );
+
+        MgLockMutex( &scheduler->lock );
+        if( --scheduler->unfinishedTasks == 0 )
+            MgBroadcastCondition( &scheduler->wake );
+        MgUnlockMutex( &scheduler->lock );
     }
-    
-    MgElement* ParseScrapRef(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
+#line 368 "source/threads.md"
+    static void* MgWorkerThreadMain(
+        void*   arg )
     {
-        MgString scrapID;
-    
-        if( MgGetChar(reader) != '<' ) return 0;
-        if( MgGetChar(reader) != '<' ) return 0;
-    
-        char const* idBegin = reader->cursor;
-        char const* idEnd   = idBegin;
+        MgWorker* worker = (MgWorker*) arg;
+        MgScheduler* scheduler = worker->scheduler;
         for(;;)
         {
-            idEnd = reader->cursor;
-            int c = MgGetChar( reader );
-            if( c == -1 )
-                return 0;
-    
-            if( c == '>' )
+            MgTask task;
+            if( MgFindTask(scheduler, worker->index, &task) )
             {
-                int d = MgGetChar( reader );
-                if( d == '>' )
-                {
-                    break;
-                }
+                MgRunTask( scheduler, worker->index, task );
+                continue;
             }
+
+            MgLockMutex( &scheduler->lock );
+            while( !scheduler->queuedTasks && !scheduler->stopping )
+                MgWaitCondition( &scheduler->wake, &scheduler->lock );
+            MgBool stopping = scheduler->stopping;
+            MgUnlockMutex( &scheduler->lock );
+            if( stopping )
+                break;
         }
-    
-        // In order to avoid accidentally treating an expression
-        // with both left and right shifts as a scrap reference,
-        // we require that there be no whitespace after the `<<`.
-        // This lets a user easily avoid problems by inserting
-        // spaces into their expressions:
-        //
-        // TODO: the " &nbsp; " in the next line should really be
-        // blank, to illustrate the point, but right now Mangle
-        // assumes it is a scrap reference (exactly as described
-        // by this logic...)
-        // scrap ref: `1 << &nbsp; foo &nbsp; >> bar`
-        // shifts:      `1 << foo >> bar`
-    
-        if( idBegin != idEnd && isspace(*idBegin) )
-            return 0;
-    
-        scrapID = MgMakeString( idBegin, idEnd );
-        MgScrapFileGroup* scrapFileGroup = MgFindOrCreateScrapGroup(
-            context,
-            kScrapKind_Unknown,
-            scrapID,
-            inputFile );
-    
-        MgElement* element = MgCreateParentElement(
-            kMgElementKind_ScrapRef,
-            0 );
-        MgAttribute* attr = MgAddCustomAttribute(element, "$scrap-group");
-        attr->scrapFileGroup = scrapFileGroup;
-        attr = MgAddCustomAttribute(element, "$resume-at");
-        MgSourceLoc sourceLoc = MgGetSourceLoc( inputFile, line, reader->cursor );
-        attr->sourceLoc = sourceLoc;
-    
-        return element;
+        return NULL;
     }
-    
-    MgElement* ParseEm(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags,
-        char            c )
+#line 396 "source/threads.md"
+    void MgRunScheduledTasks(
+        MgScheduler*    scheduler )
     {
-        MgElement* inner = NULL;
-        if( flags & kMgSpanFlag_DontProcessMarkdown )
-            return NULL;
-    
-        // follow GitHub Flavored Markdown, in only
-        // allowing underscores for <em> when
-        // they mark a whole word...
-    
-        // we need to look at the character before `c`
-        if( reader->cursor > inputFile->text.begin )
-        {
-            char prev = *(reader->cursor - 1);
-            if( (c == '_') && !isspace(prev) )
-                return NULL;            
-        }
-    
-        int count = 0;
-        for(; count < 2; ++count)
+        for(;;)
         {
-            int d = MgGetChar( reader );
-            if( d != c )
+            MgTask task;
+            if( MgFindTask(scheduler, 0, &task) )
             {
-                MgUnGetChar( reader, d );
-                break;
+                MgRunTask( scheduler, 0, task );
+                continue;
             }
+
+            MgLockMutex( &scheduler->lock );
+            MgBool done = scheduler->unfinishedTasks == 0;
+            if( !done && !scheduler->queuedTasks )
+                MgWaitCondition( &scheduler->wake, &scheduler->lock );
+            MgUnlockMutex( &scheduler->lock );
+            if( done )
+                break;
         }
-        if( !count )
-            return NULL;
-    
-        int e = MgPeekChar( reader );
-        if( isspace(e) )
-            return NULL; // can't start with white-space
-    
-        // appears to be the start of a span.
-        // now we need to find the matching marker(s)
-        char const* start = reader->cursor;
-        char const* end = MgFindMatching( reader, c, count );
-        if( !end )
-            return NULL;
-    
-        if( (c == '_') && isalpha(MgPeekChar(reader)) )
-            return NULL;
-    
-        // need to scan the inner text for other span markup
-        inner = MgReadSpanElements( context, inputFile, line, MgMakeString(start, end), flags );
-    
-        return MgCreateParentElement(
-            count == 2 ? kMgElementKind_Strong : kMgElementKind_Em ,
-            inner );
-    }
-    
-    MgElement* ParseEm_Underscore(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
-    {
-        return ParseEm(
-            context,
-            inputFile,
-            line,
-            reader,
-            flags,
-            '_' );
     }
-    
-    MgElement* ParseEm_Asterisk(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
-    {
-        return ParseEm(
-            context,
-            inputFile,
-            line,
-            reader,
-            flags,
-            '*' );
+#line 422 "source/threads.md"
+    MgScheduler* MgStartScheduler(
+        int workerCount )
+    {
+        MgScheduler* scheduler = (MgScheduler*) MgAllocate(kMgAllocKind_Parallel, sizeof(MgScheduler));
+        memset(scheduler, 0, sizeof(*scheduler));
+        scheduler->queues   = (MgTaskQueue*) MgAllocate(kMgAllocKind_Parallel, workerCount * sizeof(MgTaskQueue));
+        scheduler->workers  = (MgWorker*) MgAllocate(kMgAllocKind_Parallel, workerCount * sizeof(MgWorker));
+        memset(scheduler->queues, 0, workerCount * sizeof(MgTaskQueue));
+        MgInitializeMutex( &scheduler->lock );
+        MgInitializeCondition( &scheduler->wake );
+
+        scheduler->workerCount = workerCount;
+        for( int ii = 0; ii < workerCount; ++ii )
+        {
+            MgInitializeMutex( &scheduler->queues[ii].lock );
+            scheduler->workers[ii].scheduler    = scheduler;
+            scheduler->workers[ii].index        = ii;
+            scheduler->workers[ii].started      = MG_FALSE;
+        }
+        for( int ii = 1; ii < workerCount; ++ii )
+        {
+            MgWorker* worker = &scheduler->workers[ii];
+            worker->started = MgStartThread(&worker->thread, MgWorkerThreadMain, worker);
+        }
+        return scheduler;
     }
-    
-    MgElement* ParseInlineCode(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
+
+    void MgStopScheduler(
+        MgScheduler*    scheduler )
     {
-        MgElement* inner = NULL;
-        if( flags & kMgSpanFlag_DontProcessMarkdown )
-            return NULL;
-    
-        int count = 0;
-        for(; count < 2; ++count)
+        MgLockMutex( &scheduler->lock );
+        scheduler->stopping = MG_TRUE;
+        MgBroadcastCondition( &scheduler->wake );
+        MgUnlockMutex( &scheduler->lock );
+
+        for( int ii = 1; ii < scheduler->workerCount; ++ii )
         {
-            int d = MgGetChar( reader );
-            if( d != '`' )
-            {
-                MgUnGetChar( reader, d );
-                break;
-            }
+            if( scheduler->workers[ii].started )
+                MgJoinThread( scheduler->workers[ii].thread );
         }
-        if( !count )
-            return NULL;
-    
-        // allow an optional space at start,
-        // which will get trimmed
-        int lead = MgGetChar(reader);
-        if( lead != ' ' )
+
+        int workerCount = scheduler->workerCount;
+        for( int ii = 0; ii < workerCount; ++ii )
         {
-            MgUnGetChar(reader, lead);
+            MgTaskQueue* queue = &scheduler->queues[ii];
+            MgDestroyMutex( &queue->lock );
+            MgFree(kMgAllocKind_Parallel, queue->tasks, queue->capacity * sizeof(MgTask));
         }
-    
-        // appears to be the start of a span.
-        // now we need to find the matching marker
-        char const* start = reader->cursor;
-        char const* end = MgFindMatching( reader, '`', count );
-        if( !end )
-            return NULL;
-    
-        // allow an optional space at end
-        // which will get trimmed
-        if( start != end && (*(end-1) == ' ') )
-            --end;
-    
-        inner = MgReadSpanElements( context, inputFile, line, MgMakeString(start, end), kMgSpanFlags_InlineCode );
-    
-        return MgCreateParentElement(
-            kMgElementKind_InlineCode,
-            inner );
+        MgDestroyCondition( &scheduler->wake );
+        MgDestroyMutex( &scheduler->lock );
+        MgFree(kMgAllocKind_Parallel, scheduler->queues, workerCount * sizeof(MgTaskQueue));
+        MgFree(kMgAllocKind_Parallel, scheduler->workers, workerCount * sizeof(MgWorker));
+        MgFree(kMgAllocKind_Parallel, scheduler, sizeof(MgScheduler));
     }
-    
-    MgElement* ParseLink(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
+    #endif
+#line 299 "source/stats.md"
+    static double MgGetThroughput(
+        MgPhaseStats const* phase )
     {
-        MgString text;
-        if( flags & kMgSpanFlag_DontProcessMarkdown )
-            return 0;
-    
-        int textOpenBrace = MgGetChar( reader );
-        if( textOpenBrace != '[' )
+        if( phase->wallSeconds <= 0 )
             return 0;
-    
-        text = MgFindMatchingString( reader, ']', 1 );
-        if( !text.end )
+        return (double) phase->bytes / (1024.0 * 1024.0) / phase->wallSeconds;
+    }
+
+    static double MgGetOtherThreadsCpuSeconds(
+        double  mainCpuSeconds,
+        double  totalCpuSeconds )
+    {
+        if( totalCpuSeconds <= mainCpuSeconds )
             return 0;
-    
-        int targetOpenBrace = MgGetChar( reader );
-        if( targetOpenBrace == '(' )
-        {
-            MgElement* inner    = NULL;
-            MgElement* link     = NULL;
-    
-            // inline link
-            char const* targetBegin = reader->cursor;
-            char const* targetEnd = MgFindMatching( reader, ')', 1 );
-            if( !targetEnd )
-                return 0;
-    
-            inner = MgReadSpanElements( context, inputFile, line, text, flags );
-    
-            link = MgCreateParentElement(
-                kMgElementKind_Link,
-                inner );
-    
-            MgAddAttribute(link, "href", MgMakeString(targetBegin, targetEnd));
-            return link;
-        }
-        else if( targetOpenBrace == '[' )
+        return totalCpuSeconds - mainCpuSeconds;
+    }
+
+    void MgPrintStats(
+        MgContext*  context,
+        FILE*       stream )
+    {
+        MgStats* stats = context->stats;
+        double totalWallSeconds = MgGetWallSeconds() - stats->startWallSeconds;
+        double mainCpuSeconds   = MgGetCpuSeconds() - stats->startCpuSeconds;
+        double totalCpuSeconds  = MgGetProcessCpuSeconds() - stats->startProcessCpuSeconds;
+
+        fprintf(stream, "%-20s %10s %10s %12s %10s %10s\n",
+            "phase", "wall ms", "cpu ms", "bytes", "elements", "MB/s");
+        for( int ii = 0; ii < kMgPhaseCount; ++ii )
         {
-            // reference link
-            MgString id = MgFindMatchingString(reader, ']', 1);
-            if( !id.end )
-                return 0;
-    
-            if( MgIsEmptyString(id) )
-            {
-                id = text;
-            }
-    
-            // \todo: need to save this identifier,
-            // so taht we can look up the link target later...
-            MgReferenceLink* referenceLink = MgFindOrCreateReferenceLink(
-                inputFile,
-                id );
-    
-            MgElement* inner = MgReadSpanElements( context, inputFile, line, text, flags );
-    
-            MgElement* link = MgCreateParentElement(
-                kMgElementKind_ReferenceLink,
-                inner );
-    
-            MgAttribute* attr = MgAddCustomAttribute(link, "$referenceLink");
-            attr->referenceLink = referenceLink;
-    
-            return link;
+            MgPhaseStats const* phase = &stats->phases[ii];
+            fprintf(stream, "%-20s %10.2f %10.2f %12lld %10lld %10.2f\n",
+                kMgPhaseNames[ii],
+                phase->wallSeconds * 1000.0,
+                phase->cpuSeconds * 1000.0,
+                phase->bytes,
+                phase->elements,
+                MgGetThroughput(phase));
         }
-    
-        return 0;
+        fprintf(stream, "%-20s %10.2f %10.2f\n",
+            "main thread", totalWallSeconds * 1000.0, mainCpuSeconds * 1000.0);
+        fprintf(stream, "%-20s %10s %10.2f\n",
+            "other threads", "", MgGetOtherThreadsCpuSeconds(mainCpuSeconds, totalCpuSeconds) * 1000.0);
+        fprintf(stream, "%-20s %10.2f %10.2f\n",
+            "total", totalWallSeconds * 1000.0, totalCpuSeconds * 1000.0);
+        fprintf(stream, "outputs: %d written, %d unchanged, %d skipped\n",
+            stats->outputsWritten, stats->outputsUnchanged, stats->outputsSkipped);
+        fprintf(stream, "peak RSS: %lld KB\n",
+            MgGetPeakResidentBytes() / 1024);
+
+        MgPrintAllocStats(context, stream);
     }
-    
-    //
-    
-    MgElement* TryParseSpanElement(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgSpanFlags       flags )
+#line 356 "source/stats.md"
+    MgBool MgWriteStatsJson(
+        MgContext*  context,
+        char const* path )
     {
-        typedef MgElement* (*ParseSpanFunc)( MgContext*, MgInputFile*, MgLine*, MgReader*, MgSpanFlags );
-        static const ParseSpanFunc parseSpanFuncs[] =
+        MgStats* stats = context->stats;
+        FILE* stream = fopen(path, "wb");
+        if( !stream )
         {
-            &ParseScrapRef,
-            &ParseLink,
-            &ParseHtmlEntity_LessThan,
-            &ParseHtmlEntity_GreaterThan,
-            &ParseHtmlEntity_Ampersand,
-            &ParseEm_Underscore,
-            &ParseEm_Asterisk,
-            &ParseInlineCode,
-            0,
-        };
-        ParseSpanFunc const* parseFunc = &parseSpanFuncs[0];
-        do
+            fprintf(stderr, "mangle: failed to open \"%s\" for writing\n", path);
+            return MG_FALSE;
+        }
+
+        fprintf(stream, "{\n  \"phases\": [\n");
+        for( int ii = 0; ii < kMgPhaseCount; ++ii )
         {
-            MgReader tempReader = *reader;
-            MgElement* p = (*parseFunc)( context, inputFile, line, &tempReader, flags );
-            if( p )
-            {
-                reader->cursor = tempReader.cursor;
-                return p;              
-            }
-            ++parseFunc;
+            MgPhaseStats const* phase = &stats->phases[ii];
+            fprintf(stream,
+                "    { \"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"bytes\": %lld, \"elements\": %lld, \"mb_per_s\": %.3f }%s\n",
+                kMgPhaseNames[ii],
+                phase->wallSeconds * 1000.0,
+                phase->cpuSeconds * 1000.0,
+                phase->bytes,
+                phase->elements,
+                MgGetThroughput(phase),
+                ii + 1 < kMgPhaseCount ? "," : "");
         }
-        while(*parseFunc);
-    
-        return 0;
+        fprintf(stream, "  ],\n");
+        fprintf(stream, "  \"total_wall_ms\": %.3f,\n", (MgGetWallSeconds() - stats->startWallSeconds) * 1000.0);
+        double mainCpuSeconds = MgGetCpuSeconds() - stats->startCpuSeconds;
+        double totalCpuSeconds = MgGetProcessCpuSeconds() - stats->startProcessCpuSeconds;
+        fprintf(stream, "  \"main_thread_cpu_ms\": %.3f,\n", mainCpuSeconds * 1000.0);
+        fprintf(stream, "  \"other_threads_cpu_ms\": %.3f,\n", MgGetOtherThreadsCpuSeconds(mainCpuSeconds, totalCpuSeconds) * 1000.0);
+        fprintf(stream, "  \"total_cpu_ms\": %.3f,\n", totalCpuSeconds * 1000.0);
+        fprintf(stream, "  \"outputs_written\": %d,\n", stats->outputsWritten);
+        fprintf(stream, "  \"outputs_unchanged\": %d,\n", stats->outputsUnchanged);
+        fprintf(stream, "  \"outputs_skipped\": %d,\n", stats->outputsSkipped);
+        MgWriteAllocStatsJson(context, stream);
+        fprintf(stream, "  \"peak_rss_bytes\": %lld\n", MgGetPeakResidentBytes());
+        fprintf(stream, "}\n");
+        fclose(stream);
+        return MG_TRUE;
     }
-    
-    //
-    
-    void ReadLineSpans(
-        MgContext*    context,
-        MgInputFile*      inputFile,
-        MgLine*       line,
-        char const* textBegin,
-        char const* textEnd,
-        MgSpanFlags   flags,
-        SpanWriter* writer )
+#line 5 "source/parse.md"
+    enum
     {
-        MgString string = { textBegin, textEnd };
-        MgReader reader;
-        MgInitializeStringReader( &reader, string );
-    
-        BeginSpan( writer, reader.cursor );
-    
-        while(!MgAtEnd(&reader))
-        {
-            // look for a match among our various cases
-            MgElement* element = TryParseSpanElement( context, inputFile, line, &reader, flags );
-            if( element )
-            {
-                AddSpanElement( writer, element );
-                BeginSpan( writer, reader.cursor );
-                continue;
-            }
-    
-            // fallback position - read one character
-            // and add it to our current textual span
-            int c = MgGetChar( &reader );
-    
-            // okay, with one special case for the '\'
-            // escape character...
-            //
-            // \todo: where do escapes get ignored?
-            if( c == '\\'
-                && !(flags & kMgSpanFlag_DontProcessMarkdown))
-            {
-                // end the current span, since we need
-                // to skip the '\'
-                FlushSpan( writer );
-    
-                // start fresh span *after* the backslash
-                BeginSpan( writer, reader.cursor );
-    
-                // read the escaped character, so that
+        kMaxHeaderLevel = 6,
+    };
+
+    /*
+    Flags for parsing span-level elements in Markdown source.
+    */
+    enum
+    {
+        /* No flags. */
+        kMgSpanFlags_None = 0x00,
+
+        /* Enable escaping of HTML entiteis like `&amp;` into characters like `&`.*/
+        kMgSpanFlag_EscapeHtmlEntities = 0x01,
+
+        /* Disable processing of standard Markdown syntax. */
+        kMgSpanFlag_DontProcessMarkdown = 0x02,
+
+        /* Default behavior: escape HTML entities, process Markdown. */
+        kMgSpanFlags_Default =
+            kMgSpanFlag_EscapeHtmlEntities,
+
+        /* Inside a code block: escape HTML, but don't process Markdown */
+        kMgSpanFlags_CodeBlock =
+            kMgSpanFlag_EscapeHtmlEntities
+            | kMgSpanFlag_DontProcessMarkdown,
+
+        /* Inline code: handle the same as a code block */
+        kMgSpanFlags_InlineCode = kMgSpanFlags_CodeBlock,
+
+        /* Inside an HTML block: don't process Markdown. */
+        kMgSpanFlags_HtmlBlock =
+            kMgSpanFlag_DontProcessMarkdown,
+    };
+    typedef unsigned MgSpanFlags;
+
+    /*
+    When encountering either a reference to or a definition of a "reference-style"
+    link in the document, call this function to get or create the object to represent
+    the link. At a definition site, fill in the `MgReferenceLink*` that was returned,
+    to provide information that will be used at any sites that reference it.
+    */
+    MgReferenceLink* MgFindOrCreateReferenceLink(
+        MgInputFile*    inputFile,
+        MgString          id )
+    {
+        MgHash idHash = MgHashStringNoCase( id );
+        MgReferenceLink* link = inputFile->firstReferenceLink;
+        while( link )
+        {
+            if( link->idHash == idHash
+                && MgStringsAreEqualNoCase(
+                id,
+                link->id  ) )
+            {
+                return link;
+            }
+            link = link->next;
+        }
+
+        link = (MgReferenceLink*) MgAllocate(kMgAllocKind_ReferenceLink, sizeof(MgReferenceLink));
+        link->id    = id;
+        link->idHash = idHash;
+        link->url   = MgMakeEmptyString();
+        link->title = MgMakeEmptyString();
+
+        link->next = inputFile->firstReferenceLink;
+        inputFile->firstReferenceLink = link;
+
+        return link;
+    }
+
+    /*
+    Allocate and add a new attribute to an existing element, with the
+    specified NULL-terminated `id` and value.
+    */
+    MgAttribute* MgAddAttribute(
+        MgElement*  element,
+        char const* id,
+        MgString      val )
+    {
+        MgAttribute* attr = (MgAttribute*) MgAllocate(kMgAllocKind_Attribute, sizeof(MgAttribute));
+        attr->next  = NULL;
+        attr->id    = MgTerminatedString(id);
+        attr->val   = val;
+
+        // this is a linear-time insert, but we expect the
+        // number of attributes per element to be very low,
+        // so it probably won't matter for performance.
+        MgAttribute** link = &element->firstAttr;
+        while( *link )
+            link = &((*link)->next);
+        *link = attr;
+        return attr;
+    }
+
+    /*
+    Allocate an add a new atttribute to an existing element, with the
+    specified NULL-terminated `id`, but with no value. The caller is
+    expected to fill in of the fields in the `union` inside the
+    attribute, based on the chosen ID.
+    */
+    MgAttribute* MgAddCustomAttribute(
+        MgElement*  element,
+        char const* id)
+    {
+        return MgAddAttribute(element, id, MgMakeString(NULL, NULL));
+    }
+
+    MgElement* MgCreateElementImpl(
+        MgElementKind   kind,
+        MgString          text,
+        MgElement*      firstChild )
+    {
+        MgElement* element = MgAllocateElement(kind);
+        element->kind       = kind;
+        element->flags      = 0;
+        element->text       = text;
+        element->firstAttr  = NULL;
+        element->firstChild = firstChild;
+        element->next       = NULL;
+        return element;
+    }
+
+    /*
+    Create a leaf document element, with the specified kind and text.
+    */
+    MgElement* MgCreateLeafElement(
+        MgElementKind   kind,
+        MgString          text )
+    {
+        return MgCreateElementImpl(
+            kind,
+            text,
+            NULL );  // no children
+    }
+
+    /*
+    Create a parent document element, with the specified first child in
+    the linked list of child elements.
+    */
+    MgElement* MgCreateParentElement(
+        MgElementKind   kind,
+        MgElement*      firstChild )
+    {
+        return MgCreateElementImpl(
+            kind,
+            MgMakeString(NULL, NULL), // no text
+            firstChild );
+    }
+
+    MgScrapNameGroup* MgFindScrapNameGroup(
+        MgContext*    context,
+        MgString      id,
+        MgHash        idHash )
+    {
+        MgScrapNameGroup* group = context->firstScrapNameGroup;
+        while( group )
+        {
+            if( group->idHash == idHash
+                && MgStringsAreEqual( group->id, id ) )
+                return group;
+
+            group = group->next;
+        }
+
+        return 0;
+    }
+
+    MgScrapFileGroup* MgFindScrapFileGroup(
+        MgScrapNameGroup* nameGroup,
+        MgInputFile*      inputFile )
+    {
+        MgScrapFileGroup* fileGroup = nameGroup->firstFileGroup;
+        while( fileGroup )
+        {
+            if( fileGroup->inputFile == inputFile )
+                return fileGroup;
+
+            fileGroup = fileGroup->next;
+        }
+
+        return 0;
+    }
+
+    /*
+    When encountering either a reference to or a definition of a scrap,
+    call this function to get or create the object that represents the scrap
+    group with that `id` for the given `file`.
+
+    The `kind` can either be `kMgScrapKind_Unknown` if you don't care what
+    kind of scrap it is, or a specific scrap kind if you want to set the
+    scrap kind as part of retrieving it. (TODO: separate those steps)
+    */
+    MgScrapFileGroup* MgFindOrCreateScrapGroup(
+        MgContext*    context,
+        MgScrapKind   kind,
+        MgString      id,
+        MgInputFile*  file )
+    {
+        MgBeginPhase( context, kMgPhase_ScrapRegistration );
+        MgCountPhaseWork( context, kMgPhase_ScrapRegistration, id.end - id.begin, 1 );
+
+        MgHash idHash = MgHashString( id );
+        MgScrapNameGroup* nameGroup = MgFindScrapNameGroup( context, id, idHash );
+        if( !nameGroup )
+        {
+            nameGroup = (MgScrapNameGroup*) MgAllocate(kMgAllocKind_ScrapNameGroup, sizeof(MgScrapNameGroup));
+            nameGroup->kind = kind;
+            nameGroup->id   = id;
+            nameGroup->idHash = idHash;
+            nameGroup->name = 0;
+            nameGroup->firstFileGroup = 0;
+            nameGroup->lastFileGroup = 0;
+            nameGroup->next = 0;
+            memset(&nameGroup->expandedSize, 0, sizeof(nameGroup->expandedSize));
+            nameGroup->expandedSize.state = kMgExpandedSize_Unknown;
+
+            if( context->lastScrapNameGroup )
+            {
+                context->lastScrapNameGroup->next = nameGroup;
+            }
+            else
+            {
+                context->firstScrapNameGroup = nameGroup;
+            }
+            context->lastScrapNameGroup = nameGroup;
+        }
+
+        if( nameGroup->kind == kScrapKind_Unknown )
+        {
+            nameGroup->kind = kind;
+        }
+        else if( kind != kScrapKind_Unknown
+            && kind != nameGroup->kind )
+        {
+            fprintf(stderr, "incompatible scrap kinds!\n");
+        }
+
+        MgScrapFileGroup* fileGroup = MgFindScrapFileGroup( nameGroup, file );
+        if( !fileGroup )
+        {
+            fileGroup = (MgScrapFileGroup*) MgAllocate(kMgAllocKind_ScrapFileGroup, sizeof(MgScrapFileGroup));
+            fileGroup->nameGroup    = nameGroup;
+            fileGroup->inputFile    = file;
+            fileGroup->firstScrap   = 0;
+            fileGroup->lastScrap    = 0;
+            fileGroup->next         = 0;
+            memset(&fileGroup->expandedSize, 0, sizeof(fileGroup->expandedSize));
+            fileGroup->expandedSize.state = kMgExpandedSize_Unknown;
+            
+            if( nameGroup->lastFileGroup )
+            {
+                nameGroup->lastFileGroup->next = fileGroup;
+            }
+            else
+            {
+                nameGroup->firstFileGroup = fileGroup;
+            }
+            nameGroup->lastFileGroup = fileGroup;
+        }
+
+        MgEndPhase( context );
+        return fileGroup;
+    }
+
+    /*
+    Add a particular scrap definition to a group of scraps with the same
+    ID in the same file.
+    */
+    void MgAddScrapToFileGroup(
+        MgScrapFileGroup* fileGroup,
+        MgScrap*          scrap)
+    {
+        if( fileGroup->lastScrap )
+        {
+            fileGroup->lastScrap->next = scrap;
+        }
+        else
+        {
+            fileGroup->firstScrap = scrap;
+        }
+        fileGroup->lastScrap = scrap;
+    }
+
+    MgBool MgCheckMatch(
+        MgReader*   reader,
+        char            c,
+        int             count )
+    {
+        for( int ii = 0; ii < count; ++ii )
+        {
+            int d = MgGetChar( reader );
+            if( d != c )
+                return MG_FALSE;
+        }
+        return MG_TRUE;
+
+    }
+
+    /*
+    Look ahead in the reader for an occurence of character `c`, `count` times
+    in a row. Return a pointer to right before the first character in the match,
+    and leave the cursor of the reader pointing right after the match.
+
+    If no match is found, returns NULL.
+    */
+    char const* MgFindMatching(
+        MgReader*   reader,
+        char            c,
+        int             count )
+    {
+        for(;;)
+        {
+            char const* mark = reader->cursor;
+            int d = MgGetChar(reader);
+            if( d == -1 )
+                return 0;
+            if( d == c )
+            {
+                if( MgCheckMatch(reader, c, count-1) )
+                {
+                    return mark;
+                }
+            }
+
+            if( d == '\\' )
+            {
+                // read the escaped char, if any
+                int e = MgGetChar(reader);
+            }
+        }
+    }
+
+    /*
+    Similar to `MgFindMatching`, except that it returns the intial cursor of the
+    reader as the `begin` of the result string, and the result from
+    `MgFindMatching` as the `end`.
+
+    Note: this means that when no match is found, the `end` of the result will
+    be NULL, but the `begin` won't be.
+    */
+    MgString MgFindMatchingString(
+        MgReader*   reader,
+        char            c,
+        int             count)
+    {
+        MgString text;
+        text.begin = reader->cursor;
+        text.end = MgFindMatching(reader, c, count);
+        return text;
+    }
+
+    int MgGetLineNumber(
+        MgInputFile*    inputFile,
+        MgLine*         line)
+    {
+        return 1 + (line - inputFile->beginLines);
+    }
+
+    int MgGetColumnNumber(
+        MgLine*     line,
+        const char* cursor)
+    {
+        return 1 + (cursor - line->originalBegin);
+    }
+
+    /*
+    Return line number and column information (1-based) for a location in the
+    given input file, represented by the given pointer into the given line.
+    */
+    MgSourceLoc MgGetSourceLoc(
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        const char*     cursor)
+    {
+        MgSourceLoc sourceLoc;
+        sourceLoc.line  = MgGetLineNumber( inputFile, line );
+        sourceLoc.col   = MgGetColumnNumber( line, cursor );
+        return sourceLoc;
+    }
+#line 5 "source/parse-span.md"
+    /*
+    ### Span-Level Elements ###
+    */
+    typedef struct SpanWriterT
+    {
+        MgElement* firstElement;
+        MgElement* lastElement;
+
+        char const* spanStart;
+        char const* spanEnd;
+    } SpanWriter;
+
+    void InitializeSpanWriter(
+        SpanWriter* writer )
+    {
+        writer->firstElement = 0;
+        writer->lastElement = 0;
+        writer->spanStart = 0;
+        writer->spanEnd = 0;
+    }
+
+    void BeginSpan(
+        SpanWriter* writer,
+        char const* spanStart )
+    {
+        writer->spanStart = spanStart;
+        writer->spanEnd = spanStart;
+    }
+
+    void ExtendSpan(
+        SpanWriter* writer,
+        char const* spanEnd )
+    {
+        writer->spanEnd = spanEnd;
+    }
+
+    void AddSpanElementImpl(
+        SpanWriter* writer,
+        MgElement*  element )
+    {
+        // add the element to the list
+        if( writer->lastElement )
+        {
+            writer->lastElement->next = element;
+        }
+        else
+        {
+            writer->firstElement = element;
+        }
+        writer->lastElement = element;
+
+        writer->spanStart = 0;
+        writer->spanEnd = 0;    
+    }
+
+    void FlushSpan(
+        SpanWriter* writer )
+    {
+        MgElement* element = NULL;
+        if( writer->spanStart == writer->spanEnd )
+            return;
+
+        element = MgCreateLeafElement(
+            kMgElementKind_Text,
+            MgMakeString(writer->spanStart, writer->spanEnd) );
+
+        AddSpanElementImpl( writer, element );
+    }
+
+    void AddSpanElement(
+        SpanWriter* writer,
+        MgElement*  element )
+    {
+        FlushSpan( writer );
+        AddSpanElementImpl( writer, element );
+    }
+
+
+    #include <memory.h>
+
+    void AddLiteralSpan(
+        SpanWriter* writer,
+        char const* text )
+    {
+        FlushSpan( writer );
+        BeginSpan( writer, text );
+        ExtendSpan( writer, text + strlen(text) );
+        FlushSpan( writer );
+    }
+
+    void ReadLineSpans(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        char const*     textBegin,
+        char const*     textEnd,
+        MgSpanFlags       flags,
+        SpanWriter*     writer );
+
+    /*
+    Read span-level elements from the range of text given by
+    `textBegin` and `textEnd`, using the given flags. The range
+    of characters given should belong to `line` in `inputFile`,
+    which should be loaded in `context`.
+    */
+    MgElement* MgReadSpanElements(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgString        text,
+        MgSpanFlags     flags )
+    {
+        if( context->tangleOnly && flags != kMgSpanFlags_CodeBlock )
+            return NULL;
+
+        MgBool outermost = MgBeginPhase( context, kMgPhase_SpanParse );
+
+        SpanWriter writer;
+        InitializeSpanWriter( &writer );
+        ReadLineSpans(context, inputFile, line, text.begin, text.end, flags, &writer);
+
+        if( outermost )
+            MgCountPhaseElements( context, kMgPhase_SpanParse, text.end - text.begin, writer.firstElement );
+        MgEndPhase( context );
+        return writer.firstElement;
+    }
+
+    //
+    //
+    //
+
+    MgElement* ParseHtmlEntity(
+        MgContext*        context,
+        MgInputFile*      inputFile,
+        MgReader*   reader,
+        MgSpanFlags       flags,
+        char            c,
+        MgElementKind   kind )
+    {
+        if( !(flags & kMgSpanFlag_EscapeHtmlEntities) )
+            return 0;
+
+        int d = MgGetChar( reader );
+        if( d != c )
+            return 0;
+
+        return MgCreateParentElement(
+            kind, 0 );
+    }
+
+    MgElement* ParseHtmlEntity_LessThan(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        return ParseHtmlEntity(context, inputFile, reader, flags, '<', kMgElementKind_LessThanEntity);
+    }
+
+    MgElement* ParseHtmlEntity_GreaterThan(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        return ParseHtmlEntity(context, inputFile, reader, flags, '>', kMgElementKind_GreaterThanEntity);
+    }
+
+    MgElement* ParseHtmlEntity_Ampersand(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        return ParseHtmlEntity(context, inputFile, reader, flags, '&', kMgElementKind_AmpersandEntity);
+    }
+
+    MgElement* ParseScrapRef(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        MgString scrapID;
+
+        if( MgGetChar(reader) != '<' ) return 0;
+        if( MgGetChar(reader) != '<' ) return 0;
+
+        char const* idBegin = reader->cursor;
+        char const* idEnd   = idBegin;
+        for(;;)
+        {
+            idEnd = reader->cursor;
+            int c = MgGetChar( reader );
+            if( c == -1 )
+                return 0;
+
+            if( c == '>' )
+            {
+                int d = MgGetChar( reader );
+                if( d == '>' )
+                {
+                    break;
+                }
+            }
+        }
+
+        // In order to avoid accidentally treating an expression
+        // with both left and right shifts as a scrap reference,
+        // we require that there be no whitespace after the `<<`.
+        // This lets a user easily avoid problems by inserting
+        // spaces into their expressions:
+        //
+        // TODO: the " &nbsp; " in the next line should really be
+        // blank, to illustrate the point, but right now Mangle
+        // assumes it is a scrap reference (exactly as described
+        // by this logic...)
+        // scrap ref: `1 << &nbsp; foo &nbsp; >> bar`
+        // shifts:      `1 << foo >> bar`
+
+        if( idBegin != idEnd && isspace(*idBegin) )
+            return 0;
+
+        scrapID = MgMakeString( idBegin, idEnd );
+        MgScrapFileGroup* scrapFileGroup = MgFindOrCreateScrapGroup(
+            context,
+            kScrapKind_Unknown,
+            scrapID,
+            inputFile );
+
+        MgElement* element = MgCreateParentElement(
+            kMgElementKind_ScrapRef,
+            0 );
+        MgAttribute* attr = MgAddCustomAttribute(element, "$scrap-group");
+        attr->scrapFileGroup = scrapFileGroup;
+        attr = MgAddCustomAttribute(element, "$resume-at");
+        MgSourceLoc sourceLoc = MgGetSourceLoc( inputFile, line, reader->cursor );
+        attr->sourceLoc = sourceLoc;
+
+        return element;
+    }
+
+    MgElement* ParseEm(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags,
+        char            c )
+    {
+        MgElement* inner = NULL;
+        if( flags & kMgSpanFlag_DontProcessMarkdown )
+            return NULL;
+
+        // follow GitHub Flavored Markdown, in only
+        // allowing underscores for <em> when
+        // they mark a whole word...
+
+        // we need to look at the character before `c`
+        if( reader->cursor > inputFile->text.begin )
+        {
+            char prev = *(reader->cursor - 1);
+            if( (c == '_') && !isspace(prev) )
+                return NULL;            
+        }
+
+        int count = 0;
+        for(; count < 2; ++count)
+        {
+            int d = MgGetChar( reader );
+            if( d != c )
+            {
+                MgUnGetChar( reader, d );
+                break;
+            }
+        }
+        if( !count )
+            return NULL;
+
+        int e = MgPeekChar( reader );
+        if( isspace(e) )
+            return NULL; // can't start with white-space
+
+        // appears to be the start of a span.
+        // now we need to find the matching marker(s)
+        char const* start = reader->cursor;
+        char const* end = MgFindMatching( reader, c, count );
+        if( !end )
+            return NULL;
+
+        if( (c == '_') && isalpha(MgPeekChar(reader)) )
+            return NULL;
+
+        // need to scan the inner text for other span markup
+        inner = MgReadSpanElements( context, inputFile, line, MgMakeString(start, end), flags );
+
+        return MgCreateParentElement(
+            count == 2 ? kMgElementKind_Strong : kMgElementKind_Em ,
+            inner );
+    }
+
+    MgElement* ParseEm_Underscore(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        return ParseEm(
+            context,
+            inputFile,
+            line,
+            reader,
+            flags,
+            '_' );
+    }
+
+    MgElement* ParseEm_Asterisk(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        return ParseEm(
+            context,
+            inputFile,
+            line,
+            reader,
+            flags,
+            '*' );
+    }
+
+    MgElement* ParseInlineCode(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        MgElement* inner = NULL;
+        if( flags & kMgSpanFlag_DontProcessMarkdown )
+            return NULL;
+
+        int count = 0;
+        for(; count < 2; ++count)
+        {
+            int d = MgGetChar( reader );
+            if( d != '`' )
+            {
+                MgUnGetChar( reader, d );
+                break;
+            }
+        }
+        if( !count )
+            return NULL;
+
+        // allow an optional space at start,
+        // which will get trimmed
+        int lead = MgGetChar(reader);
+        if( lead != ' ' )
+        {
+            MgUnGetChar(reader, lead);
+        }
+
+        // appears to be the start of a span.
+        // now we need to find the matching marker
+        char const* start = reader->cursor;
+        char const* end = MgFindMatching( reader, '`', count );
+        if( !end )
+            return NULL;
+
+        // allow an optional space at end
+        // which will get trimmed
+        if( start != end && (*(end-1) == ' ') )
+            --end;
+
+        inner = MgReadSpanElements( context, inputFile, line, MgMakeString(start, end), kMgSpanFlags_InlineCode );
+
+        return MgCreateParentElement(
+            kMgElementKind_InlineCode,
+            inner );
+    }
+
+    MgElement* ParseLink(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        MgString text;
+        if( flags & kMgSpanFlag_DontProcessMarkdown )
+            return 0;
+
+        int textOpenBrace = MgGetChar( reader );
+        if( textOpenBrace != '[' )
+            return 0;
+
+        text = MgFindMatchingString( reader, ']', 1 );
+        if( !text.end )
+            return 0;
+
+        int targetOpenBrace = MgGetChar( reader );
+        if( targetOpenBrace == '(' )
+        {
+            MgElement* inner    = NULL;
+            MgElement* link     = NULL;
+
+            // inline link
+            char const* targetBegin = reader->cursor;
+            char const* targetEnd = MgFindMatching( reader, ')', 1 );
+            if( !targetEnd )
+                return 0;
+
+            inner = MgReadSpanElements( context, inputFile, line, text, flags );
+
+            link = MgCreateParentElement(
+                kMgElementKind_Link,
+                inner );
+
+            MgAddAttribute(link, "href", MgMakeString(targetBegin, targetEnd));
+            return link;
+        }
+        else if( targetOpenBrace == '[' )
+        {
+            // reference link
+            MgString id = MgFindMatchingString(reader, ']', 1);
+            if( !id.end )
+                return 0;
+
+            if( MgIsEmptyString(id) )
+            {
+                id = text;
+            }
+
+            // \todo: need to save this identifier,
+            // so taht we can look up the link target later...
+            MgReferenceLink* referenceLink = MgFindOrCreateReferenceLink(
+                inputFile,
+                id );
+
+            MgElement* inner = MgReadSpanElements( context, inputFile, line, text, flags );
+
+            MgElement* link = MgCreateParentElement(
+                kMgElementKind_ReferenceLink,
+                inner );
+
+            MgAttribute* attr = MgAddCustomAttribute(link, "$referenceLink");
+            attr->referenceLink = referenceLink;
+
+            return link;
+        }
+
+        return 0;
+    }
+
+    //
+
+    MgElement* TryParseSpanElement(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgSpanFlags       flags )
+    {
+        typedef MgElement* (*ParseSpanFunc)( MgContext*, MgInputFile*, MgLine*, MgReader*, MgSpanFlags );
+        #define MG_SPAN_PARSE_FUNCS \
+            MG_PARSER_ENTRY(ParseScrapRef), \
+            MG_PARSER_ENTRY(ParseLink), \
+            MG_PARSER_ENTRY(ParseHtmlEntity_LessThan), \
+            MG_PARSER_ENTRY(ParseHtmlEntity_GreaterThan), \
+            MG_PARSER_ENTRY(ParseHtmlEntity_Ampersand), \
+            MG_PARSER_ENTRY(ParseEm_Underscore), \
+            MG_PARSER_ENTRY(ParseEm_Asterisk), \
+            MG_PARSER_ENTRY(ParseInlineCode),
+        static const ParseSpanFunc parseSpanFuncs[] =
+        {
+            MG_SPAN_PARSE_FUNCS
+            0,
+        };
+
+    #if MG_PARSER_COUNTERS
+        // expand the same list again to get the name of each function
+        #undef MG_PARSER_ENTRY
+        #define MG_PARSER_ENTRY(func) #func
+        static char const* const parseSpanFuncNames[] =
+        {
+            MG_SPAN_PARSE_FUNCS
+        };
+        #undef MG_PARSER_ENTRY
+        #define MG_PARSER_ENTRY(func) &func
+    #endif
+        #undef MG_SPAN_PARSE_FUNCS
+
+        ParseSpanFunc const* parseFunc = &parseSpanFuncs[0];
+        do
+        {
+            MgReader tempReader = *reader;
+    #if MG_PARSER_COUNTERS
+            double attemptStart = MgGetWallSeconds();
+    #endif
+            MgElement* p = (*parseFunc)( context, inputFile, line, &tempReader, flags );
+    #if MG_PARSER_COUNTERS
+            {
+                int index = (int)(parseFunc - &parseSpanFuncs[0]);
+                MgCountParseAttempt( gMgSpanParserCounters, index, parseSpanFuncNames[index],
+                    inputFile, p != NULL, tempReader.cursor - reader->cursor, MgGetWallSeconds() - attemptStart );
+            }
+    #endif
+            if( p )
+            {
+                reader->cursor = tempReader.cursor;
+                return p;              
+            }
+            ++parseFunc;
+        }
+        while(*parseFunc);
+
+        return 0;
+    }
+
+    //
+
+    /*
+    With `-tangle-only`, the only span-level elements we need are the
+    scrap references inside code blocks. Every other span-level element
+    that can appear in a code block (i.e., an entity) stands for exactly
+    the character it was parsed from, so we can treat it as text. Since a
+    scrap reference must start with `<`, we skip directly from one `<` to
+    the next, rather than trying every parsing function at every character.
+    */
+    void ReadCodeLineSpans(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        char const*     textBegin,
+        char const*     textEnd,
+        SpanWriter*     writer )
+    {
+        MgString string = { textBegin, textEnd };
+        MgReader reader;
+        MgInitializeStringReader( &reader, string );
+
+        BeginSpan( writer, reader.cursor );
+
+        while(!MgAtEnd(&reader))
+        {
+            char const* lessThan = (char const*) memchr(reader.cursor, '<', textEnd - reader.cursor);
+            if( !lessThan )
+            {
+                ExtendSpan( writer, textEnd );
+                break;
+            }
+            reader.cursor = lessThan;
+            ExtendSpan( writer, reader.cursor );
+
+            MgReader tempReader = reader;
+            MgElement* element = ParseScrapRef( context, inputFile, line, &tempReader, kMgSpanFlags_CodeBlock );
+            if( element )
+            {
+                reader.cursor = tempReader.cursor;
+                AddSpanElement( writer, element );
+                BeginSpan( writer, reader.cursor );
+                continue;
+            }
+
+            MgGetChar( &reader );
+            ExtendSpan( writer, reader.cursor );
+        }
+        FlushSpan( writer );
+    }
+
+    void ReadLineSpans(
+        MgContext*    context,
+        MgInputFile*      inputFile,
+        MgLine*       line,
+        char const* textBegin,
+        char const* textEnd,
+        MgSpanFlags   flags,
+        SpanWriter* writer )
+    {
+        if( context->tangleOnly )
+        {
+            ReadCodeLineSpans( context, inputFile, line, textBegin, textEnd, writer );
+            return;
+        }
+
+        MgString string = { textBegin, textEnd };
+        MgReader reader;
+        MgInitializeStringReader( &reader, string );
+
+        BeginSpan( writer, reader.cursor );
+
+        while(!MgAtEnd(&reader))
+        {
+            // look for a match among our various cases
+            MgElement* element = TryParseSpanElement( context, inputFile, line, &reader, flags );
+            if( element )
+            {
+                AddSpanElement( writer, element );
+                BeginSpan( writer, reader.cursor );
+                continue;
+            }
+
+            // fallback position - read one character
+            // and add it to our current textual span
+            int c = MgGetChar( &reader );
+
+            // okay, with one special case for the '\'
+            // escape character...
+            //
+            // \todo: where do escapes get ignored?
+            if( c == '\\'
+                && !(flags & kMgSpanFlag_DontProcessMarkdown))
+            {
+                // end the current span, since we need
+                // to skip the '\'
+                FlushSpan( writer );
+
+                // start fresh span *after* the backslash
+                BeginSpan( writer, reader.cursor );
+
+                // read the escaped character, so that
                 // it won't get a chance to be processed
                 // by the other rules
                 c = MgGetChar( &reader );
             }
-    
-            // default: just extend the span
-            ExtendSpan( writer, reader.cursor );
+
+            // default: just extend the span
+            ExtendSpan( writer, reader.cursor );
+        }
+        FlushSpan( writer );
+    }
+
+    /*
+    Read span-level elements from the range of lines given by
+    `beginLines` and `endLines`, using the given flags. The range
+    of lines given should belong to `inputFile`, which should be
+    loaded in `context`.
+    */
+    MgElement* MgReadSpanElementsFromLines(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         beginLines,
+        MgLine*         endLines,
+        MgSpanFlags       flags )
+    {
+        if( context->tangleOnly && flags != kMgSpanFlags_CodeBlock )
+            return NULL;
+
+        MgBool outermost = MgBeginPhase( context, kMgPhase_SpanParse );
+        long long byteCount = 0;
+
+        SpanWriter writer;
+        InitializeSpanWriter( &writer );
+
+        for( MgLine* line = beginLines; line != endLines; ++line )
+        {
+            MgElement* lastElementBeforeLine = writer.lastElement;
+            ReadLineSpans( context, inputFile, line, line->text.begin, line->text.end, flags, &writer );
+            if( writer.lastElement == lastElementBeforeLine )
+            {
+                MgElement* emptyText = MgCreateLeafElement(
+                    kMgElementKind_Text,
+                    MgMakeString(line->text.begin, line->text.begin));
+                AddSpanElement( &writer, emptyText );
+            }
+            writer.lastElement->flags |= kMgElementFlag_EndsLine;
+            byteCount += line->text.end - line->text.begin;
+        }
+
+        if( outermost )
+            MgCountPhaseElements( context, kMgPhase_SpanParse, byteCount, writer.firstElement );
+        MgEndPhase( context );
+        return writer.firstElement;
+    }
+#line 698 "source/parse-span.md"
+    static MgBool MgLineMightContainScrapRef(
+        MgLine* line )
+    {
+        char const* cursor  = line->text.begin;
+        char const* end     = line->text.end;
+        while( cursor != end )
+        {
+            char const* lessThan = (char const*) memchr(cursor, '<', end - cursor);
+            if( !lessThan || lessThan + 1 == end )
+                return MG_FALSE;
+            if( lessThan[1] == '<' )
+                return MG_TRUE;
+            cursor = lessThan + 1;
+        }
+        return MG_FALSE;
+    }
+
+    static MgBool MgCanDeferSpans(
+        MgContext*  context,
+        MgLine*     beginLines,
+        MgLine*     endLines )
+    {
+        // with `-tangle-only` there is nothing to parse, and a compact
+        // tree is built from a fully-parsed document
+        if( context->tangleOnly || context->useCompactTrees )
+            return MG_FALSE;
+        if( beginLines == endLines )
+            return MG_FALSE;
+
+        for( MgLine* line = beginLines; line != endLines; ++line )
+        {
+            if( MgLineMightContainScrapRef(line) )
+                return MG_FALSE;
+        }
+        return MG_TRUE;
+    }
+#line 738 "source/parse-span.md"
+    static MgElement* MgCreateDeferredSpanParent(
+        MgInputFile*    inputFile,
+        MgElementKind   kind,
+        MgString        text,
+        MgSpanFlags     flags,
+        MgBool          wholeLines )
+    {
+        MgElement* element = MgCreateLeafElement( kind, text );
+        element->flags |= kMgElementFlag_DeferredSpans;
+
+        MgAttribute* attr = MgAddCustomAttribute( element, "$deferred-spans" );
+        attr->deferredSpans.inputFile   = inputFile;
+        attr->deferredSpans.spanFlags   = flags;
+        attr->deferredSpans.wholeLines  = wholeLines;
+        return element;
+    }
+
+    /*
+    Create a parent element of the given `kind`, whose children are the
+    span-level elements read from the range of lines given by `beginLines`
+    and `endLines`. Parsing of the children is deferred, if possible.
+    */
+    MgElement* MgCreateSpanParentFromLines(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgElementKind   kind,
+        MgLine*         beginLines,
+        MgLine*         endLines,
+        MgSpanFlags     flags )
+    {
+        if( !MgCanDeferSpans(context, beginLines, endLines) )
+        {
+            return MgCreateParentElement(
+                kind,
+                MgReadSpanElementsFromLines(context, inputFile, beginLines, endLines, flags) );
+        }
+
+        MgString text = MgMakeString( beginLines->text.begin, (endLines - 1)->text.end );
+        return MgCreateDeferredSpanParent( inputFile, kind, text, flags, MG_TRUE );
+    }
+
+    /*
+    Like `MgCreateSpanParentFromLines`, but for span-level elements read
+    from the range of characters `text`, which belongs to `line`.
+    */
+    MgElement* MgCreateSpanParentFromString(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgElementKind   kind,
+        MgLine*         line,
+        MgString        text,
+        MgSpanFlags     flags )
+    {
+        MgLine textLine = *line;
+        textLine.text = text;
+        if( !MgCanDeferSpans(context, &textLine, &textLine + 1) )
+        {
+            return MgCreateParentElement(
+                kind,
+                MgReadSpanElements(context, inputFile, line, text, flags) );
+        }
+
+        return MgCreateDeferredSpanParent( inputFile, kind, text, flags, MG_FALSE );
+    }
+#line 808 "source/parse-span.md"
+    MgAttribute* MgFindAttribute(
+        MgElement*  element,
+        char const* id );
+    MgLine MgGetTableLine(
+        MgInputFile*    inputFile,
+        size_t          index );
+    size_t MgFindTableLineIndex(
+        MgInputFile*    inputFile,
+        char const*     cursor );
+
+    /*
+    Parse the deferred span-level contents of `element`, and make them
+    its children.
+    */
+    void MgParseDeferredSpans(
+        MgContext*  context,
+        MgElement*  element )
+    {
+        MgDeferredSpans deferred = MgFindAttribute(element, "$deferred-spans")->deferredSpans;
+        MgInputFile* inputFile = deferred.inputFile;
+        MgString text = element->text;
+        element->text = MgMakeString(NULL, NULL);
+        element->flags &= ~kMgElementFlag_DeferredSpans;
+
+        MgSetAllocationFile( inputFile );
+        size_t firstIndex = MgFindTableLineIndex( inputFile, text.begin );
+        if( !deferred.wholeLines )
+        {
+            MgLine line = MgGetTableLine( inputFile, firstIndex );
+            element->firstChild = MgReadSpanElements( context, inputFile, &line, text, deferred.spanFlags );
+        }
+        else
+        {
+            size_t count = MgFindTableLineIndex( inputFile, text.end ) + 1 - firstIndex;
+            MgLine* lines = (MgLine*) MgAllocate( kMgAllocKind_Lines, count * sizeof(MgLine) );
+            for( size_t ii = 0; ii < count; ++ii )
+                lines[ii] = MgGetTableLine( inputFile, firstIndex + ii );
+            lines[0].text.begin = text.begin;
+            lines[count - 1].text.end = text.end;
+
+            element->firstChild = MgReadSpanElementsFromLines( context, inputFile, lines, lines + count, deferred.spanFlags );
+            MgFree( kMgAllocKind_Lines, lines, count * sizeof(MgLine) );
+        }
+        MgSetAllocationFile( NULL );
+    }
+#line 34 "source/parse-block.md"
+    typedef struct LineRangeT
+    {
+        MgLine* begin;
+        MgLine* end;
+    } LineRange;
+#line 110 "source/parse-block.md"
+    #define BLOCK_PARSE_FUNC(Name) \
+        MgElement* Name( MgContext* context, MgInputFile* inputFile, LineRange* ioLineRange )
+    typedef BLOCK_PARSE_FUNC((*BlockParseFunc));
+#line 21 "source/parse-block.md"
+    MgElement* ParseBlockElement(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange*      ioLineRange );
+
+    MgElement* ParseBlockElementsInRange(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange       lineRange );
+#line 393 "source/parse-block.md"
+    MgElement* ParseSetextHeader(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange*      ioLineRange,
+        char            c,
+        MgElementKind   kind );
+#line 917 "source/parse-block.md"
+    MgElement* ParseCodeBlockBody(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange       inLineRange,
+        char const*     langBegin,
+        char const*     langEnd );
+#line 2208 "source/parse-block.md"
+    char const* CheckIndentedCodeLine(
+        MgLine* line );
+#line 322 "source/parse-block.md"
+    MgBool IsBlankLine( MgLine* line )
+    {
+        char const* cursor = line->text.begin;
+        char const* end = line->text.end;
+        while( cursor != end )
+        {
+            if( !isspace(*cursor) )
+                return MG_FALSE;
+            ++cursor;
+        }
+        return MG_TRUE;
+    }
+#line 2003 "source/parse-block.md"
+    void SkipEmptyLines(
+        LineRange*  ioLineRange )
+    {
+        for(;;)
+        {
+            MgLine* begin = ioLineRange->begin;
+            if( begin == ioLineRange->end )
+                return;
+            if( !IsBlankLine(begin) )
+                return;
+                
+            ioLineRange->begin = begin + 1;
+        }
+    }
+#line 2021 "source/parse-block.md"
+    MgElement* ReadSpansInRange(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange       lines,
+        MgSpanFlags       flags)
+    {
+        return MgReadSpanElementsFromLines(
+            context,
+            inputFile,
+            lines.begin,
+            lines.end,
+            flags );
+    }
+
+    /*
+    Create a parent element of the given `kind`, with children read from
+    `lines`, as with `ReadSpansInRange`. The children may not be parsed
+    until the element is written (see `MgCreateSpanParentFromLines`).
+    */
+    MgElement* CreateSpanParentInRange(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgElementKind   kind,
+        LineRange       lines,
+        MgSpanFlags     flags)
+    {
+        return MgCreateSpanParentFromLines(
+            context,
+            inputFile,
+            kind,
+            lines.begin,
+            lines.end,
+            flags );
+    }
+
+    MgBool LineIsAll(
+        MgLine* line,
+        char    c )
+    {
+        char const* cursor  = line->text.begin;
+        char const* end     = line->text.end;
+        if( cursor == end )
+            return MG_FALSE;
+        while( cursor != end )
+        {
+            if( *cursor != c )
+            {
+                return MG_FALSE;
+            }
+            ++cursor;
+        }
+        return MG_TRUE;
+    }
+
+    MgLine* GetLine(
+        LineRange*  ioLineRange )
+    {
+        if( ioLineRange->begin == ioLineRange->end )
+            return 0;
+
+        return ioLineRange->begin++;
+    }
+
+    void UnGetLine(
+        LineRange*  ioLineRange,
+        MgLine*     line )
+    {
+        if( !line ) return;
+        assert(line == (ioLineRange->begin-1));
+        ioLineRange->begin--;
+    }
+
+    LineRange MgInclusiveLineRange(
+        MgLine* first,
+        MgLine* last)
+    {
+        LineRange range = { first, last + 1 };
+        return range;
+    }
+
+    LineRange Snip(
+        MgLine*     firstLine,
+        MgLine*     lastLine,
+        LineRange*  ioLineRange )
+    {
+        assert(firstLine);
+        assert(lastLine);
+        ioLineRange->begin = lastLine + 1;
+        return MgInclusiveLineRange( firstLine, lastLine );
+    }
+
+    //
+    //
+    //
+
+
+
+
+
+    void TrimLeadingSpace(
+        char const** ioBegin,
+        char const* end )
+    {
+        char const* begin = *ioBegin;
+        while( begin != end && isspace(*begin) )
+            ++begin;
+        *ioBegin = begin;
+    }
+
+    void TrimTrailingSpace(
+        char const* begin,
+        char const** ioEnd )
+    {
+        char const* end = *ioEnd;
+        while( end != begin && isspace(*(end -1)) )
+            --end;
+        *ioEnd = end;
+    }
+
+    void TrimTrailingChar(
+        char const* begin,
+        char const** ioEnd,
+        char            c )
+    {
+        char const* end = *ioEnd;
+        while( end != begin && (*(end -1) == c) )
+            --end;
+        *ioEnd = end;
+    }
+
+    void InitializeLineReader(
+        MgReader*   reader,
+        MgLine*         line )
+    {
+        MgInitializeStringReader( reader, line->text );
+    }
+
+    int GetIndent(
+        MgLine* line )
+    {
+        char const* cursor = line->text.begin;
+        char const* end = line->text.end;
+
+        int indent = 0;
+        while( cursor != end )
+        {
+            char c = *cursor;
+            if( c == ' ' )
+            {
+                indent += 1;
+            }
+            else if( c == '\t' )
+            {
+                indent += 4;
+            }
+            else
+            {
+                break;
+            }
+            ++cursor;
+        }
+        return indent;
+    }
+
+    MgString CString(char const* text)
+    {
+        MgString string = { text, text + strlen(text) };
+        return string;
+    }
+
+    static void SkipWhiteSpace(
+        MgReader* reader )
+    {
+        for(;;)
+        {
+            int c = MgGetChar(reader);
+            if( !isspace(c) )
+            {
+                MgUnGetChar(reader, c);
+                return;
+            }
+        }
+    }
+#line 46 "source/parse-block.md"
+    MgElement* ParseBlockElementsInRange(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange       lineRange )
+    {
+        MgElement*  elements    = NULL;
+        MgElement** elementLink = &elements;
+
+        for(;;)
+        {
+            
+#line 67 "source/parse-block.md"
+    SkipEmptyLines(&lineRange);
+#line 75 "source/parse-block.md"
+    if( lineRange.begin == lineRange.end )
+        break;
+#line 81 "source/parse-block.md"
+    MgElement* element = ParseBlockElement( context, inputFile, &lineRange );
+#line 86 "source/parse-block.md"
+    *elementLink = element;
+    while( *elementLink )
+    {
+        elementLink = &(*elementLink)->next;
+        
+#line 97 "source/parse-block.md"
+    MgCountPhaseWork( context, kMgPhase_BlockParse, 0, 1 );
+#line 91 "source/parse-block.md"
+    }
+#line 56 "source/parse-block.md"
+                                                                 
+        }
+
+        return elements;
+    }
+#line 259 "source/parse-block.md"
+    MgElement* ParseBlockLevelHtml(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        MgLine* firstLine = GetLine( ioLineRange );
+        MgLine* lastLine = firstLine;
+
+        MgReader reader;
+        InitializeLineReader( &reader, firstLine );
+
+        int c = MgGetChar( &reader );
+        if( c != '<' ) return NULL;
+
+        int d = MgGetChar( &reader );
+        if( !isalpha(d) ) return NULL;
+
+        for(;;)
+        {
+            MgLine* line = GetLine( ioLineRange );
+            if( !line )
+                break;
+
+            lastLine = line;
+
+            InitializeLineReader( &reader, line );
+            int e = MgGetChar( &reader );
+            if( e != '<' )
+                continue;
+            int f = MgGetChar( &reader );
+            if( f != '/' )
+                continue;
+            int g = MgGetChar( &reader );
+            if( !isalpha(g) )
+                continue;
+
+            break;
+        }
+
+        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        return CreateSpanParentInRange(
+            context, inputFile,
+            kMgElementKind_HtmlBlock,
+            innerRange,
+            kMgSpanFlags_HtmlBlock );
+    }
+#line 338 "source/parse-block.md"
+    BLOCK_PARSE_FUNC(ParseDefaultParagraph)
+    {
+        MgLine* firstLine = GetLine( ioLineRange );
+        MgLine* lastLine = firstLine;
+
+        for(;;)
+        {
+            MgLine* line = GetLine( ioLineRange );
+            if( !line || IsBlankLine(line) )
+            {
+                UnGetLine(ioLineRange, line);
+                break;
+            }
+
+            lastLine = line;
+        }
+
+        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        return CreateSpanParentInRange(
+            context, inputFile,
+            kMgElementKind_Paragraph,
+            innerRange,
+            kMgSpanFlags_Default );
+    }
+#line 404 "source/parse-block.md"
+    BLOCK_PARSE_FUNC(ParseSetextHeader1)
+    {
+        return ParseSetextHeader(
+            context, inputFile,
+            ioLineRange,
+            '=',
+            kMgElementKind_Header1 );
+    }
+
+    BLOCK_PARSE_FUNC(ParseSetextHeader2)
+    {
+        return ParseSetextHeader(
+            context, inputFile,
+            ioLineRange,
+            '-',
+            kMgElementKind_Header2 );
+    }
+#line 428 "source/parse-block.md"
+    MgElement* ParseSetextHeader(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange,
+        char            c,
+        MgElementKind   kind )
+    {
+        
+#line 456 "source/parse-block.md"
+    MgLine* firstLine = GetLine(ioLineRange);
+    MgLine* secondLine = GetLine(ioLineRange);
+    if( !secondLine ) return 0;
+#line 437 "source/parse-block.md"
+        
+#line 467 "source/parse-block.md"
+    if(!LineIsAll(secondLine, c))
+        return 0;
+#line 439 "source/parse-block.md"
+        // the inner range does not include the second line,
+        // so we can't just use the Snip() function for everything
+        LineRange innerRange = MgInclusiveLineRange(firstLine, firstLine);
+        Snip( firstLine, secondLine, ioLineRange );
+
+        return CreateSpanParentInRange(
+            context,
+            inputFile,
+            kind,
+            innerRange,
+            kMgSpanFlags_Default );
+    }
+#line 497 "source/parse-block.md"
+    MgElement* ParseAtxHeader(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        LineRange innerRange;
+        MgLine* firstLine = GetLine( ioLineRange );
+
+        MgReader reader;
+        InitializeLineReader(&reader, firstLine);
+
+        int level = 0;
+        for(;;)
+        {
+            int c = MgGetChar(&reader);
+            if( c != '#' )
+            {
+                MgUnGetChar(&reader, c);
+                break;
+            }
+            ++level;
+        }
+
+        if( level == 0 ) return 0;
+
+        firstLine->text.begin = reader.cursor;
+
+        TrimLeadingSpace( &firstLine->text.begin, firstLine->text.end );
+        TrimTrailingChar( firstLine->text.begin, &firstLine->text.end, '#' );
+        TrimTrailingSpace( firstLine->text.begin, &firstLine->text.end );
+
+        if( level > kMaxHeaderLevel )
+            level = kMaxHeaderLevel;
+
+        innerRange = Snip( firstLine, firstLine, ioLineRange );
+
+        return CreateSpanParentInRange(
+            context, inputFile,
+            (MgElementKind) (kMgElementKind_Header1 + (level-1)),
+            innerRange,
+            kMgSpanFlags_Default );
+    }
+#line 590 "source/parse-block.md"
+    char const* CheckQuoteLine(
+        MgLine* line )
+    {
+        MgReader reader;
+        InitializeLineReader(&reader, line );
+
+        int c = MgGetChar( &reader );
+        if( c != '>' )
+            return 0;
+
+        int d = MgGetChar( &reader );
+        if( d != ' ' )
+        {
+            MgUnGetChar( &reader, d );
+        }
+        return reader.cursor;
+    }
+
+    MgElement* ParseBlockQuote(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        MgLine* firstLine = GetLine( ioLineRange );
+        MgLine* lastLine = firstLine;
+
+        MgLine* line = firstLine;
+        for(;;)
+        {
+            if( !line )
+                break;
+
+            char const* lineStart = CheckQuoteLine(line);
+            if( !lineStart )
+            {
+                if( line == firstLine )
+                    return 0; // this isn't a block quote at all!
+                else
+                    break; // we've found the first line that doesn't belong
+            } 
+
+            // we are starting a paragraph within the block quote
+
+            // continue consuming lines until we see an empty line
+            while( line && !IsBlankLine(line) )
+            {
+                lineStart = CheckQuoteLine(line);
+                if( lineStart )
+                    line->text.begin = lineStart;
+                lastLine = line;
+                line = GetLine( ioLineRange );
+            }
+
+            // continue consuming lines until we see a non-empty line
+            while( line && IsBlankLine(line) )
+            {
+                line = GetLine( ioLineRange );
+            }
+        }
+
+        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        MgElement* firstChild = ParseBlockElementsInRange(context, inputFile, innerRange);
+        return MgCreateParentElement(
+            kMgElementKind_BlockQuote,
+            firstChild );
+    }
+#line 666 "source/parse-block.md"
+    char const* CheckUnorderedListLine(
+        MgLine* line )
+    {
+        MgReader reader;
+        InitializeLineReader( &reader, line );
+
+        // may have up to three leading spaces
+        for(int ii = 0; ii < 3; ++ii )
+        {
+            int cc = MgGetChar( &reader );
+            if( cc != ' ' )
+            {
+                MgUnGetChar( &reader, cc );
+                break;
+            }
+        }
+
+        int c = MgGetChar( &reader );
+        switch( c )
+        {
+        case '*':
+        case '+':
+        case '-':
+            break;
+
+        default:
+            return 0;
+        }
+
+        // skip white-space after the bullet
+        for(;;)
+        {
+            int d = MgGetChar( &reader );
+            if( !isspace(d) )
+            {
+                MgUnGetChar( &reader, d );
+                break;
+            }
+        }
+
+        return reader.cursor;
+    }
+
+    char const* CheckOrderedListLine(
+        MgLine* line )
+    {
+        MgReader reader;
+        InitializeLineReader( &reader, line );
+
+        // may have up to three leading spaces
+        for(int ii = 0; ii < 3; ++ii )
+        {
+            int cc = MgGetChar( &reader );
+            if( cc != ' ' )
+            {
+                MgUnGetChar( &reader, cc );
+                break;
+            }
+        }
+
+        int c = MgGetChar( &reader );
+        if( !isdigit(c) )
+            return 0;
+
+        // skip remaining digits
+        for(;;)
+        {
+            int d = MgGetChar( &reader );
+            if( !isdigit(d) )
+            {
+                MgUnGetChar( &reader, d );
+                break;
+            }
+        }
+
+        // expect a dot
+        int e = MgGetChar( &reader );
+        if( e != '.' )
+            return 0;
+
+        // skip white-space after the dot
+        for(;;)
+        {
+            int d = MgGetChar( &reader );
+            if( !isspace(d) )
+            {
+                MgUnGetChar( &reader, d );
+                break;
+            }
+        }
+
+        return reader.cursor;
+    }
+
+    char const* CheckListLineLeadingSpace(
+        MgLine* line )
+    {
+        MgReader reader;
+        InitializeLineReader( &reader, line );
+
+        for( int ii = 0; ii < 4; ++ii )
+        {
+            int c = MgGetChar( &reader );
+            if( c == '\t' )
+                break;
+            if( c != ' ' )
+            {
+                MgUnGetChar( &reader, c );
+                return 0;
+            }
+        }
+        return reader.cursor;
+    }
+
+    MgElement* ParseListItem(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange,
+        char const* (*checkLineFunc)(MgLine*) )
+    {
+        MgLine* firstLine = GetLine( ioLineRange );
+        MgLine* lastLine = firstLine;
+
+        if( !firstLine )
+            return 0;
+
+        // check the first line
+        char const* lineStart = checkLineFunc(firstLine);
+        if( !lineStart )
+            return 0;
+        firstLine->text.begin = lineStart;
+
+        // read subsequent lines of the item, until
+        MgLine* line = firstLine;
+
+        for(;;)
+        {
+            line = GetLine( ioLineRange );
+            while( line )
+            {
+                // we see an empty line, or
+                if( IsBlankLine(line) )
+                    break;
+
+                // a line that starts a new item
+                // \todo: does this need to consider other list flavors?
+                lineStart = checkLineFunc(line);
+                if(lineStart)
+                    break;
+
+                lineStart = CheckListLineLeadingSpace(line);
+                if( lineStart )
+                    line->text.begin = lineStart;
+
+                // \todo: need to trim front of line...
+
+                lastLine = line;
+                line = GetLine(ioLineRange);
+            }
+
+            // continue consuming lines until we see a non-empty line
+            while( line && IsBlankLine(line) )
+            {
+                line = GetLine(ioLineRange);
+            }
+
+            // if the next line is indented appropriately for line
+            // continuation... we continue building out the same item...
+            if( line )
+            {
+                lineStart = CheckIndentedCodeLine( line );
+                if( lineStart )
+                {
+                    line->text.begin = lineStart;
+                    lastLine = line;
+                    continue;
+                }
+            }
+            break;
+        }
+
+        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        MgElement* firstChild = ParseBlockElementsInRange( context, inputFile, innerRange );
+
+        return MgCreateParentElement(
+            kMgElementKind_ListItem,
+            firstChild );
+    }
+
+    MgElement* ParseList(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange,
+        MgElementKind kind,
+        char const* (*checkLineFunc)(MgLine*) )
+    {
+        MgElement* firstItem = ParseListItem( context, inputFile, ioLineRange, checkLineFunc );
+        MgElement* lastItem = firstItem;
+
+        if( !firstItem ) return 0;
+
+        for(;;)
+        {
+            MgElement* item = ParseListItem( context, inputFile, ioLineRange, checkLineFunc );
+            if( !item )
+                break;
+
+            lastItem->next = item;
+            lastItem = item;
+        }
+
+        return MgCreateParentElement(
+            kind,
+            firstItem );
+    }
+
+    MgElement* ParseOrderedList(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseList(
+            context, inputFile, 
+            ioLineRange,
+            kMgElementKind_OrderedList,
+            &CheckOrderedListLine );
+    }
+
+    MgElement* ParseUnorderedList(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseList(
+            context, inputFile,
+            ioLineRange,
+            kMgElementKind_UnorderedList,
+            &CheckUnorderedListLine );
+    }
+#line 941 "source/parse-block.md"
+    char const* CheckIndentedCodeLine(
+        MgLine* line )
+    {
+        // either a tab or four spaces
+        MgReader reader;
+        InitializeLineReader(&reader, line );
+
+        int c = MgGetChar( &reader );
+        if( c == '\t' )
+            return reader.cursor;
+        MgUnGetChar( &reader, c );
+
+        for( int ii = 0; ii < 4; ++ii )
+        {
+            int d = MgGetChar( &reader );
+            if( d != ' ' )
+                return 0;
+        }
+        return reader.cursor;
+    }
+
+    MgElement* ParseIndentedCode(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        MgLine* firstLine = GetLine(ioLineRange);
+        MgLine* lastLine = firstLine;
+
+        MgLine* line = firstLine;
+        for(;;)
+        {
+            if( !line )
+                break;
+
+            char const* lineStart = CheckIndentedCodeLine(line);
+            if( !lineStart )
+            {
+                if( line == firstLine )
+                    return 0; // this isn't a code block at all!
+                else
+                    break; // end of the code block
+            }
+
+            // if the line that starts the paragraph looks like a
+            // literate scrap introduction `<< foo >>=`, then end
+            // this code block so we can start a new one.
+            if( line != firstLine
+                && CheckLiterateScrapIntroductionLine(context, inputFile, lineStart, line) )
+            {
+                break;
+            }
+
+            // we are starting a paragraph within the code block
+
+            // continue consuming lines until we see an empty line
+            while( line && !IsBlankLine(line) )
+            {
+                lineStart = CheckIndentedCodeLine(line);
+                if(!lineStart)
+                    break; // end of the code element...
+
+                line->text.begin = lineStart;
+                lastLine = line;
+                line = GetLine( ioLineRange );
+            }
+
+            // continue consuming lines until we see a non-empty line
+            while( line && IsBlankLine(line) )
+            {
+                line = GetLine(ioLineRange);
+            }
+        }
+
+        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        return ParseCodeBlockBody(
+            context,
+            inputFile,
+            innerRange,
+            0, 0 ); // no way to pass in a language name
+    }
+#line 1029 "source/parse-block.md"
+    char const* CheckBracketedCodeLine(
+        MgLine* line,
+        char    c )
+    {
+        MgReader reader;
+        InitializeLineReader( &reader, line );
+
+        for( int ii = 0; ii < 3; ++ii )
+        {
+            int d = MgGetChar( &reader );
+            if( d != c )
+                return 0;
+        }
+        return reader.cursor;
+    }
+
+    MgElement* ParseBracketedCode(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange,
+        char c )
+    {
+        MgLine* openLine = GetLine( ioLineRange );
+        char const* startLang = CheckBracketedCodeLine( openLine, c );
+        if( !startLang )
+            return 0;
+        openLine->text.begin = startLang;
+
+        MgLine* firstLine = 0;
+        MgLine* lastLine = 0;
+
+        for(;;)
+        {
+            MgLine* line = GetLine( ioLineRange );
+            if( !line )
+                break; // \todo: this would make an un-terminated code block...
+            char const* end = CheckBracketedCodeLine( line, c );
+            if( end )
+            {
+                // \todo: what if there is text after the backticks?
+                // for now, we process it as an other text...
+                line->text.begin = end;
+
+                break;
+            }
+
+            if( !firstLine )
+                firstLine = line;
+            lastLine = line;
+        }
+
+        // the span *might* be empty... just in case
+        LineRange innerRange = { 0, 0 };
+        if( lastLine )
+            innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        // `openLine` begin/end gives us the language marker, if any
+        return ParseCodeBlockBody(
+            context,
+            inputFile,
+            innerRange,
+            openLine->text.begin,
+            openLine->text.end );
+    }
+
+    MgElement* ParseBracketedCode_Backtick(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseBracketedCode( context, inputFile, ioLineRange, '`' );
+    }
+
+    MgElement* ParseBracketedCode_Tilde(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseBracketedCode( context, inputFile, ioLineRange, '~' );
+    }
+#line 1114 "source/parse-block.md"
+    MgBool CheckLiterateScrapIntroductionLine(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        const char*     lineStart,
+        MgLine*         line )
+    {
+        MgString text = MgMakeString(lineStart, line->text.end);
+        MgScrapKind scrapKind = kScrapKind_Unknown;
+        char const* scrapIdBegin    = 0;
+        char const* scrapIdEnd      = 0;
+        char const* scrapNameBegin  = 0;
+        char const* scrapNameEnd    = 0;
+
+        return ParseLiterateScrapIntroduction(
+            context, inputFile, text,
+            &scrapKind,
+            &scrapIdBegin,      &scrapIdEnd,
+            &scrapNameBegin,    &scrapNameEnd );
+    }
+
+    MgElement* ParseCodeBlockBody(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange       inLineRange,
+        char const*     langBegin,
+        char const*     langEnd )
+    {
+        // check if first line looks like a
+        // literate scrap introduction
+        LineRange lineRange = inLineRange;
+        MgLine* firstLine = GetLine( &lineRange );
+
+        MgScrapKind scrapKind = kScrapKind_Unknown;
+        char const* scrapIdBegin    = 0;
+        char const* scrapIdEnd      = 0;
+        char const* scrapNameBegin  = 0;
+        char const* scrapNameEnd    = 0;
+        if( ParseLiterateScrapIntroduction(
+            context, inputFile, firstLine->text,
+            &scrapKind,
+            &scrapIdBegin,      &scrapIdEnd,
+            &scrapNameBegin,    &scrapNameEnd ) )
+        {
+            firstLine = firstLine + 1;
+        }
+        else
+        {
+            UnGetLine( &lineRange, firstLine );
+        }
+
+        MgElement* firstChild = ReadSpansInRange( context, inputFile, lineRange, kMgSpanFlags_CodeBlock );
+        MgElement* codeBlock = MgCreateParentElement(
+            kMgElementKind_CodeBlock,
+            firstChild );
+
+        if( langBegin != langEnd )
+        {
+            MgAddAttribute( codeBlock, "class", MgMakeString( langBegin, langEnd ) );
+        }
+
+        MgElement* element = codeBlock;
+        if( scrapIdBegin != 0 && inputFile->reparsing )
+        {
+            // when re-parsing a file to stream its documentation,
+            // the scrap was already registered by the first pass
+            MgScrap* scrap = inputFile->nextReparsedScrap;
+            if( scrap )
+            {
+                inputFile->nextReparsedScrap = scrap->nextInFile;
+
+                element = MgCreateParentElement(
+                    kMgElementKind_ScrapDef,
+                    element );
+
+                MgAttribute* attr = MgAddCustomAttribute( element, "$scrap" );
+                attr->scrap = scrap;
+            }
+            else
+            {
+                fprintf(stderr, "mangle: \"%s\" changed while it was being processed\n", inputFile->path);
+            }
+        }
+        else if( scrapIdBegin != 0 )
+        {
+            MgString scrapID = { scrapIdBegin, scrapIdEnd };
+            MgString scrapName = { scrapNameBegin, scrapNameEnd };
+            MgScrapFileGroup* scrapGroup = MgFindOrCreateScrapGroup(
+                context,
+                scrapKind,
+                scrapID,
+                inputFile );
+            if( scrapName.begin != scrapName.end )
+            {
+                // \todo: check that we are the first!!!
+                scrapGroup->nameGroup->name = MgReadSpanElements(context, inputFile, firstLine, scrapName, kMgSpanFlags_Default);
+            }
+
+            MgScrap* scrap = (MgScrap*) MgAllocate(kMgAllocKind_Scrap, sizeof(MgScrap));
+            scrap->fileGroup = scrapGroup;
+            scrap->sourceLoc = MgGetSourceLoc( inputFile, firstLine, firstLine->text.begin );
+            scrap->body = codeBlock;
+            scrap->compactDoc = NULL;
+            scrap->compactBody = 0;
+            scrap->ops = NULL;
+            scrap->opCount = -1;
+            scrap->next = 0;
+            scrap->nextInFile = 0;
+                
+            MgAddScrapToFileGroup( scrapGroup, scrap );
+
+            if( inputFile->lastScrap )
+            {
+                inputFile->lastScrap->nextInFile = scrap;
+            }
+            else
+            {
+                inputFile->firstScrap = scrap;
+            }
+            inputFile->lastScrap = scrap;
+
+            element = MgCreateParentElement(
+                kMgElementKind_ScrapDef,
+                element );
+
+            MgAttribute* attr = MgAddCustomAttribute( element, "$scrap" );
+            attr->scrap = scrap;
+        }
+
+
+        return element;
+    }
+#line 1248 "source/parse-block.md"
+    MgBool ParseLiterateScrapIntroduction(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgString        text,
+        MgScrapKind*    outScrapKind,
+        char const**    outScrapIdBegin,
+        char const**    outScrapIdEnd,
+        char const**    outScrapNameBegin,
+        char const**    outScrapNameEnd )
+    {
+        MgReader reader;
+        MgInitializeStringReader( &reader, text );
+
+        // Allow scrap introduction to start with
+        // comment and whitespace:
+        int c = MgGetChar( &reader );
+        switch( c )
+        {
+        default:
+            MgUnGetChar( &reader, c );
+            break;
+
+        case '/':
+            {
+                int d = MgGetChar( &reader );
+                if( d != '/' )
+                {
+                    MgUnGetChar( &reader, d );
+                    MgUnGetChar( &reader, c );
+                    break;
+                }
+
+                SkipWhiteSpace( &reader );
+                break;
+            }
+
+        // TODO: C-style "/* */" comments
+        }
+
+        if( MgGetChar(&reader) != '<' )
+            return MG_FALSE;
+        if( MgGetChar(&reader) != '<' )
+            return MG_FALSE;
+
+        // look for a possible scrap kind marker
+        char const* savedCursor = reader.cursor;
+        char const* scrapKindBegin = savedCursor;
+        char const* scrapKindEnd = 0;
+        for( ;; )
+        {
+            int c = MgGetChar( &reader );
+            if( c == ':' )
+            {
+                scrapKindEnd = reader.cursor-1;
+                break;
+            }
+
+            if( !isalpha(c) )
+                break;
+        }
+
+        MgScrapKind scrapKind = kScrapKind_Unknown;
+        if( scrapKindEnd )
+        {
+            // look for a kind
+            MgString scrapKindName = { scrapKindBegin, scrapKindEnd };
+            if( MgStringsAreEqual(scrapKindName, CString("file")) )
+            {
+                scrapKind = kScrapKind_OutputFile;
+            }
+            else if( MgStringsAreEqual(scrapKindName, CString("global")) )
+            {
+                scrapKind = kScrapKind_GlobalMacro;
+            }
+            else if( MgStringsAreEqual(scrapKindName, CString("local")) )
+            {
+                scrapKind = kScrapKind_LocalMacro;
+            }
+            else if( MgStringsAreEqual(scrapKindName, CString("raw")) )
+            {
+                scrapKind = kScrapKind_RawMacro;
+            }
+            else
+            {
+                fprintf(stderr, "unknown scrap kind: \"");
+                fwrite(scrapKindName.begin, 1, scrapKindName.end - scrapKindName.begin, stderr);
+                fprintf(stderr, "\"\n");
+            }
+        }
+        else
+        {
+            reader.cursor = savedCursor;
+        }
+
+        char const* scrapIdBegin = reader.cursor;
+
+        for(;;)
+        {
+            int c = MgGetChar(&reader);
+            if( c == -1 ) break;
+
+            if( c == '|' )
+            {
+                MgUnGetChar(&reader, c);
+                break;
+            }
+
+            if( c == '>' )
+            {
+                int d = MgGetChar(&reader);
+                MgUnGetChar(&reader, d );
+                if( d == '>' )
+                {
+                    MgUnGetChar(&reader, c);
+                    break;
+                }
+            }
+        }
+
+        char const* scrapIdEnd = reader.cursor;
+        char const* scrapNameBegin = 0;
+        char const* scrapNameEnd = 0;
+
+        int pipe = MgGetChar(&reader);
+        if( pipe != '|' )
+        {
+            MgUnGetChar(&reader, pipe);
+        }
+        else
+        {
+            scrapNameBegin = reader.cursor;
+            for(;;)
+            {
+                int c = MgGetChar(&reader);
+                if( c == -1 ) break;
+                if( c == '>' )
+                {
+                    int d = MgGetChar(&reader);
+                    MgUnGetChar(&reader, d);
+                    if( d == '>' )
+                    {
+                        MgUnGetChar(&reader, c);
+                        break;
+                    }
+                }
+            }
+            scrapNameEnd = reader.cursor;
+        }
+
+        if( MgGetChar(&reader) != '>' )
+            return MG_FALSE;
+        if( MgGetChar(&reader) != '>' )
+            return MG_FALSE;
+
+        if( MgPeekChar(&reader) == '+' )
+            MgGetChar(&reader);
+        if( MgGetChar(&reader) != '=' )
+            return MG_FALSE;
+
+        SkipWhiteSpace( &reader );
+        if( MgGetChar(&reader) != -1 )
+            return MG_FALSE;
+
+        TrimLeadingSpace(&scrapIdBegin, scrapIdEnd);
+        TrimTrailingSpace(scrapIdBegin, &scrapIdEnd);
+
+        TrimLeadingSpace(&scrapNameBegin, scrapNameEnd);
+        TrimTrailingSpace(scrapNameBegin, &scrapNameEnd);
+
+        *outScrapKind       = scrapKind;
+        *outScrapIdBegin    = scrapIdBegin;
+        *outScrapIdEnd      = scrapIdEnd;
+        *outScrapNameBegin  = scrapNameBegin;
+        *outScrapNameEnd    = scrapNameEnd;
+
+        return MG_TRUE;
+    }
+#line 1448 "source/parse-block.md"
+    MgElement* ParseHorizontalRule(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange*      ioLineRange,
+        char            c )
+    {
+        MgLine* firstLine = GetLine(ioLineRange);
+
+        MgReader reader;
+        InitializeLineReader(&reader, firstLine);
+
+        int count = 0;
+        for(;;)
+        {
+            int d = MgGetChar(&reader);
+
+            if( d == -1 )
+                break;
+
+            if( d == c )
+            {
+                ++count;
+            }
+            else if( isspace(d) )
+            {}
+            else
+            {
+                return 0;
+            }
+        }
+
+        if( count < 3 )
+            return 0;
+
+        Snip( firstLine, firstLine, ioLineRange );
+
+        return MgCreateLeafElement(
+            kMgElementKind_HorizontalRule,
+            MgMakeString(NULL, NULL) );
+    }
+
+    MgElement* ParseHorizontalRule_Hypen(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseHorizontalRule( context, inputFile, ioLineRange, '-' );
+    }
+
+    MgElement* ParseHorizontalRule_Asterisk(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseHorizontalRule( context, inputFile, ioLineRange, '*' );
+    }
+
+    MgElement* ParseHorizontalRule_Underscore(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        return ParseHorizontalRule( context, inputFile, ioLineRange, '_' );
+    }
+#line 1536 "source/parse-block.md"
+    MgBool ParseLinkDefinitionTitle(
+        MgReader*   reader,
+        char const**    outTitleBegin,
+        char const**    outTitleEnd )
+    {
+        int openTitle = MgGetChar(reader);
+        int closeTitle;
+        switch(openTitle)
+        {
+        default:
+            return MG_FALSE;
+        case '"':
+        case '\'':
+            closeTitle = openTitle;
+            break;
+        case '(':
+            closeTitle = ')';
+            break;
+        }
+
+        char const* titleBegin = reader->cursor;
+        char const* titleEnd = MgFindMatching(reader, closeTitle, 1);
+        if( !titleEnd )
+            return MG_FALSE;
+
+        // \todo: enforce that we find end of line?
+
+        *outTitleBegin = titleBegin;
+        *outTitleEnd = titleEnd;
+        return MG_TRUE;
+    }
+
+    MgElement* ParseLinkDefinition(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        MgString id;
+        MgLine* firstLine = GetLine(ioLineRange);
+
+        MgReader reader;
+        InitializeLineReader(&reader, firstLine);
+
+        // skip up to three spaces
+        for(int ii = 0; ii < 3; ++ii)
+        {
+            int c = MgGetChar(&reader);
+            if( c != ' ' )
+            {
+                MgUnGetChar(&reader, c);
+                break;
+            }
+        }
+
+        // expect a '['
+        int openBrace = MgGetChar(&reader);
+        if( openBrace != '[' )
+            return 0;
+
+        id = MgFindMatchingString(&reader, ']', 1);
+        if( !id.end )
+            return 0;
+
+        // expect a ':'
+        int colon = MgGetChar(&reader);
+        if( colon != ':' )
+            return 0;
+
+        // skip any white space
+        SkipWhiteSpace(&reader);
+
+        // allow one '<' before the link
+        int leftAngle = MgGetChar(&reader);
+        if( leftAngle != '<' )
+        {
+            MgUnGetChar(&reader, leftAngle);
+        }
+
+        // read the URL (assume it continues until white-space)
+        char const* urlBegin = reader.cursor;
+        char const* urlEnd = reader.cursor;
+        for(;;)
+        {
+            int c = MgGetChar( &reader );
+            if( c == -1 || c == '>' || isspace(c) )
+            {
+                MgUnGetChar(&reader, c);
+                break;
+            }
+            urlEnd = reader.cursor;
+        }
+
+        // expect an opening '<' to be matched by '>'
+        if( leftAngle == '<' )
+        {
+            int rightAngle = MgGetChar( &reader );
+            if( rightAngle != '>' )
+                return 0;
+        }
+
+        // \todo: should we check that the URL is non-empty?
+
+        SkipWhiteSpace(&reader);
+
+        // now look for the title
+        char const* titleBegin = 0;
+        char const* titleEnd = 0;
+        if( !MgAtEnd(&reader) )
+        {
+            ParseLinkDefinitionTitle(
+                &reader,
+                &titleBegin,
+                &titleEnd );
+        }
+        else
+        {
+            MgLine* secondLine = GetLine(ioLineRange);
+            InitializeLineReader(&reader, secondLine);
+            SkipWhiteSpace(&reader);
+
+            if( !ParseLinkDefinitionTitle(
+                &reader,
+                &titleBegin,
+                &titleEnd ) )
+            {
+                UnGetLine(ioLineRange, secondLine);
+            }
+        }
+
+        MgReferenceLink* ref = MgFindOrCreateReferenceLink(
+            inputFile,
+            id );
+
+        // \todo: how to handle redefinition?
+        ref->url.begin = urlBegin;
+        ref->url.end = urlEnd;
+        ref->title.begin = titleBegin;
+        ref->title.end = titleEnd;
+
+        // we have to return a non-NULL element to indicate
+        // a successful parse...
+        return MgCreateLeafElement(
+            kMgElementKind_Text,
+            MgMakeString(NULL, NULL));
+    }
+#line 1689 "source/parse-block.md"
+    int CountTableLinePipes(
+        MgLine*   line)
+    {
+        MgReader reader;
+        InitializeLineReader(&reader, line);
+
+        int pipeCount = 0;
+        for( ;; )
+        {
+            int c = MgGetChar(&reader);
+            if( c == -1 )
+                break;
+            else if( c == '|' )
+                ++pipeCount;
+            else if( c == '\\' )
+                MgGetChar(&reader);
+        }
+        return pipeCount;
+    }
+
+    MgElement* ParseTableCell(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgReader*   reader,
+        MgElementKind   kind )
+    {
+        char const* cellBegin   = reader->cursor;
+        char const* cellEnd     = cellBegin;
+        for( ;; )
+        {
+            cellEnd = reader->cursor;
+            int c = MgGetChar( reader );
+            if( c == '|' || c == -1 )
+            {
+                MgUnGetChar(reader, c);
+                break;
+            }
+
+            // allow escapes?
+            if( c == '\\' )
+            {
+                int d = MgGetChar(reader);
+            }
+        }
+
+        return MgCreateSpanParentFromString(
+            context, inputFile,
+            kind,
+            line,
+            MgMakeString(cellBegin, cellEnd),
+            kMgSpanFlags_Default );
+    }
+
+    MgBool ParseTableAlignments(
+        MgLine* line)
+    {
+        MgReader reader;
+        InitializeLineReader(&reader, line);
+
+        int pipeCount = 0;
+        int columnCount = 0;
+        for( ;; )
+        {
+            MgBool leftJustify = MG_FALSE;
+            MgBool rightJustify = MG_FALSE;
+
+            if( MgPeekChar(&reader) == '|' )
+            {
+                MgGetChar(&reader);
+                ++pipeCount;
+            }
+
+            if( MgPeekChar(&reader) == -1 )
+                break;
+
+            ++columnCount;
+            if( MgPeekChar(&reader) == ':' )
+            {
+                MgGetChar(&reader);
+                leftJustify = MG_TRUE;
+            }
+
+            while( MgPeekChar(&reader) == '-' )
+                MgGetChar(&reader);
+
+            if( MgPeekChar(&reader) == ':' )
+            {
+                MgGetChar(&reader);
+                rightJustify = MG_TRUE;
+            }
+
+            int next = MgPeekChar(&reader);
+            if( next != -1 && next != '|' )
+                return MG_FALSE;
+        }
+
+        return pipeCount != 0;
+    }
+
+    MgElement* ParseTableRow(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgLine*         line,
+        MgElementKind   cellKind )
+    {
+        MgReader reader;
+        InitializeLineReader( &reader, line );
+
+        // start reading cells
+        MgElement* firstCell = 0;
+        MgElement* lastCell = 0;
+        for(;;)
+        {
+            // note that this treats a pipe at the start
+            // of the line as always being a decorative pipe
+            if( MgPeekChar(&reader) == '|' )
+            {
+                MgGetChar(&reader);
+            }
+
+            // end of line?
+            //
+            // note that this always treats a pipe at the end
+            // of the line as a decorative pipe
+            if( MgPeekChar(&reader) == -1 )
+                break;
+
+            MgElement* cell = ParseTableCell(context, inputFile, line, &reader, cellKind);
+            if( lastCell )
+            {
+                lastCell->next = cell;
+            }
+            else
+            {
+                firstCell = cell;
+            }
+            lastCell = cell;
+        }
+
+        return MgCreateParentElement(
+            kMgElementKind_TableRow,
+            firstCell );
+    }
+
+    MgElement* ParseTable(
+        MgContext*    context,
+        MgInputFile*  inputFile,
+        LineRange*  ioLineRange )
+    {
+        MgLine* headerLine      = GetLine( ioLineRange );
+        MgLine* alignmentLine   = NULL;
+        MgLine* firstLine       = NULL;
+        MgLine* lastLine        = NULL;
+        LineRange innerRange;
+
+        int headerPipes = CountTableLinePipes( headerLine );
+        if( headerPipes == 0 )
+            return 0;
+
+        // \todo: how to do table cell alignment?
+        alignmentLine = GetLine( ioLineRange );
+        if( !alignmentLine || !ParseTableAlignments(alignmentLine) )
+            return 0;
+
+        // find successive lines that might be table rows
+        for(;;)
+        {
+            MgLine* line = GetLine( ioLineRange );
+            if( !line )
+                break;
+
+            int linePipes = CountTableLinePipes( line );
+            if( linePipes == 0 )
+            {
+                UnGetLine(ioLineRange, line);
+                break;
+            }
+            if( !firstLine )
+                firstLine = line;
+            lastLine = line;
+        }
+        // we need at least one line
+        if( !firstLine )
+            return 0;
+
+        innerRange = Snip( firstLine, lastLine, ioLineRange );
+
+        MgElement* firstRow = ParseTableRow(context, inputFile, headerLine, kMgElementKind_TableHeader);
+        MgElement* lastRow = firstRow;
+        for( MgLine* line = innerRange.begin; line != innerRange.end; ++line )
+        {
+            MgElement* row = ParseTableRow(context, inputFile, line, kMgElementKind_TableCell);
+            lastRow->next = row;
+            lastRow = row;
+        }
+
+        return MgCreateParentElement(
+            kMgElementKind_Table,
+            firstRow );
+    }
+#line 1896 "source/parse-block.md"
+    MgElement* ParseMetaData(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        LineRange*      ioLineRange )
+    {
+        MgLine* firstLine = GetLine( ioLineRange );
+        if( !firstLine )
+            return NULL;
+
+        MgReader reader;
+        InitializeLineReader( &reader, firstLine );
+
+        // meta-data line can't start with whitespace
+        if( isspace(MgPeekChar(&reader)) )
+            return NULL;
+
+        // read until a ':'
+        MgString key = MgFindMatchingString(&reader, ':', 1);
+        if( !key.end )
+            return NULL;
+
+        MgString value = MgMakeString(reader.cursor, firstLine->text.end);
+        TrimTrailingSpace(value.begin, &value.end);
+        TrimLeadingSpace(&value.begin, value.end);
+
+        MgElement* firstChild = MgCreateLeafElement(kMgElementKind_Text, value);
+        MgElement* lastChild = firstChild;
+
+        for(;;)
+        {
+            MgLine* line = GetLine( ioLineRange );
+            if( !line )
+                break;
+
+            InitializeLineReader( &reader, line );
+            if( !isspace(MgPeekChar(&reader)) )
+            {
+                UnGetLine( ioLineRange, line );
+                break;
+            }
+
+            value = line->text;
+            TrimTrailingSpace(value.begin, &value.end);
+            TrimLeadingSpace(&value.begin, value.end);
+
+            MgElement* child = MgCreateLeafElement(kMgElementKind_Text, value);
+            lastChild->next = child;
+            lastChild = child;
         }
-        FlushSpan( writer );
+
+        MgElement* element = MgCreateParentElement(
+            kMgElementKind_MetaData,
+            firstChild );
+        MgAddAttribute(element, "$key", key);
+        return element;
     }
-    
+
+
     /*
-    Read span-level elements from the range of lines given by
-    `beginLines` and `endLines`, using the given flags. The range
-    of lines given should belong to `inputFile`, which should be
-    loaded in `context`.
+    Like `ParseBlockElements`, but only handles meta-data elements, and
+    not general Markdown document content.
     */
-    MgElement* MgReadSpanElementsFromLines(
+    MgElement* MgParseMetaDataElements(
         MgContext*      context,
         MgInputFile*    inputFile,
         MgLine*         beginLines,
-        MgLine*         endLines,
-        MgSpanFlags       flags )
+        MgLine*         endLines )
     {
-        SpanWriter writer;
-        InitializeSpanWriter( &writer );
-    
-        for( MgLine* line = beginLines; line != endLines; ++line )
+        MgElement* firstElement = NULL;
+        MgElement* lastElement  = NULL;
+
+        LineRange lineRange = { beginLines, endLines };
+        for(;;)
         {
-            ReadLineSpans( context, inputFile, line, line->text.begin, line->text.end, flags, &writer );
-            MgElement* newLine = MgCreateLeafElement(
-                kMgElementKind_NewLine,
-                MgTerminatedString("\n"));
-            AddSpanElement( &writer, newLine );
+            SkipEmptyLines(&lineRange);
+            if( lineRange.begin == lineRange.end )
+                break;
+
+            LineRange savedLineRange = lineRange;
+            MgElement* element = ParseMetaData(context, inputFile, &lineRange);
+            if( !element )
+            {
+                fprintf(stderr, "bad metadata line\n");
+                // if we failed to parse meta-data, skip a line and keep trying
+                lineRange = savedLineRange;
+                ++lineRange.begin;            
+                continue;
+            }
+
+            if( lastElement )
+            {
+                lastElement->next = element;
+            }
+            else
+            {
+                firstElement = element;
+            }
+            lastElement = element;
         }
-        return writer.firstElement;
+
+        return firstElement;    
     }
-    
-#line 157 "source/main.md"
-                                      
-    
-#line 2109 "source/parse-block.md"
-    
-#line 34 "source/parse-block.md"
-    typedef struct LineRangeT
+#line 120 "source/parse-block.md"
+    BLOCK_PARSE_FUNC(ParseBlockElement)
     {
-        MgLine* begin;
-        MgLine* end;
-    } LineRange;
-    
-#line 101 "source/parse-block.md"
-    #define BLOCK_PARSE_FUNC(Name) \
-        MgElement* Name( MgContext* context, MgInputFile* inputFile, LineRange* ioLineRange )
-    typedef BLOCK_PARSE_FUNC((*BlockParseFunc));
-    
-#line 2109 "source/parse-block.md"
-                                 
-    
-#line 21 "source/parse-block.md"
-    MgElement* ParseBlockElement(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange*      ioLineRange );
-    
-    MgElement* ParseBlockElementsInRange(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange       lineRange );
-    
-#line 342 "source/parse-block.md"
-    MgElement* ParseSetextHeader(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange*      ioLineRange,
-        char            c,
-        MgElementKind   kind );
-    
-#line 869 "source/parse-block.md"
-    MgElement* ParseCodeBlockBody(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange       inLineRange,
-        char const*     langBegin,
-        char const*     langEnd );
-    
-#line 2101 "source/parse-block.md"
-    char const* CheckIndentedCodeLine(
-        MgLine* line );
-    
-#line 2110 "source/parse-block.md"
-                                        
-    
-#line 272 "source/parse-block.md"
-    MgBool IsBlankLine( MgLine* line )
+        static const BlockParseFunc kBlockParseFuncs[] = {
+            
+#line 204 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseLinkDefinition),
+    MG_PARSER_ENTRY(ParseTable),
+    MG_PARSER_ENTRY(ParseBlockLevelHtml),
+    MG_PARSER_ENTRY(ParseBlockQuote),
+    MG_PARSER_ENTRY(ParseIndentedCode),
+    MG_PARSER_ENTRY(ParseBracketedCode_Backtick),
+    MG_PARSER_ENTRY(ParseBracketedCode_Tilde),
+    MG_PARSER_ENTRY(ParseAtxHeader),
+#line 217 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseHorizontalRule_Hypen),
+    MG_PARSER_ENTRY(ParseHorizontalRule_Asterisk),
+    MG_PARSER_ENTRY(ParseHorizontalRule_Underscore),
+#line 222 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseOrderedList),
+    MG_PARSER_ENTRY(ParseUnorderedList),
+#line 229 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseSetextHeader1),
+    MG_PARSER_ENTRY(ParseSetextHeader2),
+#line 237 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseDefaultParagraph),
+#line 124 "source/parse-block.md"
+        };
+        
+#line 172 "source/parse-block.md"
+    #if MG_PARSER_COUNTERS
+    #undef MG_PARSER_ENTRY
+    #define MG_PARSER_ENTRY(func) #func
+        static char const* const kBlockParseFuncNames[] = {
+            
+#line 204 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseLinkDefinition),
+    MG_PARSER_ENTRY(ParseTable),
+    MG_PARSER_ENTRY(ParseBlockLevelHtml),
+    MG_PARSER_ENTRY(ParseBlockQuote),
+    MG_PARSER_ENTRY(ParseIndentedCode),
+    MG_PARSER_ENTRY(ParseBracketedCode_Backtick),
+    MG_PARSER_ENTRY(ParseBracketedCode_Tilde),
+    MG_PARSER_ENTRY(ParseAtxHeader),
+#line 217 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseHorizontalRule_Hypen),
+    MG_PARSER_ENTRY(ParseHorizontalRule_Asterisk),
+    MG_PARSER_ENTRY(ParseHorizontalRule_Underscore),
+#line 222 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseOrderedList),
+    MG_PARSER_ENTRY(ParseUnorderedList),
+#line 229 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseSetextHeader1),
+    MG_PARSER_ENTRY(ParseSetextHeader2),
+#line 237 "source/parse-block.md"
+    MG_PARSER_ENTRY(ParseDefaultParagraph),
+#line 177 "source/parse-block.md"
+        };
+    #undef MG_PARSER_ENTRY
+    #define MG_PARSER_ENTRY(func) &func
+    #endif
+#line 127 "source/parse-block.md"
+        BlockParseFunc const* funcCursor = &kBlockParseFuncs[0];
+        for(;;)
+        {
+            
+#line 141 "source/parse-block.md"
+    LineRange lineRange = *ioLineRange;
+#line 150 "source/parse-block.md"
+    #if MG_PARSER_COUNTERS
+    double attemptStart = MgGetWallSeconds();
+    #endif
+#line 143 "source/parse-block.md"
+    MgElement* element = (*funcCursor)( context, inputFile, &lineRange );
+#line 155 "source/parse-block.md"
+    #if MG_PARSER_COUNTERS
+    {
+        long long bytes = 0;
+        if( element )
+        {
+            for( MgLine* line = ioLineRange->begin; line != lineRange.begin; ++line )
+                bytes += line->text.end - line->text.begin;
+        }
+        int index = (int)(funcCursor - &kBlockParseFuncs[0]);
+        MgCountParseAttempt( gMgBlockParserCounters, index, kBlockParseFuncNames[index],
+            inputFile, element != NULL, bytes, MgGetWallSeconds() - attemptStart );
+    }
+    #endif
+#line 131 "source/parse-block.md"
+            
+#line 186 "source/parse-block.md"
+    if( element )
+    {
+        *ioLineRange = lineRange;            
+        return element;
+    }
+#line 132 "source/parse-block.md"
+            ++funcCursor;
+        }
+    }
+#line 7 "source/writer.md"
+    typedef struct MgWriterT MgWriter;
+#line 12 "source/writer.md"
+    typedef void (*MgPutCharFunc)( MgWriter*, int );
+#line 25 "source/writer.md"
+    struct MgWriterT
+    {
+        MgPutCharFunc   putCharFunc;
+        void*           userData;
+    };
+#line 34 "source/writer.md"
+    void MgPutChar(
+        MgWriter*   writer,
+        int         value )
+    {
+        writer->putCharFunc( writer, value );
+    }
+#line 46 "source/writer.md"
+    void MgWriteString(
+        MgWriter* writer,
+        MgString  string )
+    {
+        char const* cursor = string.begin;
+        while( cursor != string.end )
+            MgPutChar( writer, *cursor++ );
+    }
+#line 58 "source/writer.md"
+    void MgWriteCString(
+        MgWriter*   writer,
+        char const* text)
+    {
+        char const* cursor = text;
+        while( *cursor )
+            MgPutChar( writer, *cursor++ );
+    }
+#line 75 "source/writer.md"
+    void MemoryWriter_PutChar(
+        MgWriter* writer,
+        int     value )
+    {
+        char* cursor = (char*) writer->userData;
+        *cursor++ = (char) value;
+        writer->userData = cursor;
+    }
+#line 87 "source/writer.md"
+    void MgInitializeMemoryWriter(
+        MgWriter*   writer,
+        void*       data )
+    {
+        writer->putCharFunc = &MemoryWriter_PutChar;
+        writer->userData    = data;
+    }
+#line 105 "source/writer.md"
+    void CountingWriter_PutChar(
+        MgWriter* writer,
+        int     value )
+    {
+        int* counter = (int*) writer->userData;
+        ++(*counter);
+    }
+#line 117 "source/writer.md"
+    void MgInitializeCountingWriter(
+        MgWriter* writer,
+        int*    counter )
     {
-        char const* cursor = line->text.begin;
-        char const* end = line->text.end;
-        while( cursor != end )
+        writer->putCharFunc = &CountingWriter_PutChar;
+        writer->userData = counter;
+        *counter = 0;
+    }
+#line 17 "source/rope.md"
+    typedef struct MgRopeChunkT MgRopeChunk;
+    struct MgRopeChunkT
+    {
+        MgRopeChunk*    next;           /* previously-filled chunks */
+        size_t          capacity;       /* bytes of data, which follow this header */
+        size_t          used;
+    };
+
+    typedef struct MgRopeT
+    {
+        MgString*       segments;
+        size_t          segmentCount;
+        size_t          segmentCapacity;
+        long long       size;           /* total bytes in all segments */
+        MgRopeChunk*    chunk;          /* chunk that generated bytes are going into */
+        size_t          chunkSize;      /* size of chunks to allocate */
+    } MgRope;
+
+    enum
+    {
+        kMgRopeChunkSize = 64 * 1024,
+    };
+
+    void MgInitializeRope(
+        MgRope* rope )
+    {
+        rope->segments          = NULL;
+        rope->segmentCount      = 0;
+        rope->segmentCapacity   = 0;
+        rope->size              = 0;
+        rope->chunk             = NULL;
+        rope->chunkSize         = kMgRopeChunkSize;
+    }
+
+    void MgFreeRope(
+        MgRope* rope )
+    {
+        MgFree(kMgAllocKind_Rope, rope->segments, rope->segmentCapacity * sizeof(MgString));
+        MgRopeChunk* chunk = rope->chunk;
+        while( chunk )
         {
-            if( !isspace(*cursor) )
-                return MG_FALSE;
-            ++cursor;
+            MgRopeChunk* next = chunk->next;
+            MgFree(kMgAllocKind_Rope, chunk, sizeof(MgRopeChunk) + chunk->capacity);
+            chunk = next;
         }
-        return MG_TRUE;
+        MgInitializeRope( rope );
     }
-    
-#line 1917 "source/parse-block.md"
-    void SkipEmptyLines(
-        LineRange*  ioLineRange )
+
+    static char* MgGetRopeChunkData(
+        MgRopeChunk*    chunk )
     {
-        for(;;)
+        return (char*) (chunk + 1);
+    }
+
+    static MgString* MgAddRopeSegment(
+        MgRope* rope )
+    {
+        if( rope->segmentCount == rope->segmentCapacity )
         {
-            MgLine* begin = ioLineRange->begin;
-            if( begin == ioLineRange->end )
-                return;
-            if( !IsBlankLine(begin) )
-                return;
-                
-            ioLineRange->begin = begin + 1;
+            size_t capacity = rope->segmentCapacity ? 2 * rope->segmentCapacity : 256;
+            MgString* segments = (MgString*) MgAllocate(kMgAllocKind_Rope, capacity * sizeof(MgString));
+            if( rope->segmentCount )
+                memcpy(segments, rope->segments, rope->segmentCount * sizeof(MgString));
+            MgFree(kMgAllocKind_Rope, rope->segments, rope->segmentCapacity * sizeof(MgString));
+            rope->segments          = segments;
+            rope->segmentCapacity   = capacity;
         }
+        return &rope->segments[rope->segmentCount++];
     }
-    
-#line 1935 "source/parse-block.md"
-    MgElement* ReadSpansInRange(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange       lines,
-        MgSpanFlags       flags)
+#line 94 "source/rope.md"
+    char* MgReserveRopeBytes(
+        MgRope* rope,
+        size_t  size )
     {
-        return MgReadSpanElementsFromLines(
-            context,
-            inputFile,
-            lines.begin,
-            lines.end,
-            flags );
+        MgRopeChunk* chunk = rope->chunk;
+        if( !chunk || chunk->capacity - chunk->used < size )
+        {
+            size_t capacity = size > rope->chunkSize ? size : rope->chunkSize;
+            chunk = (MgRopeChunk*) MgAllocate(kMgAllocKind_Rope, sizeof(MgRopeChunk) + capacity);
+            chunk->next     = rope->chunk;
+            chunk->capacity = capacity;
+            chunk->used     = 0;
+            rope->chunk     = chunk;
+        }
+
+        char* data = MgGetRopeChunkData(chunk) + chunk->used;
+        chunk->used += size;
+        rope->size  += size;
+
+        MgString* last = rope->segmentCount ? &rope->segments[rope->segmentCount - 1] : NULL;
+        if( last && last->end == data )
+        {
+            last->end = data + size;
+        }
+        else
+        {
+            MgString* segment = MgAddRopeSegment( rope );
+            *segment = MgMakeString(data, data + size);
+        }
+        return data;
     }
-    
-    MgBool LineIsAll(
-        MgLine* line,
-        char    c )
+
+    void MgAppendRopeBytes(
+        MgRope*     rope,
+        char const* data,
+        size_t      size )
+    {
+        if( size )
+            memcpy(MgReserveRopeBytes(rope, size), data, size);
+    }
+#line 147 "source/rope.md"
+    void MgAppendRopeText(
+        MgRope*     rope,
+        MgString    text,
+        MgString    bounds )
+    {
+        size_t size = text.end - text.begin;
+        if( !size )
+            return;
+        rope->size += size;
+
+        size_t count = rope->segmentCount;
+        MgString* last = count ? &rope->segments[count - 1] : NULL;
+        if( last && last->end == text.begin )
+        {
+            last->end = text.end;
+            return;
+        }
+
+        MgRopeChunk* chunk = rope->chunk;
+        if( count >= 2 && chunk && last->end == MgGetRopeChunkData(chunk) + chunk->used )
+        {
+            MgString* previous = &rope->segments[count - 2];
+            size_t gap = last->end - last->begin;
+            if( previous->begin >= bounds.begin && text.end <= bounds.end
+                && previous->end + gap == text.begin
+                && memcmp(previous->end, last->begin, gap) == 0 )
+            {
+                previous->end = text.end;
+                chunk->used -= gap;
+                rope->segmentCount--;
+                return;
+            }
+        }
+
+        MgString* segment = MgAddRopeSegment( rope );
+        *segment = text;
+    }
+#line 192 "source/rope.md"
+    void MgAppendRope(
+        MgRope* rope,
+        MgRope* other )
     {
-        char const* cursor  = line->text.begin;
-        char const* end     = line->text.end;
-        if( cursor == end )
-            return MG_FALSE;
-        while( cursor != end )
+        for( size_t ii = 0; ii < other->segmentCount; ++ii )
         {
-            if( *cursor != c )
+            MgString segment = other->segments[ii];
+            MgString* last = rope->segmentCount ? &rope->segments[rope->segmentCount - 1] : NULL;
+            if( last && last->end == segment.begin )
+                last->end = segment.end;
+            else
+                *MgAddRopeSegment( rope ) = segment;
+        }
+        rope->size += other->size;
+
+        MgRopeChunk* chunks = other->chunk;
+        if( chunks )
+        {
+            MgRopeChunk* lastChunk = chunks;
+            while( lastChunk->next )
+                lastChunk = lastChunk->next;
+            if( rope->chunk )
             {
-                return MG_FALSE;
+                lastChunk->next = rope->chunk->next;
+                rope->chunk->next = chunks;
+            }
+            else
+            {
+                rope->chunk = chunks;
             }
-            ++cursor;
         }
-        return MG_TRUE;
+        other->chunk = NULL;
+        MgFreeRope( other );
     }
-    
-    MgLine* GetLine(
-        LineRange*  ioLineRange )
+#line 87 "source/compact.md"
+    static MgNode MgMakeElementNode(
+        MgElement*  element )
     {
-        if( ioLineRange->begin == ioLineRange->end )
-            return 0;
-    
-        return ioLineRange->begin++;
+        MgNode node;
+        node.element    = element;
+        node.doc        = NULL;
+        node.index      = 0;
+        node.limit      = 0;
+        return node;
     }
-    
-    void UnGetLine(
-        LineRange*  ioLineRange,
-        MgLine*     line )
+
+    static MgNode MgMakeCompactNode(
+        MgCompactDoc*   doc,
+        uint32_t        index,
+        uint32_t        limit )
+    {
+        MgNode node;
+        node.element    = NULL;
+        node.doc        = doc;
+        node.index      = index;
+        node.limit      = limit;
+        return node;
+    }
+
+    static MgBool MgIsNullNode(
+        MgNode  node )
     {
-        if( !line ) return;
-        assert(line == (ioLineRange->begin-1));
-        ioLineRange->begin--;
+        if( node.doc )
+            return node.index >= node.limit;
+        return node.element == NULL;
     }
-    
-    LineRange MgInclusiveLineRange(
-        MgLine* first,
-        MgLine* last)
+#line 122 "source/compact.md"
+    static MgElementKind MgGetNodeKind(
+        MgNode  node )
     {
-        LineRange range = { first, last + 1 };
-        return range;
+        if( node.doc )
+            return (MgElementKind) node.doc->nodes[node.index].kind;
+        return node.element->kind;
     }
-    
-    LineRange Snip(
-        MgLine*     firstLine,
-        MgLine*     lastLine,
-        LineRange*  ioLineRange )
+
+    static MgBool MgNodeEndsLine(
+        MgNode  node )
     {
-        assert(firstLine);
-        assert(lastLine);
-        ioLineRange->begin = lastLine + 1;
-        return MgInclusiveLineRange( firstLine, lastLine );
+        if( node.doc )
+            return (node.doc->nodes[node.index].flags & kMgCompactNodeFlag_EndsLine) != 0;
+        return (node.element->flags & kMgElementFlag_EndsLine) != 0;
     }
-    
-    //
-    //
-    //
-    
-    
-    
-    
-    
-    void TrimLeadingSpace(
-        char const** ioBegin,
-        char const* end )
+
+    static MgString MgGetNodeText(
+        MgNode  node )
     {
-        char const* begin = *ioBegin;
-        while( begin != end && isspace(*begin) )
-            ++begin;
-        *ioBegin = begin;
+        if( node.doc )
+        {
+            MgCompactNode const* compact = &node.doc->nodes[node.index];
+            if( compact->flags & kMgCompactNodeFlag_ExternalText )
+                return node.doc->externalText[compact->textOffset];
+
+            char const* begin = node.doc->inputFile->text.begin + compact->textOffset;
+            return MgMakeString(begin, begin + compact->textLength);
+        }
+        return node.element->text;
     }
-    
-    void TrimTrailingSpace(
-        char const* begin,
-        char const** ioEnd )
+
+    static MgAttribute* MgGetNodeAttributes(
+        MgNode  node )
     {
-        char const* end = *ioEnd;
-        while( end != begin && isspace(*(end -1)) )
-            --end;
-        *ioEnd = end;
+        if( node.doc )
+        {
+            uint32_t firstAttr = node.doc->nodes[node.index].firstAttr;
+            if( firstAttr == kMgCompactNoAttr )
+                return NULL;
+            return &node.doc->attrs[firstAttr];
+        }
+        return node.element->firstAttr;
     }
-    
-    void TrimTrailingChar(
-        char const* begin,
-        char const** ioEnd,
-        char            c )
+
+    static MgNode MgGetFirstChild(
+        MgNode  node )
     {
-        char const* end = *ioEnd;
-        while( end != begin && (*(end -1) == c) )
-            --end;
-        *ioEnd = end;
+        if( node.doc )
+            return MgMakeCompactNode(node.doc, node.index + 1, node.doc->nodes[node.index].end);
+        return MgMakeElementNode(node.element->firstChild);
     }
-    
-    void InitializeLineReader(
-        MgReader*   reader,
-        MgLine*         line )
+
+    static MgNode MgGetNextSibling(
+        MgNode  node )
     {
-        MgInitializeStringReader( reader, line->text );
+        if( node.doc )
+            return MgMakeCompactNode(node.doc, node.doc->nodes[node.index].end, node.limit);
+        return MgMakeElementNode(node.element->next);
     }
-    
-    int GetIndent(
-        MgLine* line )
+#line 185 "source/compact.md"
+    MgAttribute* MgFindNodeAttribute(
+        MgNode      node,
+        char const* id )
     {
-        char const* cursor = line->text.begin;
-        char const* end = line->text.end;
-    
-        int indent = 0;
-        while( cursor != end )
+        MgString idString = { id, id + strlen(id) };
+        for(MgAttribute* attr = MgGetNodeAttributes(node); attr; attr = attr->next)
         {
-            char c = *cursor;
-            if( c == ' ' )
-            {
-                indent += 1;
-            }
-            else if( c == '\t' )
+            if( MgStringsAreEqual(attr->id, idString) )
+                return attr;
+        }
+        return 0;
+    }
+#line 201 "source/compact.md"
+    MgNode MgGetDocumentNodes(
+        MgInputFile*    inputFile )
+    {
+        if( inputFile->compact )
+            return MgMakeCompactNode(inputFile->compact, 0, inputFile->compact->nodeCount);
+        return MgMakeElementNode(inputFile->firstElement);
+    }
+
+    MgNode MgGetScrapBody(
+        MgScrap*    scrap )
+    {
+        if( scrap->compactDoc )
+        {
+            uint32_t scrapDef = scrap->compactBody - 1;
+            return MgMakeCompactNode(scrap->compactDoc, scrap->compactBody, scrap->compactDoc->nodes[scrapDef].end);
+        }
+        return MgMakeElementNode(scrap->body);
+    }
+#line 226 "source/compact.md"
+    typedef struct MgCompactCountsT
+    {
+        uint64_t    nodes;
+        uint64_t    attrs;
+        uint64_t    externalText;
+    } MgCompactCounts;
+
+    static MgBool MgIsTextInFile(
+        MgInputFile*    inputFile,
+        MgString        text )
+    {
+        return text.begin >= inputFile->text.begin
+            && text.end <= inputFile->text.end;
+    }
+
+    static void MgCountCompactNodes(
+        MgInputFile*        inputFile,
+        MgElement*          firstElement,
+        MgCompactCounts*    counts )
+    {
+        for( MgElement* element = firstElement; element; element = element->next )
+        {
+            counts->nodes++;
+            for( MgAttribute* attr = element->firstAttr; attr; attr = attr->next )
+                counts->attrs++;
+            if( !MgIsTextInFile(inputFile, element->text) )
+                counts->externalText++;
+            MgCountCompactNodes(inputFile, element->firstChild, counts);
+        }
+    }
+#line 262 "source/compact.md"
+    static void MgFillCompactNodes(
+        MgCompactDoc*   doc,
+        MgElement*      firstElement )
+    {
+        MgInputFile* inputFile = doc->inputFile;
+        for( MgElement* element = firstElement; element; element = element->next )
+        {
+            uint32_t index = doc->nodeCount++;
+            MgCompactNode* node = &doc->nodes[index];
+            node->kind  = (uint8_t) element->kind;
+            node->flags = 0;
+            if( element->flags & kMgElementFlag_EndsLine )
+                node->flags |= kMgCompactNodeFlag_EndsLine;
+
+            if( MgIsTextInFile(inputFile, element->text) )
             {
-                indent += 4;
+                node->textOffset = (uint32_t)(element->text.begin - inputFile->text.begin);
+                node->textLength = (uint32_t)(element->text.end - element->text.begin);
             }
             else
             {
-                break;
+                node->flags |= kMgCompactNodeFlag_ExternalText;
+                node->textOffset = doc->externalTextCount;
+                node->textLength = 0;
+                doc->externalText[doc->externalTextCount++] = element->text;
             }
-            ++cursor;
+
+            
+#line 299 "source/compact.md"
+    node->firstAttr = element->firstAttr ? doc->attrCount : kMgCompactNoAttr;
+    for( MgAttribute* attr = element->firstAttr; attr; attr = attr->next )
+    {
+        MgAttribute* copy = &doc->attrs[doc->attrCount++];
+        *copy = *attr;
+        copy->next = attr->next ? copy + 1 : NULL;
+
+        if( element->kind == kMgElementKind_ScrapDef
+            && MgStringsAreEqual(attr->id, MgTerminatedString("$scrap")) )
+        {
+            attr->scrap->compactDoc = doc;
+            attr->scrap->compactBody = index + 1;
         }
-        return indent;
     }
-    
-    MgString CString(char const* text)
+#line 291 "source/compact.md"
+            MgFillCompactNodes(doc, element->firstChild);
+            doc->nodes[index].end = doc->nodeCount;
+        }
+    }
+#line 318 "source/compact.md"
+    MgCompactDoc* MgBuildCompactDoc(
+        MgInputFile*    inputFile )
+    {
+        if( (uint64_t)(inputFile->text.end - inputFile->text.begin) >= kMgCompactNoAttr )
+            return NULL;
+
+        MgCompactCounts counts = { 0, 0, 0 };
+        MgCountCompactNodes(inputFile, inputFile->firstElement, &counts);
+        if( counts.nodes >= kMgCompactNoAttr || counts.attrs >= kMgCompactNoAttr )
+            return NULL;
+
+        MgCompactDoc* doc = (MgCompactDoc*) MgAllocate(kMgAllocKind_CompactTree, sizeof(MgCompactDoc));
+        doc->inputFile          = inputFile;
+        // (each array gets at least one byte, so that empty documents still get valid allocations)
+        doc->nodes              = (MgCompactNode*) MgAllocate(kMgAllocKind_CompactTree, (size_t) counts.nodes * sizeof(MgCompactNode) + 1);
+        doc->attrs              = (MgAttribute*) MgAllocate(kMgAllocKind_CompactTree, (size_t) counts.attrs * sizeof(MgAttribute) + 1);
+        doc->externalText       = (MgString*) MgAllocate(kMgAllocKind_CompactTree, (size_t) counts.externalText * sizeof(MgString) + 1);
+        doc->nodeCount          = 0;
+        doc->attrCount          = 0;
+        doc->externalTextCount  = 0;
+
+        MgFillCompactNodes(doc, inputFile->firstElement);
+        return doc;
+    }
+#line 349 "source/compact.md"
+    static void MgFreeElementAttributes(
+        MgElement*  element )
+    {
+        MgAttribute* attr = element->firstAttr;
+        while( attr )
+        {
+            MgAttribute* nextAttr = attr->next;
+            MgFree(kMgAllocKind_Attribute, attr, sizeof(MgAttribute));
+            attr = nextAttr;
+        }
+        element->firstAttr = NULL;
+    }
+
+    static void MgFreeElements(
+        MgElement*  firstElement )
+    {
+        MgElement* element = firstElement;
+        while( element )
+        {
+            MgElement* next = element->next;
+            MgFreeElementAttributes(element);
+            MgFreeElements(element->firstChild);
+            MgFree(kMgAllocKind_Element, element, sizeof(MgElement));
+            element = next;
+        }
+    }
+#line 380 "source/compact.md"
+    void MgCompactInputFile(
+        MgContext*      context,
+        MgInputFile*    inputFile )
+    {
+        MgCompactDoc* doc = MgBuildCompactDoc(inputFile);
+        if( !doc )
+            return;
+
+        for( uint32_t ii = 0; ii < doc->attrCount; ++ii )
+        {
+            MgAttribute* attr = &doc->attrs[ii];
+            if( MgStringsAreEqual(attr->id, MgTerminatedString("$scrap")) )
+                attr->scrap->body = NULL;
+        }
+
+        MgFreeElements(inputFile->firstElement);
+        inputFile->firstElement = NULL;
+        inputFile->compact = doc;
+    }
+#line 20 "source/output-dir.md"
+    typedef struct MgOutputFileT
+    {
+        char*       path;
+        size_t      pathSize;   /* including the terminating zero */
+        char const* name;       /* last component of `path` */
+        int         directory;  /* handle of the directory holding it, or -1 */
+    } MgOutputFile;
+
+    static MgBool MgIsPathSeparator(
+        char    c )
+    {
+    #ifdef _WIN32
+        return c == '/' || c == '\\';
+    #else
+        return c == '/';
+    #endif
+    }
+
+    static MgBool MgIsAbsolutePath(
+        MgString    path )
+    {
+        if( path.begin == path.end )
+            return MG_FALSE;
+    #ifdef _WIN32
+        if( path.end - path.begin >= 2 && path.begin[1] == ':' )
+            return MG_TRUE;
+    #endif
+        return MgIsPathSeparator(path.begin[0]);
+    }
+
+    void MgInitializeOutputFile(
+        MgOutputFile*   file,
+        char const*     root,
+        MgString        name,
+        char const*     suffix )
+    {
+        if( !root || MgIsAbsolutePath(name) )
+            root = "";
+        size_t rootSize = strlen(root);
+        size_t nameSize = name.end - name.begin;
+        size_t suffixSize = strlen(suffix);
+        MgBool addSeparator = rootSize && !MgIsPathSeparator(root[rootSize - 1]);
+
+        file->pathSize = rootSize + addSeparator + nameSize + suffixSize + 1;
+        file->path = (char*) MgAllocate(kMgAllocKind_OutputPath, file->pathSize);
+
+        char* cursor = file->path;
+        memcpy(cursor, root, rootSize);
+        cursor += rootSize;
+        if( addSeparator )
+            *cursor++ = '/';
+        memcpy(cursor, name.begin, nameSize);
+        cursor += nameSize;
+        memcpy(cursor, suffix, suffixSize + 1);
+
+        char const* nameStart = file->path + file->pathSize - 1;
+        while( nameStart != file->path && !MgIsPathSeparator(nameStart[-1]) )
+            --nameStart;
+        file->name      = nameStart;
+        file->directory = -1;
+    }
+
+    void MgFreeOutputFile(
+        MgOutputFile*   file )
+    {
+        MgFree(kMgAllocKind_OutputPath, file->path, file->pathSize);
+        file->path = NULL;
+    }
+#line 93 "source/output-dir.md"
+    void MgInitializeOutputFileWithSuffix(
+        MgOutputFile*       file,
+        MgOutputFile const* other,
+        char const*         suffix )
+    {
+        MgInitializeOutputFile( file, NULL, MgTerminatedString(other->path), suffix );
+        file->directory = other->directory;
+    }
+#line 109 "source/output-dir.md"
+    typedef struct MgOutputDirectoryT MgOutputDirectory;
+    struct MgOutputDirectoryT
+    {
+        MgOutputDirectory*  next;       /* in the same bucket */
+        char*               path;
+        size_t              size;
+        MgHash              pathHash;
+        int                 fd;         /* -1 if not open */
+        MgBool              failed;     /* couldn't be opened or created */
+    };
+
+    enum
     {
-        MgString string = { text, text + strlen(text) };
-        return string;
+        kMgOutputDirectoryBucketCount   = 256,
+        kMgMaxOpenOutputDirectories     = 256,
+    };
+
+    struct MgOutputDirectoriesT
+    {
+        MgOutputDirectory*  buckets[kMgOutputDirectoryBucketCount];
+        int                 openCount;
+    };
+
+    static MgOutputDirectory* MgFindOutputDirectory(
+        MgOutputDirectories*    directories,
+        char const*             path,
+        size_t                  size,
+        MgHash                  pathHash )
+    {
+        MgOutputDirectory* directory = directories->buckets[pathHash % kMgOutputDirectoryBucketCount];
+        for( ; directory; directory = directory->next )
+        {
+            if( directory->pathHash == pathHash
+                && directory->size == size
+                && memcmp(directory->path, path, size) == 0 )
+                return directory;
+        }
+        return NULL;
     }
-    
-    static void SkipWhiteSpace(
-        MgReader* reader )
+
+    static MgOutputDirectory* MgAddOutputDirectory(
+        MgOutputDirectories*    directories,
+        char const*             path,
+        size_t                  size,
+        MgHash                  pathHash )
+    {
+        MgOutputDirectory* directory = (MgOutputDirectory*) MgAllocate(kMgAllocKind_OutputPath, sizeof(MgOutputDirectory));
+        directory->path = (char*) MgAllocate(kMgAllocKind_OutputPath, size + 1);
+        memcpy(directory->path, path, size);
+        directory->path[size]   = 0;
+        directory->size         = size;
+        directory->pathHash     = pathHash;
+        directory->fd           = -1;
+        directory->failed       = MG_FALSE;
+
+        MgOutputDirectory** bucket = &directories->buckets[pathHash % kMgOutputDirectoryBucketCount];
+        directory->next = *bucket;
+        *bucket = directory;
+        return directory;
+    }
+#line 175 "source/output-dir.md"
+    void MgFinishOutputJobs(
+        MgContext*  context );
+
+    void MgCloseOutputDirectories(
+        MgContext*  context )
     {
-        for(;;)
+        MgOutputDirectories* directories = context->outputDirectories;
+        if( !directories )
+            return;
+
+        MgFinishOutputJobs( context );
+        for( int ii = 0; ii < kMgOutputDirectoryBucketCount; ++ii )
         {
-            int c = MgGetChar(reader);
-            if( !isspace(c) )
+            for( MgOutputDirectory* directory = directories->buckets[ii]; directory; directory = directory->next )
             {
-                MgUnGetChar(reader, c);
-                return;
+    #ifndef _WIN32
+                if( directory->fd >= 0 )
+                    close(directory->fd);
+    #endif
+                directory->fd = -1;
             }
         }
+        directories->openCount = 0;
     }
-    
-#line 2111 "source/parse-block.md"
-                                     
-    
-#line 46 "source/parse-block.md"
-    MgElement* ParseBlockElementsInRange(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange       lineRange )
+#line 210 "source/output-dir.md"
+    static int MgOpenOutputDirectoryPath(
+        MgContext*  context,
+        char const* path,
+        size_t      size )
     {
-        MgElement*  elements    = NULL;
-        MgElement** elementLink = &elements;
-    
-        for(;;)
+        while( size > 1 && MgIsPathSeparator(path[size - 1]) )
+            --size;
+    #ifdef _WIN32
+        if( size == 0 )
+            return 0;
+    #else
+        if( size == 0 )
+            return AT_FDCWD;
+    #endif
+
+        MgOutputDirectories* directories = context->outputDirectories;
+        MgHash pathHash = MgHashString(MgMakeString(path, path + size));
+        MgOutputDirectory* directory = MgFindOutputDirectory(directories, path, size, pathHash);
+        if( !directory )
+            directory = MgAddOutputDirectory(directories, path, size, pathHash);
+        if( directory->failed || directory->fd >= 0 )
+            return directory->fd;
+
+        size_t leafStart = size;
+        while( leafStart && !MgIsPathSeparator(path[leafStart - 1]) )
+            --leafStart;
+        char const* leaf = directory->path + leafStart;
+
+    #ifdef _WIN32
+        if( leafStart == size || path[size - 1] == ':' )
         {
-            
-#line 67 "source/parse-block.md"
-    SkipEmptyLines(&lineRange);
-    
-#line 75 "source/parse-block.md"
-    if( lineRange.begin == lineRange.end )
-        break;
-    
-#line 68 "source/parse-block.md"
-                               
-    
-#line 81 "source/parse-block.md"
-    MgElement* element = ParseBlockElement( context, inputFile, &lineRange );
-    
-#line 69 "source/parse-block.md"
-                                    
-    
-#line 86 "source/parse-block.md"
-    *elementLink = element;
-    while( *elementLink )
-        elementLink = &(*elementLink)->next;
-    
-#line 70 "source/parse-block.md"
-                                              
-    
-#line 56 "source/parse-block.md"
-                                                                 
+            // the root of a drive, or the file system
+            directory->fd = 0;
         }
-    
-        return elements;
-    }
-    
-#line 210 "source/parse-block.md"
-    MgElement* ParseBlockLevelHtml(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
-    {
-        MgLine* firstLine = GetLine( ioLineRange );
-        MgLine* lastLine = firstLine;
-    
-        MgReader reader;
-        InitializeLineReader( &reader, firstLine );
-    
-        int c = MgGetChar( &reader );
-        if( c != '<' ) return NULL;
-    
-        int d = MgGetChar( &reader );
-        if( !isalpha(d) ) return NULL;
-    
-        for(;;)
+        else if( leafStart && MgOpenOutputDirectoryPath(context, path, leafStart) < 0 )
         {
-            MgLine* line = GetLine( ioLineRange );
-            if( !line )
-                break;
-    
-            lastLine = line;
-    
-            InitializeLineReader( &reader, line );
-            int e = MgGetChar( &reader );
-            if( e != '<' )
-                continue;
-            int f = MgGetChar( &reader );
-            if( f != '/' )
-                continue;
-            int g = MgGetChar( &reader );
-            if( !isalpha(g) )
-                continue;
-    
-            break;
+            directory->failed = MG_TRUE;
+            return -1;
         }
-    
-        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        MgElement* firstChild = ReadSpansInRange( context, inputFile, innerRange, kMgSpanFlags_HtmlBlock );
-        return MgCreateParentElement(
-            kMgElementKind_HtmlBlock,
-            firstChild );
-    }
-    
-#line 288 "source/parse-block.md"
-    BLOCK_PARSE_FUNC(ParseDefaultParagraph)
-    {
-        MgLine* firstLine = GetLine( ioLineRange );
-        MgLine* lastLine = firstLine;
-    
-        for(;;)
+        else if( _mkdir(directory->path) == 0 || errno == EEXIST )
         {
-            MgLine* line = GetLine( ioLineRange );
-            if( !line || IsBlankLine(line) )
+            directory->fd = 0;
+        }
+    #else
+        if( leafStart == size )
+        {
+            // the root of the file system
+            directory->fd = open(directory->path, O_RDONLY | O_DIRECTORY);
+        }
+        else
+        {
+            int parent = leafStart ? MgOpenOutputDirectoryPath(context, path, leafStart) : AT_FDCWD;
+            if( parent < 0 && parent != AT_FDCWD )
             {
-                UnGetLine(ioLineRange, line);
-                break;
+                directory->failed = MG_TRUE;
+                return -1;
+            }
+
+            directory->fd = openat(parent, leaf, O_RDONLY | O_DIRECTORY);
+            if( directory->fd < 0 && errno == ENOENT
+                && (mkdirat(parent, leaf, 0777) == 0 || errno == EEXIST) )
+            {
+                directory->fd = openat(parent, leaf, O_RDONLY | O_DIRECTORY);
             }
-    
-            lastLine = line;
         }
-    
-        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        MgElement* firstChild = ReadSpansInRange( context, inputFile, innerRange, kMgSpanFlags_Default );
-        return MgCreateParentElement(
-            kMgElementKind_Paragraph,
-            firstChild );
-    }
-    
-#line 353 "source/parse-block.md"
-    BLOCK_PARSE_FUNC(ParseSetextHeader1)
-    {
-        return ParseSetextHeader(
-            context, inputFile,
-            ioLineRange,
-            '=',
-            kMgElementKind_Header1 );
+    #endif
+
+        if( directory->fd < 0 )
+        {
+            directory->failed = MG_TRUE;
+            fprintf(stderr, "mangle: failed to open or create the directory \"%s\"\n", directory->path);
+            return -1;
+        }
+        directories->openCount++;
+        return directory->fd;
     }
-    
-    BLOCK_PARSE_FUNC(ParseSetextHeader2)
+
+    void MgOpenOutputFileDirectory(
+        MgContext*      context,
+        MgOutputFile*   file )
     {
-        return ParseSetextHeader(
-            context, inputFile,
-            ioLineRange,
-            '-',
-            kMgElementKind_Header2 );
+        if( !context->outputDirectories )
+        {
+            context->outputDirectories = (MgOutputDirectories*) MgAllocate(kMgAllocKind_OutputPath, sizeof(MgOutputDirectories));
+            memset(context->outputDirectories, 0, sizeof(MgOutputDirectories));
+        }
+        if( context->outputDirectories->openCount >= kMgMaxOpenOutputDirectories )
+            MgCloseOutputDirectories( context );
+
+        file->directory = MgOpenOutputDirectoryPath( context, file->path, file->name - file->path );
     }
-    
-#line 377 "source/parse-block.md"
-    MgElement* ParseSetextHeader(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange,
-        char            c,
-        MgElementKind   kind )
+#line 8 "source/export.md"
+    MgAttribute* MgFindAttribute(
+        MgElement*  pp,
+        char const* id )
     {
-        
-#line 408 "source/parse-block.md"
-    MgLine* firstLine = GetLine(ioLineRange);
-    MgLine* secondLine = GetLine(ioLineRange);
-    if( !secondLine ) return 0;
-    
-#line 384 "source/parse-block.md"
-                                 
-    
-        
-#line 419 "source/parse-block.md"
-    if(!LineIsAll(secondLine, c))
+        MgString idString = { id, id + strlen(id) };
+        for(MgAttribute* attr = pp->firstAttr; attr; attr = attr->next)
+        {
+            if( MgStringsAreEqual(attr->id, idString) )
+                return attr;
+        }
         return 0;
-    
-#line 386 "source/parse-block.md"
-                                                      
-    
-        // the inner range does not include the second line,
-        // so we can't just use the Snip() function for everything
-        LineRange innerRange = MgInclusiveLineRange(firstLine, firstLine);
-        Snip( firstLine, secondLine, ioLineRange );
-    
-        MgElement* firstChild = ReadSpansInRange(
-            context,
-            inputFile,
-            innerRange,
-            kMgSpanFlags_Default );
-    
-        return MgCreateParentElement(
-            kind,
-            firstChild );
     }
-    
-#line 449 "source/parse-block.md"
-    MgElement* ParseAtxHeader(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
-    {
-        LineRange innerRange;
-        MgLine* firstLine = GetLine( ioLineRange );
-    
-        MgReader reader;
-        InitializeLineReader(&reader, firstLine);
-    
-        int level = 0;
-        for(;;)
+#line 31 "source/export.md"
+    MgBool MgRopeIsSameAsFileOnDisk(
+        MgRope const*       rope,
+        MgOutputFile const* output)
+    {
+    #ifdef _WIN32
+        FILE* file = fopen(output->path, "rb");
+    #else
+        int fd = openat(output->directory, output->name, O_RDONLY);
+        FILE* file = fd >= 0 ? fdopen(fd, "rb") : NULL;
+        if( fd >= 0 && !file )
+            close(fd);
+    #endif
+        if( !file )
+            return MG_FALSE;
+
+        MgBool isSame = fseek(file, 0, SEEK_END) == 0
+            && ftell(file) == rope->size
+            && fseek(file, 0, SEEK_SET) == 0;
+
+        size_t segmentIndex = 0;
+        char const* cursor = rope->segmentCount ? rope->segments[0].begin : NULL;
+        char buffer[32 * 1024];
+        while( isSame )
         {
-            int c = MgGetChar(&reader);
-            if( c != '#' )
-            {
-                MgUnGetChar(&reader, c);
+            size_t count = fread(buffer, 1, sizeof(buffer), file);
+            if( count == 0 )
                 break;
+
+            char const* block = buffer;
+            while( count )
+            {
+                if( segmentIndex == rope->segmentCount )
+                {
+                    isSame = MG_FALSE;
+                    break;
+                }
+
+                MgString segment = rope->segments[segmentIndex];
+                size_t available = segment.end - cursor;
+                size_t size = available < count ? available : count;
+                if( memcmp(block, cursor, size) != 0 )
+                {
+                    isSame = MG_FALSE;
+                    break;
+                }
+                block   += size;
+                count   -= size;
+                cursor  += size;
+                if( cursor == segment.end && ++segmentIndex != rope->segmentCount )
+                    cursor = rope->segments[segmentIndex].begin;
             }
-            ++level;
         }
-    
-        if( level == 0 ) return 0;
-    
-        firstLine->text.begin = reader.cursor;
-    
-        TrimLeadingSpace( &firstLine->text.begin, firstLine->text.end );
-        TrimTrailingChar( firstLine->text.begin, &firstLine->text.end, '#' );
-        TrimTrailingSpace( firstLine->text.begin, &firstLine->text.end );
-    
-        if( level > kMaxHeaderLevel )
-            level = kMaxHeaderLevel;
-    
-        innerRange = Snip( firstLine, firstLine, ioLineRange );
-    
-        MgElement* firstChild = ReadSpansInRange( context, inputFile, innerRange, kMgSpanFlags_Default );
-    
-        return MgCreateParentElement(
-            (MgElementKind) (kMgElementKind_Header1 + (level-1)),
-            firstChild );
+
+        fclose(file);
+        return isSame && segmentIndex == rope->segmentCount;
     }
-    
-#line 542 "source/parse-block.md"
-    char const* CheckQuoteLine(
-        MgLine* line )
+#line 97 "source/export.md"
+    typedef enum MgWriteResultT
     {
-        MgReader reader;
-        InitializeLineReader(&reader, line );
-    
-        int c = MgGetChar( &reader );
-        if( c != '>' )
-            return 0;
-    
-        int d = MgGetChar( &reader );
-        if( d != ' ' )
+        kMgWriteResult_Unchanged,       /* the file on disk already held the output */
+        kMgWriteResult_Written,
+        kMgWriteResult_OpenFailed,
+        kMgWriteResult_WriteFailed,
+    } MgWriteResult;
+
+    #ifdef _WIN32
+    static MgBool MgWriteRopeToStream(
+        MgRope const*   rope,
+        FILE*           stream )
+    {
+        MgBool ok = MG_TRUE;
+        for( size_t ii = 0; ii < rope->segmentCount && ok; ++ii )
         {
-            MgUnGetChar( &reader, d );
+            MgString segment = rope->segments[ii];
+            size_t size = segment.end - segment.begin;
+            ok = fwrite(segment.begin, 1, size, stream) == size;
         }
-        return reader.cursor;
+        return ok;
     }
-    
-    MgElement* ParseBlockQuote(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+    #else
+    static MgBool MgWriteRopeToDescriptor(
+        MgRope const*   rope,
+        int             fd )
     {
-        MgLine* firstLine = GetLine( ioLineRange );
-        MgLine* lastLine = firstLine;
-    
-        MgLine* line = firstLine;
-        for(;;)
+        enum
         {
-            if( !line )
-                break;
-    
-            char const* lineStart = CheckQuoteLine(line);
-            if( !lineStart )
-            {
-                if( line == firstLine )
-                    return 0; // this isn't a block quote at all!
-                else
-                    break; // we've found the first line that doesn't belong
-            } 
-    
-            // we are starting a paragraph within the block quote
-    
-            // continue consuming lines until we see an empty line
-            while( line && !IsBlankLine(line) )
-            {
-                lineStart = CheckQuoteLine(line);
-                if( lineStart )
-                    line->text.begin = lineStart;
-                lastLine = line;
-                line = GetLine( ioLineRange );
+    #ifdef IOV_MAX
+            kMaxBatch = IOV_MAX < 1024 ? IOV_MAX : 1024,
+    #else
+            kMaxBatch = 16,
+    #endif
+        };
+        struct iovec batch[kMaxBatch];
+
+        MgBool ok = MG_TRUE;
+        size_t segmentIndex = 0;
+        char const* cursor = rope->segmentCount ? rope->segments[0].begin : NULL;
+        while( ok && segmentIndex != rope->segmentCount )
+        {
+            int batchCount = 0;
+            for( size_t ii = segmentIndex; ii < rope->segmentCount && batchCount < kMaxBatch; ++ii )
+            {
+                char const* begin = ii == segmentIndex ? cursor : rope->segments[ii].begin;
+                batch[batchCount].iov_base  = (void*) begin;
+                batch[batchCount].iov_len   = rope->segments[ii].end - begin;
+                batchCount++;
             }
-    
-            // continue consuming lines until we see a non-empty line
-            while( line && IsBlankLine(line) )
+
+            ssize_t written = writev(fd, batch, batchCount);
+            if( written < 0 )
             {
-                line = GetLine( ioLineRange );
+                ok = errno == EINTR;
+                continue;
+            }
+
+            while( segmentIndex != rope->segmentCount )
+            {
+                size_t available = rope->segments[segmentIndex].end - cursor;
+                if( (size_t) written < available )
+                {
+                    cursor += written;
+                    break;
+                }
+                written -= available;
+                if( ++segmentIndex != rope->segmentCount )
+                    cursor = rope->segments[segmentIndex].begin;
             }
         }
-    
-        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        MgElement* firstChild = ParseBlockElementsInRange(context, inputFile, innerRange);
-        return MgCreateParentElement(
-            kMgElementKind_BlockQuote,
-            firstChild );
+        return ok;
     }
-    
-#line 618 "source/parse-block.md"
-    char const* CheckUnorderedListLine(
-        MgLine* line )
+    #endif
+
+    static MgWriteResult MgWriteRopeSegments(
+        MgRope const*       rope,
+        MgOutputFile const* output)
     {
-        MgReader reader;
-        InitializeLineReader( &reader, line );
-    
-        // may have up to three leading spaces
-        for(int ii = 0; ii < 3; ++ii )
+    #ifdef _WIN32
+        FILE* file = fopen(output->path, "wb");
+        if( !file )
+            return kMgWriteResult_OpenFailed;
+
+        MgBool ok = MgWriteRopeToStream(rope, file);
+        if( fclose(file) != 0 )
+            ok = MG_FALSE;
+    #else
+        int fd = openat(output->directory, output->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if( fd < 0 )
+            return kMgWriteResult_OpenFailed;
+
+        MgBool ok = MgWriteRopeToDescriptor(rope, fd);
+        if( close(fd) != 0 )
+            ok = MG_FALSE;
+    #endif
+
+        return ok ? kMgWriteResult_Written : kMgWriteResult_WriteFailed;
+    }
+#line 208 "source/export.md"
+    MgWriteResult MgCompareAndWriteRope(
+        MgRope const*       rope,
+        MgOutputFile const* file)
+    {
+        if( MgRopeIsSameAsFileOnDisk(rope, file) )
+            return kMgWriteResult_Unchanged;
+        return MgWriteRopeSegments(rope, file);
+    }
+
+    MgBool MgReportWriteResult(
+        MgContext*          context,
+        MgOutputFile const* file,
+        long long           size,
+        MgWriteResult       result)
+    {
+        MgCountPhaseWork( context, kMgPhase_OutputCompare, size, 1 );
+        switch( result )
         {
-            int cc = MgGetChar( &reader );
-            if( cc != ' ' )
-            {
-                MgUnGetChar( &reader, cc );
-                break;
-            }
+        case kMgWriteResult_Unchanged:
+            if( context->stats )
+                context->stats->outputsUnchanged++;
+            return MG_TRUE;
+
+        case kMgWriteResult_Written:
+            MgCountPhaseWork( context, kMgPhase_DiskWrite, size, 1 );
+            if( context->stats )
+                context->stats->outputsWritten++;
+            return MG_TRUE;
+
+        case kMgWriteResult_OpenFailed:
+            fprintf(stderr, "Failed to open \"%s\" for writing\n", file->path);
+            return MG_FALSE;
+
+        default:
+            fprintf(stderr, "Failed to write \"%s\"\n", file->path);
+            return MG_FALSE;
         }
-    
-        int c = MgGetChar( &reader );
-        switch( c )
+    }
+#line 250 "source/export.md"
+    MgWriteResult MgWriteRopeToFile(
+        MgContext*          context,
+        MgRope const*       rope,
+        MgOutputFile const* file)
+    {
+        MgBeginPhase( context, kMgPhase_OutputCompare );
+        MgBool isSame = MgRopeIsSameAsFileOnDisk(rope, file);
+        MgEndPhase( context );
+        if( isSame )
+            return kMgWriteResult_Unchanged;
+
+        MgBeginPhase( context, kMgPhase_DiskWrite );
+        MgWriteResult result = MgWriteRopeSegments(rope, file);
+        MgEndPhase( context );
+        return result;
+    }
+#line 272 "source/export.md"
+    MgBool MgWriteRopeToStdout(
+        MgContext*      context,
+        MgRope const*   rope )
+    {
+        MgBeginPhase( context, kMgPhase_DiskWrite );
+        fflush(stdout);
+    #ifdef _WIN32
+        MgBool ok = MgWriteRopeToStream(rope, stdout) && fflush(stdout) == 0;
+    #else
+        MgBool ok = MgWriteRopeToDescriptor(rope, STDOUT_FILENO);
+    #endif
+        if( ok )
+            MgCountPhaseWork( context, kMgPhase_DiskWrite, rope->size, 1 );
+        MgEndPhase( context );
+
+        if( !ok )
+            fprintf(stderr, "mangle: failed to write to standard output\n");
+        else if( context->stats )
+            context->stats->outputsWritten++;
+        return ok;
+    }
+#line 24 "source/output-hash.md"
+    enum
+    {
+        kMgOutputHashVersion = 1,
+    };
+
+    MgContentHash MgGetOutputHash(
+        MgContext*          context,
+        MgScrapNameGroup*   codeFile )
+    {
+        MgContentHash hash = MG_CONTENT_HASH_OFFSET_BASIS;
+        hash = MgHashContentInteger(hash, kMgOutputHashVersion);
+        hash = MgHashContentInteger(hash, context->writeSourceMaps);
+        hash = MgHashContentInteger(hash, (long long) codeFile->expandedSize.hash);
+        return hash;
+    }
+#line 51 "source/output-hash.md"
+    typedef struct MgFileStampT
+    {
+        long long   size;
+        long long   modifiedTime;
+    } MgFileStamp;
+
+    static MgBool MgGetFileStamp(
+        MgOutputFile const* file,
+        MgFileStamp*        stamp )
+    {
+        struct stat info;
+    #if defined(_WIN32)
+        if( stat(file->path, &info) != 0 )
+            return MG_FALSE;
+    #else
+        if( fstatat(file->directory, file->name, &info, 0) != 0 )
+            return MG_FALSE;
+    #endif
+
+        stamp->size = (long long) info.st_size;
+    #if defined(_WIN32)
+        stamp->modifiedTime = (long long) info.st_mtime;
+    #elif defined(__APPLE__)
+        stamp->modifiedTime = (long long) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+    #else
+        stamp->modifiedTime = (long long) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    #endif
+        return MG_TRUE;
+    }
+#line 96 "source/output-hash.md"
+    typedef struct MgOutputHashRecordT
+    {
+        char const*     path;
+        MgHash          pathHash;
+        MgContentHash   hash;
+        MgFileStamp     stamp;
+    } MgOutputHashRecord;
+
+    struct MgOutputHashesT
+    {
+        char const*         path;           /* of the hash file */
+        MgOutputHashRecord* records;
+        int                 recordCount;
+        int                 recordCapacity;
+        char*               fileText;       /* text of the hash file, as read */
+        size_t              fileSize;
+        MgBool              changed;        /* does the hash file need to be written? */
+    };
+
+    static MgOutputHashRecord* MgFindOutputHashRecord(
+        MgOutputHashes* hashes,
+        char const*     path,
+        MgHash          pathHash )
+    {
+        for( int ii = 0; ii < hashes->recordCount; ++ii )
         {
-        case '*':
-        case '+':
-        case '-':
-            break;
-    
-        default:
-            return 0;
+            MgOutputHashRecord* record = &hashes->records[ii];
+            if( record->pathHash == pathHash && strcmp(record->path, path) == 0 )
+                return record;
         }
-    
-        // skip white-space after the bullet
-        for(;;)
+        return NULL;
+    }
+
+    static MgOutputHashRecord* MgAddOutputHashRecord(
+        MgOutputHashes* hashes,
+        char const*     path,
+        MgHash          pathHash )
+    {
+        if( hashes->recordCount == hashes->recordCapacity )
         {
-            int d = MgGetChar( &reader );
-            if( !isspace(d) )
-            {
-                MgUnGetChar( &reader, d );
-                break;
-            }
+            int capacity = hashes->recordCapacity ? 2 * hashes->recordCapacity : 16;
+            MgOutputHashRecord* records = (MgOutputHashRecord*) MgAllocate(kMgAllocKind_OutputHashes, capacity * sizeof(MgOutputHashRecord));
+            if( hashes->recordCount )
+                memcpy(records, hashes->records, hashes->recordCount * sizeof(MgOutputHashRecord));
+            MgFree(kMgAllocKind_OutputHashes, hashes->records, hashes->recordCapacity * sizeof(MgOutputHashRecord));
+            hashes->records         = records;
+            hashes->recordCapacity  = capacity;
         }
-    
-        return reader.cursor;
+
+        MgOutputHashRecord* record = &hashes->records[hashes->recordCount++];
+        record->path        = path;
+        record->pathHash    = pathHash;
+        return record;
     }
-    
-    char const* CheckOrderedListLine(
-        MgLine* line )
+#line 156 "source/output-hash.md"
+    static char const kMgOutputHashHeader[] = "mangle-output-hashes 1\n";
+
+    void MgLoadOutputHashes(
+        MgContext*  context,
+        char const* path )
     {
-        MgReader reader;
-        InitializeLineReader( &reader, line );
-    
-        // may have up to three leading spaces
-        for(int ii = 0; ii < 3; ++ii )
+        MgOutputHashes* hashes = (MgOutputHashes*) MgAllocate(kMgAllocKind_OutputHashes, sizeof(MgOutputHashes));
+        memset(hashes, 0, sizeof(*hashes));
+        hashes->path = path;
+        context->outputHashes = hashes;
+
+        FILE* stream = fopen(path, "rb");
+        if( !stream )
+            return;
+
+        long size = -1;
+        if( fseek(stream, 0, SEEK_END) == 0 )
+            size = ftell(stream);
+        char* text = NULL;
+        if( size >= 0 && fseek(stream, 0, SEEK_SET) == 0 )
         {
-            int cc = MgGetChar( &reader );
-            if( cc != ' ' )
+            text = (char*) MgAllocate(kMgAllocKind_OutputHashes, size + 1);
+            if( fread(text, 1, size, stream) != (size_t) size )
             {
-                MgUnGetChar( &reader, cc );
-                break;
+                MgFree(kMgAllocKind_OutputHashes, text, size + 1);
+                text = NULL;
             }
         }
-    
-        int c = MgGetChar( &reader );
-        if( !isdigit(c) )
-            return 0;
-    
-        // skip remaining digits
-        for(;;)
+        fclose(stream);
+        if( !text )
         {
-            int d = MgGetChar( &reader );
-            if( !isdigit(d) )
-            {
-                MgUnGetChar( &reader, d );
-                break;
-            }
+            fprintf(stderr, "mangle: failed to read \"%s\", so all code files will be expanded\n", path);
+            return;
         }
-    
-        // expect a dot
-        int e = MgGetChar( &reader );
-        if( e != '.' )
-            return 0;
-    
-        // skip white-space after the dot
-        for(;;)
+        text[size] = 0;
+        hashes->fileText = text;
+        hashes->fileSize = size + 1;
+
+        size_t headerSize = sizeof(kMgOutputHashHeader) - 1;
+        if( (size_t) size < headerSize || memcmp(text, kMgOutputHashHeader, headerSize) != 0 )
+            return;
+
+        char* line = text + headerSize;
+        while( *line )
         {
-            int d = MgGetChar( &reader );
-            if( !isspace(d) )
+            char* lineEnd = strchr(line, '\n');
+            if( lineEnd )
+                *lineEnd = 0;
+
+            unsigned long long hash;
+            long long stampSize, modifiedTime;
+            int pathOffset = 0;
+            if( sscanf(line, "%llx %lld %lld %n", &hash, &stampSize, &modifiedTime, &pathOffset) == 3
+                && pathOffset && line[pathOffset] )
             {
-                MgUnGetChar( &reader, d );
-                break;
+                char const* recordPath = line + pathOffset;
+                MgHash pathHash = MgHashString(MgTerminatedString(recordPath));
+                MgOutputHashRecord* record = MgFindOutputHashRecord(hashes, recordPath, pathHash);
+                if( !record )
+                    record = MgAddOutputHashRecord(hashes, recordPath, pathHash);
+                record->hash                = (MgContentHash) hash;
+                record->stamp.size          = stampSize;
+                record->stamp.modifiedTime  = modifiedTime;
             }
+
+            if( !lineEnd )
+                break;
+            line = lineEnd + 1;
         }
-    
-        return reader.cursor;
     }
-    
-    char const* CheckListLineLeadingSpace(
-        MgLine* line )
+#line 231 "source/output-hash.md"
+    void MgSaveOutputHashes(
+        MgContext*  context )
     {
-        MgReader reader;
-        InitializeLineReader( &reader, line );
-    
-        for( int ii = 0; ii < 4; ++ii )
+        MgOutputHashes* hashes = context->outputHashes;
+        if( !hashes || !hashes->changed )
+            return;
+
+        FILE* stream = fopen(hashes->path, "wb");
+        if( !stream )
         {
-            int c = MgGetChar( &reader );
-            if( c == '\t' )
-                break;
-            if( c != ' ' )
-            {
-                MgUnGetChar( &reader, c );
-                return 0;
-            }
+            fprintf(stderr, "mangle: failed to open \"%s\" for writing\n", hashes->path);
+            return;
         }
-        return reader.cursor;
+
+        fputs(kMgOutputHashHeader, stream);
+        for( int ii = 0; ii < hashes->recordCount; ++ii )
+        {
+            MgOutputHashRecord const* record = &hashes->records[ii];
+            fprintf(stream, "%016llx %lld %lld %s\n",
+                (unsigned long long) record->hash,
+                record->stamp.size,
+                record->stamp.modifiedTime,
+                record->path);
+        }
+        if( fclose(stream) != 0 )
+            fprintf(stderr, "mangle: failed to write \"%s\"\n", hashes->path);
     }
-    
-    MgElement* ParseListItem(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange,
-        char const* (*checkLineFunc)(MgLine*) )
+#line 267 "source/output-hash.md"
+    MgBool MgIsOutputHashCurrent(
+        MgContext*          context,
+        MgOutputFile const* file,
+        MgContentHash       hash,
+        long long*          outSize )
     {
-        MgLine* firstLine = GetLine( ioLineRange );
-        MgLine* lastLine = firstLine;
-    
-        if( !firstLine )
-            return 0;
-    
-        // check the first line
-        char const* lineStart = checkLineFunc(firstLine);
-        if( !lineStart )
-            return 0;
-        firstLine->text.begin = lineStart;
-    
-        // read subsequent lines of the item, until
-        MgLine* line = firstLine;
-    
-        for(;;)
+        MgOutputHashes* hashes = context->outputHashes;
+        if( !hashes )
+            return MG_FALSE;
+
+        char const* path = file->path;
+        MgOutputHashRecord* record = MgFindOutputHashRecord(hashes, path, MgHashString(MgTerminatedString(path)));
+        if( !record || record->hash != hash )
+            return MG_FALSE;
+
+        MgFileStamp stamp;
+        if( !MgGetFileStamp(file, &stamp)
+            || stamp.size != record->stamp.size
+            || stamp.modifiedTime != record->stamp.modifiedTime )
+            return MG_FALSE;
+
+        if( context->writeSourceMaps )
         {
-            line = GetLine( ioLineRange );
-            while( line )
-            {
-                // we see an empty line, or
-                if( IsBlankLine(line) )
-                    break;
-    
-                // a line that starts a new item
-                // \todo: does this need to consider other list flavors?
-                lineStart = checkLineFunc(line);
-                if(lineStart)
-                    break;
-    
-                lineStart = CheckListLineLeadingSpace(line);
-                if( lineStart )
-                    line->text.begin = lineStart;
-    
-                // \todo: need to trim front of line...
-    
-                lastLine = line;
-                line = GetLine(ioLineRange);
-            }
-    
-            // continue consuming lines until we see a non-empty line
-            while( line && IsBlankLine(line) )
-            {
-                line = GetLine(ioLineRange);
-            }
-    
-            // if the next line is indented appropriately for line
-            // continuation... we continue building out the same item...
-            if( line )
-            {
-                lineStart = CheckIndentedCodeLine( line );
-                if( lineStart )
-                {
-                    line->text.begin = lineStart;
-                    lastLine = line;
-                    continue;
-                }
-            }
-            break;
+            MgOutputFile mapFile;
+            MgInitializeOutputFileWithSuffix( &mapFile, file, ".map" );
+            MgBool hasMap = MgGetFileStamp(&mapFile, &stamp);
+            MgFreeOutputFile( &mapFile );
+            if( !hasMap )
+                return MG_FALSE;
         }
-    
-        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        MgElement* firstChild = ParseBlockElementsInRange( context, inputFile, innerRange );
-    
-        return MgCreateParentElement(
-            kMgElementKind_ListItem,
-            firstChild );
+        *outSize = record->stamp.size;
+        return MG_TRUE;
     }
-    
-    MgElement* ParseList(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange,
-        MgElementKind kind,
-        char const* (*checkLineFunc)(MgLine*) )
+#line 305 "source/output-hash.md"
+    void MgRecordOutputHash(
+        MgContext*          context,
+        MgOutputFile const* file,
+        MgContentHash       hash )
     {
-        MgElement* firstItem = ParseListItem( context, inputFile, ioLineRange, checkLineFunc );
-        MgElement* lastItem = firstItem;
-    
-        if( !firstItem ) return 0;
-    
-        for(;;)
-        {
-            MgElement* item = ParseListItem( context, inputFile, ioLineRange, checkLineFunc );
-            if( !item )
-                break;
-    
-            lastItem->next = item;
-            lastItem = item;
+        MgOutputHashes* hashes = context->outputHashes;
+        if( !hashes )
+            return;
+
+        MgFileStamp stamp;
+        if( !MgGetFileStamp(file, &stamp) )
+            return;
+
+        char const* path = file->path;
+        MgHash pathHash = MgHashString(MgTerminatedString(path));
+        MgOutputHashRecord* record = MgFindOutputHashRecord(hashes, path, pathHash);
+        if( !record )
+        {
+            size_t size = strlen(path) + 1;
+            char* pathCopy = (char*) MgAllocate(kMgAllocKind_OutputHashes, size);
+            memcpy(pathCopy, path, size);
+            record = MgAddOutputHashRecord(hashes, pathCopy, pathHash);
         }
-    
-        return MgCreateParentElement(
-            kind,
-            firstItem );
-    }
-    
-    MgElement* ParseOrderedList(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+        else if( record->hash == hash
+            && record->stamp.size == stamp.size
+            && record->stamp.modifiedTime == stamp.modifiedTime )
+        {
+            return;
+        }
+
+        record->hash    = hash;
+        record->stamp   = stamp;
+        hashes->changed = MG_TRUE;
+    }
+#line 18 "source/write-queue.md"
+    static long long const kMgDefaultWriteBufferBytes = (long long) 64 << 20;
+#line 27 "source/write-queue.md"
+    typedef struct MgQueuedOutputT
+    {
+        MgOutputFile    file;
+        MgRope          rope;
+        MgString        textSegment;    /* the only segment of `rope`, for a buffer */
+        char*           buffer;         /* owned buffer, if not `NULL` */
+        size_t          bufferSize;
+        MgWriteResult   result;
+    } MgQueuedOutput;
+
+    enum
     {
-        return ParseList(
-            context, inputFile, 
-            ioLineRange,
-            kMgElementKind_OrderedList,
-            &CheckOrderedListLine );
-    }
-    
-    MgElement* ParseUnorderedList(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+        kMgMaxOutputsPerJob = 2,
+    };
+
+    typedef struct MgOutputJobT MgOutputJob;
+    struct MgOutputJobT
+    {
+        MgOutputJob*    next;
+        MgQueuedOutput  outputs[kMgMaxOutputsPerJob];
+        int             outputCount;
+        long long       bytes;          /* of all outputs, counted against the budget */
+        MgBool          recordHash;     /* record `hash` for the first output, if all are written */
+        MgContentHash   hash;
+        MgBool          done;           /* written, and waiting to be retired */
+    };
+
+    MgOutputJob* MgBeginOutputJob()
     {
-        return ParseList(
-            context, inputFile,
-            ioLineRange,
-            kMgElementKind_UnorderedList,
-            &CheckUnorderedListLine );
+        MgOutputJob* job = (MgOutputJob*) MgAllocate(kMgAllocKind_WriteQueue, sizeof(MgOutputJob));
+        memset(job, 0, sizeof(*job));
+        return job;
     }
-    
-#line 893 "source/parse-block.md"
-    char const* CheckIndentedCodeLine(
-        MgLine* line )
+
+    static MgQueuedOutput* MgAddOutputToJob(
+        MgOutputJob*        job,
+        MgOutputFile const* file )
+    {
+        assert(job->outputCount < kMgMaxOutputsPerJob);
+        MgQueuedOutput* output = &job->outputs[job->outputCount++];
+        MgInitializeOutputFileWithSuffix( &output->file, file, "" );
+        return output;
+    }
+#line 74 "source/write-queue.md"
+    void MgAddRopeToOutputJob(
+        MgOutputJob*        job,
+        MgRope*             rope,
+        MgOutputFile const* file )
+    {
+        MgQueuedOutput* output = MgAddOutputToJob( job, file );
+        output->rope = *rope;
+        MgInitializeRope( rope );
+        job->bytes += output->rope.size;
+    }
+#line 89 "source/write-queue.md"
+    void MgAddBufferToOutputJob(
+        MgOutputJob*        job,
+        char*               buffer,
+        size_t              bufferSize,
+        MgString            text,
+        MgOutputFile const* file )
+    {
+        MgQueuedOutput* output = MgAddOutputToJob( job, file );
+        output->buffer              = buffer;
+        output->bufferSize          = bufferSize;
+        output->textSegment         = text;
+        MgInitializeRope( &output->rope );
+        output->rope.segments       = &output->textSegment;
+        output->rope.segmentCount   = text.begin != text.end ? 1 : 0;
+        output->rope.size           = text.end - text.begin;
+        job->bytes += output->rope.size;
+    }
+#line 110 "source/write-queue.md"
+    static void MgRetireOutputJob(
+        MgContext*      context,
+        MgOutputJob*    job )
     {
-        // either a tab or four spaces
-        MgReader reader;
-        InitializeLineReader(&reader, line );
-    
-        int c = MgGetChar( &reader );
-        if( c == '\t' )
-            return reader.cursor;
-        MgUnGetChar( &reader, c );
-    
-        for( int ii = 0; ii < 4; ++ii )
+        MgBool ok = MG_TRUE;
+        for( int ii = 0; ii < job->outputCount; ++ii )
         {
-            int d = MgGetChar( &reader );
-            if( d != ' ' )
-                return 0;
+            MgQueuedOutput* output = &job->outputs[ii];
+            ok = MgReportWriteResult( context, &output->file, output->rope.size, output->result ) && ok;
         }
-        return reader.cursor;
-    }
-    
-    MgElement* ParseIndentedCode(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+        if( ok && job->recordHash )
+            MgRecordOutputHash( context, &job->outputs[0].file, job->hash );
+
+        for( int ii = 0; ii < job->outputCount; ++ii )
+        {
+            MgQueuedOutput* output = &job->outputs[ii];
+            if( output->buffer )
+                MgFree(kMgAllocKind_OutputBuffer, output->buffer, output->bufferSize);
+            else
+                MgFreeRope( &output->rope );
+            MgFreeOutputFile( &output->file );
+        }
+        MgFree(kMgAllocKind_WriteQueue, job, sizeof(MgOutputJob));
+    }
+#line 143 "source/write-queue.md"
+    #if MG_THREADS
+    struct MgWriteQueueT
+    {
+        MgContext*      context;
+        MgMutex         lock;
+        MgCondition     wake;
+        MgThread        thread;
+        MgOutputJob*    first;
+        MgOutputJob*    last;
+        MgOutputJob*    nextToWrite;
+        long long       bytes;          /* of all jobs not yet retired */
+        long long       budget;
+        MgBool          stopping;
+    };
+#line 162 "source/write-queue.md"
+    static void* MgWriteQueueThreadMain(
+        void*   arg )
     {
-        MgLine* firstLine = GetLine(ioLineRange);
-        MgLine* lastLine = firstLine;
-    
-        MgLine* line = firstLine;
+        MgWriteQueue* queue = (MgWriteQueue*) arg;
+        MgLockMutex( &queue->lock );
         for(;;)
         {
-            if( !line )
-                break;
-    
-            char const* lineStart = CheckIndentedCodeLine(line);
-            if( !lineStart )
-            {
-                if( line == firstLine )
-                    return 0; // this isn't a code block at all!
-                else
-                    break; // end of the code block
-            }
-    
-            // if the line that starts the paragraph looks like a
-            // literate scrap introduction `<< foo >>=`, then end
-            // this code block so we can start a new one.
-            if( line != firstLine
-                && CheckLiterateScrapIntroductionLine(context, inputFile, lineStart, line) )
-            {
+            while( !queue->nextToWrite && !queue->stopping )
+                MgWaitCondition( &queue->wake, &queue->lock );
+            MgOutputJob* job = queue->nextToWrite;
+            if( !job )
                 break;
-            }
-    
-            // we are starting a paragraph within the code block
-    
-            // continue consuming lines until we see an empty line
-            while( line && !IsBlankLine(line) )
-            {
-                lineStart = CheckIndentedCodeLine(line);
-                if(!lineStart)
-                    break; // end of the code element...
-    
-                line->text.begin = lineStart;
-                lastLine = line;
-                line = GetLine( ioLineRange );
-            }
-    
-            // continue consuming lines until we see a non-empty line
-            while( line && IsBlankLine(line) )
+            MgUnlockMutex( &queue->lock );
+
+            double traceStart = MgBeginTraceSpan( queue->context );
+            for( int ii = 0; ii < job->outputCount; ++ii )
             {
-                line = GetLine(ioLineRange);
+                MgQueuedOutput* output = &job->outputs[ii];
+                output->result = MgCompareAndWriteRope( &output->rope, &output->file );
             }
+            MgEndTraceSpan( queue->context, traceStart, "write behind", "output", MgTerminatedString(job->outputs[0].file.path) );
+
+            MgLockMutex( &queue->lock );
+            job->done = MG_TRUE;
+            queue->nextToWrite = job->next;
+            MgBroadcastCondition( &queue->wake );
         }
-    
-        LineRange innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        return ParseCodeBlockBody(
-            context,
-            inputFile,
-            innerRange,
-            0, 0 ); // no way to pass in a language name
+        MgUnlockMutex( &queue->lock );
+        return NULL;
     }
-    
-#line 981 "source/parse-block.md"
-    char const* CheckBracketedCodeLine(
-        MgLine* line,
-        char    c )
+#line 198 "source/write-queue.md"
+    static MgWriteQueue* MgGetWriteQueue(
+        MgContext*  context )
     {
-        MgReader reader;
-        InitializeLineReader( &reader, line );
-    
-        for( int ii = 0; ii < 3; ++ii )
+        if( context->writeQueue || context->writeQueueFailed )
+            return context->writeQueue;
+        if( context->writeBufferBytes <= 0 || context->jobCount <= 1 )
         {
-            int d = MgGetChar( &reader );
-            if( d != c )
-                return 0;
+            context->writeQueueFailed = MG_TRUE;
+            return NULL;
         }
-        return reader.cursor;
+
+        MgEnableAllocStatsLock();
+        MgWriteQueue* queue = (MgWriteQueue*) MgAllocate(kMgAllocKind_WriteQueue, sizeof(MgWriteQueue));
+        memset(queue, 0, sizeof(*queue));
+        queue->context  = context;
+        queue->budget   = context->writeBufferBytes;
+        MgInitializeMutex( &queue->lock );
+        MgInitializeCondition( &queue->wake );
+        if( !MgStartThread(&queue->thread, MgWriteQueueThreadMain, queue) )
+        {
+            MgDestroyCondition( &queue->wake );
+            MgDestroyMutex( &queue->lock );
+            MgFree(kMgAllocKind_WriteQueue, queue, sizeof(MgWriteQueue));
+            context->writeQueueFailed = MG_TRUE;
+            return NULL;
+        }
+        context->writeQueue = queue;
+        return queue;
     }
-    
-    MgElement* ParseBracketedCode(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange,
-        char c )
+#line 239 "source/write-queue.md"
+    static void MgRetireOutputJobs(
+        MgContext*      context,
+        MgWriteQueue*   queue,
+        long long       budget )
     {
-        MgLine* openLine = GetLine( ioLineRange );
-        char const* startLang = CheckBracketedCodeLine( openLine, c );
-        if( !startLang )
-            return 0;
-        openLine->text.begin = startLang;
-    
-        MgLine* firstLine = 0;
-        MgLine* lastLine = 0;
-    
+        MgBeginPhase( context, kMgPhase_DiskWrite );
         for(;;)
         {
-            MgLine* line = GetLine( ioLineRange );
-            if( !line )
-                break; // \todo: this would make an un-terminated code block...
-            char const* end = CheckBracketedCodeLine( line, c );
-            if( end )
+            MgLockMutex( &queue->lock );
+            while( queue->first && !queue->first->done && queue->bytes > budget )
+                MgWaitCondition( &queue->wake, &queue->lock );
+
+            MgOutputJob* job = queue->first;
+            if( job && job->done )
             {
-                // \todo: what if there is text after the backticks?
-                // for now, we process it as an other text...
-                line->text.begin = end;
-    
-                break;
+                queue->first = job->next;
+                if( !queue->first )
+                    queue->last = NULL;
+                queue->bytes -= job->bytes;
             }
-    
-            if( !firstLine )
-                firstLine = line;
-            lastLine = line;
+            else
+            {
+                job = NULL;
+            }
+            MgUnlockMutex( &queue->lock );
+
+            if( !job )
+                break;
+            MgRetireOutputJob( context, job );
         }
-    
-        // the span *might* be empty... just in case
-        LineRange innerRange = { 0, 0 };
-        if( lastLine )
-            innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        // `openLine` begin/end gives us the language marker, if any
-        return ParseCodeBlockBody(
-            context,
-            inputFile,
-            innerRange,
-            openLine->text.begin,
-            openLine->text.end );
+        MgEndPhase( context );
     }
-    
-    MgElement* ParseBracketedCode_Backtick(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+    #endif
+#line 280 "source/write-queue.md"
+    void MgSubmitOutputJob(
+        MgContext*      context,
+        MgOutputJob*    job )
     {
-        return ParseBracketedCode( context, inputFile, ioLineRange, '`' );
+    #if MG_THREADS
+        MgWriteQueue* queue = MgGetWriteQueue( context );
+        if( queue )
+        {
+            MgRetireOutputJobs( context, queue, queue->budget - job->bytes );
+
+            MgLockMutex( &queue->lock );
+            if( queue->last )
+                queue->last->next = job;
+            else
+                queue->first = job;
+            queue->last = job;
+            if( !queue->nextToWrite )
+                queue->nextToWrite = job;
+            queue->bytes += job->bytes;
+            MgBroadcastCondition( &queue->wake );
+            MgUnlockMutex( &queue->lock );
+            return;
+        }
+    #endif
+
+        for( int ii = 0; ii < job->outputCount; ++ii )
+        {
+            MgQueuedOutput* output = &job->outputs[ii];
+            output->result = MgWriteRopeToFile( context, &output->rope, &output->file );
+        }
+        MgRetireOutputJob( context, job );
     }
-    
-    MgElement* ParseBracketedCode_Tilde(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+#line 319 "source/write-queue.md"
+    void MgFinishOutputJobs(
+        MgContext*  context )
     {
-        return ParseBracketedCode( context, inputFile, ioLineRange, '~' );
+    #if MG_THREADS
+        if( context->writeQueue )
+            MgRetireOutputJobs( context, context->writeQueue, -1 );
+    #endif
     }
-    
-#line 1066 "source/parse-block.md"
-    MgBool CheckLiterateScrapIntroductionLine(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        const char*     lineStart,
-        MgLine*         line )
+#line 331 "source/write-queue.md"
+    void MgStopWriteQueue(
+        MgContext*  context )
     {
-        MgString text = MgMakeString(lineStart, line->text.end);
-        MgScrapKind scrapKind = kScrapKind_Unknown;
-        char const* scrapIdBegin    = 0;
-        char const* scrapIdEnd      = 0;
-        char const* scrapNameBegin  = 0;
-        char const* scrapNameEnd    = 0;
-    
-        return ParseLiterateScrapIntroduction(
-            context, inputFile, text,
-            &scrapKind,
-            &scrapIdBegin,      &scrapIdEnd,
-            &scrapNameBegin,    &scrapNameEnd );
+    #if MG_THREADS
+        MgWriteQueue* queue = context->writeQueue;
+        if( !queue )
+            return;
+
+        MgFinishOutputJobs( context );
+        MgLockMutex( &queue->lock );
+        queue->stopping = MG_TRUE;
+        MgBroadcastCondition( &queue->wake );
+        MgUnlockMutex( &queue->lock );
+        MgJoinThread( queue->thread );
+
+        MgDestroyCondition( &queue->wake );
+        MgDestroyMutex( &queue->lock );
+        MgFree(kMgAllocKind_WriteQueue, queue, sizeof(MgWriteQueue));
+        context->writeQueue = NULL;
+    #endif
     }
-    
-    MgElement* ParseCodeBlockBody(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange       inLineRange,
-        char const*     langBegin,
-        char const*     langEnd )
+#line 43 "source/source-map.md"
+    typedef struct MgSourceMapRangeT
     {
-        // check if first line looks like a
-        // literate scrap introduction
-        LineRange lineRange = inLineRange;
-        MgLine* firstLine = GetLine( &lineRange );
-    
-        MgScrapKind scrapKind = kScrapKind_Unknown;
-        char const* scrapIdBegin    = 0;
-        char const* scrapIdEnd      = 0;
-        char const* scrapNameBegin  = 0;
-        char const* scrapNameEnd    = 0;
-        if( ParseLiterateScrapIntroduction(
-            context, inputFile, firstLine->text,
-            &scrapKind,
-            &scrapIdBegin,      &scrapIdEnd,
-            &scrapNameBegin,    &scrapNameEnd ) )
-        {
-            firstLine = firstLine + 1;
-        }
-        else
-        {
-            UnGetLine( &lineRange, firstLine );
-        }
-    
-        MgElement* firstChild = ReadSpansInRange( context, inputFile, lineRange, kMgSpanFlags_CodeBlock );
-        MgElement* codeBlock = MgCreateParentElement(
-            kMgElementKind_CodeBlock,
-            firstChild );
-    
-        if( langBegin != langEnd )
-        {
-            MgAddAttribute( codeBlock, "class", MgMakeString( langBegin, langEnd ) );
-        }
-    
-        MgElement* element = codeBlock;
-        if( scrapIdBegin != 0 )
-        {
-            MgString scrapID = { scrapIdBegin, scrapIdEnd };
-            MgString scrapName = { scrapNameBegin, scrapNameEnd };
-            MgScrapFileGroup* scrapGroup = MgFindOrCreateScrapGroup(
-                context,
-                scrapKind,
-                scrapID,
-                inputFile );
-            if( scrapName.begin != scrapName.end )
+        int             outputLine;
+        int             source;         /* index into `sources` */
+        MgSourceLoc     loc;
+    } MgSourceMapRange;
+
+    typedef struct MgSourceMapT
+    {
+        MgSourceMapRange*   ranges;
+        int                 rangeCount;
+        MgInputFile**       sources;
+        int                 sourceCount;
+        int                 capacity;       /* of both `ranges` and `sources` */
+    } MgSourceMap;
+
+    void MgInitializeSourceMap(
+        MgSourceMap*    sourceMap )
+    {
+        sourceMap->ranges       = NULL;
+        sourceMap->rangeCount   = 0;
+        sourceMap->sources      = NULL;
+        sourceMap->sourceCount  = 0;
+        sourceMap->capacity     = 0;
+    }
+
+    void MgFreeSourceMap(
+        MgSourceMap*    sourceMap )
+    {
+        int capacity = sourceMap->capacity;
+        MgFree(kMgAllocKind_SourceMap, sourceMap->ranges, capacity * sizeof(MgSourceMapRange));
+        MgFree(kMgAllocKind_SourceMap, sourceMap->sources, capacity * sizeof(MgInputFile*));
+        MgInitializeSourceMap( sourceMap );
+    }
+#line 81 "source/source-map.md"
+    static void MgGrowSourceMap(
+        MgSourceMap*    sourceMap )
+    {
+        int capacity = sourceMap->capacity ? 2 * sourceMap->capacity : 16;
+        MgSourceMapRange* ranges = (MgSourceMapRange*) MgAllocate(kMgAllocKind_SourceMap, capacity * sizeof(MgSourceMapRange));
+        MgInputFile** sources = (MgInputFile**) MgAllocate(kMgAllocKind_SourceMap, capacity * sizeof(MgInputFile*));
+        if( sourceMap->rangeCount )
+            memcpy(ranges, sourceMap->ranges, sourceMap->rangeCount * sizeof(MgSourceMapRange));
+        if( sourceMap->sourceCount )
+            memcpy(sources, sourceMap->sources, sourceMap->sourceCount * sizeof(MgInputFile*));
+
+        int rangeCount = sourceMap->rangeCount;
+        int sourceCount = sourceMap->sourceCount;
+        MgFreeSourceMap( sourceMap );
+        sourceMap->ranges       = ranges;
+        sourceMap->rangeCount   = rangeCount;
+        sourceMap->sources      = sources;
+        sourceMap->sourceCount  = sourceCount;
+        sourceMap->capacity     = capacity;
+    }
+
+    void MgAddSourceMapRange(
+        MgSourceMap*    sourceMap,
+        int             outputLine,
+        MgInputFile*    inputFile,
+        MgSourceLoc     loc )
+    {
+        if( sourceMap->rangeCount == sourceMap->capacity )
+            MgGrowSourceMap( sourceMap );
+
+        int source = sourceMap->rangeCount ? sourceMap->ranges[sourceMap->rangeCount - 1].source : 0;
+        if( source >= sourceMap->sourceCount || sourceMap->sources[source] != inputFile )
+        {
+            for( source = 0; source < sourceMap->sourceCount; ++source )
             {
-                // \todo: check that we are the first!!!
-                scrapGroup->nameGroup->name = MgReadSpanElements(context, inputFile, firstLine, scrapName, kMgSpanFlags_Default);
+                if( sourceMap->sources[source] == inputFile )
+                    break;
             }
-    
-            MgScrap* scrap = (MgScrap*) malloc(sizeof(MgScrap));
-            scrap->fileGroup = scrapGroup;
-            scrap->sourceLoc = MgGetSourceLoc( inputFile, firstLine, firstLine->text.begin );
-            scrap->body = codeBlock;
-            scrap->next = 0;
-                
-            MgAddScrapToFileGroup( scrapGroup, scrap );
-    
-            element = MgCreateParentElement(
-                kMgElementKind_ScrapDef,
-                element );
-    
-            MgAttribute* attr = MgAddCustomAttribute( element, "$scrap" );
-            attr->scrap = scrap;
+            if( source == sourceMap->sourceCount )
+                sourceMap->sources[sourceMap->sourceCount++] = inputFile;
         }
-    
-    
-        return element;
+
+        MgSourceMapRange* range = &sourceMap->ranges[sourceMap->rangeCount++];
+        range->outputLine   = outputLine;
+        range->source       = source;
+        range->loc          = loc;
     }
-    
-#line 1164 "source/parse-block.md"
-    MgBool ParseLiterateScrapIntroduction(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgString        text,
-        MgScrapKind*    outScrapKind,
-        char const**    outScrapIdBegin,
-        char const**    outScrapIdEnd,
-        char const**    outScrapNameBegin,
-        char const**    outScrapNameEnd )
+#line 135 "source/source-map.md"
+    static void MgWriteJsonString(
+        MgWriter*   writer,
+        MgString    text )
     {
-        MgReader reader;
-        MgInitializeStringReader( &reader, text );
-    
-        // Allow scrap introduction to start with
-        // comment and whitespace:
-        int c = MgGetChar( &reader );
-        switch( c )
+        MgPutChar(writer, '"');
+        for( char const* cursor = text.begin; cursor != text.end; ++cursor )
         {
-        default:
-            MgUnGetChar( &reader, c );
-            break;
-    
-        case '/':
+            unsigned char c = (unsigned char) *cursor;
+            switch( c )
             {
-                int d = MgGetChar( &reader );
-                if( d != '/' )
+            case '"':   MgWriteCString(writer, "\\\""); break;
+            case '\\':  MgWriteCString(writer, "\\\\"); break;
+            default:
+                if( c < 0x20 )
                 {
-                    MgUnGetChar( &reader, d );
-                    MgUnGetChar( &reader, c );
-                    break;
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    MgWriteCString(writer, buffer);
+                }
+                else
+                {
+                    MgPutChar(writer, c);
                 }
-    
-                SkipWhiteSpace( &reader );
                 break;
             }
-    
-        // TODO: C-style "/* */" comments
         }
-    
-        if( MgGetChar(&reader) != '<' )
-            return MG_FALSE;
-        if( MgGetChar(&reader) != '<' )
-            return MG_FALSE;
-    
-        // look for a possible scrap kind marker
-        char const* savedCursor = reader.cursor;
-        char const* scrapKindBegin = savedCursor;
-        char const* scrapKindEnd = 0;
-        for( ;; )
+        MgPutChar(writer, '"');
+    }
+
+    static void MgWriteSourceMapHeader(
+        MgWriter*           writer,
+        MgOutputFile const* output )
+    {
+        MgWriteCString(writer, "{\n  \"version\": 1,\n  \"file\": ");
+        MgWriteJsonString(writer, MgTerminatedString(output->name));
+    }
+
+    static void MgWriteSourceMapJson(
+        MgWriter*           writer,
+        MgSourceMap*        sourceMap,
+        MgOutputFile const* output,
+        char* const*        sourcePaths )
+    {
+        MgWriteSourceMapHeader(writer, output);
+        MgWriteCString(writer, ",\n  \"sources\": [");
+        for( int ii = 0; ii < sourceMap->sourceCount; ++ii )
         {
-            int c = MgGetChar( &reader );
-            if( c == ':' )
+            if( ii )
+                MgWriteCString(writer, ", ");
+            MgWriteJsonString(writer, MgTerminatedString(sourcePaths[ii]));
+        }
+
+        MgWriteCString(writer, "],\n  \"ranges\": [");
+        for( int ii = 0; ii < sourceMap->rangeCount; ++ii )
+        {
+            MgSourceMapRange const* range = &sourceMap->ranges[ii];
+            char buffer[64];
+            snprintf(buffer, sizeof(buffer), "%s\n    [%d, %d, %d, %d]",
+                ii ? "," : "",
+                range->outputLine, range->source, range->loc.line, range->loc.col);
+            MgWriteCString(writer, buffer);
+        }
+        MgWriteCString(writer, "\n  ]\n}\n");
+    }
+#line 210 "source/source-map.md"
+    static char* MgGetCurrentDirectory(
+        size_t* outSize )
+    {
+        size_t size = 256;
+        for(;;)
+        {
+            char* buffer = (char*) MgAllocate(kMgAllocKind_OutputPath, size);
+    #ifdef _WIN32
+            if( _getcwd(buffer, (int) size) )
+    #else
+            if( getcwd(buffer, size) )
+    #endif
             {
-                scrapKindEnd = reader.cursor-1;
-                break;
+                *outSize = size;
+                return buffer;
             }
-    
-            if( !isalpha(c) )
-                break;
+            MgFree(kMgAllocKind_OutputPath, buffer, size);
+            if( errno != ERANGE )
+                return NULL;
+            size *= 2;
         }
-    
-        MgScrapKind scrapKind = kScrapKind_Unknown;
-        if( scrapKindEnd )
+    }
+#line 237 "source/source-map.md"
+    static char* MgGetAbsolutePath(
+        char const* directory,
+        MgString    path,
+        size_t*     outSize )
+    {
+        size_t pathSize = path.end - path.begin;
+        size_t directorySize = MgIsAbsolutePath(path) || !directory ? 0 : strlen(directory);
+        size_t size = directorySize + 1 + pathSize + 2;
+        char* result = (char*) MgAllocate(kMgAllocKind_OutputPath, size);
+        *outSize = size;
+
+        // join the two, then copy the components of the joined path to the result
+        char* joined = (char*) MgAllocate(kMgAllocKind_OutputPath, size);
+        char* joinedEnd = joined;
+        if( directorySize )
         {
-            // look for a kind
-            MgString scrapKindName = { scrapKindBegin, scrapKindEnd };
-            if( MgStringsAreEqual(scrapKindName, CString("file")) )
+            memcpy(joinedEnd, directory, directorySize);
+            joinedEnd += directorySize;
+            *joinedEnd++ = '/';
+        }
+        memcpy(joinedEnd, path.begin, pathSize);
+        joinedEnd += pathSize;
+        char const* cursor = joined;
+        char const* end = joinedEnd;
+
+        size_t rootSize = 0;
+    #ifdef _WIN32
+        if( end - cursor >= 2 && cursor[1] == ':' )
+        {
+            result[rootSize++] = cursor[0];
+            result[rootSize++] = ':';
+            cursor += 2;
+        }
+    #endif
+        result[rootSize++] = '/';
+
+        size_t resultSize = rootSize;
+        while( cursor != end )
+        {
+            char const* componentEnd = cursor;
+            while( componentEnd != end && !MgIsPathSeparator(*componentEnd) )
+                ++componentEnd;
+            size_t componentSize = componentEnd - cursor;
+
+            if( componentSize == 0 || (componentSize == 1 && cursor[0] == '.') )
             {
-                scrapKind = kScrapKind_OutputFile;
+                // nothing to add
             }
-            else if( MgStringsAreEqual(scrapKindName, CString("global")) )
+            else if( componentSize == 2 && cursor[0] == '.' && cursor[1] == '.' )
             {
-                scrapKind = kScrapKind_GlobalMacro;
+                while( resultSize > rootSize && result[resultSize - 1] != '/' )
+                    --resultSize;
+                if( resultSize > rootSize )
+                    --resultSize;
             }
-            else if( MgStringsAreEqual(scrapKindName, CString("local")) )
+            else
             {
-                scrapKind = kScrapKind_LocalMacro;
+                if( resultSize > rootSize )
+                    result[resultSize++] = '/';
+                memcpy(result + resultSize, cursor, componentSize);
+                resultSize += componentSize;
             }
-            else if( MgStringsAreEqual(scrapKindName, CString("raw")) )
+            cursor = componentEnd == end ? end : componentEnd + 1;
+        }
+        result[resultSize] = 0;
+
+        MgFree(kMgAllocKind_OutputPath, joined, size);
+        return result;
+    }
+#line 311 "source/source-map.md"
+    static char* MgGetRelativePath(
+        char const* currentDirectory,
+        MgString    mapDirectory,
+        char const* path,
+        size_t*     outSize )
+    {
+        size_t fromSize, toSize;
+        char* from = MgGetAbsolutePath(currentDirectory, mapDirectory, &fromSize);
+        char* to = MgGetAbsolutePath(currentDirectory, MgTerminatedString(path), &toSize);
+
+        char* result = NULL;
+        size_t rootSize = strchr(from, '/') - from + 1;
+        if( strncmp(from, to, rootSize) != 0 )
+        {
+            result = to;
+            *outSize = toSize;
+            to = NULL;
+        }
+        else
+        {
+            // skip the components that both paths share
+            char const* fromCursor = from + rootSize;
+            char const* toCursor = to + rootSize;
+            while( *fromCursor && *toCursor )
             {
-                scrapKind = kScrapKind_RawMacro;
+                size_t fromComponentSize = strcspn(fromCursor, "/");
+                size_t toComponentSize = strcspn(toCursor, "/");
+                if( fromComponentSize != toComponentSize || memcmp(fromCursor, toCursor, fromComponentSize) != 0 )
+                    break;
+                fromCursor += fromComponentSize;
+                toCursor += toComponentSize;
+                if( *fromCursor )
+                    ++fromCursor;
+                if( *toCursor )
+                    ++toCursor;
             }
-            else
+
+            int climbCount = *fromCursor ? 1 : 0;
+            for( char const* cursor = fromCursor; *cursor; ++cursor )
             {
-                fprintf(stderr, "unknown scrap kind: \"");
-                fwrite(scrapKindName.begin, 1, scrapKindName.end - scrapKindName.begin, stderr);
-                fprintf(stderr, "\"\n");
+                if( *cursor == '/' )
+                    ++climbCount;
             }
+
+            size_t restSize = strlen(toCursor);
+            *outSize = 3 * climbCount + restSize + 1;
+            result = (char*) MgAllocate(kMgAllocKind_OutputPath, *outSize);
+            char* cursor = result;
+            for( int ii = 0; ii < climbCount; ++ii )
+            {
+                memcpy(cursor, "../", 3);
+                cursor += 3;
+            }
+            memcpy(cursor, toCursor, restSize + 1);
         }
-        else
+
+        MgFree(kMgAllocKind_OutputPath, from, fromSize);
+        if( to )
+            MgFree(kMgAllocKind_OutputPath, to, toSize);
+        return result;
+    }
+#line 377 "source/source-map.md"
+    void MgAddSourceMapToOutputJob(
+        MgOutputJob*        job,
+        MgSourceMap*        sourceMap,
+        MgOutputFile const* output )
+    {
+        MgOutputFile mapFile;
+        MgInitializeOutputFileWithSuffix( &mapFile, output, ".map" );
+
+        size_t currentDirectorySize = 0;
+        char* currentDirectory = MgGetCurrentDirectory( &currentDirectorySize );
+        MgString mapDirectory = MgMakeString(output->path, output->name);
+        char** sourcePaths = (char**) MgAllocate(kMgAllocKind_SourceMap, (sourceMap->sourceCount + 1) * sizeof(char*));
+        size_t* sourcePathSizes = (size_t*) MgAllocate(kMgAllocKind_SourceMap, (sourceMap->sourceCount + 1) * sizeof(size_t));
+        for( int ii = 0; ii < sourceMap->sourceCount; ++ii )
+            sourcePaths[ii] = MgGetRelativePath( currentDirectory, mapDirectory, sourceMap->sources[ii]->path, &sourcePathSizes[ii] );
+
+        MgWriter writer;
+        int counter = 0;
+        MgInitializeCountingWriter( &writer, &counter );
+        MgWriteSourceMapJson( &writer, sourceMap, output, sourcePaths );
+
+        int size = counter;
+        char* buffer = (char*) MgAllocate(kMgAllocKind_OutputBuffer, size + 1);
+        buffer[size] = 0;
+        MgInitializeMemoryWriter( &writer, buffer );
+        MgWriteSourceMapJson( &writer, sourceMap, output, sourcePaths );
+
+        for( int ii = 0; ii < sourceMap->sourceCount; ++ii )
+            MgFree(kMgAllocKind_OutputPath, sourcePaths[ii], sourcePathSizes[ii]);
+        MgFree(kMgAllocKind_SourceMap, sourcePaths, (sourceMap->sourceCount + 1) * sizeof(char*));
+        MgFree(kMgAllocKind_SourceMap, sourcePathSizes, (sourceMap->sourceCount + 1) * sizeof(size_t));
+        if( currentDirectory )
+            MgFree(kMgAllocKind_OutputPath, currentDirectory, currentDirectorySize);
+
+        MgAddBufferToOutputJob( job, buffer, size + 1, MgMakeString(buffer, buffer + size), &mapFile );
+        MgFreeOutputFile( &mapFile );
+    }
+#line 423 "source/source-map.md"
+    void MgRemoveStaleSourceMap(
+        MgOutputFile const* output )
+    {
+        MgWriter writer;
+        int size = 0;
+        MgInitializeCountingWriter( &writer, &size );
+        MgWriteSourceMapHeader( &writer, output );
+
+        char* header = (char*) MgAllocate(kMgAllocKind_SourceMap, 2 * (size + 1));
+        char* existing = header + size + 1;
+        MgInitializeMemoryWriter( &writer, header );
+        MgWriteSourceMapHeader( &writer, output );
+
+        MgOutputFile mapFile;
+        MgInitializeOutputFileWithSuffix( &mapFile, output, ".map" );
+    #ifdef _WIN32
+        FILE* file = fopen(mapFile.path, "rb");
+    #else
+        int fd = openat(mapFile.directory, mapFile.name, O_RDONLY);
+        FILE* file = fd >= 0 ? fdopen(fd, "rb") : NULL;
+        if( fd >= 0 && !file )
+            close(fd);
+    #endif
+        if( file )
         {
-            reader.cursor = savedCursor;
+            MgBool isMap = fread(existing, 1, size, file) == (size_t) size
+                && memcmp(existing, header, size) == 0;
+            fclose(file);
+
+            int removed = 0;
+            if( isMap )
+            {
+    #ifdef _WIN32
+                removed = remove(mapFile.path);
+    #else
+                removed = unlinkat(mapFile.directory, mapFile.name, 0);
+    #endif
+            }
+            if( removed != 0 )
+                fprintf(stderr, "mangle: failed to remove the stale source map \"%s\"\n", mapFile.path);
         }
-    
-        char const* scrapIdBegin = reader.cursor;
-    
-        for(;;)
+
+        MgFreeOutputFile( &mapFile );
+        MgFree(kMgAllocKind_SourceMap, header, 2 * (size + 1));
+    }
+#line 5 "source/export-code.md"
+    typedef struct MgCodeWriterT MgCodeWriter;
+    typedef struct MgExpansionPieceT MgExpansionPiece;
+
+    void ExportScrapFileGroup(
+        MgContext*        context,
+        MgScrapFileGroup* scrapFileGroup,
+        MgCodeWriter*     writer );
+
+    static MgBool MgSpawnExpansionPiece(
+        MgContext*          context,
+        MgCodeWriter*       writer,
+        MgScrapFileGroup*   fileGroup );
+
+    static MgBool MgExpandCodeFileInParallel(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup,
+        MgCodeWriter*       writer,
+        long long           sizeBound );
+
+    static MgBool MgCheckExpansionRefLimits(
+        MgContext*          context,
+        MgScrapFileGroup*   root,
+        char const*         path );
+
+    static long long MgGetExpansionByteLimit(
+        MgContext*          context,
+        char const**        outOption );
+
+    static void MgReportExpansionByteLimit(
+        MgContext*          context,
+        MgScrapFileGroup*   root,
+        char const*         path,
+        long long           limit,
+        char const*         option );
+
+    void WriteInt(
+        MgRope*     rope,
+        int         value)
+    {
+        enum
         {
-            int c = MgGetChar(&reader);
-            if( c == -1 ) break;
-    
-            if( c == '|' )
+            kBufferSize = 16,
+        };
+        char buffer[kBufferSize];
+        char* cursor = &buffer[kBufferSize];
+        char* end = cursor;
+
+        int remaining = value;
+        do
+        {
+            int digit = remaining % 10;
+            remaining = remaining / 10;
+
+            *(--cursor) = '0' + digit;
+        } while( remaining != 0 );
+
+        MgAppendRopeBytes(rope, cursor, end - cursor);
+    }
+
+    /*
+    Get the path of `inputFile` as it appears in a `#line` directive,
+    quoted and escaped. This is computed once per input file.
+    */
+    static MgString MgGetLineDirectivePath(
+        MgInputFile*    inputFile )
+    {
+        if( inputFile->lineDirectivePath.begin )
+            return inputFile->lineDirectivePath;
+
+        size_t size = strlen(inputFile->path) + 2;
+        char* path = (char*) MgAllocate(kMgAllocKind_LineDirectivePath, size);
+        char* cursor = path;
+        *cursor++ = '"';
+        for( char const* cc = inputFile->path; *cc; ++cc )
+        {
+            switch( *cc )
             {
-                MgUnGetChar(&reader, c);
+            case '\\':
+                *cursor++ = '/';
+                break;
+
+            // TODO: other characters that might need escaping?
+
+            default:
+                *cursor++ = *cc;
                 break;
-            }
-    
-            if( c == '>' )
-            {
-                int d = MgGetChar(&reader);
-                MgUnGetChar(&reader, d );
-                if( d == '>' )
-                {
-                    MgUnGetChar(&reader, c);
-                    break;
-                }
             }
         }
-    
-        char const* scrapIdEnd = reader.cursor;
-        char const* scrapNameBegin = 0;
-        char const* scrapNameEnd = 0;
-    
-        int pipe = MgGetChar(&reader);
-        if( pipe != '|' )
+        *cursor++ = '"';
+
+        inputFile->lineDirectivePath = MgMakeString(path, cursor);
+        return inputFile->lineDirectivePath;
+    }
+
+    /*
+    A code writer builds the rope for a code file, and keeps track of
+    which input line each line of output maps to, so that it only emits a
+    `#line` directive when the mapping the compiler would infer (from the
+    last directive, plus the number of lines since) is wrong.
+
+    A location for the code that follows (e.g., at the start of a scrap,
+    or after a scrap reference) doesn't emit anything right away. It is
+    held as pending until text is actually written, so that a location
+    that is replaced before any text follows it never costs a directive.
+    Indentation is also only written once a line has text on it.
+
+    With `-source-map`, each directive is replaced by a range in a source
+    map (see `source-map.md`), which needs the output line number.
+
+    Scrap text is added to the rope by reference; only line breaks,
+    indentation and directives are generated (see `rope.md`).
+
+    When a code file is expanded in parallel (see `parallel.md`), each
+    piece of it is written by a *detached* code writer, which doesn't
+    know what was written before it. Until its first location is
+    flushed, a detached writer records that location rather than
+    deciding how to get there, and notes if anything it does would
+    have depended on the earlier output.
+
+    When a code file might be larger than the limits allow (see
+    `limits.md`), the writer is given a `byteLimit`, and expansion stops
+    as soon as the output grows past it.
+    */
+    struct MgCodeWriterT
+    {
+        MgRope*         rope;
+        MgSourceMap*    sourceMap;      /* `NULL` unless writing a source map */
+        int             outputLine;
+        MgInputFile*    file;           /* location of current output line, per the last `#line` */
+        int             line;
+        int             indent;         /* column to start text on current line at */
+        MgBool          lineHasText;    /* has anything been written on current line? */
+        MgInputFile*    pendingFile;    /* location for the next text, if not `NULL` */
+        MgSourceLoc     pendingLoc;
+
+        MgExpansionPiece*   piece;      /* piece being written, when expanding in parallel */
+        int                 workerIndex;
+        MgBool              detached;   /* is the state before the first location unknown? */
+        MgInputFile*        firstFile;  /* first location flushed while detached, if any */
+        MgSourceLoc         firstLoc;
+        MgBool              dependsOnEarlierOutput;
+
+        long long           byteLimit;  /* -1 for no limit */
+        MgBool              limitExceeded;
+    };
+
+    static void MgInitializeCodeWriter(
+        MgCodeWriter*   codeWriter,
+        MgRope*         rope,
+        MgSourceMap*    sourceMap )
+    {
+        codeWriter->rope        = rope;
+        codeWriter->sourceMap   = sourceMap;
+        codeWriter->outputLine  = 1;
+        codeWriter->file        = NULL;
+        codeWriter->line        = 0;
+        codeWriter->indent      = 0;
+        codeWriter->lineHasText = MG_FALSE;
+        codeWriter->pendingFile = NULL;
+        codeWriter->piece       = NULL;
+        codeWriter->workerIndex = 0;
+        codeWriter->detached    = MG_FALSE;
+        codeWriter->firstFile   = NULL;
+        codeWriter->dependsOnEarlierOutput = MG_FALSE;
+        codeWriter->byteLimit   = -1;
+        codeWriter->limitExceeded = MG_FALSE;
+    }
+
+    static void MgWriteCodeLineBreak(
+        MgCodeWriter*   codeWriter )
+    {
+        MgAppendRopeBytes(codeWriter->rope, "\n", 1);
+        codeWriter->outputLine++;
+    }
+
+    static void MgSetCodeLocation(
+        MgCodeWriter*   codeWriter,
+        MgInputFile*    inputFile,
+        MgSourceLoc     loc )
+    {
+        codeWriter->pendingFile = inputFile;
+        codeWriter->pendingLoc  = loc;
+    }
+
+    /*
+    Before text is written, make sure that the current output line maps
+    to the pending location, if there is one. If it already does, the
+    text just continues the line. If the location is the next line of
+    the same file, a line break is all we need. Otherwise we need a
+    directive, which must start a line of its own.
+    */
+    static void MgFlushCodeLocation(
+        MgCodeWriter*   codeWriter )
+    {
+        MgInputFile* file = codeWriter->pendingFile;
+        if( !file )
+        {
+            if( codeWriter->detached )
+                codeWriter->dependsOnEarlierOutput = MG_TRUE;
+            return;
+        }
+        codeWriter->pendingFile = NULL;
+
+        MgSourceLoc loc = codeWriter->pendingLoc;
+        if( codeWriter->detached )
+        {
+            codeWriter->detached    = MG_FALSE;
+            codeWriter->firstFile   = file;
+            codeWriter->firstLoc    = loc;
+        }
+        else if( file == codeWriter->file && loc.line == codeWriter->line )
         {
-            MgUnGetChar(&reader, pipe);
+            if( !codeWriter->lineHasText )
+                codeWriter->indent = loc.col;
+            return;
         }
-        else
+        else if( file == codeWriter->file && loc.line == codeWriter->line + 1 )
         {
-            scrapNameBegin = reader.cursor;
-            for(;;)
-            {
-                int c = MgGetChar(&reader);
-                if( c == -1 ) break;
-                if( c == '>' )
-                {
-                    int d = MgGetChar(&reader);
-                    MgUnGetChar(&reader, d);
-                    if( d == '>' )
-                    {
-                        MgUnGetChar(&reader, c);
-                        break;
-                    }
-                }
-            }
-            scrapNameEnd = reader.cursor;
+            MgWriteCodeLineBreak( codeWriter );
         }
-    
-        if( MgGetChar(&reader) != '>' )
-            return MG_FALSE;
-        if( MgGetChar(&reader) != '>' )
-            return MG_FALSE;
-    
-        if( MgPeekChar(&reader) == '+' )
-            MgGetChar(&reader);
-        if( MgGetChar(&reader) != '=' )
-            return MG_FALSE;
-    
-        SkipWhiteSpace( &reader );
-        if( MgGetChar(&reader) != -1 )
-            return MG_FALSE;
-    
-        TrimLeadingSpace(&scrapIdBegin, scrapIdEnd);
-        TrimTrailingSpace(scrapIdBegin, &scrapIdEnd);
-    
-        TrimLeadingSpace(&scrapNameBegin, scrapNameEnd);
-        TrimTrailingSpace(scrapNameBegin, &scrapNameEnd);
-    
-        *outScrapKind       = scrapKind;
-        *outScrapIdBegin    = scrapIdBegin;
-        *outScrapIdEnd      = scrapIdEnd;
-        *outScrapNameBegin  = scrapNameBegin;
-        *outScrapNameEnd    = scrapNameEnd;
-    
-        return MG_TRUE;
-    }
-    
-#line 1364 "source/parse-block.md"
-    MgElement* ParseHorizontalRule(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange*      ioLineRange,
-        char            c )
-    {
-        MgLine* firstLine = GetLine(ioLineRange);
-    
-        MgReader reader;
-        InitializeLineReader(&reader, firstLine);
-    
-        int count = 0;
-        for(;;)
+        else
         {
-            int d = MgGetChar(&reader);
-    
-            if( d == -1 )
-                break;
-    
-            if( d == c )
+            if( codeWriter->lineHasText )
+                MgWriteCodeLineBreak( codeWriter );
+            if( codeWriter->sourceMap )
             {
-                ++count;
+                MgAddSourceMapRange( codeWriter->sourceMap, codeWriter->outputLine, file, loc );
             }
-            else if( isspace(d) )
-            {}
             else
             {
-                return 0;
+                MgRope* rope = codeWriter->rope;
+                MgString path = MgGetLineDirectivePath(file);
+                MgAppendRopeBytes(rope, "#line ", 6);
+                WriteInt(rope, loc.line);
+                MgAppendRopeBytes(rope, " ", 1);
+                MgAppendRopeBytes(rope, path.begin, path.end - path.begin);
+                MgWriteCodeLineBreak( codeWriter );
             }
         }
-    
-        if( count < 3 )
-            return 0;
-    
-        Snip( firstLine, firstLine, ioLineRange );
-    
-        return MgCreateLeafElement(
-            kMgElementKind_HorizontalRule,
-            MgMakeString(NULL, NULL) );
+
+        codeWriter->file        = file;
+        codeWriter->line        = loc.line;
+        codeWriter->indent      = loc.col;
+        codeWriter->lineHasText = MG_FALSE;
     }
-    
-    MgElement* ParseHorizontalRule_Hypen(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+
+    /*
+    The `bounds` are the buffer that `text` lies in (see `MgAppendRopeText`).
+    */
+    static void MgWriteCodeText(
+        MgCodeWriter*   codeWriter,
+        MgString        text,
+        MgString        bounds )
     {
-        return ParseHorizontalRule( context, inputFile, ioLineRange, '-' );
+        MgFlushCodeLocation( codeWriter );
+        if( !codeWriter->lineHasText )
+        {
+            if( codeWriter->indent > 1 )
+                memset(MgReserveRopeBytes(codeWriter->rope, codeWriter->indent - 1), ' ', codeWriter->indent - 1);
+            codeWriter->lineHasText = MG_TRUE;
+        }
+        MgAppendRopeText( codeWriter->rope, text, bounds );
     }
-    
-    MgElement* ParseHorizontalRule_Asterisk(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+
+    /*
+    A line break moves a pending location on to the start of the next
+    line, rather than writing anything.
+    */
+    static void MgWriteCodeNewLine(
+        MgCodeWriter*   codeWriter,
+        int             indent )
     {
-        return ParseHorizontalRule( context, inputFile, ioLineRange, '*' );
+        if( codeWriter->pendingFile )
+        {
+            codeWriter->pendingLoc.line++;
+            codeWriter->pendingLoc.col = indent;
+            return;
+        }
+        if( codeWriter->detached )
+            codeWriter->dependsOnEarlierOutput = MG_TRUE;
+
+        MgWriteCodeLineBreak( codeWriter );
+        codeWriter->line++;
+        codeWriter->indent      = indent;
+        codeWriter->lineHasText = MG_FALSE;
     }
-    
-    MgElement* ParseHorizontalRule_Underscore(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+
+    /*
+    Lowering a scrap body to an array of `MgScrapOp`s is done in two
+    passes over the body: one to count the operations, and then another
+    (once `ops` has been allocated) to fill them in. Adjacent slices of
+    text are merged into a single operation.
+    */
+    typedef struct MgScrapLoweringT
     {
-        return ParseHorizontalRule( context, inputFile, ioLineRange, '_' );
-    }
-    
-#line 1452 "source/parse-block.md"
-    MgBool ParseLinkDefinitionTitle(
-        MgReader*   reader,
-        char const**    outTitleBegin,
-        char const**    outTitleEnd )
+        MgScrapOp*  ops;        /* `NULL` while counting */
+        int         opCount;
+        char const* textEnd;    /* end of the last text operation, if any */
+    } MgScrapLowering;
+
+    static void MgAddScrapTextOp(
+        MgScrapLowering*    lowering,
+        MgString            text )
     {
-        int openTitle = MgGetChar(reader);
-        int closeTitle;
-        switch(openTitle)
+        if( text.begin == text.end )
+            return;
+
+        if( lowering->textEnd && lowering->textEnd == text.begin )
         {
-        default:
-            return MG_FALSE;
-        case '"':
-        case '\'':
-            closeTitle = openTitle;
-            break;
-        case '(':
-            closeTitle = ')';
-            break;
+            if( lowering->ops )
+                lowering->ops[lowering->opCount - 1].text.end = text.end;
+            lowering->textEnd = text.end;
+            return;
         }
-    
-        char const* titleBegin = reader->cursor;
-        char const* titleEnd = MgFindMatching(reader, closeTitle, 1);
-        if( !titleEnd )
-            return MG_FALSE;
-    
-        // \todo: enforce that we find end of line?
-    
-        *outTitleBegin = titleBegin;
-        *outTitleEnd = titleEnd;
-        return MG_TRUE;
+
+        if( lowering->ops )
+        {
+            MgScrapOp* op = &lowering->ops[lowering->opCount];
+            op->kind = kMgScrapOp_Text;
+            op->text = text;
+        }
+        lowering->opCount++;
+        lowering->textEnd = text.end;
     }
-    
-    MgElement* ParseLinkDefinition(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+
+    static MgScrapOp* MgAddScrapOp(
+        MgScrapLowering*    lowering,
+        MgScrapOpKind       kind )
     {
-        MgString id;
-        MgLine* firstLine = GetLine(ioLineRange);
-    
-        MgReader reader;
-        InitializeLineReader(&reader, firstLine);
-    
-        // skip up to three spaces
-        for(int ii = 0; ii < 3; ++ii)
+        MgScrapOp* op = lowering->ops ? &lowering->ops[lowering->opCount] : NULL;
+        if( op )
+            op->kind = kind;
+        lowering->opCount++;
+        lowering->textEnd = NULL;
+        return op;
+    }
+
+    static void MgLowerScrapElements(
+        MgScrapLowering*    lowering,
+        MgNode              firstElement )
+    {
+        for( MgNode element = firstElement; !MgIsNullNode(element); element = MgGetNextSibling(element) )
         {
-            int c = MgGetChar(&reader);
-            if( c != ' ' )
+            switch( MgGetNodeKind(element) )
             {
-                MgUnGetChar(&reader, c);
+            case kMgElementKind_CodeBlock:
+            case kMgElementKind_Text:
+                MgAddScrapTextOp(lowering, MgGetNodeText(element));
+                MgLowerScrapElements(lowering, MgGetFirstChild(element));
+                break;
+
+            case kMgElementKind_LessThanEntity:
+                MgAddScrapTextOp(lowering, MgTerminatedString("<"));
+                break;
+            case kMgElementKind_GreaterThanEntity:
+                MgAddScrapTextOp(lowering, MgTerminatedString(">"));
+                break;
+            case kMgElementKind_AmpersandEntity:
+                MgAddScrapTextOp(lowering, MgTerminatedString("&"));
+                break;
+
+            case kMgElementKind_ScrapRef:
+                {
+                    MgScrapOp* op = MgAddScrapOp(lowering, kMgScrapOp_Ref);
+                    if( op )
+                    {
+                        op->ref.fileGroup = MgFindNodeAttribute(element, "$scrap-group")->scrapFileGroup;
+                        op->ref.resumeLoc = MgFindNodeAttribute(element, "$resume-at")->sourceLoc;
+                    }
+                }
+                break;
+
+            default:
+                assert(MG_FALSE);
                 break;
             }
+
+            if( MgNodeEndsLine(element) )
+                MgAddScrapOp(lowering, kMgScrapOp_NewLine);
         }
-    
-        // expect a '['
-        int openBrace = MgGetChar(&reader);
-        if( openBrace != '[' )
-            return 0;
-    
-        id = MgFindMatchingString(&reader, ']', 1);
-        if( !id.end )
-            return 0;
-    
-        // expect a ':'
-        int colon = MgGetChar(&reader);
-        if( colon != ':' )
-            return 0;
-    
-        // skip any white space
-        SkipWhiteSpace(&reader);
-    
-        // allow one '<' before the link
-        int leftAngle = MgGetChar(&reader);
-        if( leftAngle != '<' )
+    }
+
+    void MgLowerScrap(
+        MgScrap*    scrap )
+    {
+        MgScrapLowering lowering;
+        lowering.ops        = NULL;
+        lowering.opCount    = 0;
+        lowering.textEnd    = NULL;
+        MgLowerScrapElements(&lowering, MgGetScrapBody(scrap));
+
+        int opCount = lowering.opCount;
+        lowering.ops        = (MgScrapOp*) MgAllocate(kMgAllocKind_ScrapOps, opCount * sizeof(MgScrapOp) + 1);
+        lowering.opCount    = 0;
+        lowering.textEnd    = NULL;
+        MgLowerScrapElements(&lowering, MgGetScrapBody(scrap));
+
+        scrap->ops      = lowering.ops;
+        scrap->opCount  = opCount;
+
+        // with `-stream-docs`, the body was only kept to be lowered
+        if( scrap->fileGroup->inputFile->scrapText )
         {
-            MgUnGetChar(&reader, leftAngle);
+            MgFreeElements( scrap->body );
+            scrap->body = NULL;
         }
-    
-        // read the URL (assume it continues until white-space)
-        char const* urlBegin = reader.cursor;
-        char const* urlEnd = reader.cursor;
-        for(;;)
+    }
+
+    /*
+    A scrap group with no explicit kind gets the default kind for the run.
+    */
+    static MgScrapKind MgGetEffectiveScrapKind(
+        MgContext*          context,
+        MgScrapNameGroup*   nameGroup )
+    {
+        MgScrapKind kind = nameGroup->kind;
+        if( kind == kScrapKind_Unknown )
+            kind = context->defaultScrapKind;
+        return kind;
+    }
+
+    /*
+    The size of an expansion is computed bottom-up over the graph of scrap
+    references, by visiting each group once and adding the sizes of the
+    groups it references. The text of a group, its line breaks, and the
+    indentation of each line are counted exactly. Whether a `#line`
+    directive is written depends on what was written before it, so we
+    count the largest directive (and line break, and indentation) that
+    each change of location could produce, which makes the result an
+    upper bound rather than an exact size.
+
+    Sizes saturate at `kMgMaxExpandedSize`, so that the exponential sizes
+    that can come of referencing a macro many times over, at several
+    levels, don't overflow.
+    */
+    static long long const kMgMaxExpandedSize = (long long) 1 << 60;
+
+    static long long MgAddExpandedSizes(
+        long long   a,
+        long long   b )
+    {
+        return a > kMgMaxExpandedSize - b ? kMgMaxExpandedSize : a + b;
+    }
+
+    static long long MgGetLocationChangeSize(
+        MgContext*      context,
+        MgInputFile*    inputFile,
+        MgSourceLoc     loc )
+    {
+        long long size = 1 + (loc.col > 1 ? loc.col - 1 : 0);
+        if( !context->writeSourceMaps )
         {
-            int c = MgGetChar( &reader );
-            if( c == -1 || c == '>' || isspace(c) )
-            {
-                MgUnGetChar(&reader, c);
-                break;
-            }
-            urlEnd = reader.cursor;
+            MgString path = MgGetLineDirectivePath(inputFile);
+            size += sizeof("#line  \n") - 1 + 10 + (path.end - path.begin);
         }
-    
-        // expect an opening '<' to be matched by '>'
-        if( leftAngle == '<' )
+        return size;
+    }
+
+    static long long MgGetScrapFileGroupExpandedSize(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup );
+
+    /*
+    The expansion of a local macro only uses one file group, so that is
+    where its size (and hash) is kept; for every other kind, it is kept
+    on the name group.
+    */
+    static MgExpandedSize* MgGetExpandedSizeRecord(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup )
+    {
+        MgScrapNameGroup* nameGroup = fileGroup->nameGroup;
+        if( MgGetEffectiveScrapKind(context, nameGroup) == kScrapKind_LocalMacro )
+            return &fileGroup->expandedSize;
+        return &nameGroup->expandedSize;
+    }
+
+    /*
+    With `-output-hashes`, we also compute a hash of each expansion (see
+    `output-hash.md`). The content hash of a scrap covers its lowered
+    operations: the text it writes, where its lines end, and the names
+    and resume locations of the groups it references.
+
+    How a run of text is split into operations depends on how it was
+    parsed (e.g., around entities, or with `-tangle-only`), so the bytes
+    of a run are hashed as one, followed by the size of the whole run.
+    */
+    static MgContentHash MgHashScrapOps(
+        MgScrap*    scrap )
+    {
+        MgContentHash hash = MG_CONTENT_HASH_OFFSET_BASIS;
+        long long textSize = 0;
+        MgScrapOp const* op = scrap->ops;
+        MgScrapOp const* end = op + scrap->opCount;
+        for( ; op != end; ++op )
         {
-            int rightAngle = MgGetChar( &reader );
-            if( rightAngle != '>' )
-                return 0;
+            if( op->kind == kMgScrapOp_Text )
+            {
+                hash = MgHashContentBytes(hash, op->text.begin, op->text.end - op->text.begin);
+                textSize += op->text.end - op->text.begin;
+                continue;
+            }
+
+            hash = MgHashContentInteger(hash, textSize);
+            hash = MgHashContentInteger(hash, op->kind);
+            textSize = 0;
+            if( op->kind == kMgScrapOp_Ref )
+            {
+                hash = MgHashContentString(hash, op->ref.fileGroup->nameGroup->id);
+                hash = MgHashContentInteger(hash, op->ref.resumeLoc.line);
+                hash = MgHashContentInteger(hash, op->ref.resumeLoc.col);
+            }
         }
-    
-        // \todo: should we check that the URL is non-empty?
-    
-        SkipWhiteSpace(&reader);
-    
-        // now look for the title
-        char const* titleBegin = 0;
-        char const* titleEnd = 0;
-        if( !MgAtEnd(&reader) )
+        return MgHashContentInteger(hash, textSize);
+    }
+
+    /*
+    Add the expansion of `scrap` to `expansion`, which is being computed
+    for the group that the scrap belongs to. Besides the bound on its
+    size, we count the bytes that the scrap writes itself (not counting
+    the groups it references), and the number of references that get
+    expanded, for the limits in `MgCheckExpansionLimits`.
+
+    With `-output-hashes`, the scrap is also folded into the hash of the
+    group: its content hash, its location and the path of its file
+    (which end up in `#line` directives), and the hash of each group it
+    references, which makes the result a Merkle hash of everything the
+    expansion reads.
+
+    Returns `MG_FALSE` if the expansion would never terminate.
+    */
+    static MgBool MgAddScrapExpandedSize(
+        MgContext*      context,
+        MgScrap*        scrap,
+        MgExpandedSize* expansion )
+    {
+        MgInputFile* inputFile = scrap->fileGroup->inputFile;
+        long long ownBytes = 0;
+        if( scrap->fileGroup->nameGroup->kind != kScrapKind_RawMacro )
+            ownBytes = MgGetLocationChangeSize(context, inputFile, scrap->sourceLoc);
+
+        if( scrap->opCount < 0 )
+            MgLowerScrap( scrap );
+
+        MgBool hashing = context->outputHashes != NULL;
+        if( hashing )
         {
-            ParseLinkDefinitionTitle(
-                &reader,
-                &titleBegin,
-                &titleEnd );
+            MgContentHash hash = expansion->hash;
+            hash = MgHashContentInteger(hash, (long long) MgHashScrapOps(scrap));
+            hash = MgHashContentString(hash, MgTerminatedString(inputFile->path));
+            hash = MgHashContentInteger(hash, scrap->sourceLoc.line);
+            hash = MgHashContentInteger(hash, scrap->sourceLoc.col);
+            expansion->hash = hash;
         }
-        else
+
+        long long newLineSize = 1 + (scrap->sourceLoc.col > 1 ? scrap->sourceLoc.col - 1 : 0);
+        MgScrapOp const* op = scrap->ops;
+        MgScrapOp const* end = op + scrap->opCount;
+        for( ; op != end; ++op )
         {
-            MgLine* secondLine = GetLine(ioLineRange);
-            InitializeLineReader(&reader, secondLine);
-            SkipWhiteSpace(&reader);
-    
-            if( !ParseLinkDefinitionTitle(
-                &reader,
-                &titleBegin,
-                &titleEnd ) )
+            switch( op->kind )
             {
-                UnGetLine(ioLineRange, secondLine);
+            case kMgScrapOp_Text:
+                ownBytes = MgAddExpandedSizes(ownBytes, op->text.end - op->text.begin);
+                break;
+
+            case kMgScrapOp_NewLine:
+                ownBytes = MgAddExpandedSizes(ownBytes, newLineSize);
+                break;
+
+            case kMgScrapOp_Ref:
+                {
+                    long long refSize = MgGetScrapFileGroupExpandedSize(context, op->ref.fileGroup);
+                    if( refSize < 0 )
+                        return MG_FALSE;
+                    MgExpandedSize const* ref = MgGetExpandedSizeRecord(context, op->ref.fileGroup);
+                    expansion->bytes = MgAddExpandedSizes(expansion->bytes, refSize);
+                    expansion->refCount = MgAddExpandedSizes(expansion->refCount, MgAddExpandedSizes(ref->refCount, 1));
+                    if( hashing )
+                        expansion->hash = MgHashContentInteger(expansion->hash, (long long) ref->hash);
+                    if( op->ref.fileGroup->nameGroup->kind != kScrapKind_RawMacro )
+                        ownBytes = MgAddExpandedSizes(ownBytes, MgGetLocationChangeSize(context, inputFile, op->ref.resumeLoc));
+                }
+                break;
             }
         }
-    
-        MgReferenceLink* ref = MgFindOrCreateReferenceLink(
-            inputFile,
-            id );
-    
-        // \todo: how to handle redefinition?
-        ref->url.begin = urlBegin;
-        ref->url.end = urlEnd;
-        ref->title.begin = titleBegin;
-        ref->title.end = titleEnd;
-    
-        // we have to return a non-NULL element to indicate
-        // a successful parse...
-        return MgCreateLeafElement(
-            kMgElementKind_Text,
-            MgMakeString(NULL, NULL));
+
+        expansion->bytes = MgAddExpandedSizes(expansion->bytes, ownBytes);
+        expansion->ownBytes = MgAddExpandedSizes(expansion->ownBytes, ownBytes);
+        return MG_TRUE;
     }
-    
-#line 1605 "source/parse-block.md"
-    int CountTableLinePipes(
-        MgLine*   line)
+
+    /*
+    Get a bound on the number of bytes that expanding `fileGroup` will
+    write, or -1 if the expansion would never terminate, because a scrap
+    refers to itself (directly or not). That error is reported here,
+    once per group involved.
+    */
+    static long long MgGetScrapFileGroupExpandedSize(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup )
     {
-        MgReader reader;
-        InitializeLineReader(&reader, line);
-    
-        int pipeCount = 0;
-        for( ;; )
+        MgScrapNameGroup* nameGroup = fileGroup->nameGroup;
+        MgScrapKind kind = MgGetEffectiveScrapKind(context, nameGroup);
+        MgBool isLocal = kind == kScrapKind_LocalMacro;
+        MgExpandedSize* expandedSize = MgGetExpandedSizeRecord(context, fileGroup);
+        switch( expandedSize->state )
         {
-            int c = MgGetChar(&reader);
-            if( c == -1 )
+        case kMgExpandedSize_Known:
+            return expandedSize->bytes;
+
+        case kMgExpandedSize_Recursive:
+            return -1;
+
+        case kMgExpandedSize_Computing:
+            fprintf(stderr, "mangle: scrap \"%.*s\" is used in its own expansion\n",
+                (int)(nameGroup->id.end - nameGroup->id.begin), nameGroup->id.begin);
+            expandedSize->state = kMgExpandedSize_Recursive;
+            return -1;
+
+        case kMgExpandedSize_Unknown:
+            break;
+        }
+
+        expandedSize->state = kMgExpandedSize_Computing;
+        MgExpandedSize expansion;
+        memset(&expansion, 0, sizeof(expansion));
+        expansion.hash = MgHashContentInteger(MG_CONTENT_HASH_OFFSET_BASIS, kind);
+        MgBool terminates = MG_TRUE;
+        for( MgScrapFileGroup* group = isLocal ? fileGroup : nameGroup->firstFileGroup; group && terminates; group = group->next )
+        {
+            for( MgScrap* scrap = group->firstScrap; scrap && terminates; scrap = scrap->next )
+                terminates = MgAddScrapExpandedSize(context, scrap, &expansion);
+            if( isLocal )
                 break;
-            else if( c == '|' )
-                ++pipeCount;
-            else if( c == '\\' )
-                MgGetChar(&reader);
         }
-        return pipeCount;
+
+        if( !terminates )
+        {
+            expandedSize->state = kMgExpandedSize_Recursive;
+            return -1;
+        }
+        expansion.state = kMgExpandedSize_Known;
+        *expandedSize = expansion;
+        return expansion.bytes;
     }
-    
-    MgElement* ParseTableCell(
+
+    /*
+    Once lowered, exporting a scrap is a simple loop over its operations.
+    The text of a scrap lies in the text of its input file, or in the
+    file's retained scrap text once that has been released.
+    */
+    void ExportScrapOps(
         MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgReader*   reader,
-        MgElementKind   kind )
+        MgScrap*        scrap,
+        MgCodeWriter*   writer,
+        int             indent )
     {
-        char const* cellBegin   = reader->cursor;
-        char const* cellEnd     = cellBegin;
-        for( ;; )
+        MgInputFile* inputFile = scrap->fileGroup->inputFile;
+        MgString bounds = inputFile->text.begin ? inputFile->text
+            : MgMakeString(inputFile->scrapText, inputFile->scrapText + inputFile->scrapTextSize);
+
+        MgScrapOp const* op = scrap->ops;
+        MgScrapOp const* end = op + scrap->opCount;
+        for( ; op != end; ++op )
         {
-            cellEnd = reader->cursor;
-            int c = MgGetChar( reader );
-            if( c == '|' || c == -1 )
+            switch( op->kind )
             {
-                MgUnGetChar(reader, c);
+            case kMgScrapOp_Text:
+                MgWriteCodeText(writer, op->text, bounds);
+                break;
+
+            case kMgScrapOp_NewLine:
+                MgWriteCodeNewLine(writer, indent);
+                break;
+
+            case kMgScrapOp_Ref:
+                {
+                    MgScrapFileGroup* scrapGroup = op->ref.fileGroup;
+                    if( !MgSpawnExpansionPiece(context, writer, scrapGroup) )
+                        ExportScrapFileGroup(context, scrapGroup, writer);
+                    if( writer->limitExceeded )
+                        return;
+                    if(scrapGroup->nameGroup->kind != kScrapKind_RawMacro)
+                    {
+                        MgSetCodeLocation(writer, scrap->fileGroup->inputFile, op->ref.resumeLoc);
+                    }
+                }
                 break;
-            }
-    
-            // allow escapes?
-            if( c == '\\' )
-            {
-                int d = MgGetChar(reader);
             }
         }
-    
-        MgElement* firstChild = MgReadSpanElements(context, inputFile, line, MgMakeString(cellBegin, cellEnd), kMgSpanFlags_Default);
-        return MgCreateParentElement(
-            kind,
-            firstChild );
     }
-    
-    MgBool ParseTableAlignments(
-        MgLine* line)
+
+    void ExportScrapText(
+        MgContext*      context,
+        MgScrap*        scrap,
+        MgCodeWriter*   writer )
     {
-        MgReader reader;
-        InitializeLineReader(&reader, line);
-    
-        int pipeCount = 0;
-        int columnCount = 0;
-        for( ;; )
+        if(scrap->fileGroup->nameGroup->kind != kScrapKind_RawMacro)
         {
-            MgBool leftJustify = MG_FALSE;
-            MgBool rightJustify = MG_FALSE;
-    
-            if( MgPeekChar(&reader) == '|' )
-            {
-                MgGetChar(&reader);
-                ++pipeCount;
-            }
-    
-            if( MgPeekChar(&reader) == -1 )
-                break;
-    
-            ++columnCount;
-            if( MgPeekChar(&reader) == ':' )
-            {
-                MgGetChar(&reader);
-                leftJustify = MG_TRUE;
-            }
-    
-            while( MgPeekChar(&reader) == '-' )
-                MgGetChar(&reader);
-    
-            if( MgPeekChar(&reader) == ':' )
-            {
-                MgGetChar(&reader);
-                rightJustify = MG_TRUE;
-            }
-    
-            int next = MgPeekChar(&reader);
-            if( next != -1 && next != '|' )
-                return MG_FALSE;
+            MgSetCodeLocation(writer, scrap->fileGroup->inputFile, scrap->sourceLoc);
         }
-    
-        return pipeCount != 0;
+        if( scrap->opCount < 0 )
+            MgLowerScrap( scrap );
+        ExportScrapOps(
+            context,
+            scrap,
+            writer,
+            scrap->sourceLoc.col );
     }
-    
-    MgElement* ParseTableRow(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         line,
-        MgElementKind   cellKind )
+
+
+    void ExportScrapFileGroupImpl(
+        MgContext*        context,
+        MgScrapFileGroup* fileGroup,
+        MgCodeWriter*     writer )
     {
-        MgReader reader;
-        InitializeLineReader( &reader, line );
-    
-        // start reading cells
-        MgElement* firstCell = 0;
-        MgElement* lastCell = 0;
-        for(;;)
+        MgScrap* scrap = fileGroup->firstScrap;
+        while( scrap && !writer->limitExceeded )
         {
-            // note that this treats a pipe at the start
-            // of the line as always being a decorative pipe
-            if( MgPeekChar(&reader) == '|' )
-            {
-                MgGetChar(&reader);
-            }
-    
-            // end of line?
-            //
-            // note that this always treats a pipe at the end
-            // of the line as a decorative pipe
-            if( MgPeekChar(&reader) == -1 )
-                break;
-    
-            MgElement* cell = ParseTableCell(context, inputFile, line, &reader, cellKind);
-            if( lastCell )
-            {
-                lastCell->next = cell;
-            }
-            else
-            {
-                firstCell = cell;
-            }
-            lastCell = cell;
+            ExportScrapText( context, scrap, writer );
+            scrap = scrap->next;
         }
-    
-        return MgCreateParentElement(
-            kMgElementKind_TableRow,
-            firstCell );
     }
-    
-    MgElement* ParseTable(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        LineRange*  ioLineRange )
+
+    void ExportScrapNameGroupImpl(
+        MgContext*        context,
+        MgScrapNameGroup* nameGroup,
+        MgCodeWriter*     writer )
     {
-        MgLine* headerLine      = GetLine( ioLineRange );
-        MgLine* alignmentLine   = NULL;
-        MgLine* firstLine       = NULL;
-        MgLine* lastLine        = NULL;
-        LineRange innerRange;
-    
-        int headerPipes = CountTableLinePipes( headerLine );
-        if( headerPipes == 0 )
-            return 0;
-    
-        // \todo: how to do table cell alignment?
-        alignmentLine = GetLine( ioLineRange );
-        if( !alignmentLine || !ParseTableAlignments(alignmentLine) )
-            return 0;
-    
-        // find successive lines that might be table rows
-        for(;;)
+        MgScrapFileGroup* fileGroup = nameGroup->firstFileGroup;
+        while( fileGroup && !writer->limitExceeded )
+        {
+            ExportScrapFileGroupImpl( context, fileGroup, writer );
+            fileGroup = fileGroup->next;
+        }
+    }
+
+
+    /*
+    Each reference checks the output against the writer's `byteLimit`,
+    so that an expansion that grows out of control stops early. The text
+    written between two checks comes from a single scrap, so it can't
+    overshoot the limit by much.
+    */
+    void ExportScrapFileGroup(
+        MgContext*        context,
+        MgScrapFileGroup* fileGroup,
+        MgCodeWriter*     writer )
+    {
+        if( writer->byteLimit >= 0 && writer->rope->size > writer->byteLimit )
+            writer->limitExceeded = MG_TRUE;
+        if( writer->limitExceeded )
+            return;
+
+        double traceStart = MgBeginTraceSpan( context );
+        MgScrapKind kind = MgGetEffectiveScrapKind( context, fileGroup->nameGroup );
+
+        switch( kind )
+        {
+        default:
+            assert(0);
+            break;
+
+        case kScrapKind_GlobalMacro:
+        case kScrapKind_RawMacro:
+        case kScrapKind_OutputFile:
+            ExportScrapNameGroupImpl(context, fileGroup->nameGroup, writer);
+            break;
+
+        case kScrapKind_LocalMacro:
+            ExportScrapFileGroupImpl(context, fileGroup, writer);
+            break;
+        }
+        MgEndTraceSpan( context, traceStart, "expand scrap", "expand", fileGroup->nameGroup->id );
+    }
+
+    /*
+    Expand `root` and write it to `file`, or to standard output with
+    `-stdout` (in which case there is no file to compare against, and no
+    source map or hash to record). Returns `MG_FALSE` if the run should
+    stop, because the expansion would never end, is over one of the limits
+    in `limits.md`, or couldn't be written to standard output.
+    */
+    static MgBool MgWriteCodeExpansion(
+        MgContext*          context,
+        MgScrapFileGroup*   root,
+        MgOutputFile const* file )
+    {
+        double traceStart = MgBeginTraceSpan( context );
+        char const* path = file->path;
+        MgString id = root->nameGroup->id;
+        MgBool toStdout = context->writeToStdout;
+
+        MgBeginPhase( context, kMgPhase_CodeExpansion );
+        long long sizeBound = MgGetScrapFileGroupExpandedSize( context, root );
+        if( sizeBound < 0 )
+        {
+            fprintf(stderr, "mangle: not writing \"%s\", since its expansion would never end\n", path);
+            MgEndPhase( context );
+            MgEndTraceSpan( context, traceStart, "MgWriteCodeFile", "output", id );
+            return MG_FALSE;
+        }
+
+        if( !MgCheckExpansionRefLimits( context, root, path ) )
+        {
+            MgEndPhase( context );
+            MgEndTraceSpan( context, traceStart, "MgWriteCodeFile", "output", id );
+            return MG_FALSE;
+        }
+
+        // skip the whole expansion if nothing it reads has changed
+        MgContentHash outputHash = 0;
+        long long skippedSize = 0;
+        if( !toStdout )
+            outputHash = MgGetOutputHash( context, root->nameGroup );
+        if( !toStdout && MgIsOutputHashCurrent( context, file, outputHash, &skippedSize ) )
+        {
+            if( context->stats )
+                context->stats->outputsSkipped++;
+            context->totalOutputBytes += skippedSize;
+            MgEndPhase( context );
+            MgEndTraceSpan( context, traceStart, "MgWriteCodeFile", "output", id );
+            return MG_TRUE;
+        }
+
+        MgRope rope;
+        MgCodeWriter codeWriter;
+        MgSourceMap sourceMap;
+        MgInitializeSourceMap( &sourceMap );
+        MgSourceMap* sourceMapOrNull = context->writeSourceMaps ? &sourceMap : NULL;
+
+        // now construct the output rope
+        MgInitializeRope( &rope );
+        if( sizeBound < kMgRopeChunkSize )
+            rope.chunkSize = (size_t) sizeBound + 1;
+        MgInitializeCodeWriter( &codeWriter, &rope, sourceMapOrNull );
+
+        // only watch the size of the output if it might be over a limit
+        char const* byteLimitOption = NULL;
+        long long byteLimit = MgGetExpansionByteLimit( context, &byteLimitOption );
+        if( byteLimit >= 0 && sizeBound > byteLimit )
+            codeWriter.byteLimit = byteLimit;
+
+        if( !MgExpandCodeFileInParallel( context, root, &codeWriter, sizeBound ) )
+            ExportScrapFileGroup( context, root, &codeWriter );
+
+        MgCountPhaseWork( context, kMgPhase_CodeExpansion, rope.size, 1 );
+        MgEndPhase( context );
+
+        if( codeWriter.limitExceeded || (codeWriter.byteLimit >= 0 && rope.size > codeWriter.byteLimit) )
         {
-            MgLine* line = GetLine( ioLineRange );
-            if( !line )
-                break;
-    
-            int linePipes = CountTableLinePipes( line );
-            if( linePipes == 0 )
-            {
-                UnGetLine(ioLineRange, line);
-                break;
-            }
-            if( !firstLine )
-                firstLine = line;
-            lastLine = line;
+            MgReportExpansionByteLimit( context, root, path, byteLimit, byteLimitOption );
+            MgFreeRope( &rope );
+            MgFreeSourceMap( &sourceMap );
+            MgEndTraceSpan( context, traceStart, "MgWriteCodeFile", "output", id );
+            return MG_FALSE;
         }
-        // we need at least one line
-        if( !firstLine )
-            return 0;
-    
-        innerRange = Snip( firstLine, lastLine, ioLineRange );
-    
-        MgElement* firstRow = ParseTableRow(context, inputFile, headerLine, kMgElementKind_TableHeader);
-        MgElement* lastRow = firstRow;
-        for( MgLine* line = innerRange.begin; line != innerRange.end; ++line )
+        context->totalOutputBytes += rope.size;
+
+        if( toStdout )
         {
-            MgElement* row = ParseTableRow(context, inputFile, line, kMgElementKind_TableCell);
-            lastRow->next = row;
-            lastRow = row;
+            MgBool ok = MgWriteRopeToStdout( context, &rope );
+            MgFreeRope( &rope );
+            MgFreeSourceMap( &sourceMap );
+            MgEndTraceSpan( context, traceStart, "MgWriteCodeFile", "output", id );
+            return ok;
         }
-    
-        return MgCreateParentElement(
-            kMgElementKind_Table,
-            firstRow );
+
+        // hand the output over to be written, possibly behind the rest of the run
+        MgOutputJob* job = MgBeginOutputJob();
+        MgAddRopeToOutputJob( job, &rope, file );
+        if( sourceMapOrNull )
+        {
+            MgAddSourceMapToOutputJob( job, sourceMapOrNull, file );
+            MgFreeSourceMap( sourceMapOrNull );
+        }
+        else
+        {
+            MgRemoveStaleSourceMap( file );
+        }
+        job->recordHash = context->outputHashes != NULL;
+        job->hash       = outputHash;
+        MgSubmitOutputJob( context, job );
+        MgEndTraceSpan( context, traceStart, "MgWriteCodeFile", "output", id );
+        return MG_TRUE;
     }
-    
-#line 1810 "source/parse-block.md"
-    MgElement* ParseMetaData(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        LineRange*      ioLineRange )
+
+    /*
+    Write one code file, beneath `-code-dir` if it was given (see
+    `output-dir.md`). With `-only` and `-stdout`, this may be any other
+    scrap group, and a local macro is expanded once for each file that
+    defines it, in order. Returns `MG_FALSE` if the run should stop.
+    */
+    MgBool MgWriteCodeFile(
+        MgContext*          context,
+        MgScrapNameGroup*   codeFile )
     {
-        MgLine* firstLine = GetLine( ioLineRange );
-        if( !firstLine )
-            return NULL;
-    
-        MgReader reader;
-        InitializeLineReader( &reader, firstLine );
-    
-        // meta-data line can't start with whitespace
-        if( isspace(MgPeekChar(&reader)) )
-            return NULL;
-    
-        // read until a ':'
-        MgString key = MgFindMatchingString(&reader, ':', 1);
-        if( !key.end )
-            return NULL;
-    
-        MgString value = MgMakeString(reader.cursor, firstLine->text.end);
-        TrimTrailingSpace(value.begin, &value.end);
-        TrimLeadingSpace(&value.begin, value.end);
-    
-        MgElement* firstChild = MgCreateLeafElement(kMgElementKind_Text, value);
-        MgElement* lastChild = firstChild;
-    
-        for(;;)
+        MgOutputFile file;
+        MgInitializeOutputFile( &file, context->codeOutputRoot, codeFile->id, "" );
+        if( !context->writeToStdout )
+            MgOpenOutputFileDirectory( context, &file );
+
+        MgBool ok = MG_TRUE;
+        MgBool isLocal = MgGetEffectiveScrapKind( context, codeFile ) == kScrapKind_LocalMacro;
+        for( MgScrapFileGroup* fileGroup = codeFile->firstFileGroup; fileGroup && ok; fileGroup = isLocal ? fileGroup->next : NULL )
         {
-            MgLine* line = GetLine( ioLineRange );
-            if( !line )
-                break;
-    
-            InitializeLineReader( &reader, line );
-            if( !isspace(MgPeekChar(&reader)) )
-            {
-                UnGetLine( ioLineRange, line );
-                break;
-            }
-    
-            value = line->text;
-            TrimTrailingSpace(value.begin, &value.end);
-            TrimLeadingSpace(&value.begin, value.end);
-    
-            MgElement* child = MgCreateLeafElement(kMgElementKind_Text, value);
-            lastChild->next = child;
-            lastChild = child;
+            ok = MgWriteCodeExpansion( context, fileGroup, &file );
         }
-    
-        MgElement* element = MgCreateParentElement(
-            kMgElementKind_MetaData,
-            firstChild );
-        MgAddAttribute(element, "$key", key);
-        return element;
+        MgFreeOutputFile( &file );
+        return ok;
     }
-    
-    
+
     /*
-    Like `ParseBlockElements`, but only handles meta-data elements, and
-    not general Markdown document content.
+    Find the scrap group named by `-only`. The name may start with a
+    kind, as in `file:foo.c`, in which case the group must be of that
+    kind. A group that isn't a code file can only be written to standard
+    output. Errors are reported here, and result in `NULL`.
     */
-    MgElement* MgParseMetaDataElements(
-        MgContext*      context,
-        MgInputFile*    inputFile,
-        MgLine*         beginLines,
-        MgLine*         endLines )
+    MgScrapNameGroup* MgFindScrapGroupForOption(
+        MgContext*  context,
+        char const* name )
     {
-        MgElement* firstElement = NULL;
-        MgElement* lastElement  = NULL;
-    
-        LineRange lineRange = { beginLines, endLines };
-        for(;;)
+        static struct { char const* prefix; MgScrapKind kind; } const kKindPrefixes[] =
         {
-            SkipEmptyLines(&lineRange);
-            if( lineRange.begin == lineRange.end )
-                break;
-    
-            LineRange savedLineRange = lineRange;
-            MgElement* element = ParseMetaData(context, inputFile, &lineRange);
-            if( !element )
-            {
-                fprintf(stderr, "bad metadata line\n");
-                // if we failed to parse meta-data, skip a line and keep trying
-                lineRange = savedLineRange;
-                ++lineRange.begin;            
-                continue;
-            }
-    
-            if( lastElement )
-            {
-                lastElement->next = element;
-            }
-            else
+            { "file:",      kScrapKind_OutputFile },
+            { "global:",    kScrapKind_GlobalMacro },
+            { "local:",     kScrapKind_LocalMacro },
+            { "raw:",       kScrapKind_RawMacro },
+        };
+
+        MgString id = MgTerminatedString(name);
+        MgScrapKind kind = kScrapKind_Unknown;
+        for( size_t ii = 0; ii < sizeof(kKindPrefixes) / sizeof(kKindPrefixes[0]); ++ii )
+        {
+            size_t prefixSize = strlen(kKindPrefixes[ii].prefix);
+            if( strncmp(name, kKindPrefixes[ii].prefix, prefixSize) == 0 )
             {
-                firstElement = element;
+                id.begin += prefixSize;
+                kind = kKindPrefixes[ii].kind;
+                break;
             }
-            lastElement = element;
         }
-    
-        return firstElement;    
-    }
-    
-#line 2112 "source/parse-block.md"
-                                       
-    
-#line 111 "source/parse-block.md"
-    BLOCK_PARSE_FUNC(ParseBlockElement)
-    {
-        static const BlockParseFunc kBlockParseFuncs[] = {
-            
-#line 146 "source/parse-block.md"
-    
-#line 155 "source/parse-block.md"
-    &ParseLinkDefinition,
-    &ParseTable,
-    &ParseBlockLevelHtml,
-    &ParseBlockQuote,
-    &ParseIndentedCode,
-    &ParseBracketedCode_Backtick,
-    &ParseBracketedCode_Tilde,
-    &ParseAtxHeader,
-    
-#line 146 "source/parse-block.md"
-                                                    
-    
-#line 168 "source/parse-block.md"
-    &ParseHorizontalRule_Hypen,
-    &ParseHorizontalRule_Asterisk,
-    &ParseHorizontalRule_Underscore,
-    
-#line 147 "source/parse-block.md"
-                                                 
-    
-#line 173 "source/parse-block.md"
-    &ParseOrderedList,
-    &ParseUnorderedList,
-    
-#line 148 "source/parse-block.md"
-                                      
-    
-#line 180 "source/parse-block.md"
-    &ParseSetextHeader1,
-    &ParseSetextHeader2,
-    
-#line 149 "source/parse-block.md"
-                                               
-    
-#line 188 "source/parse-block.md"
-    &ParseDefaultParagraph,
-    
-#line 150 "source/parse-block.md"
-                                                  
-    
-#line 114 "source/parse-block.md"
-                                                     
-        };
-    
-        BlockParseFunc const* funcCursor = &kBlockParseFuncs[0];
-        for(;;)
+
+        MgScrapNameGroup* nameGroup = MgFindScrapNameGroup( context, id, MgHashString(id) );
+        if( !nameGroup )
         {
-            
-#line 131 "source/parse-block.md"
-    LineRange lineRange = *ioLineRange;
-    MgElement* element = (*funcCursor)( context, inputFile, &lineRange );
-    
-#line 120 "source/parse-block.md"
-                                                                  
-            
-#line 137 "source/parse-block.md"
-    if( element )
-    {
-        *ioLineRange = lineRange;            
-        return element;
-    }
-    
-#line 121 "source/parse-block.md"
-                                                                             
-            ++funcCursor;
+            fprintf(stderr, "mangle: there is no scrap named \"%s\"\n", name);
+            return NULL;
+        }
+        if( kind != kScrapKind_Unknown && MgGetEffectiveScrapKind(context, nameGroup) != kind )
+        {
+            fprintf(stderr, "mangle: the scrap \"%.*s\" isn't of the kind given in \"%s\"\n",
+                (int)(id.end - id.begin), id.begin, name);
+            return NULL;
+        }
+        if( nameGroup->kind != kScrapKind_OutputFile && !context->writeToStdout )
+        {
+            fprintf(stderr, "mangle: the scrap \"%s\" isn't a code file, so it can only be written with -stdout\n", name);
+            return NULL;
         }
+        return nameGroup;
     }
-    
-#line 2113 "source/parse-block.md"
-                                    
-    
-#line 158 "source/main.md"
-                           
-    
-#line 7 "source/writer.md"
-    typedef struct MgWriterT MgWriter;
-    
-#line 12 "source/writer.md"
-    typedef void (*MgPutCharFunc)( MgWriter*, int );
-    
-#line 25 "source/writer.md"
-    struct MgWriterT
+#line 18 "source/parallel.md"
+    typedef struct MgExpansionPartT MgExpansionPart;
+    struct MgExpansionPartT
     {
-        MgPutCharFunc   putCharFunc;
-        void*           userData;
+        MgExpansionPart*    next;
+        MgExpansionPiece*   piece;      /* if not `NULL`, a child piece; the fields below are unused */
+        MgRope              rope;
+        MgSourceMap         sourceMap;
+        MgCodeWriter        writer;     /* state at the end of the part */
     };
-    
-#line 34 "source/writer.md"
-    void MgPutChar(
-        MgWriter*   writer,
-        int         value )
+
+    struct MgExpansionPieceT
     {
-        writer->putCharFunc( writer, value );
-    }
-    
-#line 46 "source/writer.md"
-    void MgWriteString(
-        MgWriter* writer,
-        MgString  string )
+        MgContext*          context;
+        MgScrapFileGroup*   fileGroup;
+        MgExpansionPart*    firstPart;
+        MgExpansionPart*    lastPart;
+    };
+#line 41 "source/parallel.md"
+    enum
     {
-        char const* cursor = string.begin;
-        while( cursor != string.end )
-            MgPutChar( writer, *cursor++ );
+        kMgMinExpansionPieceSize = 256 * 1024,
+    };
+
+    #if MG_THREADS
+    static MgExpansionPiece* MgAllocateExpansionPiece(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup )
+    {
+        MgExpansionPiece* piece = (MgExpansionPiece*) MgAllocate(kMgAllocKind_Parallel, sizeof(MgExpansionPiece));
+        piece->context      = context;
+        piece->fileGroup    = fileGroup;
+        piece->firstPart    = NULL;
+        piece->lastPart     = NULL;
+        return piece;
     }
-    
-#line 58 "source/writer.md"
-    void MgWriteCString(
-        MgWriter*   writer,
-        char const* text)
+
+    static MgExpansionPart* MgAddExpansionPart(
+        MgExpansionPiece*   piece )
+    {
+        MgExpansionPart* part = (MgExpansionPart*) MgAllocate(kMgAllocKind_Parallel, sizeof(MgExpansionPart));
+        part->next  = NULL;
+        part->piece = NULL;
+        MgInitializeRope( &part->rope );
+        MgInitializeSourceMap( &part->sourceMap );
+
+        if( piece->lastPart )
+            piece->lastPart->next = part;
+        else
+            piece->firstPart = part;
+        piece->lastPart = part;
+        return part;
+    }
+
+    static void MgFreeExpansionPiece(
+        MgExpansionPiece*   piece )
     {
-        char const* cursor = text;
-        while( *cursor )
-            MgPutChar( writer, *cursor++ );
+        MgExpansionPart* part = piece->firstPart;
+        while( part )
+        {
+            MgExpansionPart* next = part->next;
+            if( part->piece )
+                MgFreeExpansionPiece( part->piece );
+            MgFreeRope( &part->rope );
+            MgFreeSourceMap( &part->sourceMap );
+            MgFree(kMgAllocKind_Parallel, part, sizeof(MgExpansionPart));
+            part = next;
+        }
+        MgFree(kMgAllocKind_Parallel, piece, sizeof(MgExpansionPiece));
     }
-    
-#line 75 "source/writer.md"
-    void MemoryWriter_PutChar(
-        MgWriter* writer,
-        int     value )
+    #endif
+#line 101 "source/parallel.md"
+    #if MG_THREADS
+    static void MgStartExpansionPart(
+        MgContext*      context,
+        MgCodeWriter*   writer )
     {
-        char* cursor = (char*) writer->userData;
-        *cursor++ = (char) value;
-        writer->userData = cursor;
+        MgExpansionPiece* piece = writer->piece;
+        int workerIndex = writer->workerIndex;
+        MgExpansionPart* part = MgAddExpansionPart( piece );
+        MgInitializeCodeWriter( writer, &part->rope, context->writeSourceMaps ? &part->sourceMap : NULL );
+        writer->piece       = piece;
+        writer->workerIndex = workerIndex;
+        writer->detached    = MG_TRUE;
     }
-    
-#line 87 "source/writer.md"
-    void MgInitializeMemoryWriter(
-        MgWriter*   writer,
-        void*       data )
+
+    static void MgEndExpansionPart(
+        MgCodeWriter*   writer )
     {
-        writer->putCharFunc = &MemoryWriter_PutChar;
-        writer->userData    = data;
+        writer->piece->lastPart->writer = *writer;
     }
-    
-#line 105 "source/writer.md"
-    void CountingWriter_PutChar(
-        MgWriter* writer,
-        int     value )
+    #endif
+#line 125 "source/parallel.md"
+    #if MG_THREADS
+    static void MgExpandPieceTask(
+        MgScheduler*    scheduler,
+        int             workerIndex,
+        void*           data )
+    {
+        MgExpansionPiece* piece = (MgExpansionPiece*) data;
+        MgContext* context = piece->context;
+
+        MgCodeWriter writer;
+        MgInitializeCodeWriter( &writer, NULL, NULL );
+        writer.piece        = piece;
+        writer.workerIndex  = workerIndex;
+        MgStartExpansionPart( context, &writer );
+
+        ExportScrapFileGroup( context, piece->fileGroup, &writer );
+
+        MgEndExpansionPart( &writer );
+    }
+    #endif
+#line 150 "source/parallel.md"
+    static MgBool MgSpawnExpansionPiece(
+        MgContext*          context,
+        MgCodeWriter*       writer,
+        MgScrapFileGroup*   fileGroup )
     {
-        int* counter = (int*) writer->userData;
-        ++(*counter);
+    #if MG_THREADS
+        if( !writer->piece )
+            return MG_FALSE;
+        if( fileGroup->nameGroup->kind == kScrapKind_RawMacro )
+            return MG_FALSE;
+        if( MgGetScrapFileGroupExpandedSize(context, fileGroup) < kMgMinExpansionPieceSize )
+            return MG_FALSE;
+
+        MgEndExpansionPart( writer );
+        MgExpansionPiece* child = MgAllocateExpansionPiece( context, fileGroup );
+        MgAddExpansionPart( writer->piece )->piece = child;
+        MgSpawnTask( context->scheduler, writer->workerIndex, MgExpandPieceTask, child );
+        MgStartExpansionPart( context, writer );
+        return MG_TRUE;
+    #else
+        return MG_FALSE;
+    #endif
     }
-    
-#line 117 "source/writer.md"
-    void MgInitializeCountingWriter(
-        MgWriter* writer,
-        int*    counter )
+#line 186 "source/parallel.md"
+    #if MG_THREADS
+    static MgBool MgJoinExpansionPart(
+        MgCodeWriter*       out,
+        MgExpansionPart*    part )
     {
-        writer->putCharFunc = &CountingWriter_PutChar;
-        writer->userData = counter;
-        *counter = 0;
+        MgCodeWriter const* state = &part->writer;
+        if( state->dependsOnEarlierOutput )
+            return MG_FALSE;
+
+        if( !state->firstFile )
+        {
+            if( state->pendingFile )
+                MgSetCodeLocation( out, state->pendingFile, state->pendingLoc );
+            return MG_TRUE;
+        }
+
+        if( state->firstFile == out->file && state->firstLoc.line == out->line )
+            return MG_FALSE;
+
+        MgSetCodeLocation( out, state->firstFile, state->firstLoc );
+        MgFlushCodeLocation( out );
+
+        int lineOffset = out->outputLine - 1;
+        MgAppendRope( out->rope, &part->rope );
+        if( out->sourceMap )
+        {
+            MgSourceMap* sourceMap = &part->sourceMap;
+            for( int ii = 0; ii < sourceMap->rangeCount; ++ii )
+            {
+                MgSourceMapRange range = sourceMap->ranges[ii];
+                MgAddSourceMapRange( out->sourceMap, range.outputLine + lineOffset, sourceMap->sources[range.source], range.loc );
+            }
+        }
+
+        out->outputLine     += state->outputLine - 1;
+        out->file           = state->file;
+        out->line           = state->line;
+        out->indent         = state->indent;
+        out->lineHasText    = state->lineHasText;
+        out->pendingFile    = state->pendingFile;
+        out->pendingLoc     = state->pendingLoc;
+        return MG_TRUE;
     }
-    
-#line 159 "source/main.md"
-                          
-    
-#line 8 "source/export.md"
-    MgAttribute* MgFindAttribute(
-        MgElement*  pp,
-        char const* id )
+
+    static MgBool MgJoinExpansionPiece(
+        MgCodeWriter*       out,
+        MgExpansionPiece*   piece )
     {
-        MgString idString = { id, id + strlen(id) };
-        for(MgAttribute* attr = pp->firstAttr; attr; attr = attr->next)
+        for( MgExpansionPart* part = piece->firstPart; part; part = part->next )
         {
-            if( MgStringsAreEqual(attr->id, idString) )
-                return attr;
+            MgBool joined = part->piece
+                ? MgJoinExpansionPiece( out, part->piece )
+                : MgJoinExpansionPart( out, part );
+            if( !joined )
+                return MG_FALSE;
         }
-        return 0;
+        return MG_TRUE;
     }
-    
-#line 27 "source/export.md"
-    MgBool TextIsSameAsFileOnDisk(
-        MgString  text,
-        char const* filePath)
+    #endif
+#line 255 "source/parallel.md"
+    static MgBool MgExpandCodeFileInParallel(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup,
+        MgCodeWriter*       writer,
+        long long           sizeBound )
     {
-        MgReader reader;
-        FILE* file = fopen(filePath, "rb");
-        if( !file )
+    #if MG_THREADS
+        if( context->jobCount <= 1 || sizeBound < 2 * (long long) kMgMinExpansionPieceSize )
             return MG_FALSE;
-    
-        MgInitializeStringReader(&reader, text);
-    
-        for(;;)
+        if( writer->byteLimit >= 0 )
+            return MG_FALSE;
+
+        if( !context->scheduler )
         {
-            int c = fgetc(file);
-            int d = MgGetChar(&reader);
-            if( c != d )
-            {
-                return MG_FALSE;
-            }
-    
-            if( c == -1 )
-                return MG_TRUE;
+            MgEnableAllocStatsLock();
+            context->scheduler = MgStartScheduler( context->jobCount );
         }
+
+        double traceStart = MgBeginTraceSpan( context );
+        MgExpansionPiece* root = MgAllocateExpansionPiece( context, fileGroup );
+        MgSpawnTask( context->scheduler, 0, MgExpandPieceTask, root );
+        MgRunScheduledTasks( context->scheduler );
+        MgEndTraceSpan( context, traceStart, "expand in parallel", "expand", fileGroup->nameGroup->id );
+
+        traceStart = MgBeginTraceSpan( context );
+        MgBool joined = MgJoinExpansionPiece( writer, root );
+        MgFreeExpansionPiece( root );
+        MgEndTraceSpan( context, traceStart, "join pieces", "expand", fileGroup->nameGroup->id );
+        if( joined )
+            return MG_TRUE;
+
+        MgRope* rope = writer->rope;
+        MgSourceMap* sourceMap = writer->sourceMap;
+        MgFreeRope( rope );
+        if( sourceMap )
+            MgFreeSourceMap( sourceMap );
+        MgInitializeCodeWriter( writer, rope, sourceMap );
+    #endif
+        return MG_FALSE;
+    }
+#line 19 "source/limits.md"
+    enum
+    {
+        kMgDefaultMaxOutputRefs = 16 << 20,
+        kMgDefaultMaxTotalRefs  = 64 << 20,
+    };
+
+    static long long const kMgDefaultMaxOutputBytes = (long long) 1 << 30;
+    static long long const kMgDefaultMaxTotalBytes  = (long long) 4 << 30;
+#line 40 "source/limits.md"
+    enum
+    {
+        kMgExpandedCountBufferSize = 32,
+    };
+
+    static char const* MgFormatExpandedCount(
+        char*       buffer,
+        long long   count )
+    {
+        snprintf(buffer, kMgExpandedCountBufferSize,
+            count >= kMgMaxExpandedSize ? "over %lld" : "%lld", count);
+        return buffer;
     }
-    
-#line 58 "source/export.md"
-    void MgWriteTextToFile(
-        MgString      text,
-        char const* filePath)
+
+    static void MgReportExpansionContributions(
+        MgContext*          context,
+        MgScrapFileGroup*   root );
+
+    static MgBool MgCheckExpansionRefLimits(
+        MgContext*          context,
+        MgScrapFileGroup*   root,
+        char const*         path )
     {
-        if( TextIsSameAsFileOnDisk(text, filePath) )
+        long long refCount = MgGetExpandedSizeRecord(context, root)->refCount;
+        long long totalRefs = MgAddExpandedSizes(context->totalRefs, refCount);
+        char count[kMgExpandedCountBufferSize];
+        if( context->maxOutputRefs && refCount > context->maxOutputRefs )
         {
-            return;
+            fprintf(stderr, "mangle: stopping, since expanding \"%s\" would follow %s references, more than the %lld allowed by -max-output-refs\n",
+                path, MgFormatExpandedCount(count, refCount), context->maxOutputRefs);
         }
-    
-        FILE* file = fopen(filePath, "wb");
-        if( !file )
+        else if( context->maxTotalRefs && totalRefs > context->maxTotalRefs )
         {
-            fprintf(stderr, "Failed to open \"%s\" for writing\n", filePath);
-            return;
+            fprintf(stderr, "mangle: stopping, since expanding \"%s\" would bring the references followed in this run to %s, more than the %lld allowed by -max-total-refs\n",
+                path, MgFormatExpandedCount(count, totalRefs), context->maxTotalRefs);
         }
-    
-        fwrite(text.begin, 1, text.end - text.begin, file);
-    
-        fclose(file);
+        else
+        {
+            context->totalRefs = totalRefs;
+            return MG_TRUE;
+        }
+
+        MgReportExpansionContributions( context, root );
+        return MG_FALSE;
     }
-    
-#line 160 "source/main.md"
-                          
-    
-#line 5 "source/export-code.md"
-    void ExportScrapFileGroup(
-        MgContext*        context,
-        MgScrapFileGroup* scrapFileGroup,
-        MgWriter*         writer );
-    
-    void ExportScrapElements(
-        MgContext*  context,
-        MgScrap*    scrap,
-        MgElement*  firstElement,
-        MgWriter*   writer,
-        int         indent );
-    
-    void WriteInt(
-        MgWriter*     writer,
-        int         value)
+#line 94 "source/limits.md"
+    static long long MgGetExpansionByteLimit(
+        MgContext*      context,
+        char const**    outOption )
     {
-        enum
+        long long limit = -1;
+        if( context->maxOutputBytes )
         {
-            kBufferSize = 16,
-        };
-        char buffer[kBufferSize];
-        char* cursor = &buffer[kBufferSize];
-        *(--cursor) = 0;
-    
-        int remaining = value;
-        do
+            limit = context->maxOutputBytes;
+            *outOption = "-max-output-bytes";
+        }
+        if( context->maxTotalBytes )
         {
-            int digit = remaining % 10;
-            remaining = remaining / 10;
-    
-            *(--cursor) = '0' + digit;
-        } while( remaining != 0 );
-    
-        MgWriteCString(writer, cursor);
+            long long remaining = context->maxTotalBytes - context->totalOutputBytes;
+            if( remaining < 0 )
+                remaining = 0;
+            if( limit < 0 || remaining < limit )
+            {
+                limit = remaining;
+                *outOption = "-max-total-bytes";
+            }
+        }
+        return limit;
     }
-    
-    static void Indent(
-        MgWriter*   writer,
-        int         indent )
+
+    static void MgReportExpansionByteLimit(
+        MgContext*          context,
+        MgScrapFileGroup*   root,
+        char const*         path,
+        long long           limit,
+        char const*         option )
     {
-        for( int ii = 1; ii < indent; ++ii )
-            MgWriteCString(writer, " ");    
+        fprintf(stderr, "mangle: stopping, since expanding \"%s\" would write more than the %lld bytes allowed by %s\n",
+            path, limit, option);
+        MgReportExpansionContributions( context, root );
     }
-    
-    void EmitLineDirectiveAndIndent(
-        MgWriter*     writer,
-        MgInputFile*  inputFile,
-        MgSourceLoc   loc)
+#line 144 "source/limits.md"
+    typedef struct MgExpansionContributionT
     {
-        MgWriteCString(writer, "\n#line ");
-        WriteInt(writer, loc.line);
-        MgWriteCString(writer, " \"");
-    
-        char const* cc = inputFile->path;
-        for(;;)
-        {
-            int c = *cc++;
-            if( !c ) break;
-    
-            switch(c)
-            {
-            case '\\':
-                MgPutChar(writer, '/');
-                break;
-    
-            // TODO: other characters that might need escaping?
-    
-            default:
-                MgPutChar(writer, c);
-                break;
-            }
-        }
-        MgWriteCString(writer, "\"\n");
-    
-        Indent( writer, loc.col );
+        MgScrapFileGroup*   fileGroup;
+        long long           bytes;
+    } MgExpansionContribution;
+
+    typedef struct MgExpansionReportT
+    {
+        MgExpansionContribution*    groups;     /* in the order the search finished them */
+        int                         groupCount;
+    } MgExpansionReport;
+
+    static MgScrapFileGroup* MgGetNextExpansionFileGroup(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup )
+    {
+        if( MgGetEffectiveScrapKind(context, fileGroup->nameGroup) == kScrapKind_LocalMacro )
+            return NULL;
+        return fileGroup->next;
     }
-    
-    void ExportScrapElement(
-        MgContext*  context,
-        MgScrap*    scrap,
-        MgElement*  element,
-        MgWriter*   writer,
-        int         indent )
+
+    static MgScrapFileGroup* MgGetFirstExpansionFileGroup(
+        MgContext*          context,
+        MgScrapFileGroup*   fileGroup )
+    {
+        if( MgGetEffectiveScrapKind(context, fileGroup->nameGroup) == kScrapKind_LocalMacro )
+            return fileGroup;
+        return fileGroup->nameGroup->firstFileGroup;
+    }
+
+    static void MgSearchExpansionGroups(
+        MgContext*          context,
+        MgExpansionReport*  report,
+        MgScrapFileGroup*   fileGroup )
     {
-        switch( element->kind )
+        MgExpandedSize* expandedSize = MgGetExpandedSizeRecord(context, fileGroup);
+        if( expandedSize->uses >= 0 )
+            return;
+        expandedSize->uses = 0;
+
+        for( MgScrapFileGroup* group = MgGetFirstExpansionFileGroup(context, fileGroup); group; group = MgGetNextExpansionFileGroup(context, group) )
         {
-        case kMgElementKind_CodeBlock:
-        case kMgElementKind_Text:
-            MgWriteString(writer, element->text);
-            ExportScrapElements(context, scrap, element->firstChild, writer, indent);
-            break;
-    
-        case kMgElementKind_NewLine:
-            MgWriteString(writer, element->text);
-            Indent( writer, indent );
-            break;
-    
-        case kMgElementKind_LessThanEntity:
-            MgWriteCString(writer, "<");
-            break;
-        case kMgElementKind_GreaterThanEntity:
-            MgWriteCString(writer, ">");
-            break;
-        case kMgElementKind_AmpersandEntity:
-            MgWriteCString(writer, "&");
-            break;
-    
-        case kMgElementKind_ScrapRef:
+            for( MgScrap* scrap = group->firstScrap; scrap; scrap = scrap->next )
             {
-                MgScrapFileGroup* scrapGroup = MgFindAttribute(element, "$scrap-group")->scrapFileGroup;
-                ExportScrapFileGroup(context, scrapGroup, writer);
-                if(scrapGroup->nameGroup->kind != kScrapKind_RawMacro)
+                for( int ii = 0; ii < scrap->opCount; ++ii )
                 {
-                    MgSourceLoc resumeLoc = MgFindAttribute(element, "$resume-at")->sourceLoc;
-                    EmitLineDirectiveAndIndent(writer, scrap->fileGroup->inputFile, resumeLoc);
+                    if( scrap->ops[ii].kind == kMgScrapOp_Ref )
+                        MgSearchExpansionGroups( context, report, scrap->ops[ii].ref.fileGroup );
                 }
             }
-            break;
-    
-        default:
-            assert(MG_FALSE);
-            break;
         }
+        report->groups[report->groupCount++].fileGroup = fileGroup;
     }
-    
-    void ExportScrapElements(
-        MgContext*  context,
-        MgScrap*    scrap,
-        MgElement*  firstElement,
-        MgWriter*   writer,
-        int         indent )
+#line 202 "source/limits.md"
+    enum
     {
-        for( MgElement* element = firstElement; element; element = element->next )
-            ExportScrapElement( context, scrap, element, writer, indent );
-    }
-    
-    void ExportScrapText(
-        MgContext*    context,
-        MgScrap*      scrap,
-        MgWriter*     writer )
+        kMgMaxReportedExpansionGroups = 10,
+    };
+
+    static long long MgGetExpansionContribution(
+        MgExpandedSize const*   expandedSize )
     {
-        if(scrap->fileGroup->nameGroup->kind != kScrapKind_RawMacro)
-        {
-            EmitLineDirectiveAndIndent(writer, scrap->fileGroup->inputFile, scrap->sourceLoc);
-        }
-        ExportScrapElements(
-            context,
-            scrap,
-            scrap->body,
-            writer,
-            scrap->sourceLoc.col );
+        long long ownBytes  = expandedSize->ownBytes;
+        long long uses      = expandedSize->uses;
+        if( ownBytes && uses > kMgMaxExpandedSize / ownBytes )
+            return kMgMaxExpandedSize;
+        return ownBytes * uses;
     }
-    
-    
-    void ExportScrapFileGroupImpl(
-        MgContext*        context,
-        MgScrapFileGroup* fileGroup,
-        MgWriter*         writer )
+
+    static int MgCompareExpansionContributions(
+        void const* left,
+        void const* right )
     {
-        MgScrap* scrap = fileGroup->firstScrap;
-        while( scrap )
-        {
-            ExportScrapText( context, scrap, writer );
-            scrap = scrap->next;
-        }
+        long long leftBytes = ((MgExpansionContribution const*) left)->bytes;
+        long long rightBytes = ((MgExpansionContribution const*) right)->bytes;
+        return leftBytes < rightBytes ? 1 : leftBytes > rightBytes ? -1 : 0;
     }
-    
-    void ExportScrapNameGroupImpl(
-        MgContext*        context,
-        MgScrapNameGroup* nameGroup,
-        MgWriter*         writer )
+
+    static void MgReportExpansionContributions(
+        MgContext*          context,
+        MgScrapFileGroup*   root )
     {
-        MgScrapFileGroup* fileGroup = nameGroup->firstFileGroup;
-        while( fileGroup )
+        int groupCount = 0;
+        for( MgScrapNameGroup* nameGroup = context->firstScrapNameGroup; nameGroup; nameGroup = nameGroup->next )
         {
-            ExportScrapFileGroupImpl( context, fileGroup, writer );
-            fileGroup = fileGroup->next;
+            nameGroup->expandedSize.uses = -1;
+            for( MgScrapFileGroup* fileGroup = nameGroup->firstFileGroup; fileGroup; fileGroup = fileGroup->next )
+            {
+                fileGroup->expandedSize.uses = -1;
+                groupCount++;
+            }
         }
-    }
-    
-    
-    void ExportScrapFileGroup(
-        MgContext*        context,
-        MgScrapFileGroup* fileGroup,
-        MgWriter*         writer )
-    {
-        MgScrapKind kind = fileGroup->nameGroup->kind;
-        if(kind == kScrapKind_Unknown)
+
+        MgExpansionReport report;
+        report.groups       = (MgExpansionContribution*) MgAllocate(kMgAllocKind_ExpansionReport, groupCount * sizeof(MgExpansionContribution));
+        report.groupCount   = 0;
+        MgSearchExpansionGroups( context, &report, root );
+
+        MgGetExpandedSizeRecord(context, root)->uses = 1;
+        for( int ii = report.groupCount - 1; ii >= 0; --ii )
         {
-            kind = context->defaultScrapKind;
+            MgScrapFileGroup* fileGroup = report.groups[ii].fileGroup;
+            long long uses = MgGetExpandedSizeRecord(context, fileGroup)->uses;
+            for( MgScrapFileGroup* group = MgGetFirstExpansionFileGroup(context, fileGroup); group; group = MgGetNextExpansionFileGroup(context, group) )
+            {
+                for( MgScrap* scrap = group->firstScrap; scrap; scrap = scrap->next )
+                {
+                    for( int jj = 0; jj < scrap->opCount; ++jj )
+                    {
+                        if( scrap->ops[jj].kind != kMgScrapOp_Ref )
+                            continue;
+                        MgExpandedSize* ref = MgGetExpandedSizeRecord(context, scrap->ops[jj].ref.fileGroup);
+                        ref->uses = MgAddExpandedSizes(ref->uses, uses);
+                    }
+                }
+            }
         }
-    
-        switch( kind )
+
+        for( int ii = 0; ii < report.groupCount; ++ii )
+            report.groups[ii].bytes = MgGetExpansionContribution(MgGetExpandedSizeRecord(context, report.groups[ii].fileGroup));
+        qsort(report.groups, report.groupCount, sizeof(MgExpansionContribution), MgCompareExpansionContributions);
+
+        fprintf(stderr, "mangle: the scrap groups that contribute the most to \"%.*s\" are:\n",
+            (int)(root->nameGroup->id.end - root->nameGroup->id.begin), root->nameGroup->id.begin);
+        for( int ii = 0; ii < report.groupCount && ii < kMgMaxReportedExpansionGroups; ++ii )
         {
-        default:
-            assert(0);
-            break;
-    
-        case kScrapKind_GlobalMacro:
-        case kScrapKind_RawMacro:
-        case kScrapKind_OutputFile:
-            ExportScrapNameGroupImpl(context, fileGroup->nameGroup, writer);
-            break;
-    
-        case kScrapKind_LocalMacro:
-            ExportScrapFileGroupImpl(context, fileGroup, writer);
-            break;
+            MgScrapFileGroup* fileGroup = report.groups[ii].fileGroup;
+            MgScrapNameGroup* nameGroup = fileGroup->nameGroup;
+            MgExpandedSize const* expandedSize = MgGetExpandedSizeRecord(context, fileGroup);
+            long long bytes = report.groups[ii].bytes;
+            char count[kMgExpandedCountBufferSize];
+            fprintf(stderr, "mangle:   %s%s bytes from \"%.*s\"",
+                bytes >= kMgMaxExpandedSize ? "" : "up to ",
+                MgFormatExpandedCount(count, bytes),
+                (int)(nameGroup->id.end - nameGroup->id.begin), nameGroup->id.begin);
+            if( MgGetEffectiveScrapKind(context, nameGroup) == kScrapKind_LocalMacro )
+                fprintf(stderr, " in \"%s\"", fileGroup->inputFile->path);
+            fprintf(stderr, ", expanded %s time%s\n",
+                MgFormatExpandedCount(count, expandedSize->uses), expandedSize->uses == 1 ? "" : "s");
         }
+        MgFree(kMgAllocKind_ExpansionReport, report.groups, groupCount * sizeof(MgExpansionContribution));
     }
-    
-    void MgWriteCodeFile(
-        MgContext*          context,
-        MgScrapNameGroup*   codeFile )
-    {
-        MgString id = codeFile->id;
-    
-        // \todo: alloca or malloc the name buffer when required...
-        char nameBuffer[1024];
-        char* writeCursor = &nameBuffer[0];
-        char const* readCursor = id.begin;
-        char const* end = id.end;
-        while( readCursor != end )
-        {
-            *writeCursor++ = *readCursor++;
-        }
-        *writeCursor++ = 0;
-    
-        MgWriter writer;
-    
-        // now construct the outputString
-        int counter = 0;
-        MgInitializeCountingWriter( &writer, &counter );
-        ExportScrapNameGroupImpl( context, codeFile, &writer );
-    
-        int outputSize = counter;
-        char* outputBuffer = (char*) malloc(outputSize + 1);
-        outputBuffer[outputSize] = 0;
-            
-        MgInitializeMemoryWriter( &writer, outputBuffer );
-        ExportScrapNameGroupImpl( context, codeFile, &writer );
-    
-        MgString outputText = MgMakeString( outputBuffer, outputBuffer + outputSize );
-        MgWriteTextToFile(outputText, nameBuffer);
-    }
-    
-#line 161 "source/main.md"
-                               
-    
 #line 5 "source/export-html.md"
     void WriteElement(
         MgContext*    context,
-        MgElement*  pp,
+        MgNode        pp,
         MgWriter*     output );
-    
+
     void WriteAttributes(
-        MgElement* pp,
+        MgNode        pp,
         MgWriter*     output )
     {
-        for(MgAttribute* attr = pp->firstAttr; attr; attr = attr->next)
+        for(MgAttribute* attr = MgGetNodeAttributes(pp); attr; attr = attr->next)
         {
             if( attr->id.begin[0] == '$' )
                 continue;
-    
+
             MgWriteCString(output, " ");
             MgWriteString( output, attr->id );
             MgWriteCString(output, "=\"");
@@ -3704,18 +8438,18 @@
             MgWriteCString(output, "\"");
         }
     }
-    
+
     void WriteElements(
         MgContext*  context,
-        MgElement*  firstElement,
+        MgNode      firstElement,
         MgWriter*     writer )
     {
-        for( MgElement* element = firstElement; element; element = element->next )
+        for( MgNode element = firstElement; !MgIsNullNode(element); element = MgGetNextSibling(element) )
         {
             WriteElement( context, element, writer );
         }
     }
-    
+
     void WriteScrapGroupName(
         MgContext*        context,
         MgWriter*         writer,
@@ -3723,28 +8457,42 @@
     {
         if( scrapGroup->name )
         {
-            WriteElements(context, scrapGroup->name, writer);
+            WriteElements(context, MgMakeElementNode(scrapGroup->name), writer);
         }
         else
         {
             MgWriteString(writer, scrapGroup->id);
         }
-    
+
+    }
+
+    /*
+    Parse the span-level contents of a block element, if that was deferred
+    (see `MgParseDeferredSpans`). Compact trees are always fully parsed.
+    */
+    static void MgParseDeferredNodeSpans(
+        MgContext*  context,
+        MgNode      node )
+    {
+        if( node.element && (node.element->flags & kMgElementFlag_DeferredSpans) )
+            MgParseDeferredSpans( context, node.element );
     }
-    
+
     void WriteElement(
         MgContext*    context,
-        MgElement*  pp,
+        MgNode        pp,
         MgWriter*     output )
     {
-        MgElementKind kind = pp->kind;
+        MgParseDeferredNodeSpans( context, pp );
+
+        MgElementKind kind = MgGetNodeKind(pp);
         switch( kind )
         {
         default:
             fprintf(stderr, "unknown: %d\n", kind);
             assert(0);
             break;
-    
+
         case kMgElementKind_Table:
             MgWriteCString(output, "<table>");
             break;
@@ -3757,7 +8505,7 @@
         case kMgElementKind_TableCell:
             MgWriteCString(output, "<td>");
             break;
-    
+
         case kMgElementKind_LessThanEntity:
             MgWriteCString(output, "&lt;");
             break;
@@ -3767,12 +8515,11 @@
         case kMgElementKind_AmpersandEntity:
             MgWriteCString(output, "&amp;");
             break;
-    
+
         case kMgElementKind_Text:
-        case kMgElementKind_NewLine:
         case kMgElementKind_HtmlBlock:
             break;
-    
+
         case kMgElementKind_Link:
             {
                 MgWriteCString(output, "<a");
@@ -3782,7 +8529,7 @@
             break;
         case kMgElementKind_ReferenceLink:
             {
-                MgReferenceLink* ref = MgFindAttribute(pp, "$referenceLink")->referenceLink;
+                MgReferenceLink* ref = MgFindNodeAttribute(pp, "$referenceLink")->referenceLink;
                 MgWriteCString(output, "<a href=\"");
                 MgWriteString(output, ref->url);
                 MgWriteCString(output, "\">");
@@ -3790,7 +8537,7 @@
             break;
         case kMgElementKind_ScrapDef:
             {
-                MgScrap* scrap = MgFindAttribute(pp, "$scrap")->scrap;
+                MgScrap* scrap = MgFindNodeAttribute(pp, "$scrap")->scrap;
                 MgWriteCString(output, "<div class='scrap-def'>&#x3008;<span class='scrap-name'>");
                 // output the scrap name (\todo: properly formatted)
                 WriteScrapGroupName(context, output, scrap->fileGroup->nameGroup);
@@ -3804,7 +8551,7 @@
             break;
         case kMgElementKind_ScrapRef:
             {
-                MgScrapFileGroup* scrapGroup = MgFindAttribute(pp, "$scrap-group")->scrapFileGroup;
+                MgScrapFileGroup* scrapGroup = MgFindNodeAttribute(pp, "$scrap-group")->scrapFileGroup;
                 MgWriteCString(output, "<span class='scrap-ref'>&#x3008;<span class='scrap-name'>");
                 // output the scrap name (\todo: properly formatted)
                 WriteScrapGroupName(context, output, scrapGroup->nameGroup);
@@ -3862,16 +8609,16 @@
             MgWriteCString(output, ">");
             break;
         }
-    
-        MgWriteString(output, pp->text);
-        WriteElements(context, pp->firstChild, output);
-    
+
+        MgWriteString(output, MgGetNodeText(pp));
+        WriteElements(context, MgGetFirstChild(pp), output);
+
         switch( kind )
         {
         default:
             assert(0);
             break;
-    
+
         case kMgElementKind_Table:
             MgWriteCString(output, "</table>");
             break;
@@ -3884,14 +8631,13 @@
         case kMgElementKind_TableCell:
             MgWriteCString(output, "</td>");
             break;
-    
+
         case kMgElementKind_LessThanEntity:
         case kMgElementKind_GreaterThanEntity:
         case kMgElementKind_AmpersandEntity:
             break;
-    
+
         case kMgElementKind_Text:
-        case kMgElementKind_NewLine:
         case kMgElementKind_HtmlBlock:
             break;
         case kMgElementKind_Link:
@@ -3954,11 +8700,13 @@
             MgWriteCString(output, ">");
             break;
         }
-    
+
+        if( MgNodeEndsLine(pp) )
+            MgWriteCString(output, "\n");
     }
-    
+
     //
-    
+
     static void WriteToFile(
         FILE* file,
         char const* begin,
@@ -3966,74 +8714,76 @@
     {
         fwrite(begin, 1, end-begin, file);
     }
-    
+
     static void MgWriteElementText(
-        MgElement*  element,
+        MgNode      element,
         MgWriter*   writer )
     {
         // TODO: some elements need special handling here...
-        MgWriteString( writer, element->text );
-    
-        MgElement* child = element->firstChild;
-        while( child )
+        MgWriteString( writer, MgGetNodeText(element) );
+
+        MgNode child = MgGetFirstChild(element);
+        while( !MgIsNullNode(child) )
         {
             MgWriteElementText( child, writer );
-            child = child->next;
+            if( MgNodeEndsLine(child) )
+                MgWriteCString( writer, "\n" );
+            child = MgGetNextSibling(child);
         }
     }
-    
-    MgElement* MgFindMetaDataInFile(
+
+    MgNode MgFindMetaDataInFile(
         MgInputFile*    file,
         const char*     key )
     {
         MgString keyString = MgTerminatedString(key);
-    
-        MgElement* element = file->firstElement;
-        for(; element; element = element->next)
+
+        MgNode element = MgGetDocumentNodes(file);
+        for(; !MgIsNullNode(element); element = MgGetNextSibling(element))
         {
-            if( element->kind != kMgElementKind_MetaData )
+            if( MgGetNodeKind(element) != kMgElementKind_MetaData )
                 continue;
-    
-            MgAttribute* keyAttr = MgFindAttribute(element, "$key");
+
+            MgAttribute* keyAttr = MgFindNodeAttribute(element, "$key");
             if( !keyAttr )
                 continue;
-    
+
             if( !MgStringsAreEqualNoCase(keyString, keyAttr->val) )
                 continue;
-    
+
             return element;
         }
-    
-        return NULL;
+
+        return MgMakeElementNode(NULL);
     }
-    
-    
-    
-    MgElement* MgFindMetaData(
+
+
+
+    MgNode MgFindMetaData(
         MgContext*      context,
         MgInputFile*    inputFile,
         const char*     key )
     {
-        MgElement* element = NULL;
-    
+        MgNode element;
+
         // look for file-specific meta-data
         element = MgFindMetaDataInFile( inputFile, key );
-        if( element ) return element;
-    
+        if( !MgIsNullNode(element) ) return element;
+
         // look for generic meta-data
         if( context->metaDataFile )
         {
             element = MgFindMetaDataInFile( context->metaDataFile, key );
-            if( element ) return element;        
+            if( !MgIsNullNode(element) ) return element;
         }
-    
-        return NULL;
+
+        return MgMakeElementNode(NULL);
     }
-    
+
     typedef void (*MgMetaDataFunc)(
-        MgElement*  metaData,
+        MgNode      metaData,
         void*       userData );
-    
+
     void MgForEachMetaDataInFile(
         MgInputFile*    file,
         const char*     key,
@@ -4041,24 +8791,24 @@
         void*           userData )
     {
         MgString keyString = MgTerminatedString(key);
-    
-        MgElement* element = file->firstElement;
-        for(; element; element = element->next)
+
+        MgNode element = MgGetDocumentNodes(file);
+        for(; !MgIsNullNode(element); element = MgGetNextSibling(element))
         {
-            if( element->kind != kMgElementKind_MetaData )
+            if( MgGetNodeKind(element) != kMgElementKind_MetaData )
                 continue;
-    
-            MgAttribute* keyAttr = MgFindAttribute(element, "$key");
+
+            MgAttribute* keyAttr = MgFindNodeAttribute(element, "$key");
             if( !keyAttr )
                 continue;
-    
+
             if( !MgStringsAreEqualNoCase(keyString, keyAttr->val) )
                 continue;
-    
+
             func( element, userData );
         }
     }
-    
+
     void MgForEachMetaData(
         MgContext*      context,
         MgInputFile*    file,
@@ -4069,13 +8819,13 @@
         // generic meta-data first
         if( context->metaDataFile )
             MgForEachMetaDataInFile( context->metaDataFile, key, func, userData );
-    
+
         // then file-specific meta-data
         MgForEachMetaDataInFile( file, key, func, userData );
     }
-    
+
     void MgCssMetaDataCallback(
-        MgElement*  cssElement,
+        MgNode      cssElement,
         void*       userData )
     {
         MgWriter* writer = (MgWriter*) userData;
@@ -4083,16 +8833,16 @@
         MgWriteElementText(cssElement, writer);
         MgWriteCString(writer, "'>\n");    
     }
-    
-    static MgElement* MgFindTitleElement(
-        MgElement* firstElement )
+
+    static MgNode MgFindTitleElement(
+        MgNode firstElement )
     {
         // only look along the top-level "spine" of the document
-        MgElement* element = firstElement;
-        MgElement* bestElement = NULL;
-        for(; element; element = element->next)
+        MgNode element = firstElement;
+        MgNode bestElement = MgMakeElementNode(NULL);
+        for(; !MgIsNullNode(element); element = MgGetNextSibling(element))
         {
-            switch(element->kind)
+            switch(MgGetNodeKind(element))
             {
             case kMgElementKind_Header1:
             case kMgElementKind_Header2:
@@ -4101,22 +8851,22 @@
             case kMgElementKind_Header5:
             case kMgElementKind_Header6:
                 break;
-    
+
             default:
                 continue; // only consider headers
             }
-    
+
             // here we rely on the fact that the header element
             // kinds are defined to have ascending order in the enum...
-            if( !bestElement || bestElement->kind > element->kind )
+            if( MgIsNullNode(bestElement) || MgGetNodeKind(bestElement) > MgGetNodeKind(element) )
             {
                 bestElement = element;
             }
         }
-    
+
         return bestElement;
     }
-    
+
     void MgWriteDoc(
         MgContext*        context,
         MgInputFile*      inputFile,
@@ -4127,110 +8877,105 @@
             "<html>\n"
             "<head>\n"
             "    <meta http-equiv=\"content-type\" content=\"text/html; charset=utf-8\" />\n");
-    
+
         // try to find a title to output
         // TODO: support title coming from command line or config file
-        MgElement* titleElement = MgFindMetaData(context, inputFile, "title");
-        if( !titleElement )
-            titleElement = MgFindTitleElement(inputFile->firstElement);
+        MgNode titleElement = MgFindMetaData(context, inputFile, "title");
+        if( MgIsNullNode(titleElement) )
+            titleElement = MgFindTitleElement(MgGetDocumentNodes(inputFile));
         MgWriteCString(writer, "<title>");
-        if( titleElement )
+        if( !MgIsNullNode(titleElement) )
+        {
+            MgParseDeferredNodeSpans(context, titleElement);
             MgWriteElementText(titleElement, writer);
+        }
         MgWriteCString(writer, "</title>\n");
-    
+
         // handle CSS meta-data
         MgForEachMetaData(context, inputFile, "css", &MgCssMetaDataCallback, writer);
-    
+
         // TODO: add other kinds of meta-data support
-    
+
         MgWriteCString(writer,
             "</head>\n"
             "<body>\n");
-    
+
         WriteElements(
             context,
-            inputFile->firstElement,
+            MgGetDocumentNodes(inputFile),
             writer );
-    
+
         MgWriteCString(writer,
             "</body>\n");
     }
-    
-    #ifdef _MSC_VER
-    char* stpcpy(char* dest, char const* src)
-    {
-        while( *dest++ = *src++ )
-        {}
-        return dest-1;
-    }
-    #endif
-    
+
     void MgWriteDocFileToPath(
-        MgContext*    context,
-        MgInputFile*  inputFile,
-        const char* path)
+        MgContext*          context,
+        MgInputFile*        inputFile,
+        MgOutputFile const* file)
     {
+        MgBeginPhase( context, kMgPhase_HtmlRender );
         MgWriter writer;
-    
+
         int counter = 0;
         MgInitializeCountingWriter( &writer, &counter );
-    
+
         // run the export logic once, to count the size needed
         MgWriteDoc( context, inputFile, &writer );
-    
+
         int size = counter;
-        char* data = (char*) malloc(size + 1);
+        char* data = (char*) MgAllocate(kMgAllocKind_OutputBuffer, size + 1);
         data[size] = 0; // \todo: shouldn't be required
-    
+
         MgInitializeMemoryWriter( &writer, data );
-    
+
         // run the export logic again, this time writing to the output buffer
         MgWriteDoc( context, inputFile, &writer );
-    
+
         MgString outputText = MgMakeString( data, data + size );
-    
-        MgWriteTextToFile(outputText, path);
+        MgCountPhaseWork( context, kMgPhase_HtmlRender, size, 1 );
+        MgEndPhase( context );
+
+        // the job takes over the buffer (see `write-queue.md`)
+        MgOutputJob* job = MgBeginOutputJob();
+        MgAddBufferToOutputJob( job, data, size + 1, outputText, file );
+        MgSubmitOutputJob( context, job );
     }
-    
+
     void MgWriteDocFile(
         MgContext* context,
         MgInputFile* inputFile)
     {
+        double traceStart = MgBeginTraceSpan( context );
+
         // compute path for output file...
-    
-        // find just the name part of the input file path
+
+        // find just the name part of the input file path, without its extension
         char const* inputFilePath = inputFile->path;
-        char const* docOutputPath = ""; // \todo: options parsing!!!
         char const* slash = strrchr(inputFilePath, '/');
         char const* inputFileName = slash ? slash+1 : inputFilePath;
-    
-        // allocate six extra characters for worst-case ".html\0"
-        int outputPathSize = strlen(docOutputPath) + strlen(inputFileName) + 6;
-        char* outputFileName = (char*) malloc(outputPathSize);
-        char* cursor = outputFileName;
-        cursor = stpcpy(cursor, docOutputPath);
-        cursor = stpcpy(cursor, inputFileName);
-        char* dot = strrchr(outputFileName, '.');
-        cursor = strcpy(dot ? dot : cursor, ".html");
-    
+        char const* dot = strrchr(inputFileName, '.');
+        MgString outputName = MgMakeString(inputFileName, dot ? dot : inputFileName + strlen(inputFileName));
+
+        MgOutputFile outputFile;
+        MgInitializeOutputFile( &outputFile, context->docOutputRoot, outputName, ".html" );
+        MgOpenOutputFileDirectory( context, &outputFile );
+
         MgWriteDocFileToPath(
             context,
             inputFile,
-            outputFileName );
-    
-        free(outputFileName);
-    }
-    
-#line 162 "source/main.md"
-                               
-    
+            &outputFile );
+
+        MgFreeOutputFile( &outputFile );
+        MgEndTraceSpan( context, traceStart, "MgWriteDocFile", "output", MgTerminatedString(inputFilePath) );
+    }
 #line 5 "source/input.md"
     MgString ReadLineText(
         MgReader* reader )
     {
         char const* textBegin = reader->cursor;
         char const* textEnd = textBegin;
-    
+
         for(;;)
         {
             int c, d;
@@ -4240,7 +8985,7 @@
             default:
                 textEnd = reader->cursor;
                 continue;
-    
+
             case '\r':
             case '\n':
                 d = MgGetChar(reader);
@@ -4248,7 +8993,7 @@
                 {
                     MgUnGetChar(reader, d);
                 }
-    
+
                 // fall-through:
             case -1:
                 // either a newline or the end of the file
@@ -4256,7 +9001,7 @@
             }
         }    
     }
-    
+
     void ReadLine(
         MgReader*   reader,
         MgLine*         line )
@@ -4266,14 +9011,14 @@
         line->text.begin = text.begin;
         line->text.end   = text.end;
     }
-    
+
     void ReadLines(
         MgReader*   reader,
         MgLine*         beginLines,
         MgLine*         endLines )
     {
         MgLine* lineCursor = beginLines;
-    
+
         // always at least one line
         ReadLine( reader, lineCursor++ );
         while(!MgAtEnd(reader))
@@ -4281,13 +9026,13 @@
             ReadLine( reader, lineCursor++ );
         }
     }
-    
+
     int MgCountLinesInString(
         MgString string )
     {
         MgReader reader;
         MgInitializeStringReader( &reader, string );
-    
+
         // always at least one line
         MgString lineText = ReadLineText( &reader );
         int lineCount = 1;
@@ -4298,7 +9043,7 @@
         }
         return lineCount;
     }
-    
+
     void MgReadLinesFromString(
         MgString  string,
         MgLine* beginLines,
@@ -4308,31 +9053,167 @@
         MgInitializeStringReader( &reader, string );
         ReadLines( &reader, beginLines, endLines );
     }
-    
+
     //
-    
+
     void MgReadLines(
         MgContext*      context,
         MgInputFile*    inputFile )
     {
+        MgBeginPhase( context, kMgPhase_LineIndexing );
+
         int lineCount = MgCountLinesInString( inputFile->text );
-        MgLine* beginLines = (MgLine*) malloc(lineCount * sizeof(MgLine));
+        MgLine* beginLines = (MgLine*) MgAllocate(kMgAllocKind_Lines, lineCount * sizeof(MgLine));
         MgLine* endLines = beginLines + lineCount;
         inputFile->beginLines = beginLines;
         inputFile->endLines = endLines;
-    
+
         MgReadLinesFromString(
             inputFile->text,
             beginLines,
-            endLines );    
+            endLines );
+
+        MgCountPhaseWork( context, kMgPhase_LineIndexing,
+            inputFile->text.end - inputFile->text.begin, lineCount );
+        MgEndPhase( context );
+    }
+
+    /*
+    Once an input file has been parsed, replace its array of `MgLine`s with a
+    compact line table (see `MgLineTable`), and free the array. Files smaller
+    than 4GB get 32-bit offsets, and larger ones 64-bit offsets.
+    */
+    void MgBuildLineTable(
+        MgContext*      context,
+        MgInputFile*    inputFile )
+    {
+        MgBeginPhase( context, kMgPhase_LineIndexing );
+
+        char const* base = inputFile->text.begin;
+        size_t count = inputFile->endLines - inputFile->beginLines;
+        MgLineTable* table = &inputFile->lineTable;
+        table->count = count;
+        if( (uint64_t) (inputFile->text.end - base) <= 0xFFFFFFFFu )
+        {
+            table->entries32 = (MgLineEntry32*) MgAllocate(kMgAllocKind_LineTable, count * sizeof(MgLineEntry32));
+            for( size_t ii = 0; ii < count; ++ii )
+            {
+                MgLine* line = &inputFile->beginLines[ii];
+                MgLineEntry32* entry = &table->entries32[ii];
+                entry->start    = (uint32_t) (line->originalBegin - base);
+                entry->trim     = (uint32_t) (line->text.begin - line->originalBegin);
+                entry->length   = line->text.end > line->text.begin ? (uint32_t) (line->text.end - line->text.begin) : 0;
+            }
+        }
+        else
+        {
+            table->entries64 = (MgLineEntry64*) MgAllocate(kMgAllocKind_LineTable, count * sizeof(MgLineEntry64));
+            for( size_t ii = 0; ii < count; ++ii )
+            {
+                MgLine* line = &inputFile->beginLines[ii];
+                MgLineEntry64* entry = &table->entries64[ii];
+                entry->start    = (uint64_t) (line->originalBegin - base);
+                entry->trim     = (uint64_t) (line->text.begin - line->originalBegin);
+                entry->length   = line->text.end > line->text.begin ? (uint64_t) (line->text.end - line->text.begin) : 0;
+            }
+        }
+
+        MgFree( kMgAllocKind_Lines, inputFile->beginLines, count * sizeof(MgLine) );
+        inputFile->beginLines = NULL;
+        inputFile->endLines = NULL;
+
+        MgEndPhase( context );
+    }
+
+    /*
+    Read the entry at `index` in a line table, whichever size of offsets the
+    table uses.
+    */
+    static MgLineEntry64 MgGetLineEntry(
+        MgLineTable const*  table,
+        size_t              index )
+    {
+        MgLineEntry64 entry;
+        if( table->entries32 )
+        {
+            entry.start     = table->entries32[index].start;
+            entry.trim      = table->entries32[index].trim;
+            entry.length    = table->entries32[index].length;
+        }
+        else
+        {
+            entry = table->entries64[index];
+        }
+        return entry;
+    }
+
+    /*
+    Reconstruct the `MgLine` at `index` in the line table of an input file.
+    */
+    MgLine MgGetTableLine(
+        MgInputFile*    inputFile,
+        size_t          index )
+    {
+        MgLineEntry64 entry = MgGetLineEntry( &inputFile->lineTable, index );
+        MgLine line;
+        line.originalBegin  = inputFile->text.begin + entry.start;
+        line.text.begin     = line.originalBegin + entry.trim;
+        line.text.end       = line.text.begin + entry.length;
+        return line;
+    }
+
+    /*
+    Find the index of the line in the line table that contains `cursor`,
+    which must point into the text of the input file.
+    */
+    size_t MgFindTableLineIndex(
+        MgInputFile*    inputFile,
+        char const*     cursor )
+    {
+        MgLineTable const* table = &inputFile->lineTable;
+        uint64_t offset = (uint64_t) (cursor - inputFile->text.begin);
+        size_t lo = 0;
+        size_t hi = table->count;
+        while( hi - lo > 1 )
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if( MgGetLineEntry( table, mid ).start <= offset )
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    /*
+    Return line number and column information (1-based) for a location in an
+    input file that has already been parsed. This is the counterpart of
+    `MgGetSourceLoc`, which is used during parsing.
+    */
+    MgSourceLoc MgGetTableSourceLoc(
+        MgInputFile*    inputFile,
+        char const*     cursor )
+    {
+        size_t index = MgFindTableLineIndex( inputFile, cursor );
+        MgLine line = MgGetTableLine( inputFile, index );
+        MgSourceLoc sourceLoc;
+        sourceLoc.line  = (int) index + 1;
+        sourceLoc.col   = MgGetColumnNumber( &line, cursor );
+        return sourceLoc;
     }
-    
+
     void MgParseInputFileText(
         MgContext*      context,
         MgInputFile*    inputFile )
     {
+        double traceStart = MgBeginTraceSpan( context );
+        MgSetAllocationFile( inputFile );
         MgReadLines( context, inputFile );
-    
+
+        MgBeginPhase( context, kMgPhase_BlockParse );
+        MgCountPhaseWork( context, kMgPhase_BlockParse,
+            inputFile->text.end - inputFile->text.begin, 0 );
+
         LineRange range;
         range.begin = inputFile->beginLines;
         range.end   = inputFile->endLines;
@@ -4341,22 +9222,30 @@
             inputFile,
             range );
         inputFile->firstElement = firstElement;
+
+        MgEndPhase( context );
+        MgBuildLineTable( context, inputFile );
+        MgSetAllocationFile( NULL );
+        MgEndTraceSpan( context, traceStart, "MgParseInputFileText", "parse", MgTerminatedString(inputFile->path) );
     }
-    
+
     void MgParseMetaDataText(
         MgContext*      context,
         MgInputFile*    inputFile )
     {
+        MgSetAllocationFile( inputFile );
         MgReadLines( context, inputFile );
-    
+
         MgElement* firstElement = MgParseMetaDataElements(
             context,
             inputFile,
             inputFile->beginLines,
             inputFile->endLines );
         inputFile->firstElement = firstElement;
+        MgBuildLineTable( context, inputFile );
+        MgSetAllocationFile( NULL );
     }
-    
+
     MgInputFile* MgAllocateInputFile(
         MgContext*    context,
         const char* path,
@@ -4366,15 +9255,15 @@
         if( !context )      return 0;
         if( !path )         return 0;
         if( !textBegin )    return 0;
-    
+
         if( !textEnd )
         {
             textEnd = textBegin + strlen(textBegin);
         }
-    
+
         MgString text = { textBegin, textEnd };
-    
-        MgInputFile* inputFile = (MgInputFile*) malloc(sizeof(MgInputFile));
+
+        MgInputFile* inputFile = (MgInputFile*) MgAllocate(kMgAllocKind_InputFile, sizeof(MgInputFile));
         if( !inputFile )
             return NULL;
         inputFile->path         = path;
@@ -4383,10 +9272,30 @@
         inputFile->next         = 0;
         inputFile->allocatedFileData = 0;
         inputFile->firstReferenceLink = 0;
-    
+        inputFile->compact = 0;
+        inputFile->lineDirectivePath = MgMakeString(NULL, NULL);
+        inputFile->beginLines = 0;
+        inputFile->endLines = 0;
+        inputFile->lineTable.entries32 = 0;
+        inputFile->lineTable.entries64 = 0;
+        inputFile->lineTable.count = 0;
+        inputFile->scrapText = 0;
+        inputFile->scrapTextSize = 0;
+        inputFile->firstScrap = 0;
+        inputFile->lastScrap = 0;
+        inputFile->nextReparsedScrap = 0;
+        inputFile->reparsing = MG_FALSE;
+        inputFile->allocated.objects = 0;
+        inputFile->allocated.bytes = 0;
+        MgChargeAllocationToFile( inputFile, sizeof(MgInputFile) );
+    #if MG_PARSER_COUNTERS
+        inputFile->parseAttempts = 0;
+        inputFile->failedParseAttempts = 0;
+    #endif
+
         return inputFile;
     }
-    
+
     MgInputFile* MgAddInputFileText(
         MgContext*    context,
         const char* path,
@@ -4400,7 +9309,7 @@
             textEnd );
         if( !inputFile )
             return NULL;
-    
+
         if( context->lastInputFile )
         {
             context->lastInputFile->next = inputFile;
@@ -4410,16 +9319,18 @@
             context->firstInputFile = inputFile;
         }
         context->lastInputFile = inputFile;
-    
+
         MgParseInputFileText(
             context,
             inputFile );
-    
+
+        if( context->useCompactTrees )
+            MgCompactInputFile( context, inputFile );
+
         return inputFile;
     }
-    
-    char* MgReadFileStreamContent(
-        MgContext*  context,
+
+    char* MgReadFileStreamContentImpl(
         char const* path,
         FILE*       stream,
         int*        outSize )
@@ -4429,9 +9340,9 @@
         int end = ftell(stream);
         fseek(stream, begin, SEEK_SET);
         int size = end - begin;
-    
+
         // allocate buffer for input file
-        char* fileData = (char*) malloc(size + 1);
+        char* fileData = (char*) MgAllocate(kMgAllocKind_InputBuffer, size + 1);
         if( !fileData )
         {
             fprintf(stderr, "failed to allocate buffer for \"%s\"\n", path);        
@@ -4440,19 +9351,33 @@
         // we NULL-terminate the buffer just in case
         // (but the code should never rely on this)
         fileData[size] = 0;
-    
+
         int sizeRead = fread(fileData, 1, size, stream);
         if( sizeRead != size )
         {
             fprintf(stderr, "failed to read from \"%s\"\n", path);
-            free(fileData);
+            MgFree(kMgAllocKind_InputBuffer, fileData, size + 1);
             return NULL;
         }
-    
+
         *outSize = size;
         return fileData;
     }
-    
+
+    char* MgReadFileStreamContent(
+        MgContext*  context,
+        char const* path,
+        FILE*       stream,
+        int*        outSize )
+    {
+        MgBeginPhase( context, kMgPhase_FileRead );
+        char* fileData = MgReadFileStreamContentImpl( path, stream, outSize );
+        if( fileData )
+            MgCountPhaseWork( context, kMgPhase_FileRead, *outSize, 1 );
+        MgEndPhase( context );
+        return fileData;
+    }
+
     MgInputFile* MgAddInputFileStream(
         MgContext*  context,
         char const* path,
@@ -4460,12 +9385,12 @@
     {
         if( !context )  return 0;
         if( !stream )   return 0;
-    
+
         int size = 0;
         char* fileData = MgReadFileStreamContent( context, path, stream, &size );
         if( !fileData )
             return NULL;
-    
+
         MgString text = { fileData, fileData + size };
         MgInputFile* inputFile = MgAddInputFileText(
             context,
@@ -4473,9 +9398,10 @@
             fileData,
             fileData + size );
         inputFile->allocatedFileData = fileData;
+        MgChargeAllocationToFile( inputFile, size + 1 );
         return inputFile;
     }
-    
+
     MgInputFile* MgAddInputFilePath(
         MgContext*    context,
         const char* path )
@@ -4483,22 +9409,24 @@
         FILE* stream = NULL;
         if( !context )  return 0;
         if( !path )     return 0;
-    
+
+        double traceStart = MgBeginTraceSpan( context );
         stream = fopen(path, "rb");
         if( !stream )
         {
             fprintf(stderr, "mangle: failed to open \"%s\" for reading\n", path);
             return 0;
         }
-    
+
         MgInputFile* inputFile = MgAddInputFileStream(
             context,
             path,
             stream );
         fclose(stream);
+        MgEndTraceSpan( context, traceStart, "MgAddInputFilePath", "input", MgTerminatedString(path) );
         return inputFile;
     }
-    
+
     MgInputFile* MgAddMetaDataText(
         MgContext*  context,
         const char* path,
@@ -4508,7 +9436,7 @@
         // don't allow multiple meta-data files
         if( context->metaDataFile )
             return NULL;
-    
+
         MgInputFile* inputFile = MgAllocateInputFile(
             context,
             path,
@@ -4516,15 +9444,19 @@
             textEnd );
         if( !inputFile )
             return NULL;
-    
+
         context->metaDataFile = inputFile;
-    
+
         MgParseMetaDataText(
             context,
             inputFile );
+
+        if( context->useCompactTrees )
+            MgCompactInputFile( context, inputFile );
+
         return inputFile;
     }
-    
+
     MgInputFile* MgAddMetaDataFileStream(
         MgContext*  context,
         const char* path,
@@ -4532,12 +9464,12 @@
     {
         if( !context )  return 0;
         if( !stream )   return 0;
-    
+
         int size = 0;
         char* fileData = MgReadFileStreamContent( context, path, stream, &size );
         if( !fileData )
             return NULL;
-    
+
         MgString text = { fileData, fileData + size };
         MgInputFile* inputFile = MgAddMetaDataText(
             context,
@@ -4545,39 +9477,318 @@
             fileData,
             fileData + size );
         inputFile->allocatedFileData = fileData;
+        MgChargeAllocationToFile( inputFile, size + 1 );
+        return inputFile;
+    }
+
+
+    MgInputFile* MgAddMetaDataFile(
+        MgContext*  context,
+        const char* path )
+    {
+        FILE* stream = NULL;
+        if( !context )  return 0;
+        if( !path )     return 0;
+
+        double traceStart = MgBeginTraceSpan( context );
+        stream = fopen(path, "rb");
+        if( !stream )
+        {
+            fprintf(stderr, "mangle: failed to open \"%s\" for reading\n", path);
+            return 0;
+        }
+
+        MgInputFile* inputFile = MgAddMetaDataFileStream(
+            context,
+            path,
+            stream );
+        fclose(stream);
+        MgEndTraceSpan( context, traceStart, "MgAddMetaDataFile", "input", MgTerminatedString(path) );
         return inputFile;
     }
-    
-    
-    MgInputFile* MgAddMetaDataFile(
-        MgContext*  context,
-        const char* path )
+#line 41 "source/stream.md"
+    typedef struct MgTextRelocationT
+    {
+        MgInputFile*    inputFile;
+        char*           cursor;             /* `NULL` while measuring */
+        size_t          size;
+    } MgTextRelocation;
+
+    static void MgRelocateString(
+        MgTextRelocation*   relocation,
+        MgString*           text )
+    {
+        if( !MgIsTextInFile(relocation->inputFile, *text) )
+            return;
+
+        size_t size = text->end - text->begin;
+        relocation->size += size;
+        if( !relocation->cursor )
+            return;
+
+        memcpy(relocation->cursor, text->begin, size);
+        text->begin = relocation->cursor;
+        text->end   = relocation->cursor + size;
+        relocation->cursor += size;
+    }
+#line 74 "source/stream.md"
+    static void MgExtendScrapBodyText(
+        MgInputFile*    inputFile,
+        MgString        text,
+        char const**    ioBegin,
+        char const**    ioEnd )
+    {
+        if( text.begin == text.end || !MgIsTextInFile(inputFile, text) )
+            return;
+        if( !*ioBegin || text.begin < *ioBegin )
+            *ioBegin = text.begin;
+        if( !*ioEnd || text.end > *ioEnd )
+            *ioEnd = text.end;
+    }
+
+    static void MgFindScrapBodyText(
+        MgInputFile*    inputFile,
+        MgElement*      firstElement,
+        char const**    ioBegin,
+        char const**    ioEnd )
+    {
+        for( MgElement* element = firstElement; element; element = element->next )
+        {
+            MgExtendScrapBodyText(inputFile, element->text, ioBegin, ioEnd);
+            for( MgAttribute* attr = element->firstAttr; attr; attr = attr->next )
+            {
+                if( attr->id.begin[0] != '$' )
+                    MgExtendScrapBodyText(inputFile, attr->val, ioBegin, ioEnd);
+            }
+            MgFindScrapBodyText(inputFile, element->firstChild, ioBegin, ioEnd);
+        }
+    }
+
+    static void MgMoveScrapBodyString(
+        MgInputFile*    inputFile,
+        MgString*       text,
+        char const*     from,
+        char*           to )
+    {
+        if( text->begin == text->end || !MgIsTextInFile(inputFile, *text) )
+            return;
+        text->begin = to + (text->begin - from);
+        text->end   = to + (text->end - from);
+    }
+
+    static void MgMoveScrapBodyText(
+        MgInputFile*    inputFile,
+        MgElement*      firstElement,
+        char const*     from,
+        char*           to )
+    {
+        for( MgElement* element = firstElement; element; element = element->next )
+        {
+            MgMoveScrapBodyString(inputFile, &element->text, from, to);
+            for( MgAttribute* attr = element->firstAttr; attr; attr = attr->next )
+            {
+                if( attr->id.begin[0] != '$' )
+                    MgMoveScrapBodyString(inputFile, &attr->val, from, to);
+            }
+            MgMoveScrapBodyText(inputFile, element->firstChild, from, to);
+        }
+    }
+
+    static void MgRelocateScrapBody(
+        MgTextRelocation*   relocation,
+        MgElement*          body )
+    {
+        char const* begin = NULL;
+        char const* end = NULL;
+        MgFindScrapBodyText(relocation->inputFile, body, &begin, &end);
+        if( !begin )
+            return;
+
+        size_t size = end - begin;
+        relocation->size += size;
+        if( !relocation->cursor )
+            return;
+
+        memcpy(relocation->cursor, begin, size);
+        MgMoveScrapBodyText(relocation->inputFile, body, begin, relocation->cursor);
+        relocation->cursor += size;
+    }
+#line 159 "source/stream.md"
+    static void MgRelocateScrapNameGroupText(
+        MgTextRelocation*   relocation,
+        MgScrapNameGroup*   nameGroup );
+
+    static void MgRelocateScrapText(
+        MgTextRelocation*   relocation,
+        MgElement*          firstElement,
+        MgBool              inScrapBody )
+    {
+        for( MgElement* element = firstElement; element; element = element->next )
+        {
+            if( inScrapBody )
+            {
+                MgRelocateString(relocation, &element->text);
+                for( MgAttribute* attr = element->firstAttr; attr; attr = attr->next )
+                {
+                    if( attr->id.begin[0] != '$' )
+                        MgRelocateString(relocation, &attr->val);
+                }
+            }
+
+            switch( element->kind )
+            {
+            case kMgElementKind_ScrapDef:
+                {
+                    MgScrap* scrap = MgFindAttribute(element, "$scrap")->scrap;
+                    MgRelocateScrapNameGroupText(relocation, scrap->fileGroup->nameGroup);
+                    MgRelocateScrapBody(relocation, element->firstChild);
+                    MgRelocateScrapText(relocation, element->firstChild, MG_FALSE);
+                }
+                continue;
+
+            case kMgElementKind_ScrapRef:
+                {
+                    MgScrapFileGroup* fileGroup = MgFindAttribute(element, "$scrap-group")->scrapFileGroup;
+                    MgRelocateScrapNameGroupText(relocation, fileGroup->nameGroup);
+                }
+                break;
+
+            default:
+                break;
+            }
+
+            MgRelocateScrapText(relocation, element->firstChild, inScrapBody);
+        }
+    }
+
+    static void MgRelocateScrapNameGroupText(
+        MgTextRelocation*   relocation,
+        MgScrapNameGroup*   nameGroup )
+    {
+        MgRelocateString(relocation, &nameGroup->id);
+        MgRelocateScrapText(relocation, nameGroup->name, MG_TRUE);
+    }
+#line 222 "source/stream.md"
+    static void MgReleaseInputFileData(
+        MgInputFile*    inputFile )
+    {
+        MgReferenceLink* link = inputFile->firstReferenceLink;
+        while( link )
+        {
+            MgReferenceLink* next = link->next;
+            MgFree(kMgAllocKind_ReferenceLink, link, sizeof(MgReferenceLink));
+            link = next;
+        }
+        inputFile->firstReferenceLink = NULL;
+
+        MgLineTable* table = &inputFile->lineTable;
+        MgFree(kMgAllocKind_LineTable, table->entries32, table->count * sizeof(MgLineEntry32));
+        MgFree(kMgAllocKind_LineTable, table->entries64, table->count * sizeof(MgLineEntry64));
+        table->entries32 = NULL;
+        table->entries64 = NULL;
+        table->count = 0;
+
+        if( inputFile->allocatedFileData )
+        {
+            MgFree(kMgAllocKind_InputBuffer, inputFile->allocatedFileData,
+                (inputFile->text.end - inputFile->text.begin) + 1);
+            inputFile->allocatedFileData = NULL;
+        }
+        inputFile->text = MgMakeString(NULL, NULL);
+    }
+#line 253 "source/stream.md"
+    static void MgFreeElementsExceptScrapBodies(
+        MgElement*  firstElement )
+    {
+        MgElement* element = firstElement;
+        while( element )
+        {
+            MgElement* next = element->next;
+            MgFreeElementAttributes(element);
+            if( element->kind != kMgElementKind_ScrapDef )
+                MgFreeElementsExceptScrapBodies(element->firstChild);
+            MgFree(kMgAllocKind_Element, element, sizeof(MgElement));
+            element = next;
+        }
+    }
+#line 274 "source/stream.md"
+    void MgReduceToScrapDatabase(
+        MgContext*      context,
+        MgInputFile*    inputFile )
+    {
+        MgTextRelocation relocation;
+        relocation.inputFile    = inputFile;
+        relocation.cursor       = NULL;
+        relocation.size         = 0;
+        MgRelocateScrapText(&relocation, inputFile->firstElement, MG_FALSE);
+
+        size_t size = relocation.size;
+        MgSetAllocationFile( inputFile );
+        inputFile->scrapText = (char*) MgAllocate(kMgAllocKind_ScrapText, size + 1);
+        MgSetAllocationFile( NULL );
+        inputFile->scrapTextSize = size + 1;
+
+        relocation.cursor   = inputFile->scrapText;
+        relocation.size     = 0;
+        MgRelocateScrapText(&relocation, inputFile->firstElement, MG_FALSE);
+
+        MgFreeElementsExceptScrapBodies(inputFile->firstElement);
+        inputFile->firstElement = NULL;
+        MgReleaseInputFileData(inputFile);
+    }
+#line 307 "source/stream.md"
+    void MgReleaseScrapBodies(
+        MgContext*  context )
     {
-        FILE* stream = NULL;
-        if( !context )  return 0;
-        if( !path )     return 0;
-    
-        stream = fopen(path, "rb");
+        for( MgInputFile* inputFile = context->firstInputFile; inputFile; inputFile = inputFile->next )
+        {
+            for( MgScrap* scrap = inputFile->firstScrap; scrap; scrap = scrap->nextInFile )
+            {
+                MgFreeElements( scrap->body );
+                scrap->body = NULL;
+                if( scrap->opCount >= 0 )
+                    MgFree(kMgAllocKind_ScrapOps, scrap->ops, scrap->opCount * sizeof(MgScrapOp) + 1);
+                scrap->ops = NULL;
+                scrap->opCount = 0;
+            }
+        }
+    }
+#line 331 "source/stream.md"
+    void MgStreamDocFile(
+        MgContext*      context,
+        MgInputFile*    inputFile )
+    {
+        FILE* stream = fopen(inputFile->path, "rb");
         if( !stream )
         {
-            fprintf(stderr, "mangle: failed to open \"%s\" for reading\n", path);
-            return 0;
+            fprintf(stderr, "mangle: failed to open \"%s\" for reading\n", inputFile->path);
+            return;
         }
-    
-        MgInputFile* inputFile = MgAddMetaDataFileStream(
-            context,
-            path,
-            stream );
+
+        int size = 0;
+        char* fileData = MgReadFileStreamContent( context, inputFile->path, stream, &size );
         fclose(stream);
-        return inputFile;
+        if( !fileData )
+            return;
+
+        inputFile->text = MgMakeString(fileData, fileData + size);
+        inputFile->allocatedFileData = fileData;
+        MgChargeAllocationToFile( inputFile, size + 1 );
+
+        inputFile->reparsing = MG_TRUE;
+        inputFile->nextReparsedScrap = inputFile->firstScrap;
+        MgParseInputFileText( context, inputFile );
+        inputFile->reparsing = MG_FALSE;
+
+        MgWriteDocFile( context, inputFile );
+
+        MgFreeElements(inputFile->firstElement);
+        inputFile->firstElement = NULL;
+        MgReleaseInputFileData(inputFile);
     }
-    
-#line 163 "source/main.md"
-                         
-    
 #line 6 "source/options.md"
     /* Command-Line Options */
-    
+
     typedef struct OptionsT
     {
         char const* executableName;
@@ -4586,8 +9797,24 @@
         char const* metaDataFilePath;
         MgBool generateHTML;
         MgScrapKind defaultScrapKind;
+        MgBool printStats;
+        char const* statsJsonPath;
+        char const* traceFilePath;
+        MgBool compactTrees;
+        MgBool streamDocs;
+        MgBool tangleOnly;
+        MgBool sourceMaps;
+        int jobCount;
+        char const* outputHashesPath;
+        long long maxOutputBytes;
+        long long maxTotalBytes;
+        long long maxOutputRefs;
+        long long maxTotalRefs;
+        char const* onlyScrapId;
+        MgBool toStdout;
+        long long writeBufferBytes;
     } Options;
-    
+
     void InitializeOptions(
         Options*    options )
     {
@@ -4597,8 +9824,77 @@
         options->metaDataFilePath   = 0;
         options->defaultScrapKind = kScrapKind_GlobalMacro;
         options->generateHTML = MG_FALSE;
+        options->printStats = MG_FALSE;
+        options->statsJsonPath = 0;
+        options->traceFilePath = 0;
+        options->compactTrees = MG_FALSE;
+        options->streamDocs = MG_FALSE;
+        options->tangleOnly = MG_FALSE;
+        options->sourceMaps = MG_FALSE;
+        options->jobCount = 0;
+        options->outputHashesPath = 0;
+        options->maxOutputBytes = kMgDefaultMaxOutputBytes;
+        options->maxTotalBytes = kMgDefaultMaxTotalBytes;
+        options->maxOutputRefs = kMgDefaultMaxOutputRefs;
+        options->maxTotalRefs = kMgDefaultMaxTotalRefs;
+        options->onlyScrapId = 0;
+        options->toStdout = MG_FALSE;
+        options->writeBufferBytes = kMgDefaultWriteBufferBytes;
+    }
+
+    /*
+    Copy the options that decide what a run does into the context. Every
+    driver of a run (Mangle's own `main`, and the end-to-end benchmark in
+    `bench/`) goes through here, so that they all honor the same options.
+    */
+    void ApplyOptions(
+        Options const*  options,
+        MgContext*      context )
+    {
+        context->defaultScrapKind   = options->defaultScrapKind;
+        context->useCompactTrees    = options->compactTrees && !options->streamDocs;
+        context->tangleOnly         = options->tangleOnly || options->toStdout || options->onlyScrapId;
+        context->writeSourceMaps    = options->sourceMaps;
+        context->writeToStdout      = options->toStdout;
+        context->codeOutputRoot     = options->sourceOutputPath;
+        context->docOutputRoot      = options->docOutputPath;
+        context->maxOutputBytes     = options->maxOutputBytes;
+        context->maxTotalBytes      = options->maxTotalBytes;
+        context->maxOutputRefs      = options->maxOutputRefs;
+        context->maxTotalRefs       = options->maxTotalRefs;
+        context->jobCount           = options->jobCount ? options->jobCount : MgGetProcessorCount();
+        context->writeBufferBytes   = options->writeBufferBytes;
+    }
+
+    /*
+    Parse a limit (see `limits.md`) or a size, which is a count with an
+    optional suffix of `K`, `M` or `G` (for powers of 1024). Zero means no
+    limit.
+    */
+    static int ParseLimitOption(
+        char const* text,
+        long long*  outLimit )
+    {
+        char* end = NULL;
+        long long limit = strtoll(text, &end, 10);
+        if( end == text || limit < 0 )
+            return 0;
+
+        long long scale = 1;
+        switch( *end )
+        {
+        case 'k': case 'K': scale = (long long) 1 << 10; ++end; break;
+        case 'm': case 'M': scale = (long long) 1 << 20; ++end; break;
+        case 'g': case 'G': scale = (long long) 1 << 30; ++end; break;
+        default: break;
+        }
+        if( *end != 0 || limit > kMgMaxExpandedSize / scale )
+            return 0;
+
+        *outLimit = limit * scale;
+        return 1;
     }
-    
+
     int ParseOptions(
         Options*    options,
         int*        ioArgCount,
@@ -4606,21 +9902,21 @@
     {
         int     remaining   = *ioArgCount;
         char**  readCursor  = argv;
-    
+
         char**  writeCursor = argv;
         int     outArgCount = 0;
-    
+
         if( remaining > 0 )
         {
             options->executableName = *readCursor++;
             --remaining;
         }
-    
+
         while(remaining)
         {
             char* option = *readCursor++;
             --remaining;
-    
+
             if( option[0] == '-' )
             {
                 if(strcmp(option+1, "-") == 0)
@@ -4651,6 +9947,165 @@
                 {
                     options->defaultScrapKind = kScrapKind_LocalMacro;
                 }
+                else if( strcmp(option+1, "compact-tree") == 0)
+                {
+                    options->compactTrees = MG_TRUE;
+                }
+                else if( strcmp(option+1, "stream-docs") == 0)
+                {
+                    options->streamDocs = MG_TRUE;
+                }
+                else if( strcmp(option+1, "tangle-only") == 0)
+                {
+                    options->tangleOnly = MG_TRUE;
+                }
+                else if( strcmp(option+1, "source-map") == 0)
+                {
+                    options->sourceMaps = MG_TRUE;
+                }
+                else if( strcmp(option+1, "code-dir") == 0
+                    || strcmp(option+1, "doc-dir") == 0 )
+                {
+                    // directory to write code files or documentation beneath
+                    if( remaining != 0 )
+                    {
+                        if( strcmp(option+1, "code-dir") == 0 )
+                            options->sourceOutputPath = *readCursor++;
+                        else
+                            options->docOutputPath = *readCursor++;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected argument for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "stdout") == 0)
+                {
+                    options->toStdout = MG_TRUE;
+                }
+                else if( strcmp(option+1, "only") == 0 )
+                {
+                    // id of the one scrap group to write
+                    if( remaining != 0 )
+                    {
+                        options->onlyScrapId = *readCursor++;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected argument for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "jobs") == 0 )
+                {
+                    // number of threads for expanding large code files
+                    if( remaining != 0 && atoi(*readCursor) > 0 )
+                    {
+                        options->jobCount = atoi(*readCursor++);
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected a positive count for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "output-hashes") == 0 )
+                {
+                    // path of the file that records hashes of code files
+                    if( remaining != 0 )
+                    {
+                        options->outputHashesPath = *readCursor++;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected argument for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "max-output-bytes") == 0
+                    || strcmp(option+1, "max-total-bytes") == 0
+                    || strcmp(option+1, "max-output-refs") == 0
+                    || strcmp(option+1, "max-total-refs") == 0 )
+                {
+                    // limits on the expansion of code files
+                    long long* limit = &options->maxOutputBytes;
+                    if( strcmp(option+1, "max-total-bytes") == 0 )
+                        limit = &options->maxTotalBytes;
+                    else if( strcmp(option+1, "max-output-refs") == 0 )
+                        limit = &options->maxOutputRefs;
+                    else if( strcmp(option+1, "max-total-refs") == 0 )
+                        limit = &options->maxTotalRefs;
+
+                    if( remaining != 0 && ParseLimitOption(*readCursor, limit) )
+                    {
+                        ++readCursor;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected a count (optionally followed by K, M or G) for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "write-buffer") == 0 )
+                {
+                    // memory for outputs waiting to be written behind the run
+                    if( remaining != 0 && ParseLimitOption(*readCursor, &options->writeBufferBytes) )
+                    {
+                        ++readCursor;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected a size (optionally followed by K, M or G) for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "stats") == 0)
+                {
+                    options->printStats = MG_TRUE;
+                }
+                else if( strcmp(option+1, "stats-json") == 0 )
+                {
+                    // path for statistics in JSON format
+                    if( remaining != 0 )
+                    {
+                        options->statsJsonPath = *readCursor++;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected argument for option %s\n", option);
+                        return 0;
+                    }
+                }
+                else if( strcmp(option+1, "trace") == 0 )
+                {
+                    // path for trace-event output
+                    if( remaining != 0 )
+                    {
+                        options->traceFilePath = *readCursor++;
+                        --remaining;
+                        continue;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "expected argument for option %s\n", option);
+                        return 0;
+                    }
+                }
                 else
                 {
                     fprintf(stderr, "unknown option: %s\n", option);
@@ -4664,7 +10119,7 @@
                 ++outArgCount;
             }
         }
-    
+
         // pass through any options after `--` without inspecting them
         while( remaining )
         {
@@ -4673,114 +10128,217 @@
             *writeCursor++ = option;
             ++outArgCount;
         }
-    
+
         *ioArgCount = outArgCount;
         return 1;
     }
-    
-#line 164 "source/main.md"
-                           
-    
-#line 127 "source/main.md"
-                   
-    
-#line 128 "source/main.md"
-               
-    
-#line 7 "source/main.md"
+#line 69 "source/main.md"
+    void MgStartRun(
+        Options const*  options,
+        MgContext*      context )
+    {
+        
+#line 82 "source/main.md"
+    static MgStats stats;
+    static MgAllocStats allocStats;
+    if( options->printStats || options->statsJsonPath )
+    {
+        MgInitializeStats( &stats );
+        context->stats = &stats;
+
+        gMgAllocStats = &allocStats;
+    }
+#line 74 "source/main.md"
+        
+#line 96 "source/main.md"
+    static MgTrace trace;
+    if( options->traceFilePath && MgBeginTrace( &trace, options->traceFilePath ) )
+    {
+        context->trace = &trace;
+    }
+#line 75 "source/main.md"
+        
+#line 105 "source/main.md"
+    if( options->outputHashesPath )
+    {
+        MgLoadOutputHashes( context, options->outputHashesPath );
+    }
+#line 76 "source/main.md"
+    }
+#line 117 "source/main.md"
+    MgBool MgReadInputs(
+        Options const*  options,
+        MgContext*      context,
+        int             inputCount,
+        char**          inputPaths )
+    {
+        
+#line 131 "source/main.md"
+    if( options->metaDataFilePath )
+    {
+        MgAddMetaDataFile( context, options->metaDataFilePath );
+    }
+#line 124 "source/main.md"
+        
+#line 140 "source/main.md"
+    for( int ii = 0; ii < inputCount; ++ii )
+    {
+        char const* path = inputPaths[ii];
+        
+#line 147 "source/main.md"
+    MgInputFile* inputFile = MgAddInputFilePath( context, path );
+    if( !inputFile )
+    {
+        return MG_FALSE;
+    }
+#line 157 "source/main.md"
+    if( options->streamDocs )
+    {
+        MgReduceToScrapDatabase( context, inputFile );
+    }
+#line 144 "source/main.md"
+    }
+#line 125 "source/main.md"
+        return MG_TRUE;
+    }
+#line 175 "source/main.md"
+    void MgWriteDocOutputs(
+        Options const*  options,
+        MgContext*      context )
+    {
+        if( context->tangleOnly )
+            return;
+
+        if( options->streamDocs )
+            MgReleaseScrapBodies( context );
+        for( MgInputFile* file = context->firstInputFile; file; file = file->next )
+        {
+            if( options->streamDocs )
+                MgStreamDocFile( context, file );
+            else
+                MgWriteDocFile( context, file );
+        }
+    }
+#line 201 "source/main.md"
+    MgBool MgWriteCodeOutputs(
+        Options const*  options,
+        MgContext*      context )
+    {
+        if( options->onlyScrapId )
+        {
+            
+#line 230 "source/main.md"
+    MgScrapNameGroup* group = MgFindScrapGroupForOption( context, options->onlyScrapId );
+    if( !group || !MgWriteCodeFile( context, group ) )
+    {
+        MgStopWriteQueue( context );
+        return MG_FALSE;
+    }
+#line 208 "source/main.md"
+            return MG_TRUE;
+        }
+
+        for( MgScrapNameGroup* group = context->firstScrapNameGroup; group; group = group->next )
+        {
+            if( group->kind != kScrapKind_OutputFile )
+                continue;
+
+            if( !MgWriteCodeFile( context, group ) )
+            {
+                MgStopWriteQueue( context );
+                return MG_FALSE;
+            }
+        }
+        return MG_TRUE;
+    }
+#line 243 "source/main.md"
+    void MgFinishWritingOutputs(
+        Options const*  options,
+        MgContext*      context )
+    {
+        MgStopWriteQueue( context );
+        MgSaveOutputHashes( context );
+    }
+#line 254 "source/main.md"
+    void MgFinishRun(
+        Options const*  options,
+        MgContext*      context )
+    {
+        
+#line 267 "source/main.md"
+    #if MG_THREADS
+    if( context->scheduler )
+    {
+        MgStopScheduler( context->scheduler );
+        context->scheduler = NULL;
+    }
+    #endif
+#line 259 "source/main.md"
+        
+#line 281 "source/main.md"
+    if( options->printStats )
+    {
+        MgPrintStats( context, stderr );
+    }
+    if( options->statsJsonPath )
+    {
+        MgWriteStatsJson( context, options->statsJsonPath );
+    }
+#line 260 "source/main.md"
+        
+#line 293 "source/main.md"
+    if( context->trace )
+    {
+        MgEndTrace( context->trace );
+    }
+#line 261 "source/main.md"
+        
+#line 301 "source/main.md"
+    #if MG_PARSER_COUNTERS
+    MgPrintParserCounters( context, stderr );
+    #endif
+#line 262 "source/main.md"
+    }
+#line 8 "source/main.md"
     int main(
         int     argc,
         char**  argv )
     {
         
-#line 24 "source/main.md"
+#line 35 "source/main.md"
     MgContext context;
     memset(&context, 0, sizeof(context));
-    
-#line 11 "source/main.md"
-                      
+#line 13 "source/main.md"
         
-#line 34 "source/main.md"
+#line 45 "source/main.md"
     Options options;
     InitializeOptions( &options );
-    
+
     if( !ParseOptions( &options, &argc, argv ) )
     {
-    
+
         fprintf(stderr, "usage: %s file1.md [...]", argv[0]);
         exit(1);
     }
-    
+
     if( !argc )
     {
         fprintf(stderr, "no input files\n");
         exit(0);
     }
-    context.defaultScrapKind = options.defaultScrapKind;
-    
-#line 12 "source/main.md"
-                         
-        
-#line 57 "source/main.md"
-    
-#line 63 "source/main.md"
-    if( options.metaDataFilePath )
-    {
-        MgAddMetaDataFile( &context, options.metaDataFilePath );
-    }
-    
-#line 57 "source/main.md"
-                                      
-    
-#line 72 "source/main.md"
-    for( int ii = 0; ii < argc; ++ii )
-    {
-        char const* path = argv[ii];
-        
-#line 81 "source/main.md"
-    if( !MgAddInputFilePath( &context, path ) )
-    {
-        exit(1);
-    }
-    
-#line 75 "source/main.md"
-                                           
-    }
-    
-#line 58 "source/main.md"
-                                 
-    
-#line 13 "source/main.md"
-                       
-        
-#line 92 "source/main.md"
-    
-#line 110 "source/main.md"
-    for( MgScrapNameGroup* group = context.firstScrapNameGroup; group; group = group->next )
-    {
-        if( group->kind != kScrapKind_OutputFile )
-            continue;
-    
-        MgWriteCodeFile( &context, group );
-    }
-    
-#line 92 "source/main.md"
-                               
-    
-#line 100 "source/main.md"
-    for( MgInputFile* file = context.firstInputFile; file; file = file->next )
-    {
-        MgWriteDocFile( &context, file );
-    }
-    
-#line 93 "source/main.md"
-                                        
-    
+    ApplyOptions( &options, &context );
 #line 14 "source/main.md"
-                         
+        MgStartRun( &options, &context );
+        if( !MgReadInputs( &options, &context, argc, argv ) )
+        {
+            exit(1);
+        }
+        if( !MgWriteCodeOutputs( &options, &context ) )
+        {
+            exit(1);
+        }
+        MgWriteDocOutputs( &options, &context );
+        MgFinishWritingOutputs( &options, &context );
+        MgFinishRun( &options, &context );
         return 0;
     }
-    
-#line 129 "source/main.md"
-                       
-    
\ No newline at end of file
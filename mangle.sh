@@ -16,7 +16,7 @@ fi
 : ${CC:="cc"}
 
 pushd "$MANGLEPATH" > /dev/null
-$CC mangle.c -o mangle
+$CC mangle.c -o mangle -pthread
 popd > /dev/null
 
 # And now that it has (hopefully) been built, we run it
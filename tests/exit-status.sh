@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Checks that Mangle exits with a non-zero status when it can't write a
+# code file, so that a build, or a pipeline such as
+#
+#   mangle -stdout -only file:foo.c *.md | cc -x c -
+#
+# sees the failure rather than a truncated output.
+#
+#   tests/exit-status.sh
+#
+# Mangle is built from `mangle.c` into a scratch directory first. Writing
+# to a full device needs `/dev/full`, so that case is skipped where there
+# isn't one.
+
+pushd `dirname $0` > /dev/null
+TESTPATH=`pwd`
+popd > /dev/null
+ROOTPATH=`dirname "$TESTPATH"`
+
+: ${CC:="cc"}
+: ${CFLAGS:="-O2 -w"}
+: ${LIBS:="-pthread"}
+: ${TEST_WORK:="$TESTPATH/_work"}
+
+rm -rf "$TEST_WORK"
+mkdir -p "$TEST_WORK"
+$CC $CFLAGS "$ROOTPATH/mangle.c" -o "$TEST_WORK/mangle" $LIBS || exit 1
+MANGLE="$TEST_WORK/mangle"
+
+cat > "$TEST_WORK/cycle.md" <<'EOF'
+Cycle
+=====
+
+    <<file:cycle.c>>=
+    <<loop>>
+
+    <<loop>>=
+    <<loop>>
+EOF
+
+FAILURES=0
+
+# expect <status> <description> <command...>
+expect() {
+	local expected=$1
+	local description=$2
+	shift 2
+	(cd "$TEST_WORK" && "$@") > /dev/null 2>&1
+	local status=$?
+	if [[ $expected == "zero" && $status -ne 0 ]] || [[ $expected == "nonzero" && $status -eq 0 ]]; then
+		echo "FAIL $description: exit status $status"
+		FAILURES=$((FAILURES + 1))
+	else
+		echo "ok   $description"
+	fi
+}
+
+HELLO="$ROOTPATH/examples/hello-world/hello-world.md"
+
+expect zero "-stdout to /dev/null" \
+	sh -c "'$MANGLE' -stdout -only file:hello.c '$HELLO' > /dev/null"
+if [[ -w /dev/full ]]; then
+	expect nonzero "-stdout to a full device" \
+		sh -c "'$MANGLE' -stdout -only file:hello.c '$HELLO' > /dev/full"
+else
+	echo "skip -stdout to a full device: no /dev/full"
+fi
+expect nonzero "-stdout of an expansion that never ends" \
+	sh -c "'$MANGLE' -stdout -only file:cycle.c cycle.md > /dev/null"
+expect nonzero "code file whose expansion never ends" \
+	"$MANGLE" cycle.md
+
+if [[ $FAILURES -ne 0 ]]; then
+	exit 1
+fi